@@ -0,0 +1,165 @@
+#ifndef BVH_BATCH_TRAVERSER_HPP
+#define BVH_BATCH_TRAVERSER_HPP
+
+#include <memory>
+#include <optional>
+#include <cstdint>
+#include <climits>
+#include <cassert>
+
+#include "bvh/bvh.hpp"
+#include "bvh/ray.hpp"
+#include "bvh/morton.hpp"
+#include "bvh/radix_sort.hpp"
+#include "bvh/single_ray_traverser.hpp"
+#include "bvh/platform.hpp"
+
+namespace bvh {
+
+	/// Traversal of batches of incoherent rays (e.g. secondary or ambient occlusion rays) with a single-ray
+	/// traverser. The rays of a batch are sorted by the octant of their direction, and then by the Morton code of
+	/// their origin, so that the rays that a thread traces one after the other visit the same nodes, which stay in
+	/// the cache. The sorted batch is traced in parallel, and the results are written in the original order of the
+	/// rays. The primitive intersector is shared by the threads, which the intersectors of this library allow.
+	template <typename Bvh, typename NodeIntersector = FastNodeIntersector<Bvh>, typename Morton = uint32_t>
+	class BatchTraverser {
+		using Scalar = typename Bvh::ScalarType;
+
+		/// Number of bits processed by every iteration of the radix sort.
+		static constexpr size_t bits_per_iteration = 10;
+		static constexpr size_t octant_bit_count = 3;
+
+		SingleRayTraverser<Bvh, NodeIntersector> traverser;
+		RadixSort<bits_per_iteration> radix_sort;
+
+		std::unique_ptr<Morton[]> keys, keys_copy;
+		std::unique_ptr<size_t[]> order, order_copy;
+		size_t capacity = 0;
+
+		void reserve(size_t ray_count) {
+			if (capacity >= ray_count)
+				return;
+			keys       = std::make_unique<Morton[]>(ray_count);
+			keys_copy  = std::make_unique<Morton[]>(ray_count);
+			order      = std::make_unique<size_t[]>(ray_count);
+			order_copy = std::make_unique<size_t[]>(ray_count);
+			capacity   = ray_count;
+		}
+
+		static Morton octant(const Vector3<Scalar>& direction) {
+			return
+				(direction[0] < 0 ? 1 : 0) |
+				(direction[1] < 0 ? 2 : 0) |
+				(direction[2] < 0 ? 4 : 0);
+		}
+
+		/// Returns the bounding box of the origins, enlarged so that the Morton encoder never divides by zero.
+		static BoundingBox<Scalar> origin_bounding_box(const Ray<Scalar>* rays, size_t ray_count) {
+			auto bbox = BoundingBox<Scalar>::empty();
+
+#pragma omp declare reduction \
+        (bbox_extend:BoundingBox<Scalar>:omp_out.extend(omp_in)) \
+        initializer(omp_priv = BoundingBox<Scalar>::empty())
+
+#pragma omp parallel for reduction(bbox_extend: bbox)
+			for (size_t i = 0; i < ray_count; ++i)
+				bbox.extend(rays[i].origin);
+
+			for (int i = 0; i < 3; ++i) {
+				if (!(bbox.max[i] > bbox.min[i]))
+					bbox.max[i] = bbox.min[i] + Scalar(1);
+			}
+			return bbox;
+		}
+
+		/// Calls the given function with each ray and its index, in parallel, in the order of the sorted batch.
+		template <typename F>
+		void for_each_sorted_ray(const Ray<Scalar>* rays, size_t ray_count, F f) {
+			if (ray_count < sort_threshold) {
+#pragma omp parallel for schedule(dynamic, chunk_size)
+				for (size_t i = 0; i < ray_count; ++i)
+					f(rays[i], i);
+				return;
+			}
+
+			assert(bit_count <= max_bit_count);
+			reserve(ray_count);
+			MortonEncoder<Morton, Scalar> encoder(origin_bounding_box(rays, ray_count), size_t(1) << bit_count);
+
+			Morton* sorted_keys   = keys.get();
+			Morton* unsorted_keys = keys_copy.get();
+			size_t* sorted_order   = order.get();
+			size_t* unsorted_order = order_copy.get();
+
+#pragma omp parallel
+			{
+#pragma omp for
+				for (size_t i = 0; i < ray_count; ++i) {
+					sorted_keys[i] = (octant(rays[i].direction) << (3 * bit_count)) | encoder.encode(rays[i].origin);
+					sorted_order[i] = i;
+				}
+
+				radix_sort.sort_in_parallel(
+					sorted_keys,
+					unsorted_keys,
+					sorted_order,
+					unsorted_order,
+					ray_count, 3 * bit_count + octant_bit_count);
+
+#pragma omp for schedule(dynamic, chunk_size)
+				for (size_t i = 0; i < ray_count; ++i) {
+					auto j = sorted_order[i];
+					f(rays[j], j);
+				}
+			}
+		}
+
+	public:
+		/// Maximum number of bits available per dimension for the origin of the rays.
+		static constexpr size_t max_bit_count = (sizeof(Morton) * CHAR_BIT - octant_bit_count) / 3;
+
+		/// Number of bits per dimension used to encode the origin of the rays.
+		size_t bit_count = max_bit_count;
+
+		/// Batches that are smaller than this are traced in their original order.
+		size_t sort_threshold = 1024;
+
+		/// Number of consecutive rays of the sorted batch that a thread traces at once.
+		size_t chunk_size = 64;
+
+		BatchTraverser(const Bvh& bvh)
+			: traverser(bvh)
+		{}
+
+		/// Intersects the BVH with the given rays, and writes the closest (or any, depending on the
+		/// primitive intersector) hit of each ray in `hits`, at the index of the ray in the batch.
+		template <typename PrimitiveIntersector>
+		void traverse_batch(
+			const Ray<Scalar>* rays, size_t ray_count,
+			PrimitiveIntersector& primitive_intersector,
+			std::optional<typename PrimitiveIntersector::Result>* hits,
+			bool cyl, bool hybrid)
+		{
+			for_each_sorted_ray(rays, ray_count, [&] (const Ray<Scalar>& ray, size_t i) {
+				hits[i] = traverser.traverse(ray, primitive_intersector, cyl, hybrid);
+			});
+		}
+
+		/// Tests whether each ray of the batch hits a primitive between `ray.tmin` and `ray.tmax`,
+		/// like `SingleRayTraverser::occluded()`, and writes the result of each ray in `occluded`.
+		template <typename PrimitiveIntersector>
+		void occluded_batch(
+			const Ray<Scalar>* rays, size_t ray_count,
+			PrimitiveIntersector& primitive_intersector,
+			bool* occluded,
+			bool cyl, bool hybrid)
+		{
+			for_each_sorted_ray(rays, ray_count, [&] (const Ray<Scalar>& ray, size_t i) {
+				occluded[i] = traverser.occluded(ray, primitive_intersector, cyl, hybrid);
+			});
+		}
+	};
+
+} // namespace bvh
+
+#endif
@@ -30,6 +30,7 @@ class BinnedSahBuilder : public TopDownBuilder, public SahBasedAlgorithm<Bvh> {
 public:
     using TopDownBuilder::max_depth;
     using TopDownBuilder::max_leaf_size;
+    using TopDownBuilder::observer;
     using SahBasedAlgorithm<Bvh>::traversal_cost;
 
     BinnedSahBuilder(Bvh& bvh)
@@ -42,6 +43,8 @@ public:
         const Vector3<Scalar>* centers,
         size_t primitive_count)
     {
+        BuildTimer timer(observer);
+
         // Allocate buffers
         bvh.nodes = std::make_unique<typename Bvh::Node[]>(2 * primitive_count + 1);
         bvh.primitive_indices = std::make_unique<size_t[]>(primitive_count);
@@ -57,10 +60,13 @@ public:
 
             #pragma omp single
             {
+                timer.phase(BuildPhase::Initialization, primitive_count);
                 BuildTask first_task(*this, bboxes, centers);
                 run_task(first_task, 0, 0, primitive_count, 0);
             }
         }
+
+        timer.phase(BuildPhase::Splitting, bvh.node_count);
     }
 };
 
@@ -216,7 +222,7 @@ public:
             auto& bins = bins_per_axis[best_axis];
             auto left_bbox  = BoundingBox<Scalar>::empty();
             auto right_bbox = BoundingBox<Scalar>::empty();
-            for (size_t i = 0; i < best_splits[best_axis].second; ++i)
+            for (size_t i = 0; i < split_index; ++i)
                 left_bbox.extend(bins[i].bbox);
             for (size_t i = split_index; i < bin_count; ++i)
                 right_bbox.extend(bins[i].bbox);
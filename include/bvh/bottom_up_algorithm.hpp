@@ -3,8 +3,11 @@
 
 #include <memory>
 #include <cstddef>
+#include <cassert>
+#include <algorithm>
 
 #include "bvh/bvh.hpp"
+#include "bvh/node_set.hpp"
 #include "bvh/platform.hpp"
 
 namespace bvh {
@@ -12,7 +15,10 @@ namespace bvh {
 /// Base class for bottom-up BVH traversal algorithms. The implementation is inspired
 /// from T. Karras' bottom-up refitting algorithm, explained in the article
 /// "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees".
-template <typename Bvh, bool MaintainChildIndices = false>
+/// The `NodeSet` parameter selects the nodes that are traversed (see `BoxNodes` and `CylinderNodes`).
+/// The cylinder nodes of hybrid hierarchies form a forest, whose roots are given by the box leaves:
+/// each tree is then processed independently, and the nodes that belong to no tree are ignored.
+template <typename Bvh, bool MaintainChildIndices = false, typename NodeSet = BoxNodes<Bvh>>
 class BottomUpAlgorithm {
 protected:
     std::unique_ptr<size_t[]> parents, children;
@@ -20,22 +26,40 @@ protected:
 
     Bvh& bvh;
 
+    auto& nodes() const { return NodeSet::nodes(bvh); }
+    size_t node_count() const { return NodeSet::node_count(bvh); }
+
+    static constexpr size_t no_parent = size_t(-1);
+
+    /// Returns true if the nodes are a forest rather than a single tree rooted at index 0.
+    bool is_forest() const { return NodeSet::is_cylinder && bvh.hybrid; }
+
     BottomUpAlgorithm(Bvh& bvh)
         : bvh(bvh)
     {
         bvh__assert_not_in_parallel();
-        parents = std::make_unique<size_t[]>(bvh.node_count);
-        flags   = std::make_unique<int[]>(bvh.node_count);
+        auto node_count = this->node_count();
+        parents = std::make_unique<size_t[]>(node_count);
+        flags   = std::make_unique<int[]>(node_count);
 
         if (MaintainChildIndices)
-            children = std::make_unique<size_t[]>(bvh.node_count);
-
-        parents[0] = 0;
+            children = std::make_unique<size_t[]>(node_count);
+
+        // Roots are their own parents, and unreachable nodes have no parent at all
+        if (is_forest()) {
+            std::fill(parents.get(), parents.get() + node_count, no_parent);
+            #pragma omp parallel for
+            for (size_t i = 0; i < bvh.node_count; i++) {
+                if (bvh.nodes[i].is_leaf)
+                    parents[bvh.nodes[i].cylinder_root()] = bvh.nodes[i].cylinder_root();
+            }
+        } else
+            parents[0] = 0;
 
         // Compute parent/children indices
         #pragma omp parallel for
-        for (size_t i = 0; i < bvh.node_count; i++) {
-            auto& node = bvh.nodes[i];
+        for (size_t i = 0; i < node_count; i++) {
+            auto& node = nodes()[i];
             if (node.is_leaf)
                 continue;
             auto first_child = node.first_child_or_primitive;
@@ -58,21 +82,23 @@ protected:
         #pragma omp single nowait
         {
             // Special case if the BVH is just a leaf
-            if (bvh.node_count == 1)
+            if (!is_forest() && node_count() == 1)
                 process_leaf(0);
         }
 
         #pragma omp for
-        for (size_t i = 1; i < bvh.node_count; ++i) {
+        for (size_t i = is_forest() ? 0 : 1; i < node_count(); ++i) {
             // Only process leaves
-            if (MaintainChildIndices ? children[i] != 0 : !bvh.nodes[i].is_leaf)
+            if (MaintainChildIndices ? children[i] != 0 : !nodes()[i].is_leaf)
+                continue;
+            if (is_forest() && parents[i] == no_parent)
                 continue;
 
             process_leaf(i);
 
             // Process inner nodes on the path from that leaf up to the root
             size_t j = i;
-            do {
+            while (parents[j] != j) {
                 j = parents[j];
 
                 // Make sure that the children of this inner node have been processed
@@ -84,7 +110,7 @@ protected:
                 flags[j] = 0;
 
                 process_inner_node(j);
-            } while (j != 0);
+            }
         }
     }
 };
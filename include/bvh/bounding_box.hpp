@@ -7,6 +7,9 @@
 #include <cassert>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <limits>
+#include <initializer_list>
 
 std::chrono::steady_clock myclock;
 
@@ -212,30 +215,100 @@ namespace bvh {
 
 			projectCylOnLine(smaller, bigger.axis, bigger.c, p1, p2, rad);
 			// 2. check if rad is smaller than the bigger radius
-			if (rad > bigger.r)
+			bool is_approximate = false;
+			if (rad > bigger.r) {
 				if (!is_in_eps_range(rad, bigger.r, e))
 					return false;
+				is_approximate = true;
+			}
 
 			// 3. check if the two returned points are between the bigger axis endpoints
 			// p1 - a, p1 - b
-			if (dot(p1 - bigger.c, p1 - bigger.c + bigger.h * bigger.axis) > 0)
+			if (dot(p1 - bigger.c, p1 - bigger.c + bigger.h * bigger.axis) > 0) {
 				if (!is_around(p1, bigger.c, e) && !is_around(p1, bigger.c + bigger.h * bigger.axis, e))
 					return false;
-			if (dot(p2 - bigger.c, p2 - bigger.c + bigger.h * bigger.axis) > 0)
+				is_approximate = true;
+			}
+			if (dot(p2 - bigger.c, p2 - bigger.c + bigger.h * bigger.axis) > 0) {
 				if (!is_around(p2, bigger.c, e) && !is_around(p2, bigger.c + bigger.h * bigger.axis, e))
 					return false;
+				is_approximate = true;
+			}
 
 			// if all holds
 			big = bigger;
+			// the smaller cylinder may stick out by up to epsilon, so the result is grown by as
+			// much to remain conservative (this matters in single precision, where epsilon is
+			// comparable to the rounding errors)
+			if (is_approximate) {
+				big.c -= big.axis * e;
+				big.h += Scalar(2) * e;
+				big.r += e;
+			}
 			return true;
 		}
 
+		/// Returns the half area of a cylinder that encloses both this cylinder and the given one.
+		/// Each cylinder is contained in the capsule around its axis segment, so the result is
+		/// obtained in closed form from the four cap centers, using the line that joins the farthest
+		/// two as the axis. This is an upper bound on the half area of the union that is much cheaper
+		/// than `extend()`, meant to rank merge candidates.
+		bvh__always_inline__ Scalar union_half_area_bound(const BoundingCyl& other) const {
+			const Vector3<Scalar> points[4] = { c, c + axis * h, other.c, other.c + other.axis * other.h };
+			const Scalar radii[4] = { r, r, other.r, other.r };
+
+			size_t first = 0, second = 1;
+			Scalar max_distance = -1;
+			for (size_t i = 0; i < 4; ++i) {
+				for (size_t j = i + 1; j < 4; ++j) {
+					auto distance = dot(points[j] - points[i], points[j] - points[i]);
+					if (distance > max_distance) {
+						max_distance = distance;
+						first = i;
+						second = j;
+					}
+				}
+			}
+			auto ax = max_distance > 0 ? (points[second] - points[first]) * (Scalar(1) / std::sqrt(max_distance)) : axis;
+
+			// Extent of the capsules along the axis and around it
+			Scalar tmin = std::numeric_limits<Scalar>::max();
+			Scalar tmax = -std::numeric_limits<Scalar>::max();
+			Scalar radius = 0;
+			for (size_t i = 0; i < 4; ++i) {
+				auto p = points[i] - points[first];
+				auto t = dot(p, ax);
+				tmin = std::min(tmin, t - radii[i]);
+				tmax = std::max(tmax, t + radii[i]);
+				radius = std::max(radius, std::sqrt(std::max(dot(p, p) - t * t, Scalar(0))) + radii[i]);
+			}
+			return Scalar(M_PI) * radius * (tmax - tmin + radius);
+		}
+
+		/// Grows the cylinder by a margin of `epsilon` times its scale (the magnitude of the
+		/// coordinates of its caps, plus its radius): the radius grows by the margin, and each cap
+		/// moves outwards by the margin along the axis. The rounding errors of the construction
+		/// methods are relative to that scale, so that a few ulps are enough to make the result
+		/// enclose the cylinders it was made of.
+		bvh__always_inline__ BoundingCyl& inflate(Scalar epsilon) {
+			auto top = c + axis * h;
+			Scalar scale = 0;
+			for (int i = 0; i < 3; ++i)
+				scale = std::max(scale, std::max(std::abs(c[i]), std::abs(top[i])));
+			auto margin = epsilon * (scale + r);
+			c -= axis * margin;
+			h += Scalar(2) * margin;
+			r += margin;
+			return *this;
+		}
+
 		// Construction methods
 		// "extend" the cylinder by another cylinder (enclose two cylinders by a new one)
 		// basically compute the union cylinder of the existing cylinder and the new one
-		bvh__always_inline__ BoundingCyl& extend(const BoundingCyl& bbox) {
-			Vector3<Scalar> center(0);
-			Scalar r1 = 0, r2 = 0, d1, d2, height = 0;
+		// When search_steps is not zero, the union is instead found by a brute force search over
+		// the axis (see search_union()), which is much more expensive.
+		bvh__always_inline__ BoundingCyl& extend(const BoundingCyl& bbox, size_t search_steps = 0) {
+			Scalar d1, d2;
 			Vector3<Scalar> A, B, C, D;
 
 			// general position
@@ -253,11 +326,6 @@ namespace bvh {
 				this->c = B;
 			}
 
-			// test if it is already fully contained in the other
-			BoundingCyl container;
-			if (this->is_inside(bbox, container)) {
-				return *this = container;
-			}
 			//----------------------------------------------------
 			Vector3<Scalar> u, v, ax, mid1, mid2;
 			// Use the weighted variant
@@ -272,55 +340,154 @@ namespace bvh {
 
 			mid1 = A + d1 * u;
 			mid2 = C + d2 * v;
-			ax = normalize(mid2 - mid1);
+			ax = mid2 - mid1;
+
+			// The candidates are the enclosing cylinders around the weighted axis, and around the
+			// axes of both cylinders, which gives back the larger one when it contains the other.
+			// Degenerate axes (of degenerate primitives, for instance) are skipped.
+			BoundingCyl result;
+			bool has_result = false;
+			auto consider = [&] (const Vector3<Scalar>& origin, const Vector3<Scalar>& direction) {
+				if (!(dot(direction, direction) > 0))
+					return;
+				auto candidate = enclose(bbox, *this, origin, normalize(direction));
+				if (!has_result || candidate.half_area() < result.half_area())
+					result = candidate;
+				has_result = true;
+			};
+			consider(mid1, ax);
+			consider(this->c, this->axis);
+			consider(bbox.c, bbox.axis);
+			if (!has_result)
+				result = enclose(bbox, *this, this->c, Vector3<Scalar>(0, 0, 1));
+
+			// optimize - brute force search of the axis among search_steps^2 positions
+			if (search_steps > 0)
+				result = search_union(bbox, *this, A, B, C, D, search_steps, result);
 
-			height = length(mid2 - mid1);
-			Vector3<Scalar> c1, c1h, c2, c2h;
+			*this = result;
+			return *this;
+		}
 
-			projectCylOnLine(bbox, ax, mid1, c1, c1h, r1);
-			projectCylOnLine(*this, ax, mid1, c2, c2h, r2);
+		/// Returns the smallest cylinder around the line of unit direction `ax` through `origin` that
+		/// encloses both `first` and `second`. A cylinder is the convex hull of its caps: a cap disk
+		/// of radius r spans r * sin(angle) along the axis, and lies within r of the distance of its
+		/// center, so that the result always contains both cylinders (see also `search_union()`).
+		static BoundingCyl enclose(
+			const BoundingCyl& first, const BoundingCyl& second,
+			const Vector3<Scalar>& origin, const Vector3<Scalar>& ax)
+		{
+			Scalar bottom = std::numeric_limits<Scalar>::max();
+			Scalar top = -std::numeric_limits<Scalar>::max();
+			Scalar radius = 0;
+			for (const auto* cyl : { &first, &second }) {
+				auto cos = dot(ax, cyl->axis);
+				auto x = cyl->r * std::sqrt(std::max(Scalar(1) - cos * cos, Scalar(0)));
+				for (const auto& cap : { cyl->c, cyl->c + cyl->axis * cyl->h }) {
+					auto p = cap - origin;
+					auto t = dot(p, ax);
+					bottom = std::min(bottom, t - x);
+					top = std::max(top, t + x);
+					radius = std::max(radius, std::sqrt(std::max(dot(p, p) - t * t, Scalar(0))) + cyl->r);
+				}
+			}
+			return BoundingCyl(origin + ax * bottom, ax, top - bottom, radius);
+		}
 
-			height = getHeight(c1, c1h, c2, c2h, center);
-			BoundingCyl result;
-			result.h = height;
-			result.r = std::max(r1, r2);
-			result.c = center;
-			result.axis = ax;
-			
-			bool optim = false;
-			// optimize - brute force find best from the 100 positions
-			if (optim) {
-				Scalar lenBA = length(B - A);
-				Scalar lenDC = length(D - C);
-				Scalar numsteps = 10;
-
-				BoundingCyl helper;
-				//Scalar height;
-				for (int k = 0; k < numsteps; k++) { // numsteps steps on upper line
-					mid1 = A + (lenBA * (Scalar)k / numsteps) * (u);
-					for (int l = 0; l < numsteps; l++) { // numsteps steps on lower line
-						mid2 = C + (lenDC * (Scalar)l / numsteps) * (v);
-
-						ax = normalize(mid2 - mid1);
-						projectCylOnLine(bbox, ax, mid1, c1, c1h, r1);
-						projectCylOnLine(*this, ax, mid1, c2, c2h, r2);
-						// compute height
-						height = getHeight(c1, c1h, c2, c2h, center);
-
-						helper.h = height;
-						helper.r = std::max(r1, r2);
-						helper.c = center;
-						helper.axis = ax;
-
-						if (helper.surface() < result.surface()) {
-							result = helper;
+		/// Number of axis candidates of `search_union()` that are evaluated together.
+		static constexpr size_t search_block_size = 16;
+
+		/// Brute-force search of the axis of the union of two cylinders, `first` and `second`.
+		/// The candidate axes join `steps` regularly spaced points on the segment [A, B], between the
+		/// bottom caps, to `steps` points on the segment [C, D], between the top caps. For each axis,
+		/// the candidate is the smallest cylinder around that axis that encloses the caps of both
+		/// cylinders, so that it always contains them. The candidates are evaluated in blocks stored
+		/// as arrays of scalars, so that the evaluation vectorizes. Returns the candidate with the
+		/// smallest area, or `fallback` if all the axes are degenerate.
+		static BoundingCyl search_union(
+			const BoundingCyl& first, const BoundingCyl& second,
+			const Vector3<Scalar>& A, const Vector3<Scalar>& B,
+			const Vector3<Scalar>& C, const Vector3<Scalar>& D,
+			size_t steps, const BoundingCyl& fallback)
+		{
+			const BoundingCyl* cyls[2] = { &first, &second };
+			Scalar caps[2][2][3];
+			for (size_t i = 0; i < 2; ++i) {
+				auto top = cyls[i]->c + cyls[i]->axis * cyls[i]->h;
+				for (int j = 0; j < 3; ++j) {
+					caps[i][0][j] = cyls[i]->c[j];
+					caps[i][1][j] = top[j];
+				}
+			}
+
+			auto best_area = std::numeric_limits<Scalar>::max();
+			size_t best_candidate = size_t(-1);
+			Scalar best_bottom = 0, best_height = 0, best_radius = 0;
+			auto candidate_count = steps * steps;
+			auto step = Scalar(1) / Scalar(steps);
+			for (size_t block_begin = 0; block_begin < candidate_count; block_begin += search_block_size) {
+				Scalar areas[search_block_size], bottoms[search_block_size];
+				Scalar heights[search_block_size], radii[search_block_size];
+				#pragma omp simd
+				for (size_t i = 0; i < search_block_size; ++i) {
+					auto candidate = std::min(block_begin + i, candidate_count - 1);
+					auto k = Scalar(candidate / steps) * step;
+					auto l = Scalar(candidate % steps) * step;
+					Scalar mid[3], ax[3];
+					for (int j = 0; j < 3; ++j) {
+						mid[j] = A[j] + (B[j] - A[j]) * k;
+						ax[j] = C[j] + (D[j] - C[j]) * l - mid[j];
+					}
+					auto length_squared = ax[0] * ax[0] + ax[1] * ax[1] + ax[2] * ax[2];
+					auto inv_length = length_squared > 0 ? Scalar(1) / std::sqrt(length_squared) : Scalar(0);
+					for (int j = 0; j < 3; ++j)
+						ax[j] *= inv_length;
+
+					// A cylinder is the convex hull of its caps: a cap disk of radius r spans
+					// r * sin(angle) along the axis, and lies within r of the distance of its center
+					Scalar bottom = std::numeric_limits<Scalar>::max();
+					Scalar top = -std::numeric_limits<Scalar>::max();
+					Scalar radius = 0;
+					for (size_t c = 0; c < 2; ++c) {
+						const auto& cyl_axis = cyls[c]->axis;
+						auto cos = ax[0] * cyl_axis[0] + ax[1] * cyl_axis[1] + ax[2] * cyl_axis[2];
+						auto x = cyls[c]->r * std::sqrt(std::max(Scalar(1) - cos * cos, Scalar(0)));
+						for (size_t e = 0; e < 2; ++e) {
+							Scalar p[3] = { caps[c][e][0] - mid[0], caps[c][e][1] - mid[1], caps[c][e][2] - mid[2] };
+							auto t = p[0] * ax[0] + p[1] * ax[1] + p[2] * ax[2];
+							auto d2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] - t * t;
+							bottom = std::min(bottom, t - x);
+							top = std::max(top, t + x);
+							radius = std::max(radius, std::sqrt(std::max(d2, Scalar(0))) + cyls[c]->r);
 						}
 					}
+					auto height = top - bottom;
+
+					areas[i] = length_squared > 0
+						? Scalar(M_PI) * radius * (height + radius)
+						: std::numeric_limits<Scalar>::max();
+					bottoms[i] = bottom;
+					heights[i] = height;
+					radii[i] = radius;
+				}
+
+				auto block_end = std::min(block_begin + search_block_size, candidate_count);
+				for (size_t i = 0; i < block_end - block_begin; ++i) {
+					if (areas[i] < best_area) {
+						best_area = areas[i];
+						best_bottom = bottoms[i];
+						best_height = heights[i];
+						best_radius = radii[i];
+						best_candidate = block_begin + i;
+					}
 				}
 			}
+			if (best_candidate == size_t(-1))
+				return fallback;
 
-			*this = result;
-			return *this;
+			auto mid = A + (B - A) * (Scalar(best_candidate / steps) * step);
+			auto ax = normalize(C + (D - C) * (Scalar(best_candidate % steps) * step) - mid);
+			return BoundingCyl(mid + ax * best_bottom, ax, best_height, best_radius);
 		}
 
 		bvh__always_inline__ static BoundingCyl empty() {
@@ -0,0 +1,106 @@
+#ifndef BVH_BUILD_OBSERVER_HPP
+#define BVH_BUILD_OBSERVER_HPP
+
+#include <cstddef>
+#include <chrono>
+
+namespace bvh {
+
+/// Phases of the construction of a BVH, as reported to a `BuildObserver`.
+enum class BuildPhase {
+    /// Computation of the bounding volumes and centers of the primitives (done by the caller).
+    BoundingVolumes,
+    /// Allocation and initialization of the buffers of a top-down builder.
+    Initialization,
+    /// Sorting of the primitives, by Morton code or along each axis.
+    Sorting,
+    /// Creation of the leaves of a bottom-up builder.
+    Leaves,
+    /// Clustering waves over cylinders.
+    CylinderClustering,
+    /// Conversion of the cylinder clusters into boxes, in the hybrid build.
+    Conversion,
+    /// Clustering (or merging) waves over boxes.
+    BoxClustering,
+    /// Recursive splitting of a top-down builder.
+    Splitting,
+    /// Transfer of the nodes into the BVH.
+    Finalization,
+    /// Post-build optimizations, applied by the caller.
+    Optimization
+};
+
+inline const char* build_phase_name(BuildPhase phase) {
+    switch (phase) {
+        case BuildPhase::BoundingVolumes:    return "bounding volumes";
+        case BuildPhase::Initialization:     return "initialization";
+        case BuildPhase::Sorting:            return "sorting";
+        case BuildPhase::Leaves:             return "leaves";
+        case BuildPhase::CylinderClustering: return "cylinder clustering";
+        case BuildPhase::Conversion:         return "conversion";
+        case BuildPhase::BoxClustering:      return "box clustering";
+        case BuildPhase::Splitting:          return "splitting";
+        case BuildPhase::Finalization:       return "finalization";
+        case BuildPhase::Optimization:       return "optimization";
+    }
+    return "unknown";
+}
+
+/// Receives the timings of the phases of a build. Builders have an `observer` member,
+/// which is null by default, in which case nothing is measured. The element count is the
+/// number of primitives, clusters, or nodes at the end of the phase, depending on the phase.
+class BuildObserver {
+public:
+    virtual ~BuildObserver() {}
+
+    /// Called at the end of each phase, with its duration in milliseconds.
+    virtual void phase_completed(BuildPhase, double /* milliseconds */, size_t /* element_count */) {}
+
+    /// Called after each clustering iteration, with the number of clusters before and after it.
+    virtual void iteration_completed(
+        BuildPhase,
+        size_t /* iteration */,
+        double /* milliseconds */,
+        size_t /* cluster_count_before */,
+        size_t /* cluster_count_after */) {}
+};
+
+/// Measures the phases of a build on behalf of an optional observer.
+/// Each phase (or iteration) starts when the previous one is reported.
+class BuildTimer {
+    using Clock = std::chrono::high_resolution_clock;
+
+    BuildObserver* observer;
+    Clock::time_point phase_start;
+    Clock::time_point iteration_start;
+
+    static double milliseconds_since(Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+public:
+    BuildTimer(BuildObserver* observer)
+        : observer(observer)
+    {
+        if (observer)
+            phase_start = iteration_start = Clock::now();
+    }
+
+    void phase(BuildPhase phase, size_t element_count) {
+        if (!observer)
+            return;
+        observer->phase_completed(phase, milliseconds_since(phase_start), element_count);
+        phase_start = iteration_start = Clock::now();
+    }
+
+    void iteration(BuildPhase phase, size_t iteration, size_t cluster_count_before, size_t cluster_count_after) {
+        if (!observer)
+            return;
+        observer->iteration_completed(phase, iteration, milliseconds_since(iteration_start), cluster_count_before, cluster_count_after);
+        iteration_start = Clock::now();
+    }
+};
+
+} // namespace bvh
+
+#endif
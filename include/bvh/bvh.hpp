@@ -2,10 +2,13 @@
 #define BVH_BVH_HPP
 
 #include <climits>
+#include <algorithm>
 #include <memory>
+#include <utility>
 #include <cassert>
 
 #include "bvh/bounding_box.hpp"
+#include "bvh/cylinder_nodes.hpp"
 #include "bvh/utilities.hpp"
 
 namespace bvh {
@@ -14,58 +17,17 @@ namespace bvh {
 	/// The memory layout is such that the children of a node are always grouped together.
 	/// This means that each node only needs one index to point to its children, as the other
 	/// child can be obtained by adding one to the index of the first child. The root of the
-	/// hierarchy is located at index 0 in the array of nodes.
-	template <typename Scalar>
+	/// hierarchy is located at index 0 in the array of nodes. Cylinder hierarchies use the
+	/// same conventions, and the layout of their nodes is given by the second template parameter.
+	/// In hybrid hierarchies, `nodes` only contains the box levels, whose leaves refer to the roots
+	/// of cylinder subtrees (see `Node::cylinder_root()`), and `cnodes` only contains these subtrees.
+	template <typename Scalar, template <typename> class CylinderNode = FullCylinderNode>
 	struct Bvh {
 		using IndexType = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
 		using ScalarType = Scalar;
 
-		// Custom node - cylinder.
-		struct CustomNode {
-			Vector3<Scalar> p1, axis;
-			Scalar h, r;
-			bool is_leaf : 1;
-			IndexType primitive_count : sizeof(IndexType)* CHAR_BIT - 1;
-			IndexType first_child_or_primitive;
-
-			struct BoundingBoxProxy {
-				CustomNode& node;
-
-				BoundingBoxProxy(CustomNode& node) : node(node)
-				{}
-
-				BoundingBoxProxy& operator = (const BoundingCyl<Scalar>& cyl) {
-					node.p1 = cyl.c;
-					node.axis = cyl.axis;
-					node.r = cyl.r;
-					node.h = cyl.h;
-					return *this;
-				}
-
-				operator BoundingCyl<Scalar>() const {
-					return BoundingCyl<Scalar>(node.p1, node.axis, node.h, node.r);
-				}
-
-				BoundingCyl<Scalar> to_bounding_box() const {
-					return static_cast<BoundingCyl<Scalar>>(*this);
-				}
-
-				Scalar half_area() const { return to_bounding_box().half_area(); }
-
-				BoundingBoxProxy& extend(const BoundingBox<Scalar>& bbox) {
-					return *this = to_bounding_box().extend(bbox);
-				}
-
-			};
-
-			BoundingBoxProxy bounding_box_proxy() {
-				return BoundingBoxProxy(*this);
-			}
-
-			const BoundingBoxProxy bounding_box_proxy() const {
-				return BoundingBoxProxy(*const_cast<CustomNode*>(this));
-			}
-		};
+		/// Cylinder nodes, stored with the layout given as a template parameter.
+		using CustomNode = CylinderNode<Scalar>;
 
 		// The size of this structure should be 32 bytes in
 		// single precision and 64 bytes in double precision.
@@ -74,7 +36,24 @@ namespace bvh {
 			bool is_leaf : 1;
 			IndexType primitive_count : sizeof(IndexType)* CHAR_BIT - 1;
 			IndexType first_child_or_primitive;
-			IndexType origin = 0;
+
+			/// Box leaves of hybrid hierarchies refer to the root of a cylinder subtree instead of primitives.
+			/// They are tagged by an empty range of primitives, and store the index of the root in place
+			/// of the index of the first primitive, so that nodes keep the same size in every hierarchy.
+			bool is_cylinder_link() const {
+				return is_leaf && primitive_count == 0;
+			}
+
+			IndexType cylinder_root() const {
+				assert(is_cylinder_link());
+				return first_child_or_primitive;
+			}
+
+			void set_cylinder_root(IndexType root) {
+				is_leaf = true;
+				primitive_count = 0;
+				first_child_or_primitive = root;
+			}
 
 			/// Accessor to simplify the manipulation of the bounding box of a node.
 			/// This type is convertible to a `BoundingBox`.
@@ -125,6 +104,8 @@ namespace bvh {
 			}
 		};
 
+		static_assert(sizeof(Node) == 8 * sizeof(Scalar), "BVH nodes must be 32 bytes in single precision, and 64 in double precision");
+
 		/// Given a node index, returns the index of its sibling.
 		static size_t sibling(size_t index) {
 			assert(index != 0);
@@ -137,12 +118,31 @@ namespace bvh {
 			return index % 2 == 1;
 		}
 
-		std::unique_ptr<Node[]>   nodes;
-		std::unique_ptr<CustomNode[]>   cnodes;
-		std::unique_ptr<size_t[]> primitive_indices;
+		/// Returns the number of primitive indices referenced by the leaves, which is
+		/// not stored, since the builders may reserve more indices than they use.
+		size_t reference_count() const {
+			size_t count = 0;
+			auto count_leaves = [&] (const auto* leaves, size_t leaf_count) {
+				for (size_t i = 0; i < leaf_count; ++i) {
+					if (leaves[i].is_leaf)
+						count = std::max(count, size_t(leaves[i].first_child_or_primitive + leaves[i].primitive_count));
+				}
+			};
+			// The leaves of the box levels of hybrid hierarchies refer to cylinder subtrees
+			if (cylinder)
+				count_leaves(cnodes.get(), cnode_count);
+			else
+				count_leaves(nodes.get(), node_count);
+			return count;
+		}
+
+		BvhArray<Node>       nodes;
+		BvhArray<CustomNode> cnodes;
+		BvhArray<size_t>     primitive_indices;
 		bool cylinder = false;
 		bool hybrid = false;
 		size_t node_count = 0;
+		size_t cnode_count = 0;
 	};
 
 } // namespace bvh
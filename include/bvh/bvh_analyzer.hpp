@@ -0,0 +1,350 @@
+#ifndef BVH_BVH_ANALYZER_HPP
+#define BVH_BVH_ANALYZER_HPP
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <limits>
+#include <algorithm>
+
+#include "bvh/bvh.hpp"
+#include "bvh/node_set.hpp"
+#include "bvh/sah_based_algorithm.hpp"
+#include "bvh/bottom_up_algorithm.hpp"
+#include "bvh/platform.hpp"
+
+namespace bvh {
+
+/// Quality metrics of a BVH, as computed by `BvhAnalyzer`. Levels are numbered from the root,
+/// which is at level 0. In hybrid hierarchies, the children of the root of a cylinder subtree are
+/// one level below the box leaf that refers to that subtree, since the volume of the root is never
+/// tested: it is replaced by the box leaf.
+template <typename Scalar>
+struct BvhAnalysis {
+    struct Level {
+        size_t box_count = 0;
+        size_t cylinder_count = 0;
+        size_t leaf_count = 0;
+
+        /// Sums of the half-areas of the boxes and cylinders of the level.
+        Scalar box_half_area = 0;
+        Scalar cylinder_half_area = 0;
+
+        /// Sum of the half-areas of the intersections of the bounding boxes of the pairs
+        /// of siblings of the level. For cylinders, the bounding boxes of the cylinders are used.
+        Scalar sibling_overlap = 0;
+
+        size_t node_count() const { return box_count + cylinder_count; }
+        Scalar half_area() const { return box_half_area + cylinder_half_area; }
+    };
+
+    bool cylinder = false;
+    bool hybrid = false;
+
+    std::vector<Level> levels;
+
+    /// Number of leaves per number of primitives: `leaf_sizes[i]` leaves have `i` primitives.
+    /// The box leaves of hybrid hierarchies are not leaves in this sense: they lead to cylinder subtrees.
+    std::vector<size_t> leaf_sizes;
+
+    /// SAH cost of the whole hierarchy (see `SahBasedAlgorithm`).
+    Scalar sah_cost = 0;
+
+    /// Sum of the sibling overlaps of all the levels, relative to the half-area of the root.
+    Scalar sibling_overlap = 0;
+
+    /// Number of edges on the longest path from the root to a leaf.
+    size_t depth = 0;
+
+    /// Levels of the box leaves of hybrid hierarchies, where the traversal switches from boxes to cylinders.
+    /// These are only meaningful for hybrid hierarchies.
+    size_t min_transition_depth = 0;
+    size_t max_transition_depth = 0;
+    Scalar mean_transition_depth = 0;
+
+    size_t leaf_count() const {
+        size_t count = 0;
+        for (auto& level : levels)
+            count += level.leaf_count;
+        return count;
+    }
+
+    /// Returns the metrics as a JSON object.
+    std::string to_json() const {
+        std::ostringstream out;
+        out.precision(std::numeric_limits<Scalar>::max_digits10);
+        out << "{\n";
+        out << "  \"type\": \"" << (hybrid ? "hybrid" : cylinder ? "cylinder" : "box") << "\",\n";
+        out << "  \"sah_cost\": " << sah_cost << ",\n";
+        out << "  \"sibling_overlap\": " << sibling_overlap << ",\n";
+        out << "  \"depth\": " << depth << ",\n";
+        out << "  \"leaf_count\": " << leaf_count() << ",\n";
+        if (hybrid) {
+            out << "  \"transition_depth\": { \"min\": " << min_transition_depth <<
+                ", \"max\": " << max_transition_depth <<
+                ", \"mean\": " << mean_transition_depth << " },\n";
+        } else
+            out << "  \"transition_depth\": null,\n";
+        out << "  \"leaf_sizes\": [";
+        for (size_t i = 0; i < leaf_sizes.size(); ++i)
+            out << (i > 0 ? ", " : "") << leaf_sizes[i];
+        out << "],\n";
+        out << "  \"levels\": [\n";
+        for (size_t i = 0; i < levels.size(); ++i) {
+            auto& level = levels[i];
+            out << "    { \"boxes\": " << level.box_count <<
+                ", \"cylinders\": " << level.cylinder_count <<
+                ", \"leaves\": " << level.leaf_count <<
+                ", \"box_half_area\": " << level.box_half_area <<
+                ", \"cylinder_half_area\": " << level.cylinder_half_area <<
+                ", \"sibling_overlap\": " << level.sibling_overlap << " }" <<
+                (i + 1 < levels.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n";
+        out << "}\n";
+        return out.str();
+    }
+};
+
+/// Computes quality metrics of box, cylinder, and hybrid hierarchies in memory: per-level node
+/// counts and half-areas, sibling overlap, leaf sizes, SAH cost, depth, and the level at which
+/// hybrid hierarchies switch from boxes to cylinders. The box and cylinder nodes are each processed
+/// with a parallel bottom-up traversal, and the per-level histograms are then filled in parallel.
+template <typename Bvh>
+class BvhAnalyzer : protected SahBasedAlgorithm<Bvh> {
+    using Scalar = typename Bvh::ScalarType;
+
+public:
+    using Analysis = BvhAnalysis<Scalar>;
+
+    using SahBasedAlgorithm<Bvh>::traversal_cost;
+    using SahBasedAlgorithm<Bvh>::cylinder_traversal_cost;
+
+private:
+    static constexpr size_t no_depth = std::numeric_limits<size_t>::max();
+
+    /// Bottom-up pass over a set of nodes, which computes the height of every subtree and the
+    /// overlap of the children of every inner node, and records the root of each node.
+    template <typename NodeSet>
+    class SubtreePass : public BottomUpAlgorithm<Bvh, false, NodeSet> {
+        using Base = BottomUpAlgorithm<Bvh, false, NodeSet>;
+        using Base::parents;
+        using Base::nodes;
+        using Base::node_count;
+        using Base::no_parent;
+
+    public:
+        std::unique_ptr<size_t[]> heights;
+        std::unique_ptr<Scalar[]> overlaps;
+
+        /// Depth relative to the root of the tree that contains the node, or `no_depth` for unreachable nodes.
+        std::unique_ptr<size_t[]> depths;
+        std::unique_ptr<size_t[]> roots;
+
+        SubtreePass(Bvh& bvh)
+            : Base(bvh)
+        {}
+
+        void run() {
+            auto node_count = this->node_count();
+            heights  = std::make_unique<size_t[]>(node_count);
+            overlaps = std::make_unique<Scalar[]>(node_count);
+            depths   = std::make_unique<size_t[]>(node_count);
+            roots    = std::make_unique<size_t[]>(node_count);
+
+            #pragma omp parallel
+            {
+                this->traverse_in_parallel(
+                    [&] (size_t i) {
+                        heights[i] = 0;
+                        overlaps[i] = 0;
+                    },
+                    [&] (size_t i) {
+                        auto first_child = nodes()[i].first_child_or_primitive;
+                        heights[i] = std::max(heights[first_child + 0], heights[first_child + 1]) + 1;
+                        auto overlap = bounding_box(nodes()[first_child + 0]).shrink(bounding_box(nodes()[first_child + 1]));
+                        auto d = overlap.diagonal();
+                        overlaps[i] = d[0] >= 0 && d[1] >= 0 && d[2] >= 0 ? overlap.half_area() : Scalar(0);
+                    });
+
+                // The depth of each node is the length of the path to its root
+                #pragma omp for
+                for (size_t i = 0; i < node_count; ++i) {
+                    if (parents[i] == no_parent) {
+                        depths[i] = no_depth;
+                        continue;
+                    }
+                    size_t depth = 0, j = i;
+                    while (parents[j] != j) {
+                        j = parents[j];
+                        depth++;
+                    }
+                    depths[i] = depth;
+                    roots[i] = j;
+                }
+            }
+        }
+
+    private:
+        template <typename Node>
+        static BoundingBox<Scalar> bounding_box(const Node& node) {
+            if constexpr (NodeSet::is_cylinder)
+                return node.bounding_box_proxy().to_bounding_box().AABB();
+            else
+                return node.bounding_box_proxy().to_bounding_box();
+        }
+    };
+
+    Bvh& bvh;
+
+    /// Per-thread histograms, merged at the end of the analysis.
+    struct Histograms {
+        std::vector<typename Analysis::Level> levels;
+        std::vector<size_t> leaf_sizes;
+
+        explicit Histograms(size_t level_count)
+            : levels(level_count)
+        {}
+
+        void add_leaf(size_t level, size_t primitive_count) {
+            levels[level].leaf_count++;
+            if (leaf_sizes.size() <= primitive_count)
+                leaf_sizes.resize(primitive_count + 1, 0);
+            leaf_sizes[primitive_count]++;
+        }
+
+        void merge_into(Analysis& analysis) const {
+            for (size_t i = 0; i < levels.size(); ++i) {
+                auto& level = analysis.levels[i];
+                level.box_count          += levels[i].box_count;
+                level.cylinder_count     += levels[i].cylinder_count;
+                level.leaf_count         += levels[i].leaf_count;
+                level.box_half_area      += levels[i].box_half_area;
+                level.cylinder_half_area += levels[i].cylinder_half_area;
+                level.sibling_overlap    += levels[i].sibling_overlap;
+            }
+            if (analysis.leaf_sizes.size() < leaf_sizes.size())
+                analysis.leaf_sizes.resize(leaf_sizes.size(), 0);
+            for (size_t i = 0; i < leaf_sizes.size(); ++i)
+                analysis.leaf_sizes[i] += leaf_sizes[i];
+        }
+    };
+
+public:
+    BvhAnalyzer(Bvh& bvh)
+        : bvh(bvh)
+    {}
+
+    Analysis analyze() {
+        bvh__assert_not_in_parallel();
+
+        Analysis analysis;
+        analysis.cylinder = bvh.cylinder;
+        analysis.hybrid = bvh.hybrid;
+        analysis.sah_cost = this->compute_cost(bvh);
+
+        bool has_boxes = !bvh.cylinder || bvh.hybrid;
+        std::unique_ptr<SubtreePass<BoxNodes<Bvh>>> box_pass;
+        std::unique_ptr<SubtreePass<CylinderNodes<Bvh>>> cylinder_pass;
+        if (has_boxes) {
+            box_pass = std::make_unique<SubtreePass<BoxNodes<Bvh>>>(bvh);
+            box_pass->run();
+        }
+        if (bvh.cylinder) {
+            cylinder_pass = std::make_unique<SubtreePass<CylinderNodes<Bvh>>>(bvh);
+            cylinder_pass->run();
+        }
+
+        // The cylinder subtrees of hybrid hierarchies start at the level of the box leaf that refers to them
+        std::unique_ptr<size_t[]> root_depths;
+        if (bvh.hybrid) {
+            root_depths = std::make_unique<size_t[]>(bvh.cnode_count);
+            size_t min_depth = no_depth, max_depth = 0, depth_sum = 0, transition_count = 0;
+            #pragma omp parallel for reduction(min: min_depth) reduction(max: max_depth) reduction(+: depth_sum, transition_count)
+            for (size_t i = 0; i < bvh.node_count; ++i) {
+                if (!bvh.nodes[i].is_leaf)
+                    continue;
+                auto depth = box_pass->depths[i];
+                root_depths[bvh.nodes[i].cylinder_root()] = depth;
+                min_depth = std::min(min_depth, depth);
+                max_depth = std::max(max_depth, depth);
+                depth_sum += depth;
+                transition_count++;
+            }
+            analysis.min_transition_depth  = min_depth;
+            analysis.max_transition_depth  = max_depth;
+            analysis.mean_transition_depth = Scalar(depth_sum) / Scalar(transition_count);
+        }
+        auto cylinder_depth = [&] (size_t i) {
+            auto depth = cylinder_pass->depths[i];
+            if (depth == no_depth || !bvh.hybrid)
+                return depth;
+            return depth + root_depths[cylinder_pass->roots[i]];
+        };
+
+        // The heights of the subtrees give the depth of the hierarchy
+        size_t depth = 0;
+        if (bvh.hybrid) {
+            #pragma omp parallel for reduction(max: depth)
+            for (size_t i = 0; i < bvh.node_count; ++i) {
+                if (bvh.nodes[i].is_leaf)
+                    depth = std::max(depth, box_pass->depths[i] + cylinder_pass->heights[bvh.nodes[i].cylinder_root()]);
+            }
+        } else
+            depth = has_boxes ? box_pass->heights[0] : cylinder_pass->heights[0];
+        analysis.depth = depth;
+        analysis.levels.resize(depth + 1);
+
+        #pragma omp parallel
+        {
+            Histograms histograms(depth + 1);
+
+            #pragma omp for nowait
+            for (size_t i = 0; i < (has_boxes ? bvh.node_count : 0); ++i) {
+                const auto& node = bvh.nodes[i];
+                auto& level = histograms.levels[box_pass->depths[i]];
+                level.box_count++;
+                level.box_half_area += node.bounding_box_proxy().half_area();
+                if (!node.is_leaf)
+                    histograms.levels[box_pass->depths[i] + 1].sibling_overlap += box_pass->overlaps[i];
+                else if (!bvh.hybrid)
+                    histograms.add_leaf(box_pass->depths[i], node.primitive_count);
+            }
+
+            #pragma omp for nowait
+            for (size_t i = 0; i < (bvh.cylinder ? bvh.cnode_count : 0); ++i) {
+                auto d = cylinder_depth(i);
+                if (d == no_depth)
+                    continue;
+                const auto& node = bvh.cnodes[i];
+                // The roots of the cylinder subtrees of hybrid hierarchies are replaced by box leaves
+                if (!bvh.hybrid || cylinder_pass->roots[i] != i) {
+                    auto& level = histograms.levels[d];
+                    level.cylinder_count++;
+                    level.cylinder_half_area += node.bounding_box_proxy().half_area();
+                }
+                if (!node.is_leaf)
+                    histograms.levels[d + 1].sibling_overlap += cylinder_pass->overlaps[i];
+                else
+                    histograms.add_leaf(d, node.primitive_count);
+            }
+
+            #pragma omp critical
+            { histograms.merge_into(analysis); }
+        }
+
+        Scalar overlap = 0;
+        for (auto& level : analysis.levels)
+            overlap += level.sibling_overlap;
+        auto root_half_area = has_boxes
+            ? bvh.nodes[0].bounding_box_proxy().half_area()
+            : bvh.cnodes[0].bounding_box_proxy().half_area();
+        analysis.sibling_overlap = overlap / root_half_area;
+        return analysis;
+    }
+};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef BVH_BVH_CACHE_HPP
+#define BVH_BVH_CACHE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define BVH_CACHE_HAS_MMAP
+#endif
+
+#include "bvh/bvh.hpp"
+
+namespace bvh {
+
+	/// Hash used to key cached hierarchies by the data they were built from (the primitives, and the
+	/// build parameters). Each 64-bit word is scrambled with the finalizer of SplitMix64 before being
+	/// combined with the FNV-1a scheme, which is fast enough to hash the primitives on every run.
+	class BvhCacheKey {
+		static constexpr uint64_t fnv_prime = UINT64_C(0x100000001b3);
+
+		uint64_t value = UINT64_C(0xcbf29ce484222325);
+
+		static uint64_t mix(uint64_t x) {
+			x ^= x >> 30;
+			x *= UINT64_C(0xbf58476d1ce4e5b9);
+			x ^= x >> 27;
+			x *= UINT64_C(0x94d049bb133111eb);
+			x ^= x >> 31;
+			return x;
+		}
+
+		void add_word(uint64_t word) {
+			value = (value ^ mix(word)) * fnv_prime;
+		}
+
+	public:
+		/// Adds the bytes of the given buffer to the key.
+		BvhCacheKey& add(const void* data, size_t size) {
+			auto bytes = static_cast<const unsigned char*>(data);
+			size_t i = 0;
+			for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+				uint64_t word;
+				std::memcpy(&word, bytes + i, sizeof(uint64_t));
+				add_word(word);
+			}
+			uint64_t tail = 0;
+			std::memcpy(&tail, bytes + i, size - i);
+			// The size is added so that buffers that only differ by trailing zeros have different keys
+			add_word(tail);
+			add_word(size);
+			return *this;
+		}
+
+		/// Adds a value of a trivially copyable type (e.g. a build parameter) to the key.
+		template <typename T>
+		BvhCacheKey& add(const T& x) {
+			static_assert(std::is_trivially_copyable<T>::value);
+			return add(&x, sizeof(T));
+		}
+
+		BvhCacheKey& add(const std::string& string) {
+			return add(string.data(), string.size());
+		}
+
+		uint64_t get() const { return value; }
+	};
+
+	/// Binary cache for BVHs. The file starts with a header, which records the version of the format,
+	/// the layout of the nodes, and the key of the hierarchy. It is followed by the arrays of nodes,
+	/// cylinder nodes, and primitive indices, stored as they are in memory. Each of these sections
+	/// starts at a multiple of `section_alignment` bytes (plus the offset that the node type applies
+	/// to its arrays, if any), so that `map()` can access them in place, while `load()` copies them.
+	/// Files written by another version of the format, or for another node layout, or another
+	/// platform, are rejected instead of being misinterpreted.
+	template <typename Bvh>
+	class BvhCache {
+		using Node       = typename Bvh::Node;
+		using CustomNode = typename Bvh::CustomNode;
+
+		static_assert(std::is_trivially_copyable<Node>::value && std::is_trivially_copyable<CustomNode>::value);
+
+	public:
+		/// Version of the format, to be incremented whenever it (or the layout of a node) changes.
+		static constexpr uint32_t version = 3;
+
+		static constexpr size_t section_alignment = 64;
+
+	private:
+		static constexpr char magic[8] = { 'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E' };
+
+		// Written as a native integer, to detect files written on a platform of different endianness
+		static constexpr uint32_t byte_order_mark = 0x01020304;
+
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t byte_order_mark;
+			uint32_t scalar_size;
+			uint32_t node_size;
+			uint32_t cylinder_node_size;
+			uint32_t flags;
+			uint64_t key;
+			uint64_t node_count;
+			uint64_t cylinder_node_count;
+			uint64_t reference_count;
+			uint64_t node_offset;
+			uint64_t cylinder_node_offset;
+			uint64_t primitive_index_offset;
+			uint64_t file_size;
+		};
+
+		enum Flags : uint32_t {
+			cylinder_flag = 1,
+			hybrid_flag   = 2
+		};
+
+		// Offset that a node type applies to its arrays (see `CompactCylinderNode`), if any
+		template <typename T, typename = void>
+		struct ArrayOffset { static constexpr size_t value = 0; };
+		template <typename T>
+		struct ArrayOffset<T, std::void_t<decltype(T::array_offset)>> { static constexpr size_t value = T::array_offset; };
+
+		static_assert(ArrayOffset<Node>::value < section_alignment && ArrayOffset<CustomNode>::value < section_alignment);
+
+		static uint64_t align(uint64_t offset) {
+			return (offset + section_alignment - 1) / section_alignment * section_alignment;
+		}
+
+		static void compute_offsets(Header& header) {
+			header.node_offset            = align(sizeof(Header)) + ArrayOffset<Node>::value;
+			header.cylinder_node_offset   = align(header.node_offset + header.node_count * sizeof(Node)) + ArrayOffset<CustomNode>::value;
+			header.primitive_index_offset = align(header.cylinder_node_offset + header.cylinder_node_count * sizeof(CustomNode));
+			header.file_size              = header.primitive_index_offset + header.reference_count * sizeof(size_t);
+		}
+
+		static Header make_header(const Bvh& bvh, uint64_t key, size_t reference_count) {
+			Header header;
+			std::memset(&header, 0, sizeof(Header));
+			std::memcpy(header.magic, magic, sizeof(magic));
+			header.version             = version;
+			header.byte_order_mark     = byte_order_mark;
+			header.scalar_size         = sizeof(typename Bvh::ScalarType);
+			header.node_size           = sizeof(Node);
+			header.cylinder_node_size  = sizeof(CustomNode);
+			header.flags               = (bvh.cylinder ? uint32_t(cylinder_flag) : uint32_t(0)) | (bvh.hybrid ? uint32_t(hybrid_flag) : uint32_t(0));
+			header.key                 = key;
+			header.node_count          = bvh.nodes ? bvh.node_count : 0;
+			header.cylinder_node_count = bvh.cnodes ? bvh.cnode_count : 0;
+			header.reference_count     = reference_count;
+			// Pure cylinder hierarchies record their size in both counts, but only have cylinder nodes
+			if (bvh.cylinder && !bvh.hybrid)
+				header.node_count = 0;
+			compute_offsets(header);
+			return header;
+		}
+
+		static bool is_compatible(const Header& header, uint64_t key, uint64_t file_size) {
+			// The sections must be where this version of the format puts them, within the file
+			Header expected = header;
+			compute_offsets(expected);
+			return
+				expected.node_offset            == header.node_offset &&
+				expected.cylinder_node_offset   == header.cylinder_node_offset &&
+				expected.primitive_index_offset == header.primitive_index_offset &&
+				expected.file_size              == file_size &&
+				header.file_size                == file_size &&
+				header.reference_count          != 0 &&
+				!std::memcmp(header.magic, magic, sizeof(magic)) &&
+				header.version            == version &&
+				header.byte_order_mark    == byte_order_mark &&
+				header.scalar_size        == sizeof(typename Bvh::ScalarType) &&
+				header.node_size          == sizeof(Node) &&
+				header.cylinder_node_size == sizeof(CustomNode) &&
+				header.key                == key;
+		}
+
+		static void write_section(std::ofstream& out, const void* data, size_t size, uint64_t offset) {
+			static const char padding[2 * section_alignment] = {};
+			auto position = static_cast<uint64_t>(out.tellp());
+			out.write(padding, offset - position);
+			out.write(static_cast<const char*>(data), size);
+		}
+
+		template <typename T>
+		static BvhArray<T> read_section(std::ifstream& in, size_t count, uint64_t offset) {
+			if (count == 0)
+				return nullptr;
+			auto data = std::make_unique<T[]>(count);
+			in.seekg(offset);
+			in.read(reinterpret_cast<char*>(data.get()), count * sizeof(T));
+			return data;
+		}
+
+		template <typename T>
+		static BvhArray<T> map_section(const std::shared_ptr<void>& mapping, char* bytes, size_t count, uint64_t offset) {
+			if (count == 0)
+				return nullptr;
+			return BvhArray<T>(reinterpret_cast<T*>(bytes + offset), ArrayDeleter<T>(mapping));
+		}
+
+		static size_t set_counts(Bvh& bvh, const Header& header) {
+			bvh.cylinder = header.flags & cylinder_flag;
+			bvh.hybrid = header.flags & hybrid_flag;
+			bvh.cnode_count = header.cylinder_node_count;
+			bvh.node_count = bvh.cylinder && !bvh.hybrid ? bvh.cnode_count : header.node_count;
+			return header.reference_count;
+		}
+
+	public:
+		/// Writes the given BVH, with the given number of primitive indices, to a file.
+		/// Returns true if it succeeded.
+		static bool save(const Bvh& bvh, const std::string& file_name, uint64_t key, size_t reference_count) {
+			auto header = make_header(bvh, key, reference_count);
+			std::ofstream out(file_name, std::ofstream::binary | std::ofstream::trunc);
+			if (!out)
+				return false;
+			out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			write_section(out, bvh.nodes.get(), header.node_count * sizeof(Node), header.node_offset);
+			write_section(out, bvh.cnodes.get(), header.cylinder_node_count * sizeof(CustomNode), header.cylinder_node_offset);
+			write_section(out, bvh.primitive_indices.get(), reference_count * sizeof(size_t), header.primitive_index_offset);
+			return static_cast<bool>(out.flush());
+		}
+
+		static bool save(const Bvh& bvh, const std::string& file_name, uint64_t key) {
+			return save(bvh, file_name, key, bvh.reference_count());
+		}
+
+		/// Reads a BVH from a file, provided that it was written with the same key and node layout.
+		/// Returns the number of primitive indices of the loaded BVH, or zero if it could not be loaded,
+		/// in which case the given BVH is left untouched.
+		static size_t load(Bvh& bvh, const std::string& file_name, uint64_t key) {
+			std::ifstream in(file_name, std::ifstream::binary | std::ifstream::ate);
+			if (!in)
+				return 0;
+			auto file_size = static_cast<uint64_t>(in.tellg());
+			Header header;
+			in.seekg(0);
+			if (file_size < sizeof(Header) ||
+				!in.read(reinterpret_cast<char*>(&header), sizeof(Header)) ||
+				!is_compatible(header, key, file_size))
+				return 0;
+
+			auto nodes = read_section<Node>(in, header.node_count, header.node_offset);
+			auto cnodes = read_section<CustomNode>(in, header.cylinder_node_count, header.cylinder_node_offset);
+			auto primitive_indices = read_section<size_t>(in, header.reference_count, header.primitive_index_offset);
+			if (!in)
+				return 0;
+
+			bvh.nodes = std::move(nodes);
+			bvh.cnodes = std::move(cnodes);
+			bvh.primitive_indices = std::move(primitive_indices);
+			return set_counts(bvh, header);
+		}
+
+		/// Maps a BVH from a file, under the same conditions as `load()`. The arrays of the BVH point
+		/// into a private mapping of the file, which is unmapped once all of them are released: pages
+		/// are only read when they are first accessed, and the BVH can still be modified (e.g. refitted)
+		/// without modifying the file. Falls back to `load()` on platforms that do not support `mmap()`.
+		static size_t map(Bvh& bvh, const std::string& file_name, uint64_t key) {
+#ifdef BVH_CACHE_HAS_MMAP
+			int fd = open(file_name.c_str(), O_RDONLY);
+			if (fd < 0)
+				return 0;
+			struct stat info;
+			void* data = MAP_FAILED;
+			size_t file_size = 0;
+			if (fstat(fd, &info) == 0 && static_cast<uint64_t>(info.st_size) >= sizeof(Header)) {
+				file_size = info.st_size;
+				data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			}
+			close(fd);
+			if (data == MAP_FAILED)
+				return 0;
+			std::shared_ptr<void> mapping(data, [file_size] (void* ptr) { munmap(ptr, file_size); });
+
+			Header header;
+			std::memcpy(&header, data, sizeof(Header));
+			if (!is_compatible(header, key, file_size))
+				return 0;
+
+			auto bytes = static_cast<char*>(data);
+			bvh.nodes = map_section<Node>(mapping, bytes, header.node_count, header.node_offset);
+			bvh.cnodes = map_section<CustomNode>(mapping, bytes, header.cylinder_node_count, header.cylinder_node_offset);
+			bvh.primitive_indices = map_section<size_t>(mapping, bytes, header.reference_count, header.primitive_index_offset);
+			return set_counts(bvh, header);
+#else
+			return load(bvh, file_name, key);
+#endif
+		}
+	};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef BVH_CAPSULE_HPP
+#define BVH_CAPSULE_HPP
+
+#include <optional>
+#include <algorithm>
+#include <cmath>
+
+#include "bvh/vector.hpp"
+#include "bvh/bounding_box.hpp"
+#include "bvh/ray.hpp"
+#include "bvh/utilities.hpp"
+
+namespace bvh {
+
+/// Capsule primitive, defined by a line segment and a radius: the set of points that are within
+/// `radius` of the segment. This is the section of a strand of hair between two control points of
+/// a linear curve. Consecutive capsules of a curve overlap at their joints, which leaves no cracks
+/// at the bends. The bounding cylinder of a capsule is exact, which makes it a better fit for
+/// cylinder hierarchies than thin ribbons of triangles.
+template <typename Scalar>
+struct Capsule {
+    struct Intersection {
+        /// Distance along the ray, and parameter of the closest point on the segment, from 0 at `p0` to 1 at `p1`.
+        Scalar t, u;
+
+        Scalar distance() const { return t; }
+    };
+
+    using ScalarType       = Scalar;
+    using IntersectionType = Intersection;
+
+    Vector3<Scalar> p0, p1;
+    Scalar radius;
+
+    Capsule() = default;
+    Capsule(const Vector3<Scalar>& p0, const Vector3<Scalar>& p1, Scalar radius)
+        : p0(p0), p1(p1), radius(radius)
+    {}
+
+    Vector3<Scalar> center() const {
+        return (p0 + p1) * Scalar(0.5);
+    }
+
+    /// Returns the unit direction of the segment, or an arbitrary one when the capsule is a sphere.
+    Vector3<Scalar> axis() const {
+        auto d = p1 - p0;
+        return length(d) > 0 ? normalize(d) : Vector3<Scalar>(0, 1, 0);
+    }
+
+    BoundingBox<Scalar> bounding_box() const {
+        BoundingBox<Scalar> bbox(min(p0, p1), max(p0, p1));
+        bbox.min -= Vector3<Scalar>(radius);
+        bbox.max += Vector3<Scalar>(radius);
+        return bbox;
+    }
+
+    /// Returns the smallest cylinder containing the capsule: the segment extended by the
+    /// radius on both sides, so that the cylinder contains the hemispherical caps.
+    BoundingCyl<Scalar> bounding_cyl() const {
+        auto axis = this->axis();
+        return BoundingCyl<Scalar>(p0 - axis * radius, axis, length(p1 - p0) + Scalar(2) * radius, radius);
+    }
+
+    /// Returns the normal of the surface at the given point of the surface.
+    Vector3<Scalar> normal(const Intersection& intersection, const Ray<Scalar>& ray) const {
+        auto point = ray.origin + ray.direction * intersection.t;
+        return normalize(point - (p0 + (p1 - p0) * intersection.u));
+    }
+
+    /// Returns the distance from the given segment to the surface of the capsule, or 0 if they
+    /// overlap. The segment can be a point, when both ends are equal.
+    Scalar distance(const Vector3<Scalar>& q0, const Vector3<Scalar>& q1) const {
+        return std::max(segment_distance(p0, p1, q0, q1) - radius, Scalar(0));
+    }
+
+    Scalar distance(const Vector3<Scalar>& point) const {
+        return distance(point, point);
+    }
+
+    /// Returns the closest intersection in `[ray.tmin, ray.tmax)`. Rays starting inside
+    /// the capsule hit it where they leave it.
+    std::optional<Intersection> intersect(const Ray<Scalar>& ray) const {
+        auto ba = p1 - p0;
+        auto oa = ray.origin - p0;
+        auto baba = dot(ba, ba);
+        auto bard = dot(ba, ray.direction);
+        auto baoa = dot(ba, oa);
+        auto rdoa = dot(ray.direction, oa);
+        auto rdrd = dot(ray.direction, ray.direction);
+        auto r2 = radius * radius;
+
+        std::optional<Intersection> best_hit;
+        auto tmax = ray.tmax;
+        auto record_hit = [&] (Scalar t, Scalar u) {
+            if (t >= ray.tmin && t < tmax) {
+                tmax = t;
+                best_hit = std::make_optional(Intersection { t, u });
+            }
+        };
+
+        // Body: infinite cylinder around the segment, restricted to the points that project onto the segment
+        auto a = baba * rdrd - bard * bard;
+        if (a > 0) {
+            auto b = baba * rdoa - baoa * bard;
+            auto c = baba * dot(oa, oa) - baoa * baoa - r2 * baba;
+            auto delta = b * b - a * c;
+            if (delta >= 0) {
+                auto sqrt_delta = std::sqrt(delta);
+                auto t0 = (-b - sqrt_delta) / a;
+                auto y0 = baoa + t0 * bard;
+                // The caps are contained in the infinite cylinder, so nothing is hit before entering it
+                if (y0 >= 0 && y0 <= baba && t0 >= ray.tmin && t0 < ray.tmax)
+                    return std::make_optional(Intersection { t0, y0 / baba });
+                auto t1 = (-b + sqrt_delta) / a;
+                auto y1 = baoa + t1 * bard;
+                if (y1 >= 0 && y1 <= baba)
+                    record_hit(t1, y1 / baba);
+            }
+        }
+
+        // Caps: hemispheres at both ends, beyond the segment
+        for (int i = 0; i < 2; ++i) {
+            auto oc = i == 0 ? oa : ray.origin - p1;
+            auto b = dot(ray.direction, oc);
+            auto c = dot(oc, oc) - r2;
+            auto delta = b * b - rdrd * c;
+            if (delta < 0)
+                continue;
+            auto sqrt_delta = std::sqrt(delta);
+            for (auto t : { (-b - sqrt_delta) / rdrd, (-b + sqrt_delta) / rdrd }) {
+                auto y = baoa + t * bard;
+                if (i == 0 ? y <= 0 : y >= baba)
+                    record_hit(t, Scalar(i));
+            }
+        }
+
+        return best_hit;
+    }
+};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef BVH_CHUNKED_HYBRID_BUILDER_HPP
+#define BVH_CHUNKED_HYBRID_BUILDER_HPP
+
+#include <memory>
+#include <vector>
+#include <limits>
+
+#include "bvh/bvh.hpp"
+#include "bvh/bounding_box.hpp"
+#include "bvh/binned_sah_builder.hpp"
+#include "bvh/locally_ordered_clustering_builder.hpp"
+#include "bvh/build_observer.hpp"
+
+namespace bvh {
+
+	/// Hybrid BVH builder for large scenes, which builds the two kinds of levels in the opposite order
+	/// of the hybrid build of `LocallyOrderedClusteringBuilder`. A binned SAH builder first splits the
+	/// primitives top-down into spatially coherent chunks of at most `chunk_size` primitives, which
+	/// become the box leaves. The cylinder subtree of each chunk is then built by locally-ordered
+	/// clustering, independently of the other chunks. The top-down levels are built in parallel by
+	/// tasks, and the chunks are clustered concurrently, one per thread, in buffers that are small
+	/// enough to stay in the cache. The box leaves refer to the roots of the cylinder subtrees (see
+	/// `Node::cylinder_root()`), as in the other hybrid hierarchies.
+	template <typename Bvh, typename Morton, typename Node, size_t BinCount = 16>
+	class ChunkedHybridBuilder {
+		using Scalar = typename Bvh::ScalarType;
+		using ChunkBuilder = LocallyOrderedClusteringBuilder<Bvh, Morton, Node>;
+
+		Bvh& bvh;
+
+		void configure(ChunkBuilder& builder) const {
+			builder.search_radius = search_radius;
+			builder.approximate_cylinder_distances = approximate_cylinder_distances;
+			builder.cylinder_search_steps = cylinder_search_steps;
+			builder.cylinder_search_threshold = cylinder_search_threshold;
+			builder.cylinder_inflation = cylinder_inflation;
+			builder.direction_bit_count = direction_bit_count;
+		}
+
+	public:
+		/// Maximum number of primitives of a chunk. Cylinders pay off in the lower levels of the
+		/// hierarchy, hence small chunks, which leave the upper levels to the top-down builder.
+		size_t chunk_size = 32;
+
+		/// Parameters of the clustering of each chunk (see `LocallyOrderedClusteringBuilder`).
+		size_t search_radius = 10;
+		bool approximate_cylinder_distances = false;
+		size_t cylinder_search_steps = 0;
+		size_t cylinder_search_threshold = 1024;
+		Scalar cylinder_inflation = Scalar(4) * std::numeric_limits<Scalar>::epsilon();
+		size_t direction_bit_count = 0;
+
+		BuildObserver* observer = nullptr;
+
+		ChunkedHybridBuilder(Bvh& bvh)
+			: bvh(bvh)
+		{}
+
+		void build(
+			const BoundingBox<Scalar>& global_bbox,
+			const BoundingCyl<Scalar>* bcyls,
+			const Vector3<Scalar>* centers,
+			size_t primitive_count)
+		{
+			// The top-down levels are built over the bounding boxes of the cylinders
+			auto bboxes = std::make_unique<BoundingBox<Scalar>[]>(primitive_count);
+#pragma omp parallel for
+			for (size_t i = 0; i < primitive_count; ++i)
+				bboxes[i] = bcyls[i].AABB();
+
+			// A leaf costs as much as a chunk, hence every node that fits in a chunk becomes
+			// a leaf, and every larger node is split (using a median split when the SAH fails)
+			BinnedSahBuilder<Bvh, BinCount> top_down_builder(bvh);
+			top_down_builder.observer = observer;
+			top_down_builder.max_leaf_size = chunk_size;
+			top_down_builder.traversal_cost = Scalar(chunk_size);
+			top_down_builder.build(global_bbox, bboxes.get(), centers, primitive_count);
+
+			BuildTimer timer(observer);
+
+			// The subtree of every chunk of n primitives has 2n - 1 nodes, and is followed by an empty
+			// leaf, so that every root is at an even offset and siblings keep their position within pairs
+			std::vector<size_t> chunks, offsets(1, 0);
+			for (size_t i = 0; i < bvh.node_count; ++i) {
+				if (bvh.nodes[i].is_leaf) {
+					chunks.push_back(i);
+					offsets.push_back(offsets.back() + 2 * bvh.nodes[i].primitive_count);
+				}
+			}
+			auto cnode_count = offsets.back();
+			auto cnodes = std::make_unique<typename Bvh::CustomNode[]>(cnode_count);
+			auto primitive_indices = std::make_unique<size_t[]>(primitive_count);
+
+#pragma omp parallel
+			{
+				Bvh chunk_bvh;
+				ChunkBuilder chunk_builder(chunk_bvh);
+				configure(chunk_builder);
+				std::vector<BoundingCyl<Scalar>> chunk_bcyls;
+				std::vector<Vector3<Scalar>> chunk_centers;
+
+#pragma omp for schedule(dynamic, 1)
+				for (size_t k = 0; k < chunks.size(); ++k) {
+					auto& leaf = bvh.nodes[chunks[k]];
+					size_t first = leaf.first_child_or_primitive;
+					size_t count = leaf.primitive_count;
+					auto indices = bvh.primitive_indices.get() + first;
+					chunk_bcyls.resize(count);
+					chunk_centers.resize(count);
+					for (size_t i = 0; i < count; ++i) {
+						chunk_bcyls[i] = bcyls[indices[i]];
+						chunk_centers[i] = centers[indices[i]];
+					}
+					chunk_builder.build(leaf.bounding_box_proxy().to_bounding_box(), chunk_bcyls.data(), chunk_centers.data(), count);
+
+					// Move the subtree to its offset, and make its indices refer to the whole hierarchy
+					auto offset = offsets[k];
+					for (size_t i = 0; i < chunk_bvh.cnode_count; ++i) {
+						auto& cnode = cnodes[offset + i];
+						cnode = chunk_bvh.cnodes[i];
+						cnode.first_child_or_primitive += cnode.is_leaf ? first : offset;
+					}
+					auto& padding = cnodes[offset + chunk_bvh.cnode_count];
+					padding = chunk_bvh.cnodes[0];
+					padding.is_leaf = true;
+					padding.primitive_count = 0;
+					padding.first_child_or_primitive = 0;
+					for (size_t i = 0; i < count; ++i)
+						primitive_indices[first + i] = indices[chunk_bvh.primitive_indices[i]];
+					leaf.set_cylinder_root(offset);
+				}
+			}
+
+			bvh.primitive_indices = std::move(primitive_indices);
+			bvh.cnodes = std::move(cnodes);
+			bvh.cnode_count = cnode_count;
+			timer.phase(BuildPhase::CylinderClustering, chunks.size());
+		}
+	};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef BVH_CYLINDER_NODES_HPP
+#define BVH_CYLINDER_NODES_HPP
+
+#include <array>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+#include "bvh/bounding_box.hpp"
+#include "bvh/utilities.hpp"
+
+namespace bvh {
+
+	/// Encodes a direction into two signed 16-bit integers using the octahedral mapping.
+	/// See "A Survey of Efficient Representations for Independent Unit Vectors", by Z. Cigolle et al.
+	template <typename Scalar>
+	std::array<int16_t, 2> octahedral_encode(const Vector3<Scalar>& v) {
+		Scalar norm = std::abs(v[0]) + std::abs(v[1]) + std::abs(v[2]);
+		if (norm == 0)
+			return std::array<int16_t, 2> { 0, 0 };
+		Scalar x = v[0] / norm;
+		Scalar y = v[1] / norm;
+		if (v[2] < 0) {
+			Scalar folded_x = (Scalar(1) - std::abs(y)) * (x >= 0 ? Scalar(1) : Scalar(-1));
+			Scalar folded_y = (Scalar(1) - std::abs(x)) * (y >= 0 ? Scalar(1) : Scalar(-1));
+			x = folded_x;
+			y = folded_y;
+		}
+		auto quantize = [] (Scalar s) {
+			return static_cast<int16_t>(std::round(std::min(Scalar(1), std::max(Scalar(-1), s)) * Scalar(32767)));
+		};
+		return std::array<int16_t, 2> { quantize(x), quantize(y) };
+	}
+
+	/// Decodes a direction encoded with `octahedral_encode()`. The result is normalized.
+	template <typename Scalar>
+	bvh__always_inline__ inline Vector3<Scalar> octahedral_decode(const std::array<int16_t, 2>& e) {
+		Scalar x = Scalar(e[0]) * Scalar(1.0 / 32767.0);
+		Scalar y = Scalar(e[1]) * Scalar(1.0 / 32767.0);
+		Scalar z = Scalar(1) - std::abs(x) - std::abs(y);
+		// Unfold the lower hemisphere without branching on the sign of z
+		Scalar t = std::max(-z, Scalar(0));
+		x += x >= 0 ? -t : t;
+		y += y >= 0 ? -t : t;
+		return normalize(Vector3<Scalar>(x, y, z));
+	}
+
+	/// Cylinder node stored with the same precision as the BVH. This is the layout used
+	/// by the builders during construction.
+	template <typename Scalar>
+	struct FullCylinderNode {
+		using IndexType = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
+
+		Vector3<Scalar> p1, axis;
+		Scalar h, r;
+		bool is_leaf : 1;
+		IndexType primitive_count : sizeof(IndexType)* CHAR_BIT - 1;
+		IndexType first_child_or_primitive;
+
+		struct BoundingBoxProxy {
+			FullCylinderNode& node;
+
+			BoundingBoxProxy(FullCylinderNode& node) : node(node)
+			{}
+
+			BoundingBoxProxy& operator = (const BoundingCyl<Scalar>& cyl) {
+				node.p1 = cyl.c;
+				node.axis = cyl.axis;
+				node.r = cyl.r;
+				node.h = cyl.h;
+				return *this;
+			}
+
+			operator BoundingCyl<Scalar>() const {
+				return BoundingCyl<Scalar>(node.p1, node.axis, node.h, node.r);
+			}
+
+			BoundingCyl<Scalar> to_bounding_box() const {
+				return static_cast<BoundingCyl<Scalar>>(*this);
+			}
+
+			Scalar half_area() const { return to_bounding_box().half_area(); }
+
+			BoundingBoxProxy& extend(const BoundingBox<Scalar>& bbox) {
+				return *this = to_bounding_box().extend(bbox);
+			}
+
+		};
+
+		BoundingBoxProxy bounding_box_proxy() {
+			return BoundingBoxProxy(*this);
+		}
+
+		const BoundingBoxProxy bounding_box_proxy() const {
+			return BoundingBoxProxy(*const_cast<FullCylinderNode*>(this));
+		}
+	};
+
+	/// Compact cylinder node, stored in single precision with an octahedral-encoded axis
+	/// and a precomputed squared radius. The size of this structure is 32 bytes, regardless
+	/// of the precision of the BVH, so that two siblings fit in one cache line. Assigning a
+	/// cylinder to this node rounds it conservatively: the stored cylinder always encloses
+	/// the original one. The top cap `p1 + h * axis` is not stored, since it is cheaper to
+	/// recompute it during traversal than to load it.
+	template <typename Scalar>
+	struct CompactCylinderNode {
+		using IndexType = uint32_t;
+
+		Vector3<float> p1;
+		std::array<int16_t, 2> encoded_axis;
+		float h, r2;
+		bool is_leaf : 1;
+		IndexType primitive_count : sizeof(IndexType)* CHAR_BIT - 1;
+		IndexType first_child_or_primitive;
+
+		static constexpr size_t cache_line_size = 64;
+
+		bvh__always_inline__ Vector3<Scalar> origin() const {
+			return Vector3<Scalar>(Scalar(p1[0]), Scalar(p1[1]), Scalar(p1[2]));
+		}
+
+		bvh__always_inline__ Vector3<Scalar> direction() const {
+			return octahedral_decode<Scalar>(encoded_axis);
+		}
+
+		/// Stores a cylinder that encloses the given one.
+		void encode(const BoundingCyl<Scalar>& cyl) {
+			// All the computations are done in double precision, so that the error
+			// bounds below are exact with respect to the stored values.
+			Vector3<double> c(double(cyl.c[0]), double(cyl.c[1]), double(cyl.c[2]));
+			Vector3<double> a(double(cyl.axis[0]), double(cyl.axis[1]), double(cyl.axis[2]));
+			double h = cyl.h, r = cyl.r;
+
+			encoded_axis = octahedral_encode(a);
+			auto d = octahedral_decode<double>(encoded_axis);
+
+			// The angular error of the quantized axis, padded to account for the
+			// error of the decoding step when it is done in single precision.
+			double delta = length(a - d) + 1e-6;
+
+			// Move the origin down along the decoded axis until the rotated cylinder
+			// covers the bottom cap, even after rounding it to single precision.
+			auto magnitude = std::max(std::abs(c[0]), std::max(std::abs(c[1]), std::abs(c[2])));
+			Vector3<double> e;
+			double lo;
+			for (double s = r * delta; ; s += -lo * 2 + double(std::numeric_limits<float>::epsilon()) * (magnitude + s)) {
+				p1 = Vector3<float>(float(c[0] - s * d[0]), float(c[1] - s * d[1]), float(c[2] - s * d[2]));
+				e = Vector3<double>(double(p1[0]), double(p1[1]), double(p1[2])) - c;
+				lo = -dot(e, d) - r * delta;
+				if (lo >= 0)
+					break;
+			}
+
+			auto top = -dot(e, d) + h + r * delta;
+			auto radius = length(e - dot(e, d) * d) + h * delta + r;
+			this->h = round_up(top);
+			r2 = round_up(radius * radius);
+		}
+
+		struct BoundingBoxProxy {
+			CompactCylinderNode& node;
+
+			BoundingBoxProxy(CompactCylinderNode& node) : node(node)
+			{}
+
+			BoundingBoxProxy& operator = (const BoundingCyl<Scalar>& cyl) {
+				node.encode(cyl);
+				return *this;
+			}
+
+			operator BoundingCyl<Scalar>() const {
+				return BoundingCyl<Scalar>(node.origin(), node.direction(), Scalar(node.h), Scalar(std::sqrt(node.r2)));
+			}
+
+			BoundingCyl<Scalar> to_bounding_box() const {
+				return static_cast<BoundingCyl<Scalar>>(*this);
+			}
+
+			Scalar half_area() const { return to_bounding_box().half_area(); }
+
+			BoundingBoxProxy& extend(const BoundingBox<Scalar>& bbox) {
+				return *this = to_bounding_box().extend(bbox);
+			}
+		};
+
+		BoundingBoxProxy bounding_box_proxy() {
+			return BoundingBoxProxy(*this);
+		}
+
+		const BoundingBoxProxy bounding_box_proxy() const {
+			return BoundingBoxProxy(*const_cast<CompactCylinderNode*>(this));
+		}
+
+		/// Arrays of compact nodes are offset by half a cache line, so that the element at
+		/// index 1 starts on a cache line boundary. Since siblings are stored at indices
+		/// 2k + 1 and 2k + 2, every pair of siblings then occupies exactly one line.
+		static constexpr size_t array_offset = cache_line_size / 2;
+
+		static void* operator new[](size_t size) {
+			auto ptr = static_cast<char*>(::operator new[](size + array_offset, std::align_val_t(cache_line_size)));
+			return ptr + array_offset;
+		}
+
+		static void operator delete[](void* ptr) {
+			::operator delete[](static_cast<char*>(ptr) - array_offset, std::align_val_t(cache_line_size));
+		}
+
+	private:
+		static float round_up(double x) {
+			auto f = float(x);
+			return double(f) < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+		}
+	};
+
+	/// Copies the contents of a cylinder node into a node with a possibly different layout.
+	template <typename Destination, typename Source>
+	void copy_cylinder_node(const Source& source, Destination& destination) {
+		destination.bounding_box_proxy() = source.bounding_box_proxy().to_bounding_box();
+		destination.is_leaf = source.is_leaf;
+		destination.primitive_count = source.primitive_count;
+		destination.first_child_or_primitive = source.first_child_or_primitive;
+	}
+
+} // namespace bvh
+
+#endif
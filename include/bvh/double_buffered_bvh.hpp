@@ -0,0 +1,245 @@
+#ifndef BVH_DOUBLE_BUFFERED_BVH_HPP
+#define BVH_DOUBLE_BUFFERED_BVH_HPP
+
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+#include "bvh/bvh.hpp"
+
+namespace bvh {
+
+/// Hierarchy that can be rebuilt in the background while it is being traversed. Rebuilds run on
+/// a separate thread (the builders themselves run in parallel on that thread), into a back buffer,
+/// while readers keep traversing the front buffer. The owner then publishes the back buffer, which
+/// is an atomic exchange of the front buffer: readers never wait, and the ones that are still
+/// traversing the previous front buffer keep it until they release it. Previous buffers are
+/// reclaimed with epochs: every reader announces the epoch at which it acquired the front buffer,
+/// and a buffer that was retired at some epoch is freed once no reader announces that epoch or an
+/// earlier one.
+///
+/// Refits are applied to a copy of the front buffer, which is then published in the same way, so
+/// that the hierarchy can be refitted for the frames in between two rebuilds without modifying the
+/// nodes that are being traversed. A rebuild works on the primitives as they were when it started:
+/// refitting the hierarchy after publishing it brings it up to date.
+///
+/// Readers are identified by an index below `MaxReaderCount`, and a reader must not acquire the
+/// hierarchy again before releasing it. A snapshot can be shared by the threads that render a frame.
+/// The other functions (rebuilds, refits, publication and reclamation) must be called by the owner
+/// of this object, from a single thread.
+template <typename Bvh, size_t MaxReaderCount = 64>
+class DoubleBufferedBvh {
+public:
+    static constexpr size_t max_reader_count = MaxReaderCount;
+
+private:
+    struct Buffer {
+        Bvh bvh;
+        size_t reference_count = 0;
+    };
+
+    // Epoch announced by a reader, or zero when it does not hold a snapshot.
+    // Every slot is on its own cache line, so that readers do not invalidate each other.
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch { 0 };
+    };
+
+    std::unique_ptr<Buffer> current;
+    std::atomic<const Buffer*> front { nullptr };
+    std::atomic<uint64_t> epoch { 1 };
+    mutable ReaderSlot reader_slots[max_reader_count];
+
+    std::vector<std::pair<std::unique_ptr<Buffer>, uint64_t>> retired;
+    std::unique_ptr<Buffer> spare;
+    std::future<std::unique_ptr<Buffer>> rebuild;
+
+    /// Copies an array of a buffer into another, reusing the array of the destination when it has the
+    /// right size. Missing arrays (e.g. the box nodes of pure cylinder hierarchies, which still record
+    /// their size in `node_count`) are copied as missing arrays.
+    template <typename T>
+    static void copy_array(const BvhArray<T>& source, size_t source_count, BvhArray<T>& destination, size_t destination_count) {
+        if (!source) {
+            destination.reset();
+            return;
+        }
+        if (!destination || destination_count != source_count)
+            destination = std::make_unique<T[]>(source_count);
+        std::copy(source.get(), source.get() + source_count, destination.get());
+    }
+
+    /// Copies a buffer into another, reusing the arrays of the destination when they have the right size.
+    static void copy(const Buffer& source, Buffer& destination) {
+        auto& src = source.bvh;
+        auto& dst = destination.bvh;
+        copy_array(src.nodes, src.node_count, dst.nodes, dst.node_count);
+        copy_array(src.cnodes, src.cnode_count, dst.cnodes, dst.cnode_count);
+        copy_array(src.primitive_indices, source.reference_count, dst.primitive_indices, destination.reference_count);
+        dst.node_count = src.node_count;
+        dst.cnode_count = src.cnode_count;
+        dst.cylinder = src.cylinder;
+        dst.hybrid = src.hybrid;
+        destination.reference_count = source.reference_count;
+    }
+
+    /// Makes the given buffer the front buffer, and retires the previous one.
+    void publish(std::unique_ptr<Buffer> buffer) {
+        front.store(buffer.get());
+        // Readers that see the new epoch acquire the new buffer, hence the
+        // previous buffer can only be used by readers of an earlier epoch
+        auto retire_epoch = epoch.fetch_add(1);
+        if (current)
+            retired.emplace_back(std::move(current), retire_epoch);
+        current = std::move(buffer);
+        reclaim();
+    }
+
+public:
+    /// Hierarchy acquired by a reader, which stays valid until the snapshot is destroyed.
+    class Snapshot {
+        std::atomic<uint64_t>* slot;
+        const Bvh* bvh;
+
+        Snapshot(std::atomic<uint64_t>* slot, const Bvh* bvh)
+            : slot(slot), bvh(bvh)
+        {}
+
+        friend class DoubleBufferedBvh;
+
+    public:
+        Snapshot(Snapshot&& other)
+            : slot(std::exchange(other.slot, nullptr)), bvh(other.bvh)
+        {}
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator = (const Snapshot&) = delete;
+        Snapshot& operator = (Snapshot&&) = delete;
+
+        ~Snapshot() {
+            if (slot)
+                slot->store(0, std::memory_order_release);
+        }
+
+        const Bvh& operator * () const { return *bvh; }
+        const Bvh* operator -> () const { return bvh; }
+    };
+
+    DoubleBufferedBvh() = default;
+
+    DoubleBufferedBvh(Bvh&& bvh) {
+        auto buffer = std::make_unique<Buffer>();
+        buffer->bvh = std::move(bvh);
+        buffer->reference_count = buffer->bvh.reference_count();
+        publish(std::move(buffer));
+    }
+
+    DoubleBufferedBvh(const DoubleBufferedBvh&) = delete;
+    DoubleBufferedBvh& operator = (const DoubleBufferedBvh&) = delete;
+
+    ~DoubleBufferedBvh() {
+        wait();
+#ifndef NDEBUG
+        for (auto& slot : reader_slots)
+            assert(slot.epoch.load() == 0);
+#endif
+    }
+
+    /// Acquires the front buffer for the reader with the given index. This never blocks.
+    /// There must be a front buffer: either given on construction, or published since then.
+    Snapshot acquire(size_t reader) const {
+        assert(reader < max_reader_count);
+        auto& slot = reader_slots[reader].epoch;
+        assert(slot.load(std::memory_order_relaxed) == 0);
+        // The epoch must be announced before the front buffer is loaded, since
+        // the owner retires the previous buffer after exchanging the front buffer
+        slot.store(epoch.load());
+        auto buffer = front.load();
+        assert(buffer);
+        return Snapshot(&slot, &buffer->bvh);
+    }
+
+    /// Starts rebuilding the hierarchy in the background, with a function `build(bvh)` that builds
+    /// into the given `Bvh` (including its `cylinder` and `hybrid` flags). The function runs on another
+    /// thread, and must therefore not refer to data that is modified in the meantime (e.g. it should
+    /// own a copy of the bounding volumes of the primitives). Returns false, and does nothing, if the
+    /// previous rebuild has not been published yet.
+    template <typename Build>
+    bool rebuild_async(Build&& build) {
+        if (rebuild.valid())
+            return false;
+        rebuild = std::async(std::launch::async, [build = std::forward<Build>(build)] () mutable {
+            auto buffer = std::make_unique<Buffer>();
+            build(buffer->bvh);
+            buffer->reference_count = buffer->bvh.reference_count();
+            return buffer;
+        });
+        return true;
+    }
+
+    /// Returns true if a rebuild has been started, but not published yet.
+    bool is_rebuilding() const { return rebuild.valid(); }
+
+    /// Returns true if a rebuild has completed, and can be published without waiting.
+    bool is_rebuild_ready() const {
+        return rebuild.valid() && rebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    /// Waits for the current rebuild to complete, if there is one.
+    void wait() const {
+        if (rebuild.valid())
+            rebuild.wait();
+    }
+
+    /// Publishes the result of the last rebuild if it has completed, which is typically done
+    /// between two frames. Returns true if the front buffer has changed. This never blocks.
+    bool publish_rebuild() {
+        if (!is_rebuild_ready())
+            return false;
+        publish(rebuild.get());
+        return true;
+    }
+
+    /// Refits a copy of the front buffer with a function `refit(bvh)` (e.g. using `HierarchyRefitter`
+    /// or `CylinderHierarchyRefitter`), and publishes it. The copy reuses the arrays of a reclaimed
+    /// buffer when possible, so that refitting every frame does not allocate memory.
+    template <typename Refit>
+    void refit(Refit&& refit) {
+        assert(current);
+        auto buffer = spare ? std::move(spare) : std::make_unique<Buffer>();
+        copy(*current, *buffer);
+        refit(buffer->bvh);
+        publish(std::move(buffer));
+    }
+
+    /// Frees the retired buffers that are not used by readers anymore, keeping
+    /// one of them for the next refit. Returns the number of buffers still in use.
+    size_t reclaim() {
+        // Oldest epoch announced by a reader
+        auto oldest_epoch = UINT64_MAX;
+        for (auto& slot : reader_slots) {
+            auto reader_epoch = slot.epoch.load();
+            if (reader_epoch != 0)
+                oldest_epoch = std::min(oldest_epoch, reader_epoch);
+        }
+        auto in_use = std::partition(retired.begin(), retired.end(),
+            [&] (const auto& buffer) { return buffer.second >= oldest_epoch; });
+        for (auto it = in_use; it != retired.end(); ++it) {
+            if (!spare)
+                spare = std::move(it->first);
+        }
+        retired.erase(in_use, retired.end());
+        return retired.size();
+    }
+
+    /// Returns the number of retired buffers that have not been reclaimed yet.
+    size_t retired_count() const { return retired.size(); }
+};
+
+} // namespace bvh
+
+#endif
@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <optional>
 #include <stack>
+#include <limits>
 
 #include "bvh/bvh.hpp"
 #include "bvh/bounding_box.hpp"
@@ -29,6 +30,31 @@ class HeuristicPrimitiveSplitter {
         return std::cbrt(bbox.largest_extent() * (Scalar(2) * bbox.half_area() - primitive.area()));
     }
 
+    /// Returns the splitting priority of a primitive in a cylinder hierarchy. The height of the
+    /// cylinder takes the place of the largest extent, so that long primitives, whose cylinders
+    /// have a much larger area than themselves, get most of the references.
+    static Scalar compute_cylinder_priority(const Primitive& primitive, const BoundingCyl<Scalar>& cyl) {
+        auto priority = std::cbrt(cyl.h * (Scalar(2) * cyl.half_area() - primitive.area()));
+        // Degenerate primitives have invalid cylinders, and are never split
+        return priority > 0 ? priority : Scalar(0);
+    }
+
+    /// Remaps the primitive indices of the given leaves and removes the duplicate references.
+    template <typename Node>
+    void repair_leaves(Node* nodes, size_t node_count, size_t* primitive_indices) {
+        #pragma omp parallel for
+        for (size_t i = 0; i < node_count; ++i) {
+            auto& node = nodes[i];
+            if (node.is_leaf && node.primitive_count > 0) {
+                auto begin = primitive_indices + node.first_child_or_primitive;
+                auto end   = begin + node.primitive_count;
+                std::transform(begin, end, begin, [&] (size_t i) { return original_indices[i]; });
+                std::sort(begin, end);
+                node.primitive_count = std::unique(begin, end) - begin;
+            }
+        }
+    }
+
 public:
     /// Performs triangle splitting on the given array of triangles.
     /// It returns the number of triangles after splitting.
@@ -135,19 +161,84 @@ public:
         return std::make_tuple(reference_count, std::move(bboxes), std::move(centers));
     }
 
-    /// Remaps BVH primitive indices and removes duplicate triangle references in the BVH leaves.
-    void repair_bvh_leaves(Bvh<Scalar>& bvh) {
-        #pragma omp parallel for
-        for (size_t i = 0; i < bvh.node_count; ++i) {
-            auto& node = bvh.nodes[i];
-            if (node.is_leaf) {
-                auto begin = bvh.primitive_indices.get() + node.first_child_or_primitive;
-                auto end   = begin + node.primitive_count;
-                std::transform(begin, end, begin, [&] (size_t i) { return original_indices[i]; });
-                std::sort(begin, end);
-                node.primitive_count = std::unique(begin, end) - begin;
+    /// Performs splitting for cylinder hierarchies on the given array of primitives: each split
+    /// primitive is cut along the axis of its bounding cylinder into slabs of equal height, whose
+    /// cylinders only cover their part of the primitive. This requires the primitives to provide
+    /// `slab_bounding_cyl()` (see `Triangle`). It returns the number of references after splitting.
+    std::tuple<size_t, std::unique_ptr<BoundingCyl<Scalar>[]>, std::unique_ptr<Vector3<Scalar>[]>>
+    split_cylinders(
+        const Primitive* primitives,
+        size_t primitive_count,
+        Scalar split_factor = Scalar(0.5))
+    {
+        auto split_indices = std::make_unique<size_t[]>(primitive_count);
+
+        std::unique_ptr<BoundingCyl<Scalar>[]> bcyls;
+        std::unique_ptr<Vector3<Scalar>[]> centers;
+
+        Scalar total_priority = 0;
+        size_t reference_count = 0;
+
+        #pragma omp parallel
+        {
+            #pragma omp for reduction(+: total_priority)
+            for (size_t i = 0; i < primitive_count; ++i)
+                total_priority += compute_cylinder_priority(primitives[i], primitives[i].bounding_cyl());
+
+            #pragma omp for
+            for (size_t i = 0; i < primitive_count; ++i) {
+                auto priority = compute_cylinder_priority(primitives[i], primitives[i].bounding_cyl());
+                split_indices[i] = 1 + (total_priority > 0 ? priority * (Scalar(primitive_count) * split_factor / total_priority) : 0);
+            }
+
+            prefix_sum.sum_in_parallel(split_indices.get(), split_indices.get(), primitive_count);
+
+            #pragma omp single
+            {
+                reference_count = split_indices[primitive_count - 1];
+                bcyls = std::make_unique<BoundingCyl<Scalar>[]>(reference_count);
+                centers = std::make_unique<Vector3<Scalar>[]>(reference_count);
+                original_indices = std::make_unique<size_t[]>(reference_count);
+            }
+
+            #pragma omp for
+            for (size_t i = 0; i < primitive_count; ++i) {
+                size_t split_begin = i > 0 ? split_indices[i - 1] : 0;
+                size_t split_count = split_indices[i] - split_begin;
+
+                auto bcyl = primitives[i].bounding_cyl();
+                if (split_count == 1) {
+                    bcyls[split_begin]   = bcyl;
+                    centers[split_begin] = primitives[i].center();
+                    original_indices[split_begin] = i;
+                    continue;
+                }
+
+                // The slabs are clipped independently, and are slightly inflated so
+                // that no part of the primitive falls in between two of them
+                auto slab_height = bcyl.h / Scalar(split_count);
+                for (size_t j = 0; j < split_count; ++j) {
+                    auto begin = Scalar(j) * slab_height;
+                    auto end   = j + 1 == split_count ? bcyl.h : begin + slab_height;
+                    auto fragment = primitives[i].slab_bounding_cyl(bcyl, begin, end);
+                    bcyls[split_begin + j]   = fragment.inflate(Scalar(4) * std::numeric_limits<Scalar>::epsilon());
+                    centers[split_begin + j] = fragment.center();
+                    original_indices[split_begin + j] = i;
+                }
             }
         }
+
+        return std::make_tuple(reference_count, std::move(bcyls), std::move(centers));
+    }
+
+    /// Remaps BVH primitive indices and removes duplicate triangle references in the BVH leaves.
+    /// In cylinder and hybrid hierarchies, the leaves are those of the cylinder nodes.
+    template <template <typename> class CylinderNode>
+    void repair_bvh_leaves(Bvh<Scalar, CylinderNode>& bvh) {
+        if (bvh.cylinder)
+            repair_leaves(bvh.cnodes.get(), bvh.cnode_count, bvh.primitive_indices.get());
+        else
+            repair_leaves(bvh.nodes.get(), bvh.node_count, bvh.primitive_indices.get());
     }
 };
 
@@ -1,18 +1,26 @@
 #ifndef BVH_HIERARCHY_REFITTER_HPP
 #define BVH_HIERARCHY_REFITTER_HPP
 
+#include <optional>
+#include <limits>
+
 #include "bvh/bvh.hpp"
 #include "bvh/bottom_up_algorithm.hpp"
 #include "bvh/platform.hpp"
 
 namespace bvh {
 
-template <typename Bvh>
-class HierarchyRefitter : public BottomUpAlgorithm<Bvh> {
+/// Recomputes the bounding volumes of the inner nodes of the set given as a parameter,
+/// from the bounding volumes of their children.
+template <typename Bvh, typename NodeSet = BoxNodes<Bvh>>
+class HierarchyRefitter : public BottomUpAlgorithm<Bvh, false, NodeSet> {
 protected:
-    using BottomUpAlgorithm<Bvh>::bvh;
-    using BottomUpAlgorithm<Bvh>::traverse_in_parallel;
-    using BottomUpAlgorithm<Bvh>::parents;
+    using Scalar = typename Bvh::ScalarType;
+
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::bvh;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::nodes;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::traverse_in_parallel;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::parents;
 
     template <typename UpdateLeaf>
     void refit_in_parallel(const UpdateLeaf& update_leaf) {
@@ -20,20 +28,30 @@ protected:
 
         // Refit every node of the tree in parallel
         traverse_in_parallel(
-            [&] (size_t i) { update_leaf(bvh.nodes[i]); },
+            [&] (size_t i) { update_leaf(nodes()[i]); },
             [&] (size_t i) {
-                auto& node = bvh.nodes[i];
+                auto& node = nodes()[i];
                 auto first_child = node.first_child_or_primitive;
-                node.bounding_box_proxy() = bvh.nodes[first_child + 0]
+                auto bounds = nodes()[first_child + 0]
                     .bounding_box_proxy()
                     .to_bounding_box()
-                    .extend(bvh.nodes[first_child + 1].bounding_box_proxy());
+                    .extend(nodes()[first_child + 1].bounding_box_proxy());
+                if constexpr (NodeSet::is_cylinder) {
+                    if (cylinder_inflation > 0)
+                        bounds.inflate(cylinder_inflation);
+                }
+                node.bounding_box_proxy() = bounds;
             });
     }
 
 public:
+    /// Relative margin by which the refitted cylinders are inflated, when the node set is made of
+    /// cylinders, so that they stay conservative in single precision, as when they are built (see
+    /// `LocallyOrderedClusteringBuilder::cylinder_inflation`). Zero disables it.
+    Scalar cylinder_inflation = Scalar(4) * std::numeric_limits<Scalar>::epsilon();
+
     HierarchyRefitter(Bvh& bvh)
-        : BottomUpAlgorithm<Bvh>(bvh)
+        : BottomUpAlgorithm<Bvh, false, NodeSet>(bvh)
     {}
 
     template <typename UpdateLeaf>
@@ -45,6 +63,64 @@ public:
     }
 };
 
+/// Refits cylinder and hybrid hierarchies, for instance after the primitives have moved.
+/// The cylinder nodes (or the trees of the cylinder forest, for hybrid hierarchies) are
+/// refitted first, and the box levels of hybrid hierarchies are then refitted from the
+/// bounding boxes of the cylinder roots that their leaves refer to.
+template <typename Bvh>
+class CylinderHierarchyRefitter {
+    using Scalar = typename Bvh::ScalarType;
+
+    Bvh& bvh;
+    HierarchyRefitter<Bvh, CylinderNodes<Bvh>> cylinder_refitter;
+    std::optional<HierarchyRefitter<Bvh>> box_refitter;
+
+public:
+    /// Relative margin by which the refitted cylinders are inflated, at the leaves and at the inner
+    /// nodes, as in `LocallyOrderedClusteringBuilder::cylinder_inflation`. Zero disables it.
+    Scalar cylinder_inflation = Scalar(4) * std::numeric_limits<Scalar>::epsilon();
+
+    CylinderHierarchyRefitter(Bvh& bvh)
+        : bvh(bvh), cylinder_refitter(bvh)
+    {
+        assert(bvh.cylinder);
+        if (bvh.hybrid)
+            box_refitter.emplace(bvh);
+    }
+
+    /// Refits the hierarchy, using the given function to update the cylinder leaves,
+    /// which are then inflated, as the inner nodes.
+    template <typename UpdateLeaf>
+    void refit(const UpdateLeaf& update_leaf) {
+        cylinder_refitter.cylinder_inflation = cylinder_inflation;
+        cylinder_refitter.refit([&] (typename Bvh::CustomNode& leaf) {
+            update_leaf(leaf);
+            if (cylinder_inflation > 0 && leaf.primitive_count > 0)
+                leaf.bounding_box_proxy() = leaf.bounding_box_proxy().to_bounding_box().inflate(cylinder_inflation);
+        });
+        if (box_refitter) {
+            box_refitter->refit([&] (typename Bvh::Node& leaf) {
+                leaf.bounding_box_proxy() = bvh.cnodes[leaf.cylinder_root()].bounding_box_proxy().to_bounding_box().AABB();
+            });
+        }
+    }
+
+    /// Refits the hierarchy, recomputing the cylinder leaves from the given primitives.
+    template <typename Primitive>
+    void refit_from_primitives(const Primitive* primitives) {
+        refit([&] (typename Bvh::CustomNode& leaf) {
+            assert(leaf.is_leaf);
+            if (leaf.primitive_count == 0)
+                return;
+            auto first_primitive = bvh.primitive_indices.get() + leaf.first_child_or_primitive;
+            auto cyl = primitives[first_primitive[0]].bounding_cyl();
+            for (size_t i = 1; i < leaf.primitive_count; ++i)
+                cyl.extend(primitives[first_primitive[i]].bounding_cyl());
+            leaf.bounding_box_proxy() = cyl;
+        });
+    }
+};
+
 } // namespace bvh
 
 #endif
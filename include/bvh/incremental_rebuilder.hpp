@@ -0,0 +1,355 @@
+#ifndef BVH_INCREMENTAL_REBUILDER_HPP
+#define BVH_INCREMENTAL_REBUILDER_HPP
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cassert>
+#include <type_traits>
+
+#include "bvh/bvh.hpp"
+#include "bvh/bottom_up_algorithm.hpp"
+#include "bvh/locally_ordered_clustering_builder.hpp"
+#include "bvh/utilities.hpp"
+
+namespace bvh {
+
+/// Updates a hierarchy after some of its primitives have moved, by rebuilding the subtrees that
+/// contain them with the PLOC builder, and refitting their ancestors. The subtrees that are rebuilt
+/// are the largest ones in which at least `dirty_ratio` of the primitives have moved, so that a group
+/// of primitives that moves together is rebuilt as a whole, whereas the leaves of isolated primitives
+/// are only refitted. The node set selects the nodes of box hierarchies (`BoxNodes`), or the cylinder
+/// nodes of cylinder and hybrid hierarchies (`CylinderNodes`), in which case the box levels of hybrid
+/// hierarchies are refitted above the cylinder subtrees.
+///
+/// The rebuilt subtrees are spliced in place, in the nodes and primitive references that they replace,
+/// which requires one primitive per leaf, as the bottom-up builders produce without leaf collapsing.
+/// Primitives must not be referenced more than once (no spatial splits). The parents and counters that
+/// are computed on construction are kept up to date by the updates, so that the cost of an update only
+/// depends on the size of the rebuilt subtrees and on the depth of the tree: the hierarchy must not be
+/// modified by other means while this object is in use.
+template <typename Bvh, typename NodeSet = BoxNodes<Bvh>, typename Morton = uint32_t>
+class IncrementalRebuilder : public BottomUpAlgorithm<Bvh, false, NodeSet> {
+    using Scalar         = typename Bvh::ScalarType;
+    using BoundingVolume = typename NodeSet::BoundingVolume;
+    using BuilderNode    = std::conditional_t<NodeSet::is_cylinder, FullCylinderNode<Scalar>, typename Bvh::Node>;
+
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::bvh;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::nodes;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::parents;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::is_forest;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::traverse_in_parallel;
+    using BottomUpAlgorithm<Bvh, false, NodeSet>::no_parent;
+
+    /// Number of primitives below every node, and number of those that are dirty (only during an update).
+    std::unique_ptr<size_t[]> primitive_counts;
+    std::unique_ptr<size_t[]> dirty_counts;
+
+    /// Leaf of every primitive reference, and reference of every primitive.
+    std::unique_ptr<size_t[]> reference_leaves;
+    std::unique_ptr<size_t[]> primitive_references;
+    size_t reference_count = 0;
+
+    /// Parents of the box nodes of hybrid hierarchies, and box leaf of every cylinder root.
+    std::unique_ptr<size_t[]> box_parents;
+    std::unique_ptr<size_t[]> root_box_leaves;
+
+    std::vector<size_t> dirty_nodes;
+    std::vector<size_t> rebuilt_roots;
+    std::vector<size_t> refitted_leaves;
+
+    // Buffers used to rebuild a subtree
+    std::vector<size_t> stack;
+    std::vector<size_t> subtree_pairs;
+    std::vector<size_t> subtree_references;
+    std::vector<size_t> subtree_primitives;
+    std::vector<size_t> subtree_order;
+    std::vector<std::pair<size_t, size_t>> splice_stack;
+
+    Bvh subtree;
+
+    template <typename Primitive>
+    static BoundingVolume bounding_volume(const Primitive& primitive) {
+        if constexpr (NodeSet::is_cylinder)
+            return primitive.bounding_cyl();
+        else
+            return primitive.bounding_box();
+    }
+
+    bool is_rebuild_candidate(size_t i) const {
+        return dirty_counts[i] >= dirty_ratio * primitive_counts[i];
+    }
+
+    /// Collects the first index of each pair of children and the primitive references of the subtree
+    /// below the given node. Returns false if a leaf of this subtree has more than one primitive.
+    bool collect_subtree(size_t root) {
+        subtree_pairs.clear();
+        subtree_references.clear();
+        stack.push_back(root);
+        bool has_single_primitive_leaves = true;
+        while (!stack.empty()) {
+            const auto& node = nodes()[stack.back()];
+            stack.pop_back();
+            if (node.is_leaf) {
+                has_single_primitive_leaves &= node.primitive_count == 1;
+                subtree_references.push_back(node.first_child_or_primitive);
+            } else {
+                subtree_pairs.push_back(node.first_child_or_primitive);
+                stack.push_back(node.first_child_or_primitive + 0);
+                stack.push_back(node.first_child_or_primitive + 1);
+            }
+        }
+        return has_single_primitive_leaves;
+    }
+
+    template <typename Primitive>
+    void rebuild_subtree(size_t root, const Primitive* primitives) {
+        collect_subtree(root);
+
+        // Build a hierarchy over the primitives of the subtree only
+        auto primitive_count = subtree_references.size();
+        auto bounding_volumes = std::make_unique<BoundingVolume[]>(primitive_count);
+        auto centers = std::make_unique<Vector3<Scalar>[]>(primitive_count);
+        auto global_bbox = BoundingBox<Scalar>::empty();
+        subtree_primitives.resize(primitive_count);
+        for (size_t i = 0; i < primitive_count; ++i) {
+            auto primitive_index = bvh.primitive_indices[subtree_references[i]];
+            subtree_primitives[i] = primitive_index;
+            bounding_volumes[i] = bounding_volume(primitives[primitive_index]);
+            centers[i] = primitives[primitive_index].center();
+            if constexpr (NodeSet::is_cylinder)
+                global_bbox.extend(bounding_volumes[i].AABB());
+            else
+                global_bbox.extend(bounding_volumes[i]);
+        }
+        subtree_builder.build(global_bbox, bounding_volumes.get(), centers.get(), primitive_count);
+
+        // Splice the new nodes into the slots of the old ones, pair by pair, so that siblings stay together
+        const auto& new_nodes = NodeSet::nodes(subtree);
+        assert(NodeSet::node_count(subtree) == subtree_pairs.size() * 2 + 1);
+        size_t next_pair = 0, next_reference = 0;
+        subtree_order.clear();
+        splice_stack.emplace_back(0, root);
+        while (!splice_stack.empty()) {
+            auto [source, destination] = splice_stack.back();
+            splice_stack.pop_back();
+            auto node = new_nodes[source];
+            if (node.is_leaf) {
+                assert(node.primitive_count == 1);
+                auto reference = subtree_references[next_reference++];
+                auto primitive_index = subtree_primitives[subtree.primitive_indices[node.first_child_or_primitive]];
+                bvh.primitive_indices[reference] = primitive_index;
+                reference_leaves[reference] = destination;
+                primitive_references[primitive_index] = reference;
+                node.first_child_or_primitive = reference;
+            } else {
+                auto pair = subtree_pairs[next_pair++];
+                parents[pair + 0] = destination;
+                parents[pair + 1] = destination;
+                splice_stack.emplace_back(node.first_child_or_primitive + 0, pair + 0);
+                splice_stack.emplace_back(node.first_child_or_primitive + 1, pair + 1);
+                node.first_child_or_primitive = pair;
+            }
+            nodes()[destination] = node;
+            subtree_order.push_back(destination);
+        }
+
+        // Children come after their parent in that order
+        for (auto it = subtree_order.rbegin(); it != subtree_order.rend(); ++it) {
+            const auto& node = nodes()[*it];
+            primitive_counts[*it] = node.is_leaf
+                ? node.primitive_count
+                : primitive_counts[node.first_child_or_primitive] + primitive_counts[node.first_child_or_primitive + 1];
+        }
+    }
+
+    template <typename Primitive>
+    void refit_leaf(size_t i, const Primitive* primitives) {
+        auto& leaf = nodes()[i];
+        auto first_primitive = bvh.primitive_indices.get() + leaf.first_child_or_primitive;
+        auto bounds = bounding_volume(primitives[first_primitive[0]]);
+        for (size_t j = 1; j < leaf.primitive_count; ++j)
+            bounds.extend(bounding_volume(primitives[first_primitive[j]]));
+        leaf.bounding_box_proxy() = pad(bounds);
+    }
+
+    /// Pads the refitted cylinders as the subtree builder pads the cylinders that it builds. Boxes are exact.
+    static const BoundingBox<Scalar>& pad(const BoundingBox<Scalar>& bbox) {
+        return bbox;
+    }
+
+    BoundingCyl<Scalar> pad(BoundingCyl<Scalar> bcyl) const {
+        return subtree_builder.cylinder_inflation > 0 ? bcyl.inflate(subtree_builder.cylinder_inflation) : bcyl;
+    }
+
+    template <typename Nodes>
+    void refit_inner_node(Nodes& nodes, size_t i) const {
+        auto& node = nodes[i];
+        auto first_child = node.first_child_or_primitive;
+        node.bounding_box_proxy() = pad(nodes[first_child + 0]
+            .bounding_box_proxy()
+            .to_bounding_box()
+            .extend(nodes[first_child + 1].bounding_box_proxy()));
+    }
+
+    /// Refits the nodes on the path from the given node to the root. When every node that changed is refitted
+    /// that way, after all of them have changed, the last refit of each ancestor sees the final state of its children.
+    void refit_ancestors(size_t i) {
+        while (parents[i] != i) {
+            i = parents[i];
+            refit_inner_node(nodes(), i);
+        }
+        if constexpr (NodeSet::is_cylinder) {
+            if (!is_forest())
+                return;
+            auto j = root_box_leaves[i];
+            bvh.nodes[j].bounding_box_proxy() = nodes()[i].bounding_box_proxy().to_bounding_box().AABB();
+            while (box_parents[j] != j) {
+                j = box_parents[j];
+                refit_inner_node(bvh.nodes, j);
+            }
+        }
+    }
+
+    void reset_dirty_counts() {
+        for (auto i : dirty_nodes)
+            dirty_counts[i] = 0;
+        dirty_nodes.clear();
+    }
+
+public:
+    /// Fraction of the primitives of a subtree that must be dirty for this subtree to be rebuilt.
+    Scalar dirty_ratio = Scalar(0.5);
+
+    /// Fraction of all the primitives above which an update is rejected, since a full rebuild is then cheaper.
+    Scalar full_rebuild_ratio = Scalar(0.3);
+
+    /// Builder of the subtrees, whose parameters can be changed, and whose buffers are reused across updates.
+    LocallyOrderedClusteringBuilder<Bvh, Morton, BuilderNode> subtree_builder;
+
+    struct Statistics {
+        size_t rebuilt_subtree_count = 0;
+        size_t rebuilt_primitive_count = 0;
+        size_t refitted_leaf_count = 0;
+    };
+
+    /// Statistics of the last update.
+    Statistics statistics;
+
+    IncrementalRebuilder(Bvh& bvh)
+        : BottomUpAlgorithm<Bvh, false, NodeSet>(bvh), subtree_builder(subtree)
+    {
+        assert(NodeSet::is_cylinder ? bvh.cylinder : !bvh.cylinder);
+        auto node_count = this->node_count();
+        primitive_counts = std::make_unique<size_t[]>(node_count);
+        dirty_counts = std::make_unique<size_t[]>(node_count);
+
+        #pragma omp parallel
+        {
+            traverse_in_parallel(
+                [&] (size_t i) { primitive_counts[i] = nodes()[i].primitive_count; },
+                [&] (size_t i) {
+                    auto first_child = nodes()[i].first_child_or_primitive;
+                    primitive_counts[i] = primitive_counts[first_child + 0] + primitive_counts[first_child + 1];
+                });
+        }
+
+        if (is_forest()) {
+            box_parents = std::make_unique<size_t[]>(bvh.node_count);
+            root_box_leaves = std::make_unique<size_t[]>(node_count);
+            box_parents[0] = 0;
+            for (size_t i = 0; i < bvh.node_count; ++i) {
+                const auto& node = bvh.nodes[i];
+                if (node.is_leaf) {
+                    root_box_leaves[node.cylinder_root()] = i;
+                    reference_count += primitive_counts[node.cylinder_root()];
+                } else {
+                    box_parents[node.first_child_or_primitive + 0] = i;
+                    box_parents[node.first_child_or_primitive + 1] = i;
+                }
+            }
+        } else
+            reference_count = primitive_counts[0];
+
+        reference_leaves = std::make_unique<size_t[]>(reference_count);
+        primitive_references = std::make_unique<size_t[]>(reference_count);
+        #pragma omp parallel for
+        for (size_t i = 0; i < node_count; ++i) {
+            const auto& node = nodes()[i];
+            if (!node.is_leaf || (is_forest() && parents[i] == no_parent))
+                continue;
+            for (size_t j = 0; j < node.primitive_count; ++j) {
+                auto reference = node.first_child_or_primitive + j;
+                reference_leaves[reference] = i;
+                primitive_references[bvh.primitive_indices[reference]] = reference;
+            }
+        }
+    }
+
+    /// Updates the hierarchy after the given primitives (given without duplicates) have changed.
+    /// Returns false, leaving the hierarchy untouched, if the update is more expensive than a full
+    /// rebuild, or if a subtree that must be rebuilt has leaves with several primitives. The
+    /// hierarchy must then be rebuilt, and this object constructed again.
+    template <typename Primitive>
+    bool update(const Primitive* primitives, const size_t* dirty_primitives, size_t dirty_primitive_count) {
+        statistics = Statistics();
+
+        // Count the dirty primitives below every node
+        for (size_t i = 0; i < dirty_primitive_count; ++i) {
+            assert(dirty_primitives[i] < reference_count);
+            auto j = reference_leaves[primitive_references[dirty_primitives[i]]];
+            while (true) {
+                if (dirty_counts[j]++ == 0)
+                    dirty_nodes.push_back(j);
+                if (parents[j] == j)
+                    break;
+                j = parents[j];
+            }
+        }
+
+        // Rebuild the topmost inner nodes that have enough dirty primitives,
+        // and refit the dirty leaves that are not below one of them
+        rebuilt_roots.clear();
+        refitted_leaves.clear();
+        for (auto i : dirty_nodes) {
+            bool is_leaf = nodes()[i].is_leaf;
+            if (!is_leaf && !is_rebuild_candidate(i))
+                continue;
+            bool is_below_candidate = false;
+            for (auto j = i; parents[j] != j && !is_below_candidate;) {
+                j = parents[j];
+                is_below_candidate = is_rebuild_candidate(j);
+            }
+            if (!is_below_candidate)
+                (is_leaf ? refitted_leaves : rebuilt_roots).push_back(i);
+        }
+        reset_dirty_counts();
+
+        size_t rebuilt_primitive_count = 0;
+        for (auto root : rebuilt_roots) {
+            if (!collect_subtree(root))
+                return false;
+            rebuilt_primitive_count += primitive_counts[root];
+        }
+        if (rebuilt_primitive_count > full_rebuild_ratio * reference_count)
+            return false;
+
+        for (auto root : rebuilt_roots)
+            rebuild_subtree(root, primitives);
+        for (auto leaf : refitted_leaves)
+            refit_leaf(leaf, primitives);
+        for (auto root : rebuilt_roots)
+            refit_ancestors(root);
+        for (auto leaf : refitted_leaves)
+            refit_ancestors(leaf);
+
+        statistics.rebuilt_subtree_count = rebuilt_roots.size();
+        statistics.rebuilt_primitive_count = rebuilt_primitive_count;
+        statistics.refitted_leaf_count = refitted_leaves.size();
+        return true;
+    }
+};
+
+} // namespace bvh
+
+#endif
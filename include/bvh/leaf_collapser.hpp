@@ -14,34 +14,43 @@ namespace bvh {
 /// Collapses leaves of the BVH according to the SAH. This optimization
 /// is only helpful for bottom-up builders, as top-down builders already
 /// have a termination criterion that prevents leaf creation when the SAH
-/// cost does not improve.
-template <typename Bvh>
-class LeafCollapser : public SahBasedAlgorithm<Bvh>, public BottomUpAlgorithm<Bvh, true> {
+/// cost does not improve. Cylinder hierarchies are collapsed with `CylinderNodes` as the
+/// node set. The box leaves of hybrid hierarchies each refer to a cylinder subtree, and
+/// therefore cannot be collapsed.
+template <typename Bvh, typename NodeSet = BoxNodes<Bvh>>
+class LeafCollapser : public SahBasedAlgorithm<Bvh, NodeSet>, public BottomUpAlgorithm<Bvh, true, NodeSet> {
     using Scalar = typename Bvh::ScalarType;
+    using Node   = typename NodeSet::Node;
 
     PrefixSum<size_t> prefix_sum;
 
-    using BottomUpAlgorithm<Bvh, true>::traverse_in_parallel;
-    using BottomUpAlgorithm<Bvh, true>::children;
-    using BottomUpAlgorithm<Bvh, true>::parents;
-    using BottomUpAlgorithm<Bvh, true>::bvh;
+    using SahBasedAlgorithm<Bvh, NodeSet>::node_traversal_cost;
+    using BottomUpAlgorithm<Bvh, true, NodeSet>::traverse_in_parallel;
+    using BottomUpAlgorithm<Bvh, true, NodeSet>::children;
+    using BottomUpAlgorithm<Bvh, true, NodeSet>::parents;
+    using BottomUpAlgorithm<Bvh, true, NodeSet>::nodes;
+    using BottomUpAlgorithm<Bvh, true, NodeSet>::bvh;
 
 public:
-    using SahBasedAlgorithm<Bvh>::traversal_cost;
+    using SahBasedAlgorithm<Bvh, NodeSet>::traversal_cost;
+    using SahBasedAlgorithm<Bvh, NodeSet>::cylinder_traversal_cost;
 
     LeafCollapser(Bvh& bvh)
-        : BottomUpAlgorithm<Bvh, true>(bvh)
+        : BottomUpAlgorithm<Bvh, true, NodeSet>(bvh)
     {}
 
     void collapse() {
-        if (bvh__unlikely(bvh.nodes[0].is_leaf))
+        // The cylinder nodes of hybrid hierarchies form a forest, which is not supported
+        assert(!this->is_forest());
+        if (bvh__unlikely(nodes()[0].is_leaf || (bvh.hybrid && !NodeSet::is_cylinder)))
             return;
 
-        std::unique_ptr<size_t[]> primitive_indices_copy;
-        std::unique_ptr<typename Bvh::Node[]> nodes_copy;
+        BvhArray<size_t> primitive_indices_copy;
+        BvhArray<Node> nodes_copy;
 
-        auto node_index       = std::make_unique<size_t[]>(bvh.node_count / 2 + 1);
-        auto primitive_counts = std::make_unique<size_t[]>(bvh.node_count);
+        auto node_count       = NodeSet::node_count(bvh);
+        auto node_index       = std::make_unique<size_t[]>(node_count / 2 + 1);
+        auto primitive_counts = std::make_unique<size_t[]>(node_count);
 
         node_index[0] = 1;
 
@@ -49,13 +58,13 @@ public:
         {
             // Bottom-up traversal to collapse leaves
             traverse_in_parallel(
-                [&] (size_t i) { primitive_counts[i] = bvh.nodes[i].primitive_count; },
+                [&] (size_t i) { primitive_counts[i] = nodes()[i].primitive_count; },
                 [&] (size_t i) {
-                    auto& node = bvh.nodes[i];
+                    auto& node = nodes()[i];
                     assert(!node.is_leaf);
                     auto first_child  = node.first_child_or_primitive;
-                    auto& left_child  = bvh.nodes[first_child + 0];
-                    auto& right_child = bvh.nodes[first_child + 1];
+                    auto& left_child  = nodes()[first_child + 0];
+                    auto& right_child = nodes()[first_child + 1];
 
                     auto left_primitive_count  = primitive_counts[first_child + 0];
                     auto right_primitive_count = primitive_counts[first_child + 1];
@@ -65,7 +74,7 @@ public:
                     // Compute the cost of collapsing this node when both children are leaves
                     if (left_child.is_leaf && right_child.is_leaf) {
                         auto collapse_cost =
-                            node.bounding_box_proxy().to_bounding_box().half_area() * (Scalar(total_primitive_count) - traversal_cost);
+                            node.bounding_box_proxy().to_bounding_box().half_area() * (Scalar(total_primitive_count) - node_traversal_cost());
                         auto base_cost =
                             left_child .bounding_box_proxy().to_bounding_box().half_area() * left_primitive_count +
                             right_child.bounding_box_proxy().to_bounding_box().half_area() * right_primitive_count;
@@ -79,20 +88,20 @@ public:
                     node_index[(first_child + 1) / 2] = 2;
                 });
 
-            prefix_sum.sum_in_parallel(node_index.get(), node_index.get(), bvh.node_count / 2 + 1);
+            prefix_sum.sum_in_parallel(node_index.get(), node_index.get(), node_count / 2 + 1);
 
             #pragma omp single
             {
-                nodes_copy = std::make_unique<typename Bvh::Node[]>(node_index[bvh.node_count / 2]);
+                nodes_copy = std::make_unique<Node[]>(node_index[node_count / 2]);
                 primitive_indices_copy = std::make_unique<size_t[]>(primitive_counts[0]);
-                nodes_copy[0] = bvh.nodes[0];
+                nodes_copy[0] = nodes()[0];
                 nodes_copy[0].first_child_or_primitive =
-                    node_index[(bvh.nodes[0].first_child_or_primitive - 1) / 2];
+                    node_index[(nodes()[0].first_child_or_primitive - 1) / 2];
             }
 
             #pragma omp for
-            for (size_t i = 1; i < bvh.node_count; i++) {
-                if (!bvh.nodes[i].is_leaf || node_index[(i - 1) / 2] == node_index[(i + 1) / 2])
+            for (size_t i = 1; i < node_count; i++) {
+                if (!nodes()[i].is_leaf || node_index[(i - 1) / 2] == node_index[(i + 1) / 2])
                     continue;
 
                 // Find the index of the first primitive in this subtree
@@ -108,7 +117,7 @@ public:
                 j = i;
                 while (true) {
                     if (children[j] == 0) {
-                        auto& node = bvh.nodes[j];
+                        auto& node = nodes()[j];
                         std::copy(
                             bvh.primitive_indices.get() + node.first_child_or_primitive,
                             bvh.primitive_indices.get() + node.first_child_or_primitive + node.primitive_count,
@@ -123,30 +132,30 @@ public:
                         j = children[j];
                 }
 
-                bvh.nodes[i].first_child_or_primitive = first_primitive - primitive_counts[i];
-                bvh.nodes[i].primitive_count = primitive_counts[i];
+                nodes()[i].first_child_or_primitive = first_primitive - primitive_counts[i];
+                nodes()[i].primitive_count = primitive_counts[i];
             }
 
             // Create the new nodes
             #pragma omp for
-            for (size_t i = 1; i < bvh.node_count; i += 2) {
+            for (size_t i = 1; i < node_count; i += 2) {
                 auto j = node_index[(i - 1) / 2];
                 if (j == node_index[(i + 1) / 2])
                     continue;
-                nodes_copy[j + 0] = bvh.nodes[i + 0];
-                nodes_copy[j + 1] = bvh.nodes[i + 1];
-                if (!bvh.nodes[i + 0].is_leaf)
+                nodes_copy[j + 0] = nodes()[i + 0];
+                nodes_copy[j + 1] = nodes()[i + 1];
+                if (!nodes()[i + 0].is_leaf)
                     nodes_copy[j + 0].first_child_or_primitive =
-                        node_index[(bvh.nodes[i + 0].first_child_or_primitive - 1) / 2];
-                if (!bvh.nodes[i + 1].is_leaf)
+                        node_index[(nodes()[i + 0].first_child_or_primitive - 1) / 2];
+                if (!nodes()[i + 1].is_leaf)
                     nodes_copy[j + 1].first_child_or_primitive =
-                        node_index[(bvh.nodes[i + 1].first_child_or_primitive - 1) / 2];
+                        node_index[(nodes()[i + 1].first_child_or_primitive - 1) / 2];
             }
         }
 
-        std::swap(bvh.nodes, nodes_copy);
+        std::swap(nodes(), nodes_copy);
         std::swap(bvh.primitive_indices, primitive_indices_copy);
-        bvh.node_count = node_index[bvh.node_count / 2];
+        NodeSet::set_node_count(bvh, node_index[node_count / 2]);
     }
 };
 
@@ -110,6 +110,7 @@ class LinearBvhBuilder : public MortonCodeBasedBuilder<Bvh, Morton> {
 
 public:
     using ParentBuilder::loop_parallel_threshold;
+    using ParentBuilder::observer;
 
     LinearBvhBuilder(Bvh& bvh)
         : bvh(bvh)
@@ -129,6 +130,8 @@ public:
         std::tie(primitive_indices, morton_codes) =
             sort_primitives_by_morton_code(global_bbox, centers, primitive_count);
 
+        BuildTimer timer(observer);
+
         auto node_count = 2 * primitive_count - 1;
 
         auto nodes          = std::make_unique<Node[]>(node_count);
@@ -160,8 +163,10 @@ public:
             for (size_t i = 0; i < primitive_count - 1; ++i)
                 input_levels[begin + i] = count_leading_zeros(morton_codes[i] ^ morton_codes[i + 1]);
         }
+        timer.phase(BuildPhase::Leaves, primitive_count);
 
-        while (end - begin > 1) {
+        for (size_t k = 0; end - begin > 1; ++k) {
+            auto cluster_count = end - begin;
             auto [next_begin, next_end] = merge(
                 nodes.get(),
                 nodes_copy.get(),
@@ -178,14 +183,17 @@ public:
             previous_end = end;
             begin        = next_begin;
             end          = next_end;
+            timer.iteration(BuildPhase::BoxClustering, k, cluster_count, end - begin);
         }
+        timer.phase(BuildPhase::BoxClustering, end - begin);
 
         nodes[0].first_child_or_primitive = 1;
         nodes[0].is_leaf = false;
 
-        std::swap(bvh.nodes, nodes);
-        std::swap(bvh.primitive_indices, primitive_indices);
+        bvh.nodes = std::move(nodes);
+        bvh.primitive_indices = std::move(primitive_indices);
         bvh.node_count = node_count;
+        timer.phase(BuildPhase::Finalization, bvh.node_count);
     }
 };
 
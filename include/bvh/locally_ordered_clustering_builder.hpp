@@ -2,6 +2,7 @@
 #define BVH_LOCALLY_ORDERED_CLUSTERING_BUILDER_HPP
 
 #include <numeric>
+#include <limits>
 
 #include "bvh/morton_code_based_builder.hpp"
 #include "bvh/prefix_sum.hpp"
@@ -18,6 +19,9 @@ namespace bvh {
 	/// clusters of interest.
 	/// See "Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy Construction",
 	/// by D. Meister and J. Bittner.
+	/// The `Node` parameter is the type of nodes used during construction. For cylinder
+	/// hierarchies, using `FullCylinderNode` and a BVH with a compact layout avoids
+	/// accumulating the rounding of compact nodes over the clustering iterations.
 	template <typename Bvh, typename Morton, typename Node>
 	class LocallyOrderedClusteringBuilder : public MortonCodeBasedBuilder<Bvh, Morton> {
 		using Scalar = typename Bvh::ScalarType;
@@ -30,163 +34,72 @@ namespace bvh {
 
 		PrefixSum<size_t> prefix_sum;
 
+		/// Buffers that are kept between builds, so that rebuilding a BVH (e.g. every frame) does
+		/// not allocate memory. The node arrays that end up in the BVH are taken back on the next
+		/// build, see `GrowingBuffer::give()`.
+		struct BuildContext {
+			GrowingBuffer<Node> nodes, nodes_copy;
+			GrowingBuffer<typename Bvh::Node> bnodes, bnodes_copy;
+			GrowingBuffer<typename Bvh::CustomNode> cnodes;
+			GrowingBuffer<size_t> auxiliary_data;
+			GrowingBuffer<Scalar> distances;
+			GrowingBuffer<Scalar*> distance_matrices;
+		} context;
+
 		std::pair<size_t, size_t> search_range(size_t i, size_t begin, size_t end) const {
 			return std::make_pair(
 				i > begin + search_radius ? i - search_radius : begin,
 				std::min(i + search_radius + 1, end));
 		}
 
-		std::pair<size_t, size_t> cluster(
-			const typename Bvh::Node* bvh__restrict__ input,
-			typename Bvh::Node* bvh__restrict__ output,
-			size_t* bvh__restrict__ neighbors,
-			size_t* bvh__restrict__ merged_index,
-			size_t begin, size_t end,
-			size_t previous_end)
-		{
-			size_t next_begin = 0;
-			size_t next_end = 0;
-
-#pragma omp parallel if (end - begin > loop_parallel_threshold)
-			{
-				auto thread_count = bvh__get_num_threads();
-				auto thread_id = bvh__get_thread_num();
-				auto chunk_size = (end - begin) / thread_count;
-				auto chunk_begin = begin + thread_id * chunk_size;
-				auto chunk_end = thread_id != thread_count - 1 ? chunk_begin + chunk_size : end;
-
-				auto distances = std::make_unique<Scalar[]>((search_radius + 1) * search_radius);
-				auto distance_matrix = std::make_unique<Scalar * []>(search_radius + 1);
-				for (size_t i = 0; i <= search_radius; ++i)
-					distance_matrix[i] = &distances[i * search_radius];
-
-				// Initialize the distance matrix, which caches the distances between
-				// neighboring nodes in the array. A brute force approach that recomputes the
-				// distances for every neighbor can be implemented without a distance matrix,
-				// but would be slower for larger search radii.
-				for (size_t i = search_range(chunk_begin, begin, end).first; i < chunk_begin; ++i) {
-					auto search_end = search_range(i, begin, end).second;
-					for (size_t j = i + 1; j < search_end; ++j) {
-						distance_matrix[chunk_begin - i][j - i - 1] = input[i]
-							.bounding_box_proxy()
-							.to_bounding_box()
-							.extend(input[j].bounding_box_proxy())
-							.half_area();
-					}
-				}
-
-				// Nearest neighbor search
-				for (size_t i = chunk_begin; i < chunk_end; i++) {
-					auto [search_begin, search_end] = search_range(i, begin, end);
-					Scalar best_distance = std::numeric_limits<Scalar>::max();
-					size_t best_neighbor = -1;
-
-					// Backward search (using the previously-computed distances stored in the distance matrix)
-					for (size_t j = search_begin; j < i; ++j) {
-						auto distance = distance_matrix[i - j][i - j - 1];
-						assert(isnan(distance) == 0);
-						if (distance < best_distance) {
-							best_distance = distance;
-							best_neighbor = j;
-						}
-					}
-
-					// Forward search (caching computed distances in the distance matrix)
-					for (size_t j = i + 1; j < search_end; ++j) {
-						auto distance = input[i]
-							.bounding_box_proxy()
-							.to_bounding_box()
-							.extend(input[j].bounding_box_proxy())
-							.half_area();
-						assert(isnan(distance) == 0);
-						distance_matrix[0][j - i - 1] = distance;
-						if (distance < best_distance) {
-							best_distance = distance;
-							best_neighbor = j;
-						}
-					}
-
-					assert(best_neighbor != size_t(-1));
-					neighbors[i] = best_neighbor;
-
-					// Rotate the distance matrix columns
-					auto last = distance_matrix[search_radius];
-					std::move_backward(
-						distance_matrix.get(),
-						distance_matrix.get() + search_radius,
-						distance_matrix.get() + search_radius + 1);
-					distance_matrix[0] = last;
-				}
-
-#pragma omp barrier
-
-				// Mark nodes that are the closest as merged, but keep
-				// the one with lowest index to act as the parent
-#pragma omp for
-				for (size_t i = begin; i < end; ++i) {
-					auto j = neighbors[i];
-					bool is_mergeable = neighbors[j] == i;
-					merged_index[i] = i < j && is_mergeable ? 1 : 0;
-				}
+		/// Distance used by the nearest neighbor search: the half area of the union of two boxes.
+		Scalar merge_distance(const BoundingBox<Scalar>& a, const BoundingBox<Scalar>& b) const {
+			return BoundingBox<Scalar>(a).extend(b).half_area();
+		}
 
-				// Perform a prefix sum to compute the insertion indices
-				prefix_sum.sum_in_parallel(merged_index + begin, merged_index + begin, end - begin);
-				size_t merged_count = merged_index[end - 1];
-				size_t unmerged_count = end - begin - merged_count;
-				size_t children_count = merged_count * 2;
-				size_t children_begin = end - children_count;
-				size_t unmerged_begin = end - (children_count + unmerged_count);
+		Scalar merge_distance(const BoundingCyl<Scalar>& a, const BoundingCyl<Scalar>& b) const {
+			if (approximate_cylinder_distances)
+				return a.union_half_area_bound(b);
+			return BoundingCyl<Scalar>(a).extend(b).half_area();
+		}
 
-#pragma omp single nowait
-				{
-					next_begin = unmerged_begin;
-					next_end = children_begin;
-				}
+		/// Creates the bounding volume of the parent of two clusters.
+		static BoundingBox<Scalar> merge(const BoundingBox<Scalar>& a, const BoundingBox<Scalar>& b, size_t) {
+			return BoundingBox<Scalar>(a).extend(b);
+		}
 
-				// Finally, merge nodes that are marked for merging and create
-				// their parents using the indices computed previously.
-#pragma omp for nowait
-				for (size_t i = begin; i < end; ++i) {
-					auto j = neighbors[i];
-					if (neighbors[j] == i) {
-						if (i < j) {
-							auto& unmerged_node = output[unmerged_begin + j - begin - merged_index[j]];
-							auto first_child = children_begin + (merged_index[i] - 1) * 2;
-							unmerged_node.bounding_box_proxy() = input[j]
-								.bounding_box_proxy()
-								.to_bounding_box()
-								.extend(input[i].bounding_box_proxy());
-							unmerged_node.is_leaf = false;
-							unmerged_node.first_child_or_primitive = first_child;
-							output[first_child + 0] = input[i];
-							output[first_child + 1] = input[j];
-						}
-					}
-					else {
-						output[unmerged_begin + i - begin - merged_index[i]] = input[i];
-					}
-				}
+		BoundingCyl<Scalar> merge(const BoundingCyl<Scalar>& a, const BoundingCyl<Scalar>& b, size_t search_steps) const {
+			return pad(BoundingCyl<Scalar>(a).extend(b, search_steps));
+		}
 
-				// Copy the nodes of the previous level into the current array of nodes.
-#pragma omp for nowait
-				for (size_t i = end; i < previous_end; ++i)
-					output[i] = input[i];
-			}
+		/// Pads the bounding volume of a node, see `cylinder_inflation`. Boxes are computed exactly.
+		static const BoundingBox<Scalar>& pad(const BoundingBox<Scalar>& bbox) {
+			return bbox;
+		}
 
-			return std::make_pair(next_begin, next_end);
+		BoundingCyl<Scalar> pad(const BoundingCyl<Scalar>& bcyl) const {
+			return cylinder_inflation > 0 ? BoundingCyl<Scalar>(bcyl).inflate(cylinder_inflation) : bcyl;
 		}
 
+		/// Performs one clustering wave. The same code processes boxes and cylinders,
+		/// hence the node type is a template parameter. Clusters that are marked in the
+		/// optional `frozen` array are not merged, and are simply carried over to the next wave.
+		template <typename ClusterNode>
 		std::pair<size_t, size_t> cluster(
-			const Node* bvh__restrict__ input,
-			Node* bvh__restrict__ output,
+			const ClusterNode* bvh__restrict__ input,
+			ClusterNode* bvh__restrict__ output,
 			size_t* bvh__restrict__ neighbors,
 			size_t* bvh__restrict__ merged_index,
 			size_t begin, size_t end,
-			size_t previous_end)
+			size_t previous_end,
+			const size_t* bvh__restrict__ frozen = nullptr)
 		{
 			size_t next_begin = 0;
 			size_t next_end = 0;
 
+			// Tighter cylinders only pay off near the root, where the nodes are visited the most
+			auto search_steps = end - begin <= cylinder_search_threshold ? cylinder_search_steps : 0;
+
 #pragma omp parallel if (end - begin > loop_parallel_threshold)
 			{
 				auto thread_count = bvh__get_num_threads();
@@ -195,11 +108,27 @@ namespace bvh {
 				auto chunk_begin = begin + thread_id * chunk_size;
 				auto chunk_end = thread_id != thread_count - 1 ? chunk_begin + chunk_size : end;
 
-				auto distances = std::make_unique<Scalar[]>((search_radius + 1) * search_radius);
-				auto distance_matrix = std::make_unique<Scalar * []>(search_radius + 1);
+				// Each thread has its own distance matrix, stored in the build context
+				auto matrix_size = (search_radius + 1) * search_radius;
+#pragma omp single
+				{
+					context.distances.reserve(thread_count * matrix_size);
+					context.distance_matrices.reserve(thread_count * (search_radius + 1));
+				}
+				auto distances = context.distances.get() + thread_id * matrix_size;
+				auto distance_matrix = context.distance_matrices.get() + thread_id * (search_radius + 1);
 				for (size_t i = 0; i <= search_radius; ++i)
 					distance_matrix[i] = &distances[i * search_radius];
 
+				// Frozen clusters are infinitely far away from every other cluster
+				auto distance_between = [&] (size_t i, size_t j) {
+					if (frozen && (frozen[i] | frozen[j]))
+						return std::numeric_limits<Scalar>::max();
+					return merge_distance(
+						input[i].bounding_box_proxy().to_bounding_box(),
+						input[j].bounding_box_proxy().to_bounding_box());
+				};
+
 				// Initialize the distance matrix, which caches the distances between
 				// neighboring nodes in the array. A brute force approach that recomputes the
 				// distances for every neighbor can be implemented without a distance matrix,
@@ -207,11 +136,7 @@ namespace bvh {
 				for (size_t i = search_range(chunk_begin, begin, end).first; i < chunk_begin; ++i) {
 					auto search_end = search_range(i, begin, end).second;
 					for (size_t j = i + 1; j < search_end; ++j) {
-						distance_matrix[chunk_begin - i][j - i - 1] = input[i]
-							.bounding_box_proxy()
-							.to_bounding_box()
-							.extend(input[j].bounding_box_proxy())
-							.half_area();
+						distance_matrix[chunk_begin - i][j - i - 1] = distance_between(i, j);
 					}
 				}
 
@@ -232,11 +157,7 @@ namespace bvh {
 
 					// Forward search (caching computed distances in the distance matrix)
 					for (size_t j = i + 1; j < search_end; ++j) {
-						auto distance = input[i]
-							.bounding_box_proxy()
-							.to_bounding_box()
-							.extend(input[j].bounding_box_proxy())
-							.half_area();
+						auto distance = distance_between(i, j);
 						distance_matrix[0][j - i - 1] = distance;
 						if (distance < best_distance) {
 							best_distance = distance;
@@ -244,15 +165,17 @@ namespace bvh {
 						}
 					}
 
-					assert(best_neighbor != size_t(-1));
-					neighbors[i] = best_neighbor;
+					// A cluster that has no candidate (because it is frozen, or because all
+					// its neighbors are) is its own neighbor, which leaves it unmerged
+					assert(frozen || best_neighbor != size_t(-1));
+					neighbors[i] = best_neighbor != size_t(-1) ? best_neighbor : i;
 
 					// Rotate the distance matrix columns
 					auto last = distance_matrix[search_radius];
 					std::move_backward(
-						distance_matrix.get(),
-						distance_matrix.get() + search_radius,
-						distance_matrix.get() + search_radius + 1);
+						distance_matrix,
+						distance_matrix + search_radius,
+						distance_matrix + search_radius + 1);
 					distance_matrix[0] = last;
 				}
 
@@ -286,14 +209,16 @@ namespace bvh {
 #pragma omp for nowait
 				for (size_t i = begin; i < end; ++i) {
 					auto j = neighbors[i];
-					if (neighbors[j] == i) {
+					if (neighbors[j] == i && i != j) {
 						if (i < j) {
 							auto& unmerged_node = output[unmerged_begin + j - begin - merged_index[j]];
 							auto first_child = children_begin + (merged_index[i] - 1) * 2;
-							unmerged_node.bounding_box_proxy() = input[j]
-								.bounding_box_proxy()
-								.to_bounding_box()
-								.extend(input[i].bounding_box_proxy());
+							// The buffers are reused between builds, so the node must be reset
+							unmerged_node = ClusterNode();
+							unmerged_node.bounding_box_proxy() = merge(
+								input[j].bounding_box_proxy().to_bounding_box(),
+								input[i].bounding_box_proxy().to_bounding_box(),
+								search_steps);
 							unmerged_node.is_leaf = false;
 							unmerged_node.first_child_or_primitive = first_child;
 							output[first_child + 0] = input[i];
@@ -314,18 +239,86 @@ namespace bvh {
 			return std::make_pair(next_begin, next_end);
 		}
 
+		/// Moves the cylinder nodes produced by the clustering into the BVH. If the BVH uses
+		/// another node layout than the one used during construction, the nodes are converted.
+		/// The nodes located before `offset` are discarded, and the indices are adjusted accordingly.
+		void store_cylinder_nodes(GrowingBuffer<Node>& nodes, size_t node_count, size_t offset = 0) {
+			bvh.cnode_count = node_count - offset;
+			if constexpr (std::is_same<Node, typename Bvh::CustomNode>::value) {
+				if (offset == 0) {
+					nodes.give(bvh.cnodes);
+					return;
+				}
+			}
+			auto source = nodes.get() + offset;
+			auto cnodes = context.cnodes.reserve(bvh.cnode_count);
+#pragma omp parallel for if (bvh.cnode_count > loop_parallel_threshold)
+			for (size_t i = 0; i < bvh.cnode_count; ++i) {
+				copy_cylinder_node(source[i], cnodes[i]);
+				if (!cnodes[i].is_leaf)
+					cnodes[i].first_child_or_primitive -= offset;
+			}
+			context.cnodes.give(bvh.cnodes);
+		}
+
+		/// Marks the clusters in the range [begin, end) whose cylinder is more expensive than their
+		/// bounding box, and returns the number of clusters that can still be merged.
+		size_t freeze_clusters(const Node* nodes, size_t* frozen, size_t begin, size_t end) const {
+			size_t active_count = 0;
+#pragma omp parallel for reduction(+: active_count) if (end - begin > loop_parallel_threshold)
+			for (size_t i = begin; i < end; ++i) {
+				auto cyl = nodes[i].bounding_box_proxy().to_bounding_box();
+				frozen[i] = cylinder_cost * cyl.half_area() >= cyl.AABB().half_area() ? 1 : 0;
+				active_count += 1 - frozen[i];
+			}
+			return active_count;
+		}
+
 	public:
 		using ParentBuilder::loop_parallel_threshold;
+		using ParentBuilder::observer;
 
 		/// Parameter of the algorithm. The larger the search radius,
 		/// the longer the search for neighboring nodes lasts.
 		size_t search_radius = 10;
 
+		/// Enables the adaptive switch from cylinders to boxes in the hybrid build. Instead of
+		/// switching every cluster after a fixed number of iterations, each cluster keeps being
+		/// merged as a cylinder as long as its cylinder is cheaper to traverse than its bounding box,
+		/// according to the cost model below. The other clusters are frozen, and become the roots
+		/// of the cylinder subtrees. The iteration count given to `build()` is then an upper bound.
+		bool adaptive_switch = false;
+
+		/// Cost of a ray-cylinder test, relative to the cost of a ray-box test. The probability
+		/// of hitting a node being proportional to its area, a cluster is frozen as soon as
+		/// `cylinder_cost * area(cylinder) >= area(bounding box of the cylinder)`.
+		Scalar cylinder_cost = 4;
+
+		/// Ranks the merge candidates of cylinder clusters with a closed-form upper bound on the
+		/// area of their union (see `BoundingCyl::union_half_area_bound()`), instead of computing
+		/// the union itself. The exact union is then only computed once per actual merge, which
+		/// makes the search much faster, at the expense of slightly different merge decisions.
+		bool approximate_cylinder_distances = false;
+
+		/// Merge quality policy for cylinder clusters. By default, two clusters are merged with the
+		/// fast, weighted construction of `BoundingCyl::extend()`. Once at most
+		/// `cylinder_search_threshold` clusters remain, that is, in the levels close to the root,
+		/// the axis of each merged cylinder is also optimized by a brute-force search over
+		/// `cylinder_search_steps * cylinder_search_steps` candidates. Zero steps disable the search.
+		size_t cylinder_search_steps = 0;
+		size_t cylinder_search_threshold = 1024;
+
+		/// Relative margin by which cylinders are inflated, both at the leaves and after each merge
+		/// (see `BoundingCyl::inflate()`), so that they still enclose their children despite the
+		/// rounding errors of their construction, which matter in single precision. Zero disables it.
+		Scalar cylinder_inflation = Scalar(4) * std::numeric_limits<Scalar>::epsilon();
+
 		LocallyOrderedClusteringBuilder(Bvh& bvh)
 			: bvh(bvh)
 		{}
 
-		/// Hybrid build function
+		/// Hybrid build function. The clusters are cylinders for the given number of iterations
+		/// (or until a single cluster remains if it is zero), and boxes afterwards.
 		void build(
 			const BoundingBox<Scalar>& global_bbox,
 			const BoundingCyl<Scalar>* bboxes,
@@ -334,88 +327,109 @@ namespace bvh {
 			size_t iteration) // iteration when to switch from cylinders to AABBs
 		{
 			auto primitive_indices =
-				sort_primitives_by_morton_code(global_bbox, centers, primitive_count).first;
+				sort_primitives_by_morton_code(global_bbox, bboxes, centers, primitive_count).first;
+
+			BuildTimer timer(observer);
 
 			auto node_count = 2 * primitive_count - 1;
-			auto nodes = std::make_unique<Node[]>(node_count);
-			auto nodes_copy = std::make_unique<Node[]>(node_count);
-			auto auxiliary_data = std::make_unique<size_t[]>(node_count * 3);
+			auto nodes = context.nodes.reserve(node_count);
+			auto nodes_copy = context.nodes_copy.reserve(node_count);
+			auto auxiliary_data = context.auxiliary_data.reserve(node_count * 3);
 
 			size_t begin = node_count - primitive_count;
 			size_t end = node_count;
 			size_t previous_end = end;
 
 			// Create the leaves
-#pragma omp parallel for
+#pragma omp parallel for if (primitive_count > loop_parallel_threshold)
 			for (size_t i = 0; i < primitive_count; ++i) {
 				auto& node = nodes[begin + i];
-				node.bounding_box_proxy() = bboxes[primitive_indices[i]];
+				node = Node();
+				node.bounding_box_proxy() = pad(bboxes[primitive_indices[i]]);
 				node.is_leaf = true;
 				node.primitive_count = 1;
 				node.first_child_or_primitive = i;
 			}
+			timer.phase(BuildPhase::Leaves, primitive_count);
 
 			size_t k = 0;
 			std::string str = "";
 
-			// surface stats
-			//std::ofstream stats;
-			//stats.open("cluster_surf_hybrid.txt");
-			//Scalar surface = 0, cumsum = 0;
-
 			// export the small cylinders before the first clustering wave
 			//auto exporter = bvh::ObjExporter<Bvh>(bvh);
 			//exporter.exportToFile(str, "clusterwave_0", 0, nodes, begin, end, surface);
 			//std::cout << "export done" << std::endl;
 
+			auto frozen = adaptive_switch ? auxiliary_data + 2 * node_count : nullptr;
 			while (end - begin > 1) {
+				auto cluster_count = end - begin;
+				if (frozen && freeze_clusters(nodes, frozen, begin, end) <= 1)
+					break;
+
 				auto [next_begin, next_end] = cluster(
-					nodes.get(),
-					nodes_copy.get(),
-					auxiliary_data.get(),
-					auxiliary_data.get() + node_count,
+					nodes,
+					nodes_copy,
+					auxiliary_data,
+					auxiliary_data + node_count,
 					begin, end,
-					previous_end);
+					previous_end,
+					frozen);
 
 				std::swap(nodes_copy, nodes);
 
+				// The clusters that can still be merged may be too far apart in the Morton order
+				bool has_merged = next_end - next_begin < end - begin;
+
 				previous_end = end;
 				begin = next_begin;
 				end = next_end;
+				timer.iteration(BuildPhase::CylinderClustering, k, cluster_count, end - begin);
 
 				// export the clusters to a file
 				//exporter.exportToFile(str, "clusterwave", k, nodes, begin, end, surface);
-				//cumsum += surface;
-				//stats << k << " " << surface << " " << end - begin << " " << surface / (end - begin) << " " << cumsum << std::endl;
 				k++;
-				if (k == iteration)
+				if (k == iteration || !has_merged)
 					break;
 			}
-			auto bnode_count = 2 * primitive_count - 1;
-			auto bnodes = std::make_unique<Bvh::Node[]>(bnode_count);
-			auto bnodes_copy = std::make_unique<Bvh::Node[]>(bnode_count);
-			auto bauxiliary_data = std::make_unique<size_t[]>(bnode_count * 3);
+			timer.phase(BuildPhase::CylinderClustering, end - begin);
+
+			// The remaining clusters always occupy the range [c - 1, 2c - 1), where c is their number,
+			// and the box levels built on top of them only need the range [0, 2c - 1). Hence, only
+			// the live clusters are converted to boxes, and the box arrays are sized accordingly.
+			auto bnode_count = end;
+			auto bnodes = context.bnodes.reserve(bnode_count);
+			auto bnodes_copy = context.bnodes_copy.reserve(bnode_count);
+
+			// The cylinder nodes below the live clusters are not reachable, and are removed.
+			// The offset is even, so that siblings keep their position within pairs.
+			size_t cnode_offset = begin & ~size_t(1);
+			if (cnode_offset != begin) {
+				// The padding node that remains is turned into an empty leaf, so that it refers to nothing
+				nodes[cnode_offset] = nodes[begin];
+				nodes[cnode_offset].is_leaf = true;
+				nodes[cnode_offset].primitive_count = 0;
+				nodes[cnode_offset].first_child_or_primitive = 0;
+			}
 
-			// make an AABB from every cylinder
-			for (size_t i = 0; i < primitive_count; i++) {
+			// make an AABB from every live cylinder, and make it refer to its cylinder subtree
+#pragma omp parallel for if (end - begin > loop_parallel_threshold)
+			for (size_t i = begin; i < end; i++) {
 				auto& mynode = bnodes[i];
+				mynode = typename Bvh::Node();
 				mynode.bounding_box_proxy() = nodes[i].bounding_box_proxy().to_bounding_box().AABB();
-				mynode.is_leaf = nodes[i].is_leaf;
-				mynode.primitive_count = nodes[i].primitive_count;
-				mynode.first_child_or_primitive = nodes[i].first_child_or_primitive;
-				mynode.origin = i;
-				if (i >= begin && i < end) {
-					mynode.is_leaf = true;
-				}
+				mynode.set_cylinder_root(i - cnode_offset);
 			}
+			timer.phase(BuildPhase::Conversion, end - begin);
 
 			// boxes from here
+			previous_end = end;
 			while (end - begin > 1) {
+				auto cluster_count = end - begin;
 				auto [next_begin, next_end] = cluster(
-					bnodes.get(),
-					bnodes_copy.get(),
-					auxiliary_data.get(),
-					auxiliary_data.get() + bnode_count,
+					bnodes,
+					bnodes_copy,
+					auxiliary_data,
+					auxiliary_data + node_count,
 					begin, end,
 					previous_end);
 
@@ -424,19 +438,23 @@ namespace bvh {
 				previous_end = end;
 				begin = next_begin;
 				end = next_end;
+				timer.iteration(BuildPhase::BoxClustering, k, cluster_count, end - begin);
 
 				// export the cluster to a file
 				//exporter.exportToFile(str, "clusterwaveBox", k, bnodes, begin, end, surface);
-				//cumsum += surface;
-				//stats << k << " " << surface << " " << end - begin << " " << surface / (end - begin) << " " << cumsum << std::endl;
-				//k++;
+				k++;
 			}
-			//stats.close();
-
-			std::swap(bvh.nodes, bnodes);
-			std::swap(bvh.cnodes, nodes);
-			std::swap(bvh.primitive_indices, primitive_indices);
-			bvh.node_count = node_count;
+			timer.phase(BuildPhase::BoxClustering, end - begin);
+
+			if (bnodes != context.bnodes.get())
+				context.bnodes.swap_storage(context.bnodes_copy);
+			context.bnodes.give(bvh.nodes);
+			if (nodes != context.nodes.get())
+				context.nodes.swap_storage(context.nodes_copy);
+			store_cylinder_nodes(context.nodes, node_count, cnode_offset);
+			bvh.primitive_indices = std::move(primitive_indices);
+			bvh.node_count = bnode_count;
+			timer.phase(BuildPhase::Finalization, bvh.node_count);
 		}
 
 		void build(
@@ -446,44 +464,45 @@ namespace bvh {
 			size_t primitive_count)
 		{
 			auto primitive_indices =
-				sort_primitives_by_morton_code(global_bbox, centers, primitive_count).first;
+				sort_primitives_by_morton_code(global_bbox, bboxes, centers, primitive_count).first;
+
+			BuildTimer timer(observer);
 
 			auto node_count = 2 * primitive_count - 1;
-			auto nodes = std::make_unique<Node[]>(node_count);
-			auto nodes_copy = std::make_unique<Node[]>(node_count);
-			auto auxiliary_data = std::make_unique<size_t[]>(node_count * 3);
+			auto nodes = context.nodes.reserve(node_count);
+			auto nodes_copy = context.nodes_copy.reserve(node_count);
+			auto auxiliary_data = context.auxiliary_data.reserve(node_count * 3);
 
 			size_t begin = node_count - primitive_count;
 			size_t end = node_count;
 			size_t previous_end = end;
 
 			// Create the leaves
-#pragma omp parallel for
+#pragma omp parallel for if (primitive_count > loop_parallel_threshold)
 			for (size_t i = 0; i < primitive_count; ++i) {
 				auto& node = nodes[begin + i];
-				node.bounding_box_proxy() = bboxes[primitive_indices[i]];
+				node = Node();
+				node.bounding_box_proxy() = pad(bboxes[primitive_indices[i]]);
 				node.is_leaf = true;
 				node.primitive_count = 1;
 				node.first_child_or_primitive = i;
 			}
+			timer.phase(BuildPhase::Leaves, primitive_count);
 
-			//size_t k = 0;
+			size_t k = 0;
 			//std::string str = "";
 
-			//std::ofstream stats;
-			//stats.open("cluster_surf_cyls.txt");
-			//Scalar surface = 0, cumsum = 0;
-
 			// export the small cylinders before the first clustering wave
 			//auto exporter = bvh::ObjExporter<Bvh>(bvh);
 			//exporter.exportToFile(str, "clusterwave_0", 0, nodes, begin, end, surface);
 
 			while (end - begin > 1) {
+				auto cluster_count = end - begin;
 				auto [next_begin, next_end] = cluster(
-					nodes.get(),
-					nodes_copy.get(),
-					auxiliary_data.get(),
-					auxiliary_data.get() + node_count,
+					nodes,
+					nodes_copy,
+					auxiliary_data,
+					auxiliary_data + node_count,
 					begin, end,
 					previous_end);
 
@@ -492,18 +511,20 @@ namespace bvh {
 				previous_end = end;
 				begin = next_begin;
 				end = next_end;
+				timer.iteration(BuildPhase::CylinderClustering, k, cluster_count, end - begin);
 
 				//uncomment to export the cluster to a file
 				//exporter.exportToFile(str, "clusterwave", k, nodes, begin, end, surface);
-				//cumsum += surface;
-				//stats << k << " " << surface << " " << end - begin << " " << surface / (end - begin) << " " << cumsum << std::endl;
-				//k++;
+				k++;
 			}
-			//stats.close();
+			timer.phase(BuildPhase::CylinderClustering, end - begin);
 
-			std::swap(bvh.cnodes, nodes);
-			std::swap(bvh.primitive_indices, primitive_indices);
+			if (nodes != context.nodes.get())
+				context.nodes.swap_storage(context.nodes_copy);
+			store_cylinder_nodes(context.nodes, node_count);
+			bvh.primitive_indices = std::move(primitive_indices);
 			bvh.node_count = node_count;
+			timer.phase(BuildPhase::Finalization, bvh.node_count);
 		}
 
 		/// Modified build function that uses bounding cylinders only (the global box is also a cylinder)
@@ -516,36 +537,42 @@ namespace bvh {
 			auto primitive_indices =
 				sort_primitives_by_morton_code(global_bbox, centers, primitive_count).first;
 
+			BuildTimer timer(observer);
+
 			auto node_count = 2 * primitive_count - 1;
-			auto nodes = std::make_unique<Node[]>(node_count);
-			auto nodes_copy = std::make_unique<Node[]>(node_count);
-			auto auxiliary_data = std::make_unique<size_t[]>(node_count * 3);
+			auto nodes = context.nodes.reserve(node_count);
+			auto nodes_copy = context.nodes_copy.reserve(node_count);
+			auto auxiliary_data = context.auxiliary_data.reserve(node_count * 3);
 
 			size_t begin = node_count - primitive_count;
 			size_t end = node_count;
 			size_t previous_end = end;
 
 			// Create the leaves
-#pragma omp parallel for
+#pragma omp parallel for if (primitive_count > loop_parallel_threshold)
 			for (size_t i = 0; i < primitive_count; ++i) {
 				auto& node = nodes[begin + i];
-				node.bounding_box_proxy() = bboxes[primitive_indices[i]];
+				node = Node();
+				node.bounding_box_proxy() = pad(bboxes[primitive_indices[i]]);
 				node.is_leaf = true;
 				node.primitive_count = 1;
 				node.first_child_or_primitive = i;
 			}
+			timer.phase(BuildPhase::Leaves, primitive_count);
 
-			//size_t k = 0;
+			size_t k = 0;
 			while (end - begin > 1) {
 				//uncomment to export the cluster
 				//auto exporter = bvh::ObjExporter<Bvh>(bvh);
-				//exporter.exportToFile(str, "clusterwave", k++, nodes, begin, end);
+				//exporter.exportToFile(str, "clusterwave", k, nodes, begin, end);
+
+				auto cluster_count = end - begin;
 
 				auto [next_begin, next_end] = cluster(
-					nodes.get(),
-					nodes_copy.get(),
-					auxiliary_data.get(),
-					auxiliary_data.get() + node_count,
+					nodes,
+					nodes_copy,
+					auxiliary_data,
+					auxiliary_data + node_count,
 					begin, end,
 					previous_end);
 
@@ -554,11 +581,16 @@ namespace bvh {
 				previous_end = end;
 				begin = next_begin;
 				end = next_end;
+				timer.iteration(BuildPhase::CylinderClustering, k++, cluster_count, end - begin);
 			}
+			timer.phase(BuildPhase::CylinderClustering, end - begin);
 
-			std::swap(bvh.cnodes, nodes);
-			std::swap(bvh.primitive_indices, primitive_indices);
+			if (nodes != context.nodes.get())
+				context.nodes.swap_storage(context.nodes_copy);
+			store_cylinder_nodes(context.nodes, node_count);
+			bvh.primitive_indices = std::move(primitive_indices);
 			bvh.node_count = node_count;
+			timer.phase(BuildPhase::Finalization, bvh.node_count);
 		}
 
 		/// Original build function
@@ -571,40 +603,42 @@ namespace bvh {
 			auto primitive_indices =
 				sort_primitives_by_morton_code(global_bbox, centers, primitive_count).first;
 
+			BuildTimer timer(observer);
+
 			auto node_count = 2 * primitive_count - 1;
-			auto nodes = std::make_unique<Node[]>(node_count);
-			auto nodes_copy = std::make_unique<Node[]>(node_count);
-			auto auxiliary_data = std::make_unique<size_t[]>(node_count * 3);
+			auto nodes = context.nodes.reserve(node_count);
+			auto nodes_copy = context.nodes_copy.reserve(node_count);
+			auto auxiliary_data = context.auxiliary_data.reserve(node_count * 3);
 
 			size_t begin = node_count - primitive_count;
 			size_t end = node_count;
 			size_t previous_end = end;
 
 			// Create the leaves
-#pragma omp parallel for
+#pragma omp parallel for if (primitive_count > loop_parallel_threshold)
 			for (size_t i = 0; i < primitive_count; ++i) {
 				auto& node = nodes[begin + i];
-				node.bounding_box_proxy() = bboxes[primitive_indices[i]];
+				node = Node();
+				node.bounding_box_proxy() = pad(bboxes[primitive_indices[i]]);
 				node.is_leaf = true;
 				node.primitive_count = 1;
 				node.first_child_or_primitive = i;
 			}
+			timer.phase(BuildPhase::Leaves, primitive_count);
 
-			//size_t k = 0;
-			//std::ofstream stats;
-			//stats.open("cluster_stat_box.txt");
+			size_t k = 0;
 			//std::string str = "";
-			//Scalar surface = 0, cumsum = 0;
 			//auto exporter = bvh::ObjExporter<Bvh>(bvh);
 			//exporter.exportToFile(str, "clusterwave_box0", 0, nodes, begin, end, surface);
 			//std::cout << "export done" << std::endl;
 
 			while (end - begin > 1) {
+				auto cluster_count = end - begin;
 				auto [next_begin, next_end] = cluster(
-					nodes.get(),
-					nodes_copy.get(),
-					auxiliary_data.get(),
-					auxiliary_data.get() + node_count,
+					nodes,
+					nodes_copy,
+					auxiliary_data,
+					auxiliary_data + node_count,
 					begin, end,
 					previous_end);
 
@@ -613,19 +647,21 @@ namespace bvh {
 				previous_end = end;
 				begin = next_begin;
 				end = next_end;
+				timer.iteration(BuildPhase::BoxClustering, k, cluster_count, end - begin);
 
 				// uncomment below to export the cluster to a file
 				//auto exporter = bvh::ObjExporter<Bvh>(bvh);
 				//exporter.exportToFile(str, "clusterwave", k, nodes, begin, end, surface);
-				//cumsum += surface;
-				//stats << k << " " << surface << " " << end - begin << " " << surface / (end - begin) << " " << cumsum << std::endl;
-				//k++;
+				k++;
 			}
-			//stats.close();
+			timer.phase(BuildPhase::BoxClustering, end - begin);
 
-			std::swap(bvh.nodes, nodes);
-			std::swap(bvh.primitive_indices, primitive_indices);
+			if (nodes != context.nodes.get())
+				context.nodes.swap_storage(context.nodes_copy);
+			context.nodes.give(bvh.nodes);
+			bvh.primitive_indices = std::move(primitive_indices);
 			bvh.node_count = node_count;
+			timer.phase(BuildPhase::Finalization, bvh.node_count);
 		}
 	};
 
@@ -66,6 +66,82 @@ public:
     }
 };
 
+/// Morton encoder for oriented primitives, such as the cylinders of cylinder hierarchies.
+/// The code interleaves the three coordinates of the position with two coordinates that encode
+/// the direction of the axis of the primitive, so that neighbors in the Morton order are close
+/// and point in similar directions. The direction bits are interleaved with the position bits
+/// starting at a given level of the position, so that the direction only changes the order of
+/// primitives within the cells of that level, and does not break the locality of the coarser ones.
+template <typename Morton, typename Scalar>
+class DirectionalMortonEncoder {
+    MortonEncoder<Morton, Scalar> position_encoder;
+    size_t position_bit_count;
+    size_t direction_bit_count;
+    size_t direction_level;
+
+    /// Maps a direction to a point of [0, 1]^2. Since the axis of a cylinder has no orientation,
+    /// the direction is flipped to the upper hemisphere, which is then octahedral-mapped.
+    static std::pair<Scalar, Scalar> map_direction(Vector3<Scalar> direction) {
+        if (direction[2] < 0)
+            direction = -direction;
+        auto norm = std::abs(direction[0]) + std::abs(direction[1]) + direction[2];
+        if (norm <= 0)
+            return std::make_pair(Scalar(0.5), Scalar(0.5));
+        auto x = direction[0] / norm;
+        auto y = direction[1] / norm;
+        // The hemisphere is mapped to the diamond |x| + |y| <= 1, which is rotated into a square
+        return std::make_pair((x + y + 1) * Scalar(0.5), (x - y + 1) * Scalar(0.5));
+    }
+
+    static Morton quantize(Scalar x, size_t bit_count) {
+        auto dim = Morton(1) << bit_count;
+        return std::min(dim - 1, Morton(std::max(x * Scalar(dim), Scalar(0))));
+    }
+
+public:
+    static constexpr size_t bit_count = sizeof(Morton) * CHAR_BIT;
+
+    /// Creates an encoder with the given number of bits per dimension for the position and the
+    /// direction. The direction bits are inserted after the `direction_level` most significant
+    /// levels of the position. The total number of bits, `3 * position_bit_count + 2 * direction_bit_count`,
+    /// must fit in the Morton code.
+    DirectionalMortonEncoder(
+        const BoundingBox<Scalar>& bbox,
+        size_t position_bit_count,
+        size_t direction_bit_count,
+        size_t direction_level)
+        : position_encoder(bbox, size_t(1) << position_bit_count)
+        , position_bit_count(position_bit_count)
+        , direction_bit_count(direction_bit_count)
+        , direction_level(std::min(direction_level, position_bit_count))
+    {
+        assert(position_bit_count * 3 + direction_bit_count * 2 <= bit_count);
+    }
+
+    /// Total number of bits used by the codes.
+    size_t code_bit_count() const {
+        return position_bit_count * 3 + direction_bit_count * 2;
+    }
+
+    Morton encode(const Vector3<Scalar>& point, const Vector3<Scalar>& direction) const {
+        auto position = position_encoder.encode(point);
+        auto [u, v] = map_direction(direction);
+        auto direction_code = morton_encode(quantize(u, direction_bit_count), quantize(v, direction_bit_count), Morton(0));
+
+        // Append the triplets of position bits from the most significant one, and
+        // insert the pairs of direction bits after the first `direction_level` triplets
+        Morton code = 0;
+        size_t direction_end = direction_level + direction_bit_count;
+        for (size_t level = 0; level < std::max(position_bit_count, direction_end); ++level) {
+            if (level < position_bit_count)
+                code = (code << 3) | ((position >> ((position_bit_count - 1 - level) * 3)) & Morton(7));
+            if (level >= direction_level && level < direction_end)
+                code = (code << 2) | ((direction_code >> ((direction_end - 1 - level) * 3)) & Morton(3));
+        }
+        return code;
+    }
+};
+
 } // namespace bvh
 
 #endif
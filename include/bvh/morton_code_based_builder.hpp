@@ -9,6 +9,7 @@
 #include "bvh/vector.hpp"
 #include "bvh/morton.hpp"
 #include "bvh/radix_sort.hpp"
+#include "bvh/build_observer.hpp"
 
 namespace bvh {
 
@@ -28,9 +29,21 @@ public:
     /// Number of bits to use per dimension.
     size_t bit_count = max_bit_count;
 
+    /// Number of bits per dimension used to encode the direction of the axis of cylinders,
+    /// in addition to their position. This only applies to cylinder primitives, and is
+    /// disabled when zero. Codes of 64 bits leave room for both.
+    size_t direction_bit_count = 0;
+
+    /// Approximate number of primitives of the cells of the position within which
+    /// the direction changes the order of cylinders.
+    size_t direction_cell_size = 8;
+
     /// Threshold (number of nodes) under which the loops execute serially.
     size_t loop_parallel_threshold = 256;
 
+    /// Optional observer that receives the timings of the phases of the build.
+    BuildObserver* observer = nullptr;
+
 protected:
     using SortedPairs = std::pair<std::unique_ptr<size_t[]>, std::unique_ptr<Morton[]>>;
 
@@ -38,30 +51,27 @@ protected:
 
     ~MortonCodeBasedBuilder() {}
 
-    /// Modified function that uses bounding cylinders
-    SortedPairs sort_primitives_by_morton_code(
-        const BoundingCyl<Scalar>& global_bbox,
-        const Vector3<Scalar>* centers,
-        size_t primitive_count)
-    {
-        assert(bit_count <= max_bit_count);
-        auto morton_codes = std::make_unique<Morton[]>(primitive_count);
-        auto morton_codes_copy = std::make_unique<Morton[]>(primitive_count);
-        auto primitive_indices = std::make_unique<size_t[]>(primitive_count);
+    /// Computes the Morton code of each primitive with the given function, and
+    /// sorts the primitives by code, using the given number of bits of the codes.
+    template <typename Encode>
+    SortedPairs sort_primitives(size_t primitive_count, size_t code_bit_count, Encode encode) {
+        BuildTimer timer(observer);
+
+        auto morton_codes           = std::make_unique<Morton[]>(primitive_count);
+        auto morton_codes_copy      = std::make_unique<Morton[]>(primitive_count);
+        auto primitive_indices      = std::make_unique<size_t[]>(primitive_count);
         auto primitive_indices_copy = std::make_unique<size_t[]>(primitive_count);
 
-        Morton* sorted_morton_codes = morton_codes.get();
-        size_t* sorted_primitive_indices = primitive_indices.get();
-        Morton* unsorted_morton_codes = morton_codes_copy.get();
+        Morton* sorted_morton_codes        = morton_codes.get();
+        size_t* sorted_primitive_indices   = primitive_indices.get();
+        Morton* unsorted_morton_codes      = morton_codes_copy.get();
         size_t* unsorted_primitive_indices = primitive_indices_copy.get();
 
-        MortonEncoder<Morton, Scalar> encoder(global_bbox, size_t(1) << bit_count);
-
-#pragma omp parallel if (primitive_count > loop_parallel_threshold)
+        #pragma omp parallel if (primitive_count > loop_parallel_threshold)
         {
-#pragma omp for
+            #pragma omp for
             for (size_t i = 0; i < primitive_count; ++i) {
-                morton_codes[i] = encoder.encode(centers[i]);
+                morton_codes[i] = encode(i);
                 primitive_indices[i] = i;
             }
 
@@ -71,7 +81,7 @@ protected:
                 unsorted_morton_codes,
                 sorted_primitive_indices,
                 unsorted_primitive_indices,
-                primitive_count, bit_count * 3);
+                primitive_count, code_bit_count);
         }
 
         if (sorted_morton_codes != morton_codes.get()) {
@@ -80,51 +90,56 @@ protected:
         }
 
         assert(std::is_sorted(morton_codes.get(), morton_codes.get() + primitive_count));
+        timer.phase(BuildPhase::Sorting, primitive_count);
         return std::make_pair(std::move(primitive_indices), std::move(morton_codes));
     }
 
+    /// Modified function that uses bounding cylinders
     SortedPairs sort_primitives_by_morton_code(
-        const BoundingBox<Scalar>& global_bbox,
+        const BoundingCyl<Scalar>& global_bbox,
         const Vector3<Scalar>* centers,
         size_t primitive_count)
     {
         assert(bit_count <= max_bit_count);
-        auto morton_codes           = std::make_unique<Morton[]>(primitive_count);
-        auto morton_codes_copy      = std::make_unique<Morton[]>(primitive_count);
-        auto primitive_indices      = std::make_unique<size_t[]>(primitive_count);
-        auto primitive_indices_copy = std::make_unique<size_t[]>(primitive_count);
-
-        Morton* sorted_morton_codes        = morton_codes.get();
-        size_t* sorted_primitive_indices   = primitive_indices.get();
-        Morton* unsorted_morton_codes      = morton_codes_copy.get();
-        size_t* unsorted_primitive_indices = primitive_indices_copy.get();
-
         MortonEncoder<Morton, Scalar> encoder(global_bbox, size_t(1) << bit_count);
+        return sort_primitives(primitive_count, bit_count * 3,
+            [&] (size_t i) { return encoder.encode(centers[i]); });
+    }
 
-        #pragma omp parallel if (primitive_count > loop_parallel_threshold)
-        {
-            #pragma omp for
-            for (size_t i = 0; i < primitive_count; ++i) {
-                morton_codes[i] = encoder.encode(centers[i]);
-                primitive_indices[i] = i;
-            }
-
-            // Sort primitives by morton code
-            radix_sort.sort_in_parallel(
-                sorted_morton_codes,
-                unsorted_morton_codes,
-                sorted_primitive_indices,
-                unsorted_primitive_indices,
-                primitive_count, bit_count * 3);
-        }
+    SortedPairs sort_primitives_by_morton_code(
+        const BoundingBox<Scalar>& global_bbox,
+        const Vector3<Scalar>* centers,
+        size_t primitive_count)
+    {
+        assert(bit_count <= max_bit_count);
+        MortonEncoder<Morton, Scalar> encoder(global_bbox, size_t(1) << bit_count);
+        return sort_primitives(primitive_count, bit_count * 3,
+            [&] (size_t i) { return encoder.encode(centers[i]); });
+    }
 
-        if (sorted_morton_codes != morton_codes.get()) {
-            std::swap(morton_codes, morton_codes_copy);
-            std::swap(primitive_indices, primitive_indices_copy);
-        }
+    /// Sorts cylinders by a code that also accounts for the direction of their axis,
+    /// when `direction_bit_count` is not zero (see `DirectionalMortonEncoder`). The number
+    /// of bits of the position is reduced, if needed, so that the code fits in a `Morton`.
+    SortedPairs sort_primitives_by_morton_code(
+        const BoundingBox<Scalar>& global_bbox,
+        const BoundingCyl<Scalar>* bcyls,
+        const Vector3<Scalar>* centers,
+        size_t primitive_count)
+    {
+        if (direction_bit_count == 0)
+            return sort_primitives_by_morton_code(global_bbox, centers, primitive_count);
 
-        assert(std::is_sorted(morton_codes.get(), morton_codes.get() + primitive_count));
-        return std::make_pair(std::move(primitive_indices), std::move(morton_codes));
+        assert(bit_count <= max_bit_count);
+        assert(2 * direction_bit_count < sizeof(Morton) * CHAR_BIT);
+        auto position_bit_count = std::min(bit_count, (sizeof(Morton) * CHAR_BIT - 2 * direction_bit_count) / 3);
+
+        // The direction is used to order the primitives within cells of about
+        // `direction_cell_size` primitives, assuming that they are evenly distributed
+        auto direction_level = round_up_log2(primitive_count / direction_cell_size + 1) / 3;
+        DirectionalMortonEncoder<Morton, Scalar> encoder(
+            global_bbox, position_bit_count, direction_bit_count, direction_level);
+        return sort_primitives(primitive_count, encoder.code_bit_count(),
+            [&] (size_t i) { return encoder.encode(centers[i], bcyls[i].axis); });
     }
 };
 
@@ -1,95 +1,235 @@
 #ifndef BVH_NODE_INTERSECTORS_HPP
 #define BVH_NODE_INTERSECTORS_HPP
 
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #include "bvh/vector.hpp"
 #include "bvh/ray.hpp"
 #include "bvh/platform.hpp"
 #include "bvh/utilities.hpp"
+#include "bvh/cylinder_nodes.hpp"
 
 namespace bvh {
 
-	/// New node intersector method for cylinder shaped bounding boxes.
+	/// New node intersector method for cylinder shaped bounding boxes. The result is the range of
+	/// distances along the ray over which it is inside the cylinder, clipped to `[ray.tmin, ray.tmax]`:
+	/// the cylinder is hit when the entry distance is not larger than the exit distance, and nodes
+	/// that only lie beyond the closest hit found so far are therefore culled, as with boxes.
 	template <typename Bvh>
 	struct CustomNodeIntersector {
 		using Scalar = typename Bvh::ScalarType;
-		Vector3<Scalar> inverse_direction;
-		Scalar invdiridx;
+
+		/// Inverse of the squared length of the ray direction, for the bounding sphere test.
+		Scalar inverse_length2;
+
+		/// The bounding sphere of a cylinder is padded so that rounding errors never make
+		/// the prefilter reject a ray that hits the cylinder close to the rim of a cap.
+		static constexpr Scalar sphere_padding = Scalar(1.125);
 
 		CustomNodeIntersector(const Ray<Scalar>& ray) {
-			inverse_direction = ray.direction.inverse();
-			invdiridx = inverse_direction[0] == 0 ? (inverse_direction[1] == 0 ? (inverse_direction[2] == 0 ? -1 : 2) : 1) : 0;
+			inverse_length2 = Scalar(1) / dot(ray.direction, ray.direction);
+		}
+
+		bvh__always_inline__
+		std::pair<Scalar, Scalar> intersect(const FullCylinderNode<Scalar>& node, const Ray<Scalar>& ray) const {
+			return intersect(node.p1, node.axis, node.h, node.r * node.r, ray);
+		}
+
+		/// Intersection with a compact node, directly from the encoded data.
+		bvh__always_inline__
+		std::pair<Scalar, Scalar> intersect(const CompactCylinderNode<Scalar>& node, const Ray<Scalar>& ray) const {
+			return intersect(node.origin(), node.direction(), Scalar(node.h), Scalar(node.r2), ray);
 		}
 
+		/// Intersects the ray with the cylinder of bottom center `p1`, unit axis `axis`,
+		/// height `h`, and squared radius `r_2`.
 		bvh__always_inline__
-		std::pair<Scalar, Scalar> intersect(const typename Bvh::CustomNode& node, const Ray<Scalar>& ray) const {
-			// ray has origin and direction members
-			// CustomNode holds a bounding cylinder
-
-			// 1. step 
-			// compute A, B, C
-			Vector3<Scalar> d_p = ray.origin - node.p1;
-			Scalar dot_vva = dot(node.axis, ray.direction);
-			Scalar dot_dpva = dot(node.axis, d_p);
-			Scalar r_2 = node.r * node.r;
-			Scalar A, B, C;
-			Vector3<Scalar> v, v2;
-			v = ray.direction - dot_vva * node.axis;
-			A = dot(v, v);
-			v2 = d_p - dot_dpva * node.axis;
-			B = Scalar(2) * dot(v, v2);
-			C = dot(v2, v2) - r_2;
+		std::pair<Scalar, Scalar> intersect(
+			const Vector3<Scalar>& p1, const Vector3<Scalar>& axis,
+			Scalar h, Scalar r_2,
+			const Ray<Scalar>& ray) const
+		{
+			static constexpr Scalar max = std::numeric_limits<Scalar>::max();
+			const auto miss = std::pair<Scalar, Scalar>(max, -max);
+
+			// 1. step
+			// cheap rejection: the part of the ray within [tmin, tmax] must come close
+			// enough to the center of the cylinder to enter its bounding sphere
+			Vector3<Scalar> d_p = ray.origin - p1;
+			Vector3<Scalar> to_center = d_p - (h * Scalar(0.5)) * axis;
+			Scalar closest = std::min(std::max(-dot(to_center, ray.direction) * inverse_length2, ray.tmin), ray.tmax);
+			Vector3<Scalar> offset = to_center + closest * ray.direction;
+			if (dot(offset, offset) > sphere_padding * (Scalar(0.25) * h * h + r_2))
+				return miss;
 
 			// 2. step
-			// first check
-			Scalar sqrterm = B * B - Scalar(4) * A * C;
-			if (sqrterm < 0)
-				return std::pair<Scalar, Scalar>(
-					std::numeric_limits<Scalar>::max(),
-					-std::numeric_limits<Scalar>::max()); // no intersection
-
-			Vector<Scalar, 4> tvec(std::numeric_limits<Scalar>::max());
+			// compute A, B, C, from the components of the ray direction (v) and of
+			// the ray origin relative to p1 (v2) that are orthogonal to the axis
+			Scalar dot_vva = dot(axis, ray.direction);
+			Scalar dot_dpva = dot(axis, d_p);
+			Vector3<Scalar> v = ray.direction - dot_vva * axis;
+			Vector3<Scalar> v2 = d_p - dot_dpva * axis;
+			Scalar A = dot(v, v);
+			Scalar B = dot(v, v2); // half of the linear coefficient
+			Scalar C = dot(v2, v2) - r_2;
+
 			// 3. step
-			// intersecting an infinite cylinder
-			// solve for t1, t2
-			Scalar t1 = (-B + sqrt(sqrterm)) / (Scalar(2) * A);
-			Scalar t2 = (-B - sqrt(sqrterm)) / (Scalar(2) * A);
-			Vector3<Scalar> p2 = node.p1 + node.h * node.axis;
-			if (t1 > 0) {
-				Vector3<Scalar> q1 = ray.origin + t1 * ray.direction;
-				if (dot(node.axis, q1 - node.p1) > 0 &&
-					dot(node.axis, q1 - p2) < 0)
-					tvec[0] = t1;
-			}
-			if (t2 > 0) {
-				Vector3<Scalar> q2 = ray.origin + t2 * ray.direction;
-				if (dot(node.axis, q2 - node.p1) > 0 &&
-					dot(node.axis, q2 - p2) < 0)
-					tvec[1] = t2;
+			// range of the ray inside the infinite cylinder. The discriminant B^2 - AC is obtained
+			// from the distance between the axis and the line of the ray, which, unlike B^2 - AC,
+			// does not cancel out when the ray origin is far from the cylinder (see "Precision
+			// Improvements for Ray/Sphere Intersection", in Ray Tracing Gems). A ray that is
+			// parallel to the axis is either inside the infinite cylinder everywhere or nowhere.
+			Scalar t_near = -max, t_far = max;
+			if (A > 0) {
+				Vector3<Scalar> l = v2 - (B / A) * v;
+				Scalar sqrterm = A * (r_2 - dot(l, l));
+				if (sqrterm < 0)
+					return miss;
+				// solve for t1, t2, without subtracting two close values
+				Scalar q = -(B + std::copysign(std::sqrt(sqrterm), B));
+				Scalar t1 = q / A;
+				Scalar t2 = q != 0 ? C / q : t1;
+				t_near = std::min(t1, t2);
+				t_far = std::max(t1, t2);
 			}
+			else if (C > 0)
+				return miss;
+
 			// 4. step
-			// intersect with the cylinder caps
-			// find t3, t4 if they exist
-			if (invdiridx != -1) {
-				Scalar t3 = (node.p1[invdiridx] - ray.origin[invdiridx]) * inverse_direction[invdiridx];
-				Scalar t4 = (p2[invdiridx] - ray.origin[invdiridx]) * inverse_direction[invdiridx];
-				Vector3<Scalar> q = ray.origin + t3 * ray.direction;
-				Vector3<Scalar> qq = q - node.p1;
-				if (t3 > 0 && dot(qq, qq) < r_2)
-					tvec[2] = t3;
-				q = ray.origin + t4 * ray.direction;
-				qq = q - p2;
-				if (t4 > 0 && dot(qq, qq) < r_2)
-					tvec[3] = t4;
+			// range of the ray between the planes of the two caps, which does not depend
+			// on the orientation of the caps relative to the coordinate axes
+			if (dot_vva != 0) {
+				Scalar inv_vva = Scalar(1) / dot_vva;
+				Scalar t3 = -dot_dpva * inv_vva;
+				Scalar t4 = (h - dot_dpva) * inv_vva;
+				t_near = std::max(t_near, std::min(t3, t4));
+				t_far = std::min(t_far, std::max(t3, t4));
 			}
+			else if (dot_dpva < 0 || dot_dpva > h)
+				return miss;
 
 			// 5. step
-			// return smallest t from tvec
-			return std::make_pair(
-				robust_min(tvec[0], robust_min(tvec[1], robust_min(tvec[2], tvec[3]))),
-				robust_max(tvec[0], robust_max(tvec[1], robust_max(tvec[2], tvec[3])))
-			);
+			// the ray is inside the cylinder where it is inside both, within its own range
+			t_near = std::max(t_near, ray.tmin);
+			t_far = std::min(t_far, ray.tmax);
+			return t_near <= t_far ? std::make_pair(t_near, t_far) : miss;
+		}
+
+		/// Intersects the ray with `N` cylinder nodes stored contiguously in memory (e.g. the
+		/// two siblings of a binary node, or the children of a wide node). The nodes are first
+		/// transposed into a structure of arrays, and the test is then written without any
+		/// per-lane branch, so that the compiler can map the lanes onto SIMD registers. The
+		/// bounding sphere test is done first for all the lanes, and the rest is skipped when
+		/// it rejects all of them. The results are the ones the scalar version returns, node by node.
+		template <size_t N, typename Node>
+		bvh__always_inline__
+		std::array<std::pair<Scalar, Scalar>, N> intersect(const Node* bvh__restrict__ nodes, const Ray<Scalar>& ray) const {
+			Scalar p1[3][N], axis[3][N], h[N], r_2[N];
+			for (size_t i = 0; i < N; ++i)
+				load(nodes[i], i, p1, axis, h, r_2);
+
+			static constexpr Scalar max = std::numeric_limits<Scalar>::max();
+			Scalar ox = ray.origin[0], oy = ray.origin[1], oz = ray.origin[2];
+			Scalar dx = ray.direction[0], dy = ray.direction[1], dz = ray.direction[2];
+			Scalar tmin = ray.tmin, tmax = ray.tmax;
+
+			std::array<std::pair<Scalar, Scalar>, N> result;
+
+			bool in_sphere[N];
+			bool any_in_sphere = false;
+			#pragma omp simd reduction(|: any_in_sphere)
+			for (size_t i = 0; i < N; ++i) {
+				Scalar hh = h[i] * Scalar(0.5);
+				Scalar cx = ox - p1[0][i] - hh * axis[0][i];
+				Scalar cy = oy - p1[1][i] - hh * axis[1][i];
+				Scalar cz = oz - p1[2][i] - hh * axis[2][i];
+				Scalar closest = std::min(std::max(-(cx * dx + cy * dy + cz * dz) * inverse_length2, tmin), tmax);
+				Scalar fx = cx + closest * dx, fy = cy + closest * dy, fz = cz + closest * dz;
+				in_sphere[i] = !(fx * fx + fy * fy + fz * fz > sphere_padding * (hh * hh + r_2[i]));
+				any_in_sphere |= in_sphere[i];
+			}
+			if (!any_in_sphere) {
+				result.fill(std::make_pair(max, -max));
+				return result;
+			}
+
+			Scalar entry[N], exit[N];
+			#pragma omp simd
+			for (size_t i = 0; i < N; ++i) {
+				Scalar ax = axis[0][i], ay = axis[1][i], az = axis[2][i];
+				Scalar px = ox - p1[0][i], py = oy - p1[1][i], pz = oz - p1[2][i];
+				Scalar dot_vva = ax * dx + ay * dy + az * dz;
+				Scalar dot_dpva = ax * px + ay * py + az * pz;
+				Scalar vx = dx - dot_vva * ax, vy = dy - dot_vva * ay, vz = dz - dot_vva * az;
+				Scalar wx = px - dot_dpva * ax, wy = py - dot_dpva * ay, wz = pz - dot_dpva * az;
+				Scalar A = vx * vx + vy * vy + vz * vz;
+				Scalar B = vx * wx + vy * wy + vz * wz;
+				Scalar C = wx * wx + wy * wy + wz * wz - r_2[i];
+
+				// Range inside the infinite cylinder
+				bool side = A > 0;
+				Scalar A_safe = side ? A : Scalar(1);
+				Scalar k = B / A_safe;
+				Scalar lx = wx - k * vx, ly = wy - k * vy, lz = wz - k * vz;
+				Scalar sqrterm = A * (r_2[i] - (lx * lx + ly * ly + lz * lz));
+				bool inside = side ? !(sqrterm < 0) : !(C > 0);
+				Scalar root = std::sqrt(side && inside ? sqrterm : Scalar(0));
+				Scalar q = -(B + std::copysign(root, B));
+				Scalar t1 = q / A_safe;
+				Scalar t2 = q != 0 ? C / q : t1;
+				Scalar t_near = side ? std::min(t1, t2) : -max;
+				Scalar t_far = side ? std::max(t1, t2) : max;
+
+				// Range between the planes of the caps
+				bool oblique = dot_vva != 0;
+				Scalar inv_vva = Scalar(1) / (oblique ? dot_vva : Scalar(1));
+				Scalar t3 = -dot_dpva * inv_vva;
+				Scalar t4 = (h[i] - dot_dpva) * inv_vva;
+				inside = inside && (oblique || !(dot_dpva < 0 || dot_dpva > h[i]));
+				t_near = oblique ? std::max(t_near, std::min(t3, t4)) : t_near;
+				t_far = oblique ? std::min(t_far, std::max(t3, t4)) : t_far;
+
+				t_near = std::max(t_near, tmin);
+				t_far = std::min(t_far, tmax);
+				bool hit = in_sphere[i] && inside && t_near <= t_far;
+				entry[i] = hit ? t_near : max;
+				exit[i] = hit ? t_far : -max;
+			}
+
+			for (size_t i = 0; i < N; ++i)
+				result[i] = std::make_pair(entry[i], exit[i]);
+			return result;
+		}
+
+	private:
+		template <size_t N>
+		bvh__always_inline__
+		static void load(const FullCylinderNode<Scalar>& node, size_t i, Scalar (&p1)[3][N], Scalar (&axis)[3][N], Scalar (&h)[N], Scalar (&r_2)[N]) {
+			for (int j = 0; j < 3; ++j) {
+				p1[j][i] = node.p1[j];
+				axis[j][i] = node.axis[j];
+			}
+			h[i] = node.h;
+			r_2[i] = node.r * node.r;
+		}
+
+		template <size_t N>
+		bvh__always_inline__
+		static void load(const CompactCylinderNode<Scalar>& node, size_t i, Scalar (&p1)[3][N], Scalar (&axis)[3][N], Scalar (&h)[N], Scalar (&r_2)[N]) {
+			auto origin = node.origin();
+			auto direction = node.direction();
+			for (int j = 0; j < 3; ++j) {
+				p1[j][i] = origin[j];
+				axis[j][i] = direction[j];
+			}
+			h[i] = Scalar(node.h);
+			r_2[i] = Scalar(node.r2);
 		}
 
+	public:
 	//protected:
 		~CustomNodeIntersector() {}
 	};
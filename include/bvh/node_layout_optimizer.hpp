@@ -4,6 +4,7 @@
 #include <memory>
 
 #include "bvh/bvh.hpp"
+#include "bvh/node_set.hpp"
 #include "bvh/utilities.hpp"
 #include "bvh/radix_sort.hpp"
 
@@ -12,8 +13,9 @@ namespace bvh {
 /// Optimizes the layout of BVH nodes so that the nodes with
 /// the highest area are closer to the beginning of the array
 /// of nodes. This does not change the topology of the BVH;
-/// only the memory layout of the nodes is affected.
-template <typename Bvh>
+/// only the memory layout of the nodes is affected. The box levels
+/// of hybrid hierarchies keep referring to the same cylinder subtrees.
+template <typename Bvh, typename NodeSet = BoxNodes<Bvh>>
 class NodeLayoutOptimizer {
     using Scalar = typename Bvh::ScalarType;
     using Key    = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
@@ -28,11 +30,15 @@ public:
     {}
 
     void optimize() {
-        size_t pair_count = (bvh.node_count - 1) / 2;
+        // The cylinder nodes of hybrid hierarchies form a forest, whose roots are referred to by the box leaves
+        assert(!NodeSet::is_cylinder || !bvh.hybrid);
+        auto& nodes       = NodeSet::nodes(bvh);
+        auto node_count   = NodeSet::node_count(bvh);
+        size_t pair_count = (node_count - 1) / 2;
         auto keys         = std::make_unique<Key[]>(pair_count * 2);
         auto indices      = std::make_unique<size_t[]>(pair_count * 2);
-        auto nodes_copy   = std::make_unique<typename Bvh::Node[]>(bvh.node_count);
-        nodes_copy[0] = bvh.nodes[0];
+        auto nodes_copy   = std::make_unique<typename NodeSet::Node[]>(node_count);
+        nodes_copy[0] = nodes[0];
 
         auto sorted_indices   = indices.get();
         auto unsorted_indices = indices.get() + pair_count;
@@ -43,11 +49,11 @@ public:
         {
             // Compute the surface area of each pair of nodes
             #pragma omp for
-            for (size_t i = 1; i < bvh.node_count; i += 2) {
-                auto area = bvh.nodes[i + 0]
+            for (size_t i = 1; i < node_count; i += 2) {
+                auto area = nodes[i + 0]
                     .bounding_box_proxy()
                     .to_bounding_box()
-                    .extend(bvh.nodes[i + 1].bounding_box_proxy())
+                    .extend(nodes[i + 1].bounding_box_proxy())
                     .half_area();
                 size_t j = (i - 1) / 2;
                 keys[j]    = as<Key>(area);
@@ -73,14 +79,14 @@ public:
                 auto j = sorted_indices[pair_count - i - 1];
                 auto k = 1 + j * 2;
                 auto l = 1 + i * 2;
-                nodes_copy[l + 0] = bvh.nodes[k + 0];
-                nodes_copy[l + 1] = bvh.nodes[k + 1];
+                nodes_copy[l + 0] = nodes[k + 0];
+                nodes_copy[l + 1] = nodes[k + 1];
                 unsorted_indices[j] = l;
             }
 
             // Remap children indices to the new layout
             #pragma omp for
-            for (size_t i = 0; i < bvh.node_count; ++i) {
+            for (size_t i = 0; i < node_count; ++i) {
                 if (nodes_copy[i].is_leaf)
                     continue;
                 nodes_copy[i].first_child_or_primitive =
@@ -88,7 +94,7 @@ public:
             }
         }
 
-        std::swap(nodes_copy, bvh.nodes);
+        nodes = std::move(nodes_copy);
     }
 };
 
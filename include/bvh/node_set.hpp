@@ -0,0 +1,50 @@
+#ifndef BVH_NODE_SET_HPP
+#define BVH_NODE_SET_HPP
+
+#include <memory>
+#include <cstddef>
+
+#include "bvh/bvh.hpp"
+#include "bvh/bounding_box.hpp"
+
+namespace bvh {
+
+/// Node set that selects the AABB nodes of a BVH (`Bvh::nodes`). This is the set used by
+/// default by the post-build algorithms. In hybrid hierarchies, it contains the box levels
+/// only, whose leaves are the bounding boxes of cylinder subtrees.
+template <typename Bvh>
+struct BoxNodes {
+    using Node           = typename Bvh::Node;
+    using BoundingVolume = BoundingBox<typename Bvh::ScalarType>;
+
+    static constexpr bool is_cylinder = false;
+
+    static BvhArray<Node>& nodes(Bvh& bvh) { return bvh.nodes; }
+    static const BvhArray<Node>& nodes(const Bvh& bvh) { return bvh.nodes; }
+    static size_t node_count(const Bvh& bvh) { return bvh.node_count; }
+    static void set_node_count(Bvh& bvh, size_t node_count) { bvh.node_count = node_count; }
+};
+
+/// Node set that selects the cylinder nodes of a BVH (`Bvh::cnodes`), in the layout of the BVH.
+template <typename Bvh>
+struct CylinderNodes {
+    using Node           = typename Bvh::CustomNode;
+    using BoundingVolume = BoundingCyl<typename Bvh::ScalarType>;
+
+    static constexpr bool is_cylinder = true;
+
+    static BvhArray<Node>& nodes(Bvh& bvh) { return bvh.cnodes; }
+    static const BvhArray<Node>& nodes(const Bvh& bvh) { return bvh.cnodes; }
+    static size_t node_count(const Bvh& bvh) { return bvh.cnode_count; }
+
+    static void set_node_count(Bvh& bvh, size_t node_count) {
+        // Cylinder hierarchies also record their size in `node_count`
+        bvh.cnode_count = node_count;
+        if (!bvh.hybrid)
+            bvh.node_count = node_count;
+    }
+};
+
+} // namespace bvh
+
+#endif
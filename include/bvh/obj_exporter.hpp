@@ -1,519 +1,323 @@
 #ifndef BVH_OBJ_EXPORTER_HPP
 #define BVH_OBJ_EXPORTER_HPP
 
-#include <queue>
+#include <cmath>
+#include <cstdio>
 #include <string>
+#include <vector>
 #include <fstream>
 #include <iostream>
 #include "bvh/bvh.hpp"
 #include "bvh/bounding_box.hpp"
-
-//#define _USE_MATH_DEFINES
-//#include <math.h>
+#include "bvh/utilities.hpp"
 
 namespace bvh {
 
+	/// Exports the bounding volumes of a hierarchy, level by level. The hierarchy is walked one level
+	/// at a time: the surface area of each level is summed in parallel, and, when geometry is exported,
+	/// the bounding volumes of each level are formatted in parallel into separate buffers, which are
+	/// then written to the file of the level with one block write each.
 	template <typename Bvh>
 	class ObjExporter {
 	public:
 		using Scalar = typename Bvh::ScalarType;
 		using Element = typename Bvh::CustomNode*;
 		using Elem = typename Bvh::Node*;
+
+		enum class Mode {
+			/// Only computes the surface area of each level (and of the whole hierarchy).
+			Statistics,
+			/// Also writes the bounding volumes of each level into an OBJ file per level.
+			Geometry
+		};
+
 		const Bvh& bvh;
 		const std::string infile;
 		const int numpoints;
 
+		/// Selects whether the traversal functions emit geometry, or only statistics.
+		Mode mode = Mode::Statistics;
+
+		/// Number of nodes that are formatted into the same buffer when exporting geometry.
+		size_t export_block_size = 256;
+
 	public:
 		ObjExporter(const Bvh& bvh, int npoints = 20)
 			: bvh(bvh), numpoints(npoints)
 		{}
 
 		ObjExporter(const Bvh& bvh, std::string filename, int npoints = 20)
-			: bvh(bvh), numpoints(npoints), infile(filename.substr(0, filename.find_last_of(".")))
-		{
-			//infile = filename.substr(0, filename.find_last_of(".")); // remove the file extension
-		}
+			: bvh(bvh), infile(filename.substr(0, filename.find_last_of("."))), numpoints(npoints)
+		{}
 
-		/// Export a bounding box
-		void exportBox(typename Bvh::Node& box, std::ofstream& file, int id) {
-			// bounds = min, max, min, max, min, max
-			file << "v " << box.bounds[0] << " " << box.bounds[2] << " " << box.bounds[4] << std::endl;
-			file << "v " << box.bounds[0] << " " << box.bounds[2] << " " << box.bounds[5] << std::endl;
-			file << "v " << box.bounds[1] << " " << box.bounds[2] << " " << box.bounds[5] << std::endl;
-			file << "v " << box.bounds[1] << " " << box.bounds[2] << " " << box.bounds[4] << std::endl;
+	private:
+		static constexpr Scalar pi = Scalar(3.14159265358979323846);
 
-			file << "v " << box.bounds[0] << " " << box.bounds[3] << " " << box.bounds[4] << std::endl;
-			file << "v " << box.bounds[0] << " " << box.bounds[3] << " " << box.bounds[5] << std::endl;
-			file << "v " << box.bounds[1] << " " << box.bounds[3] << " " << box.bounds[5] << std::endl;
-			file << "v " << box.bounds[1] << " " << box.bounds[3] << " " << box.bounds[4] << std::endl << std::endl;
+		/// Nodes of one level of the hierarchy. Levels of hybrid hierarchies contain both boxes and cylinders.
+		struct Level {
+			std::vector<size_t> boxes;
+			std::vector<size_t> cylinders;
 
-			file << "g cylinder" << std::to_string(id) << std::endl;
-			file << "f " << "-8 -7 -6 -5\n";
-			file << "f " << "-4 -3 -2 -1\n";
+			size_t size() const { return boxes.size() + cylinders.size(); }
+		};
 
-			file << "f " << "-1 -2 -6 -5\n";
-			file << "f " << "-4 -3 -7 -8\n";
+		static void append_line(std::string& buffer, const char* prefix, Scalar x, Scalar y, Scalar z) {
+			char line[128];
+			int length = std::snprintf(line, sizeof(line), "%s %g %g %g\n", prefix, double(x), double(y), double(z));
+			buffer.append(line, length);
+		}
 
-			file << "f " << "-2 -3 -7 -6\n";
-			file << "f " << "-1 -4 -8 -5\n\n";
+		static void append_face(std::string& buffer, int a, int b, int c) {
+			char line[64];
+			int length = std::snprintf(line, sizeof(line), "f %d %d %d\n", a, b, c);
+			buffer.append(line, length);
 		}
 
-		/// Export a cylinder
-		//template<typename Bvh>
-		void exportBox(typename Bvh::CustomNode& cyl, std::ofstream& file, int id, int npoints = 20) {
-			// do the vertices first
-			auto point = cyl.p1 + cyl.axis * cyl.h;
-			file << "v " << cyl.p1[0] << " " << cyl.p1[1] << " " << cyl.p1[2] << std::endl; // 1
-			file << "v " << point[0] << " " << point[1] << " " << point[2] << std::endl; // 2
-			//file << std::endl;
+		/// Writes the contents of a buffer into a file in one block.
+		static void write_buffer(std::ofstream& file, const std::string& buffer) {
+			file.write(buffer.data(), buffer.size());
+		}
 
-			auto A = normalize(Vector3<Scalar>(cyl.axis[2], Scalar(0), -cyl.axis[0]));
-			auto B = normalize(cross(A, cyl.axis));
+		/// Computes the next level of the hierarchy from the given one.
+		void descend(const Level& level, Level& next) const {
+			next.boxes.clear();
+			next.cylinders.clear();
+			for (auto i : level.boxes) {
+				const auto& node = bvh.nodes[i];
+				if (!node.is_leaf) {
+					next.boxes.push_back(node.first_child_or_primitive + 0);
+					next.boxes.push_back(node.first_child_or_primitive + 1);
+				} else if (bvh.hybrid) {
+					// The leaves of hybrid hierarchies lead to the children of the root of a cylinder subtree
+					const auto& root = bvh.cnodes[node.cylinder_root()];
+					if (!root.is_leaf) {
+						next.cylinders.push_back(root.first_child_or_primitive + 0);
+						next.cylinders.push_back(root.first_child_or_primitive + 1);
+					}
+				}
+			}
+			for (auto i : level.cylinders) {
+				const auto& node = bvh.cnodes[i];
+				if (!node.is_leaf) {
+					next.cylinders.push_back(node.first_child_or_primitive + 0);
+					next.cylinders.push_back(node.first_child_or_primitive + 1);
+				}
+			}
+		}
 
-			// add first two points
-			auto pp = cyl.p1 + (A * Scalar(cos(0)) + B * Scalar(sin(0))) * cyl.r;
-			file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
-			pp = pp + cyl.axis * cyl.h;
-			file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
+		Scalar level_surface(const Level& level) const {
+			Scalar surface = 0;
+			// The number of nodes is converted to a signed type, for compatibility with older versions of OpenMP
+			auto box_count = static_cast<int64_t>(level.boxes.size());
+			auto cylinder_count = static_cast<int64_t>(level.cylinders.size());
+			#pragma omp parallel for reduction(+: surface) if (box_count > 4096)
+			for (int64_t i = 0; i < box_count; ++i)
+				surface += bvh.nodes[level.boxes[i]].bounding_box_proxy().to_bounding_box().surface();
+			#pragma omp parallel for reduction(+: surface) if (cylinder_count > 4096)
+			for (int64_t i = 0; i < cylinder_count; ++i)
+				surface += bvh.cnodes[level.cylinders[i]].bounding_box_proxy().to_bounding_box().surface();
+			return surface;
+		}
 
-			for (int i = 0; i < npoints; i++) {
-				auto v = Scalar(i) / npoints;
-				pp = cyl.p1 + (A * Scalar(cos(2 * M_PI * v)) + B * Scalar(sin(2 * M_PI * v))) * cyl.r;
-				file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
-				pp = pp + cyl.axis * cyl.h;
-				file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
+		/// Writes the bounding volumes of a level into the OBJ file of that level.
+		void export_level(const Level& level, size_t depth) {
+			auto block_count = (level.size() + export_block_size - 1) / export_block_size;
+			std::vector<std::string> buffers(block_count);
+			#pragma omp parallel for schedule(dynamic)
+			for (size_t i = 0; i < block_count; ++i) {
+				auto& buffer = buffers[i];
+				auto end = std::min(level.size(), (i + 1) * export_block_size);
+				for (size_t j = i * export_block_size; j < end; ++j) {
+					if (j < level.boxes.size())
+						formatBox(bvh.nodes[level.boxes[j]], buffer, int(j));
+					else
+						formatBox(bvh.cnodes[level.cylinders[j - level.boxes.size()]], buffer, int(j), numpoints);
+				}
 			}
+			std::ofstream file(infile + "_" + std::to_string(depth) + ".obj", std::ofstream::binary);
+			for (auto& buffer : buffers)
+				write_buffer(file, buffer);
+		}
 
-			file << std::endl;
-			file << "g cylinder" << std::to_string((int)id) << std::endl;
-			file << "usemtl cylinder" << std::endl;
-			// then add the faces
-			int i;
-			int n = npoints * 2 + 4 + 1;
-			for (i = 3; i <= npoints * 2 + 1; i += 2) {
-				file << "f " << 1 - n << " " << i - n << " " << (i + 2) - n << std::endl;
-				file << "f " << i - n << " " << (i + 1) - n << " " << (i + 2) - n << std::endl;
-				file << "f " << (i + 2) - n << " " << (i + 1) - n << " " << (i + 3) - n << std::endl;
-				file << "f " << (i + 3) - n << " " << (i + 1) - n << " " << 2 - n << std::endl;
+		/// Walks the hierarchy level by level from the given root, writes the surface area of every level
+		/// (but the last) into `statname`, and appends the number of levels and the total surface to `infile.txt`.
+		void traverse(Level level, const std::string& statname) {
+			std::ofstream statfile(statname);
+			Level next;
+			size_t depth = 0;
+			Scalar cumsum = 0;
+			while (true) {
+				if (mode == Mode::Geometry)
+					export_level(level, depth);
+				auto surface = level_surface(level);
+				cumsum += surface;
+				descend(level, next);
+				if (next.size() == 0)
+					break;
+				statfile << depth << " " << surface << " " << cumsum << "\n";
+				std::swap(level, next);
+				depth++;
 			}
-			// close the circle
-			file << "f " << 1 - n << " " << i - n << " " << 3 - n << std::endl;
-			file << "f " << i - n << " " << (i + 1) - n << " " << 3 - n << std::endl;
-			file << "f " << 3 - n << " " << (i + 1) - n << " " << 4 - n << std::endl;
-			file << "f " << 4 - n << " " << (i + 1) - n << " " << 2 - n << std::endl << std::endl;
+			statfile.close();
 
+			std::ofstream bigstat;
+			bigstat.open(infile + ".txt", std::ios_base::out | std::ios_base::app);
+			bigstat << depth << " " << cumsum << std::endl; // write the level count and the cumulative surface
+			bigstat.close();
 		}
 
-		void exportBox(typename BoundingCyl<Scalar> cyl, std::ofstream& file, int id, int npoints = 20) {
+	public:
+		/// Formats a bounding box
+		void formatBox(const typename Bvh::Node& box, std::string& buffer, int id) const {
+			// bounds = min, max, min, max, min, max
+			append_line(buffer, "v", box.bounds[0], box.bounds[2], box.bounds[4]);
+			append_line(buffer, "v", box.bounds[0], box.bounds[2], box.bounds[5]);
+			append_line(buffer, "v", box.bounds[1], box.bounds[2], box.bounds[5]);
+			append_line(buffer, "v", box.bounds[1], box.bounds[2], box.bounds[4]);
+
+			append_line(buffer, "v", box.bounds[0], box.bounds[3], box.bounds[4]);
+			append_line(buffer, "v", box.bounds[0], box.bounds[3], box.bounds[5]);
+			append_line(buffer, "v", box.bounds[1], box.bounds[3], box.bounds[5]);
+			append_line(buffer, "v", box.bounds[1], box.bounds[3], box.bounds[4]);
+			buffer += "\n";
+
+			buffer += "g cylinder" + std::to_string(id) + "\n";
+			buffer += "f -8 -7 -6 -5\n";
+			buffer += "f -4 -3 -2 -1\n";
+
+			buffer += "f -1 -2 -6 -5\n";
+			buffer += "f -4 -3 -7 -8\n";
+
+			buffer += "f -2 -3 -7 -6\n";
+			buffer += "f -1 -4 -8 -5\n\n";
+		}
+
+		/// Formats a cylinder node, whatever its layout
+		void formatBox(const typename Bvh::CustomNode& cyl, std::string& buffer, int id, int npoints = 20) const {
+			formatBox(cyl.bounding_box_proxy().to_bounding_box(), buffer, id, npoints);
+		}
+
+		/// Formats a cylinder
+		void formatBox(BoundingCyl<Scalar> cyl, std::string& buffer, int id, int npoints = 20) const {
 			// do the vertices first
 			auto point = cyl.c + cyl.axis * cyl.h;
-			file << "v " << cyl.c[0] << " " << cyl.c[1] << " " << cyl.c[2] << std::endl; // 1
-			file << "v " << point[0] << " " << point[1] << " " << point[2] << std::endl; // 2
+			append_line(buffer, "v", cyl.c[0], cyl.c[1], cyl.c[2]); // 1
+			append_line(buffer, "v", point[0], point[1], point[2]); // 2
 
 			auto A = normalize(Vector3<Scalar>(cyl.axis[2], Scalar(0), -cyl.axis[0]));
 			auto B = normalize(cross(A, cyl.axis));
 
 			// add first two points
-			auto pp = cyl.c + (A * Scalar(cos(0)) + B * Scalar(sin(0))) * cyl.r;
-			file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
+			auto pp = cyl.c + A * cyl.r;
+			append_line(buffer, "v", pp[0], pp[1], pp[2]);
 			pp = pp + cyl.axis * cyl.h;
-			file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
+			append_line(buffer, "v", pp[0], pp[1], pp[2]);
 
 			for (int i = 0; i < npoints; i++) {
 				auto v = Scalar(i) / npoints;
-				pp = cyl.c + (A * Scalar(cos(2 * M_PI * v)) + B * Scalar(sin(2 * M_PI * v))) * cyl.r;
-				file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
+				pp = cyl.c + (A * std::cos(2 * pi * v) + B * std::sin(2 * pi * v)) * cyl.r;
+				append_line(buffer, "v", pp[0], pp[1], pp[2]);
 				pp = pp + cyl.axis * cyl.h;
-				file << "v " << pp[0] << " " << pp[1] << " " << pp[2] << std::endl;
+				append_line(buffer, "v", pp[0], pp[1], pp[2]);
 			}
 
-			file << std::endl;
-			file << "g cylinder" << std::to_string((int)id) << std::endl;
-			file << "usemtl cylinder" << std::endl;
+			buffer += "\n";
+			buffer += "g cylinder" + std::to_string(id) + "\n";
+			buffer += "usemtl cylinder\n";
 			// then add the faces
 			int i;
 			int n = npoints * 2 + 4 + 1;
 			for (i = 3; i <= npoints * 2 + 1; i += 2) {
-				file << "f " << 1 - n << " " << i - n << " " << (i + 2) - n << std::endl;
-				file << "f " << i - n << " " << (i + 1) - n << " " << (i + 2) - n << std::endl;
-				file << "f " << (i + 2) - n << " " << (i + 1) - n << " " << (i + 3) - n << std::endl;
-				file << "f " << (i + 3) - n << " " << (i + 1) - n << " " << 2 - n << std::endl;
+				append_face(buffer, 1 - n, i - n, (i + 2) - n);
+				append_face(buffer, i - n, (i + 1) - n, (i + 2) - n);
+				append_face(buffer, (i + 2) - n, (i + 1) - n, (i + 3) - n);
+				append_face(buffer, (i + 3) - n, (i + 1) - n, 2 - n);
 			}
 			// close the circle
-			file << "f " << 1 - n << " " << i - n << " " << 3 - n << std::endl;
-			file << "f " << i - n << " " << (i + 1) - n << " " << 3 - n << std::endl;
-			file << "f " << 3 - n << " " << (i + 1) - n << " " << 4 - n << std::endl;
-			file << "f " << 4 - n << " " << (i + 1) - n << " " << 2 - n << std::endl << std::endl;
+			append_face(buffer, 1 - n, i - n, 3 - n);
+			append_face(buffer, i - n, (i + 1) - n, 3 - n);
+			append_face(buffer, 3 - n, (i + 1) - n, 4 - n);
+			append_face(buffer, 4 - n, (i + 1) - n, 2 - n);
+			buffer += "\n";
+		}
+
+		/// Export a bounding box
+		void exportBox(const typename Bvh::Node& box, std::ofstream& file, int id) {
+			std::string buffer;
+			formatBox(box, buffer, id);
+			write_buffer(file, buffer);
+		}
+
+		/// Export a cylinder node, whatever its layout
+		void exportBox(const typename Bvh::CustomNode& cyl, std::ofstream& file, int id, int npoints = 20) {
+			exportBox(cyl.bounding_box_proxy().to_bounding_box(), file, id, npoints);
+		}
 
+		/// Export a cylinder
+		void exportBox(BoundingCyl<Scalar> cyl, std::ofstream& file, int id, int npoints = 20) {
+			std::string buffer;
+			formatBox(cyl, buffer, id, npoints);
+			write_buffer(file, buffer);
 		}
 
 		/// Export CustomNode clusters
 		void exportToFile(std::string infile, std::string filename, size_t level,
 			std::unique_ptr<typename Bvh::CustomNode[]>& nodes, size_t begin, size_t end, Scalar& ret)
 		{
-			std::ofstream file;
-			file.open(filename + "_" + std::to_string(level) + ".obj");
-			file << infile << std::endl;
-			std::ofstream specfile;
-			int id = 0;
-			Scalar surf = 0;
-			for (size_t i = begin; i < end; ++i) {
-				exportBox(nodes[i], file, id++);
-				surf += nodes[i].bounding_box_proxy().to_bounding_box().surface();
-			}
-			ret = surf;
-			file.close();
+			exportClusters(infile, filename, level, nodes, begin, end, ret);
 		}
 
 		/// Export Node clusters
 		void exportToFile(std::string infile, std::string filename, size_t level,
 			std::unique_ptr<typename Bvh::Node[]>& nodes, size_t begin, size_t end, Scalar& ret)
 		{
-			std::ofstream file;
-			file.open(filename + "_" + std::to_string(level) + ".obj");
-			file << infile << std::endl;
-			int id = 0;
-			Scalar surf = 0;
-			for (size_t i = begin; i < end; ++i) {
-				exportBox(nodes[i], file, id++);
-				surf += nodes[i].bounding_box_proxy().to_bounding_box().surface();
-			}
-			ret = surf;
-			file.close();
+			exportClusters(infile, filename, level, nodes, begin, end, ret);
 		}
 
-		void traverseExportHybrid() {
-			///traverse the upper box part and then find the way to the cylinder part
-			// q for the boxes
-			std::queue<std::pair<Elem, int>> q;
-			// second q for cylinders
-			std::queue<std::pair<Element, int>> q2;
-
-			int level = 0;
-			q.push(std::make_pair(bvh.nodes.get(), level));
-			auto node = q.front();
-
-			// open files
-			//std::ofstream bigstat;
-			std::ofstream file;
-			//bigstat.open(infile + ".txt", std::ios_base::out | std::ios_base::app);
-			//file.open(infile + "_" + std::to_string(level) + ".obj");
-
-			//file << str;
-			//file << std::endl;
-
-			int id = 0;
-
-			// count the overall surface area on each level
-			Scalar surface = 0;
-			Scalar cumsum = 0;
-			// and write into a separate file
-			std::ofstream statfile;
-			statfile.open("stats_box.txt");
-
-			Scalar h;
-			while (!q.empty()) {
-				// pop the first
-				node = q.front();
-				q.pop();
-
-				// process q2 until the level stays the same
-				// or q2 is not empty
-				while (!q2.empty()) {
-					if (q2.front().second == level) {
-						auto q2node = q2.front();
-						q2.pop();
-						//exportBox(*q2node.first, file, id++);
-						h = (*q2node.first).bounding_box_proxy().to_bounding_box().surface();
-						surface += h;
-						cumsum += h;
-
-						auto first_child = q2node.first->first_child_or_primitive;
-						if (q2node.first->is_leaf) {
-							//typename Bvh::IndexType i;
-							//for (i = 0; i < q2node.first->primitive_count; i++) {
-							//	exportBox(bvh.cnodes[first_child + i], file, id++);
-							//}
-						}
-						else {
-							auto* left_child = &bvh.cnodes[first_child + 0];
-							auto* right_child = &bvh.cnodes[first_child + 1];
-
-							if (left_child != NULL)
-								q2.push(std::make_pair(left_child, q2node.second + 1));
-							if (right_child != NULL)
-								q2.push(std::make_pair(right_child, q2node.second + 1));
-						}
-					}
-					else
-						break;
-				}
-
-				// do something to the element
-				// while the element level is equal to level, write to open file,
-				// when it changes, close it and open a new file
-				if (node.second != level) {
-					// when changing the level, write the summed surface area into the statfile
-					statfile << level << " " << (surface) << " " << cumsum << std::endl;
-					surface = 0;
-
-					file.close();
-					level++;
-					//file.open(infile + std::to_string((level)) + ".obj");
-
-					//file << std::endl;
-				}
-				// export the node
-				//exportBox(*node.first, file, id++);
-				// add the surface 
-				h = (*node.first).bounding_box_proxy().to_bounding_box().surface();
-				surface += h;
-				cumsum += h;
-
-				// enqueue children, if they exist
-				// if not leaf, add children to the queue
-				auto first_child = node.first->first_child_or_primitive;
-
-				if (node.first->is_leaf) {
-					auto* cyl = &bvh.cnodes[node.first->origin];
-
-					auto first_child_cyl = cyl->first_child_or_primitive;
-					if (cyl->is_leaf) {
-						//typename Bvh::IndexType i;
-						//for (i = 0; i < cyl->primitive_count; i++) {
-						//	exportBox(bvh.cnodes[first_child_cyl + i], file, id++);
-						//}
-					}
-					else {
-						auto* left_child = &bvh.cnodes[first_child_cyl + 0];
-						auto* right_child = &bvh.cnodes[first_child_cyl + 1];
-
-						if (left_child != NULL)
-							q2.push(std::make_pair(left_child, node.second + 1));
-						if (right_child != NULL)
-							q2.push(std::make_pair(right_child, node.second + 1));
-					}
-				}
-				else {
-					auto* left_child = &bvh.nodes[first_child + 0];
-					auto* right_child = &bvh.nodes[first_child + 1];
-
-					if (left_child != NULL)
-						q.push(std::make_pair(left_child, node.second + 1));
-					if (right_child != NULL)
-						q.push(std::make_pair(right_child, node.second + 1));
+		template <typename Node>
+		void exportClusters(const std::string& infile, const std::string& filename, size_t level,
+			const std::unique_ptr<Node[]>& nodes, size_t begin, size_t end, Scalar& ret)
+		{
+			auto block_count = (end - begin + export_block_size - 1) / export_block_size;
+			std::vector<std::string> buffers(block_count);
+			Scalar surf = 0;
+			#pragma omp parallel for schedule(dynamic) reduction(+: surf)
+			for (size_t i = 0; i < block_count; ++i) {
+				auto block_end = std::min(end, begin + (i + 1) * export_block_size);
+				for (size_t j = begin + i * export_block_size; j < block_end; ++j) {
+					formatBox(nodes[j], buffers[i], int(j - begin));
+					surf += nodes[j].bounding_box_proxy().to_bounding_box().surface();
 				}
 			}
-			// now process what's left in q2
-			assert(!q2.empty());
-			auto node2 = q2.front();
-
-			// now empty the q2
-			while (!q2.empty()) {
-				node2 = q2.front();
-				q2.pop();
-
-				if (node2.second != level) {
-					statfile << level << " " << surface << " " << cumsum << std::endl;
-					surface = 0;
-					//file.close();
-
-					level++;
-					//file.open(infile + std::to_string(level) + "_2.obj");
+			ret = surf;
 
-					//file << str;
-					//file << std::endl;
-				}
-				// now export the node
-				//exportBox(*node2.first, file, id++);
-				// add the surface 
-				h = (*node2.first).bounding_box_proxy().to_bounding_box().surface();
-				surface += h;
-				cumsum += h;
-
-				// enqueue children, if they exist (!!)
-				// if not leaf, add children to the queue
-				auto first_child = node2.first->first_child_or_primitive;
-				if (node2.first->is_leaf) {
-					//typename Bvh::IndexType i;
-					//for (i = 0; i < node2.first->primitive_count; i++) {
-					//	exportBox(bvh.cnodes[first_child + i], file, id++);
-					//}
-				}
-				else {
-					auto* left_child = &bvh.cnodes[first_child + 0];
-					auto* right_child = &bvh.cnodes[first_child + 1];
-
-					if (left_child != NULL)
-						q2.push(std::make_pair(left_child, node2.second + 1));
-					if (right_child != NULL)
-						q2.push(std::make_pair(right_child, node2.second + 1));
-				}
-			}
-			statfile.close();
-			std::ofstream bigstat;
-			bigstat.open(infile + ".txt", std::ios_base::out | std::ios_base::app);
-			bigstat << level << " " << cumsum << std::endl; // write the level count and the cumulative surface
-			bigstat.close();
+			std::ofstream file(filename + "_" + std::to_string(level) + ".obj", std::ofstream::binary);
+			file << infile << "\n";
+			for (auto& buffer : buffers)
+				write_buffer(file, buffer);
 		}
 
-		/// Traverse hierarchy and export each level separately
-		/// expects a cylinder hierarchy with the root being a box
-		void traverseExport(/*std::string filename = infile*/) {
-			std::queue<std::pair<Element, int>> q;
-			//const auto* node = bvh.cnodes.get();
-			int level = 0;
-			q.push(std::make_pair(bvh.cnodes.get(), level));
-			auto node = q.front();
-
-			// open files
-			//std::ofstream bigstat;
-			std::ofstream file;
-			file.open(infile + "_" + std::to_string(level) + ".obj");
-			// copy original .obj
-			//std::string str((std::istreambuf_iterator<char>(original)), std::istreambuf_iterator<char>());
-			//file << str;
-			//file << std::endl;
-
-			int id = 0;
-			// count the overall surface area on each level
-			Scalar surface = 0;
-			Scalar cumsum = 0;
-			// and write into a separate file
-			std::ofstream statfile;
-			statfile.open("stats_cyl.txt");
-			Scalar h;
-			while (!q.empty()) {
-				// pop the first
-				node = q.front();
-				q.pop();
-				// do something to the element
-				// while the element level is equal to 'level', write to open file,
-				// when it changes, close it and open a new file
-				if (node.second != level) {
-					// when changing the level, write the summed surface area into the statfile
-					statfile << level << " " << (surface) << " " << cumsum << std::endl;
-					surface = 0;
-
-					//file.close();
-					level++;
-					//file.open(infile + "_" + std::to_string((level)) + ".obj");
-
-					//file << str;
-					//file << std::endl;
-				}
-				// now export the node
-				//exportBox(*node.first, file, id++);
-				// add the surface
-				h = (*node.first).bounding_box_proxy().to_bounding_box().surface();
-				surface += h;
-				cumsum += h;
-
-				// enqueue children, if they exist
-				auto first_child = node.first->first_child_or_primitive;
-				if (node.first->is_leaf) {
-					// if leaf, export every ptimitive's bounding volume
-					//typename Bvh::IndexType i;
-					//for (i = 0; i < node.first->primitive_count; i++) {
-					//	exportBox(bvh.cnodes[first_child + i], file, id++);
-					//}
-				}
-				else {
-					auto* left_child = &bvh.cnodes[first_child + 0];
-					auto* right_child = &bvh.cnodes[first_child + 1];
-
-					if (left_child != NULL)
-						q.push(std::make_pair(left_child, node.second + 1));
-					if (right_child != NULL)
-						q.push(std::make_pair(right_child, node.second + 1));
-				}
-			}
-			statfile.close();
+		/// Traverses a hybrid hierarchy, whose root is a box, and whose box leaves lead to cylinder subtrees
+		void traverseExportHybrid() {
+			Level root;
+			root.boxes.push_back(0);
+			traverse(std::move(root), "stats_box.txt");
+		}
 
-			std::ofstream bigstat;
-			bigstat.open(infile + ".txt", std::ios_base::out | std::ios_base::app);
-			bigstat << level << " " << cumsum << std::endl; // write the level count and the cumulative surface
-			bigstat.close();
+		/// Traverses a cylinder hierarchy and exports each level separately
+		void traverseExport() {
+			Level root;
+			root.cylinders.push_back(0);
+			traverse(std::move(root), "stats_cyl.txt");
 		}
 
-		void traverseExportBox(/*std::string filename = infile*/) {
-			std::queue<std::pair<Elem, int>> q;
-			int level = 0;
-			q.push(std::make_pair(bvh.nodes.get(), level));
-			auto node = q.front();
-
-			// open files
-			//std::ifstream original;
-			std::ofstream file;
-			//original.open(infile + ".obj");
-			//file.open(infile + "_" + std::to_string(level) + ".obj");
-			// copy original .obj
-			//std::string str((std::istreambuf_iterator<char>(original)), std::istreambuf_iterator<char>());
-			//file << str;
-			//file << std::endl;
-
-			int id = 0;
-
-			// count the overall surface area on each level
-			Scalar surface = 0;
-			Scalar cumsum = 0;
-			// and write into a separate file
-			std::ofstream statfile;
-			statfile.open("stats_box.txt");
-
-			Scalar h;
-			while (!q.empty()) {
-				// pop the first
-				node = q.front();
-				q.pop();
-				// do something to the element
-				// while the element level is equal to level, write to open file,
-				// when it changes, close it and open a new file
-				if (node.second != level) {
-					// when changing the level, write the summed surface area into the statfile
-					statfile << level << " " << (surface) << " " << cumsum << std::endl;
-					surface = 0;
-
-					//file.close();
-					level++;
-					//file.open(infile + std::to_string((level)) + ".obj");
-
-					//file << str;
-					//file << std::endl;
-				}
-				// now export the node
-				//exportBox(*node.first, file, id++);
-				// add the surface 
-				h = (*node.first).bounding_box_proxy().to_bounding_box().surface();
-				surface += h;
-				cumsum += h;
-
-				// enqueue children, if they exist (!!)
-				// if not leaf, add children to the queue
-				auto first_child = node.first->first_child_or_primitive;
-				if (node.first->is_leaf) {
-					//typename Bvh::IndexType i;
-					//for (i = 0; i < node.first->primitive_count; i++) {
-					//	exportBox(bvh.nodes[first_child + i], file, id++);
-					//}
-				}
-				else {
-					auto* left_child = &bvh.nodes[first_child + 0];
-					auto* right_child = &bvh.nodes[first_child + 1];
-
-					if (left_child != NULL)
-						q.push(std::make_pair(left_child, node.second + 1));
-					if (right_child != NULL)
-						q.push(std::make_pair(right_child, node.second + 1));
-				}
-			}
-			statfile.close();
-			std::ofstream bigstat;
-			bigstat.open(infile + ".txt", std::ios_base::out | std::ios_base::app);
-			bigstat << level << " " << cumsum << std::endl; // write the level count and the cumulative surface
-			bigstat.close();
+		/// Traverses a box hierarchy and exports each level separately
+		void traverseExportBox() {
+			Level root;
+			root.boxes.push_back(0);
+			traverse(std::move(root), "stats_box.txt");
 		}
 	};
 } // namespace bvh
 
-#endif
\ No newline at end of file
+#endif
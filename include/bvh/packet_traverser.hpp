@@ -0,0 +1,331 @@
+#ifndef BVH_PACKET_TRAVERSER_HPP
+#define BVH_PACKET_TRAVERSER_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+
+#include "bvh/bvh.hpp"
+#include "bvh/ray.hpp"
+#include "bvh/node_intersectors.hpp"
+#include "bvh/primitive_intersectors.hpp"
+#include "bvh/utilities.hpp"
+
+namespace bvh {
+
+	/// Traversal algorithm for packets of coherent rays (e.g. primary or shadow rays of neighboring pixels).
+	/// The whole packet goes down the hierarchy together: each node is fetched once and tested against all
+	/// the rays that are still active, and each stack entry records the mask of rays it has to be visited for.
+	/// This works for box, cylinder, and hybrid hierarchies, following the same conventions as `SingleRayTraverser`.
+	template <typename Bvh, size_t PacketSize, typename NodeIntersector = FastNodeIntersector<Bvh>, size_t StackSize = 256>
+	class PacketTraverser {
+		static_assert(PacketSize > 0 && PacketSize <= 32, "Packets are limited to 32 rays");
+
+	public:
+		static constexpr size_t packet_size = PacketSize;
+		static constexpr size_t stack_size = StackSize;
+
+	private:
+		using Scalar = typename Bvh::ScalarType;
+		using Mask = uint32_t;
+
+		static constexpr Mask full_mask = PacketSize == 32 ? Mask(-1) : (Mask(1) << PacketSize) - 1;
+
+		struct Stack {
+			struct Element {
+				size_t index;
+				bool is_cylinder;
+				Mask mask;
+			};
+
+			Element elements[stack_size];
+			size_t size = 0;
+
+			void push(const Element& t) {
+				assert(size < stack_size);
+				elements[size++] = t;
+			}
+
+			Element pop() {
+				assert(!empty());
+				return elements[--size];
+			}
+
+			bool empty() const { return size == 0; }
+		};
+
+		template <typename PrimitiveIntersector>
+		struct Packet {
+			Ray<Scalar> rays[PacketSize];
+			std::optional<typename PrimitiveIntersector::Result> best_hits[PacketSize];
+			Mask finished = 0;
+		};
+
+		/// Calls the given function for each bit set in the mask.
+		template <typename F>
+		bvh__always_inline__
+		static void for_each_ray(Mask mask, F f) {
+			while (mask) {
+				size_t i = count_trailing_zeros(mask);
+				mask &= mask - 1;
+				f(i);
+			}
+		}
+
+		bvh__always_inline__
+		static size_t count_trailing_zeros(Mask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+			return __builtin_ctz(mask);
+#else
+			size_t i = 0;
+			while (!(mask & 1)) {
+				mask >>= 1;
+				i++;
+			}
+			return i;
+#endif
+		}
+
+		template <typename Node, typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+		void intersect_leaf(
+			const Node& node, Mask mask,
+			Packet<PrimitiveIntersector>& packet,
+			PrimitiveIntersector& primitive_intersector,
+			Statistics& statistics) const
+		{
+			assert(node.is_leaf);
+			size_t begin = node.first_child_or_primitive;
+			size_t end = begin + node.primitive_count;
+			for_each_ray(mask, [&] (size_t j) {
+				auto& ray = packet.rays[j];
+				statistics[j].intersections += end - begin;
+				if constexpr (IntersectsLeaves<PrimitiveIntersector>::value) {
+					if (auto hit = primitive_intersector.intersect_leaf(begin, end, ray)) {
+						packet.best_hits[j] = hit;
+						if (primitive_intersector.any_hit)
+							packet.finished |= Mask(1) << j;
+						else
+							ray.tmax = hit->distance();
+					}
+					return;
+				}
+				for (size_t i = begin; i < end; ++i) {
+					if (auto hit = primitive_intersector.intersect(i, ray)) {
+						packet.best_hits[j] = hit;
+						if (primitive_intersector.any_hit) {
+							packet.finished |= Mask(1) << j;
+							break;
+						}
+						ray.tmax = hit->distance();
+					}
+				}
+			});
+		}
+
+		/// Selects the rays of the mask that hit a child, and accumulates their entry distances
+		/// so that the child that is closest for most of the packet is visited first.
+		template <typename Distances>
+		bvh__always_inline__
+		static Mask hit_mask(Mask mask, const Distances& distances, Scalar& entry_sum) {
+			Mask result = 0;
+			entry_sum = 0;
+			for_each_ray(mask, [&] (size_t i) {
+				if (distances[i].first <= distances[i].second) {
+					result |= Mask(1) << i;
+					entry_sum += distances[i].first;
+				}
+			});
+			return result;
+		}
+
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+		void intersect(Packet<PrimitiveIntersector>& packet, Mask active, PrimitiveIntersector& primitive_intersector, bool cyl, bool hybrid, Statistics& statistics) const {
+			std::optional<NodeIntersector> node_intersectors[PacketSize];
+			std::optional<CustomNodeIntersector<Bvh>> cnode_intersectors[PacketSize];
+			for_each_ray(active, [&] (size_t i) {
+				if (!cyl || hybrid)
+					node_intersectors[i].emplace(packet.rays[i]);
+				if (cyl)
+					cnode_intersectors[i].emplace(packet.rays[i]);
+			});
+
+			Stack stack;
+			if (cyl && !hybrid)
+				stack.push(typename Stack::Element { 0, true, active });
+			else if (bvh__unlikely(bvh.nodes[0].is_leaf)) {
+				if (!hybrid) {
+					intersect_leaf(bvh.nodes[0], active, packet, primitive_intersector, statistics);
+					return;
+				}
+				stack.push(typename Stack::Element { bvh.nodes[0].cylinder_root(), true, active });
+			} else
+				stack.push(typename Stack::Element { 0, false, active });
+
+			while (!stack.empty()) {
+				auto element = stack.pop();
+				auto mask = element.mask & ~packet.finished;
+				if (!mask)
+					continue;
+
+				if (element.is_cylinder) {
+					const auto& cnode = bvh.cnodes[element.index];
+					if (cnode.is_leaf) {
+						intersect_leaf(cnode, mask, packet, primitive_intersector, statistics);
+						continue;
+					}
+					for_each_ray(mask, [&] (size_t i) { statistics[i].traversal_steps++; });
+
+					auto first_child = cnode.first_child_or_primitive;
+					const auto* left = &bvh.cnodes[first_child + 0];
+					std::pair<Scalar, Scalar> distances_left[PacketSize], distances_right[PacketSize];
+					for_each_ray(mask, [&] (size_t i) {
+						auto distances = cnode_intersectors[i]->template intersect<2>(left, packet.rays[i]);
+						distances_left[i] = distances[0];
+						distances_right[i] = distances[1];
+					});
+					visit_children(stack, first_child, true, mask, distances_left, distances_right, packet, primitive_intersector, statistics);
+				} else {
+					for_each_ray(mask, [&] (size_t i) { statistics[i].traversal_steps++; });
+
+					auto first_child = bvh.nodes[element.index].first_child_or_primitive;
+					const auto& left = bvh.nodes[first_child + 0];
+					const auto& right = bvh.nodes[first_child + 1];
+					std::pair<Scalar, Scalar> distances_left[PacketSize], distances_right[PacketSize];
+					for_each_ray(mask, [&] (size_t i) {
+						distances_left[i] = node_intersectors[i]->intersect(left, packet.rays[i]);
+						distances_right[i] = node_intersectors[i]->intersect(right, packet.rays[i]);
+					});
+					visit_children(stack, first_child, false, mask, distances_left, distances_right, packet, primitive_intersector, statistics, hybrid);
+				}
+			}
+		}
+
+		/// Processes the leaves among the two children of a node, and pushes the other ones on
+		/// the stack so that the one that is the closest on average is popped first.
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+		void visit_children(
+			Stack& stack, size_t first_child, bool is_cylinder, Mask mask,
+			const std::pair<Scalar, Scalar>* distances_left,
+			const std::pair<Scalar, Scalar>* distances_right,
+			Packet<PrimitiveIntersector>& packet,
+			PrimitiveIntersector& primitive_intersector,
+			Statistics& statistics,
+			bool hybrid = false) const
+		{
+			Scalar entry_left, entry_right;
+			Mask masks[2] = {
+				hit_mask(mask, distances_left, entry_left),
+				hit_mask(mask, distances_right, entry_right)
+			};
+			typename Stack::Element children[2];
+			size_t child_count = 0;
+			for (size_t k = 0; k < 2; ++k) {
+				if (!masks[k])
+					continue;
+				auto index = first_child + k;
+				if (is_cylinder) {
+					if (bvh.cnodes[index].is_leaf)
+						intersect_leaf(bvh.cnodes[index], masks[k], packet, primitive_intersector, statistics);
+					else
+						children[child_count++] = typename Stack::Element { index, true, masks[k] };
+				} else if (bvh.nodes[index].is_leaf) {
+					// Box leaves of hybrid hierarchies are the bounding boxes of cylinder subtrees
+					if (hybrid)
+						children[child_count++] = typename Stack::Element { bvh.nodes[index].cylinder_root(), true, masks[k] };
+					else
+						intersect_leaf(bvh.nodes[index], masks[k], packet, primitive_intersector, statistics);
+				} else
+					children[child_count++] = typename Stack::Element { index, false, masks[k] };
+			}
+
+			// Compare the average entry distances of the rays that hit each child
+			if (child_count == 2 &&
+				entry_left * Scalar(count_bits(masks[1])) < entry_right * Scalar(count_bits(masks[0])))
+				std::swap(children[0], children[1]);
+			for (size_t k = 0; k < child_count; ++k)
+				stack.push(children[k]);
+		}
+
+		bvh__always_inline__
+		static size_t count_bits(Mask mask) {
+			size_t count = 0;
+			for (; mask; mask &= mask - 1)
+				count++;
+			return count;
+		}
+
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+		void traverse_packet(
+			const Ray<Scalar>* rays, size_t ray_count,
+			PrimitiveIntersector& primitive_intersector,
+			std::optional<typename PrimitiveIntersector::Result>* hits,
+			bool cyl, bool hybrid,
+			Statistics& statistics) const
+		{
+			assert(ray_count <= PacketSize);
+			Packet<PrimitiveIntersector> packet;
+			for (size_t i = 0; i < ray_count; ++i)
+				packet.rays[i] = rays[i];
+			Mask active = ray_count == PacketSize ? full_mask : (Mask(1) << ray_count) - 1;
+			intersect(packet, active, primitive_intersector, cyl, hybrid, statistics);
+			for (size_t i = 0; i < ray_count; ++i)
+				hits[i] = packet.best_hits[i];
+		}
+
+		const Bvh& bvh;
+
+	public:
+		/// Statistics collected during traversal, for each ray of the packet.
+		struct Statistics {
+			size_t traversal_steps = 0;
+			size_t intersections = 0;
+		};
+
+		PacketTraverser(const Bvh& bvh)
+			: bvh(bvh)
+		{}
+
+		/// Intersects the BVH with a packet of at most `PacketSize` rays, and writes the closest
+		/// (or any, depending on the primitive intersector) hit of each ray in `hits`.
+		template <typename PrimitiveIntersector>
+		void traverse(
+			const Ray<Scalar>* rays, size_t ray_count,
+			PrimitiveIntersector& primitive_intersector,
+			std::optional<typename PrimitiveIntersector::Result>* hits,
+			bool cyl, bool hybrid) const
+		{
+			struct Empty {
+				struct Counter {
+					Counter& operator ++ (int) { return *this; }
+					Counter& operator ++ () { return *this; }
+					Counter& operator += (size_t) { return *this; }
+				} traversal_steps, intersections;
+			};
+			struct {
+				Empty empty;
+				Empty& operator [] (size_t) { return empty; }
+			} statistics;
+			traverse_packet(rays, ray_count, primitive_intersector, hits, cyl, hybrid, statistics);
+		}
+
+		/// Intersects the BVH with a packet of rays, and records statistics on the number of
+		/// traversal and intersection steps of each ray in the array `statistics`.
+		template <typename PrimitiveIntersector>
+		void traverse(
+			const Ray<Scalar>* rays, size_t ray_count,
+			PrimitiveIntersector& primitive_intersector,
+			std::optional<typename PrimitiveIntersector::Result>* hits,
+			bool cyl, bool hybrid,
+			Statistics* statistics) const
+		{
+			traverse_packet(rays, ray_count, primitive_intersector, hits, cyl, hybrid, statistics);
+		}
+	};
+
+} // namespace bvh
+
+#endif
@@ -12,24 +12,34 @@ namespace bvh {
 /// Optimization that tries to re-insert BVH nodes in such a way that the
 /// SAH cost of the tree decreases after the re-insertion. Inspired from the
 /// article "Parallel Reinsertion for Bounding Volume Hierarchy Optimization",
-/// by D. Meister and J. Bittner.
-template <typename Bvh>
+/// by D. Meister and J. Bittner. The search only relies on the areas of the bounding volumes,
+/// hence cylinder hierarchies are optimized in the same way, with `CylinderNodes` as the node set.
+/// For hybrid hierarchies, the box levels are optimized, and the cylinder subtrees move along with
+/// the box leaves that refer to them.
+template <typename Bvh, typename NodeSet = BoxNodes<Bvh>>
 class ParallelReinsertionOptimizer :
-    public SahBasedAlgorithm<Bvh>,
-    protected HierarchyRefitter<Bvh>
+    public SahBasedAlgorithm<Bvh, NodeSet>,
+    protected HierarchyRefitter<Bvh, NodeSet>
 {
-    using Scalar    = typename Bvh::ScalarType;
-    using Insertion = std::pair<size_t, Scalar>;
-
-    using SahBasedAlgorithm<Bvh>::compute_cost;
-    using HierarchyRefitter<Bvh>::bvh;
-    using HierarchyRefitter<Bvh>::parents;
-    using HierarchyRefitter<Bvh>::refit_in_parallel;
+    using Scalar         = typename Bvh::ScalarType;
+    using BoundingVolume = typename NodeSet::BoundingVolume;
+    using Insertion      = std::pair<size_t, Scalar>;
+    using Node           = typename NodeSet::Node;
+
+    using SahBasedAlgorithm<Bvh, NodeSet>::compute_cost;
+    using HierarchyRefitter<Bvh, NodeSet>::bvh;
+    using HierarchyRefitter<Bvh, NodeSet>::nodes;
+    using HierarchyRefitter<Bvh, NodeSet>::node_count;
+    using HierarchyRefitter<Bvh, NodeSet>::parents;
+    using HierarchyRefitter<Bvh, NodeSet>::refit_in_parallel;
 
 public:
     ParallelReinsertionOptimizer(Bvh& bvh)
-        : HierarchyRefitter<Bvh>(bvh)
-    {}
+        : HierarchyRefitter<Bvh, NodeSet>(bvh)
+    {
+        // The cylinder nodes of hybrid hierarchies form a forest, which is not supported
+        assert(!this->is_forest());
+    }
 
 private:
     std::array<size_t, 6> get_conflicts(size_t in, size_t out) {
@@ -48,15 +58,18 @@ private:
     void reinsert(size_t in, size_t out) {
         auto sibling_in   = bvh.sibling(in);
         auto parent_in    = parents[in];
-        auto sibling_node = bvh.nodes[sibling_in];
-        auto out_node     = bvh.nodes[out];
+        auto sibling_node = nodes()[sibling_in];
+        auto out_node     = nodes()[out];
 
         // Re-insert it into the destination
-        bvh.nodes[out].bounding_box_proxy().extend(bvh.nodes[in].bounding_box_proxy());
-        bvh.nodes[out].first_child_or_primitive = std::min(in, sibling_in);
-        bvh.nodes[out].is_leaf = false;
-        bvh.nodes[sibling_in] = out_node;
-        bvh.nodes[parent_in] = sibling_node;
+        nodes()[out].bounding_box_proxy() = out_node
+            .bounding_box_proxy()
+            .to_bounding_box()
+            .extend(nodes()[in].bounding_box_proxy());
+        nodes()[out].first_child_or_primitive = std::min(in, sibling_in);
+        nodes()[out].is_leaf = false;
+        nodes()[sibling_in] = out_node;
+        nodes()[parent_in] = sibling_node;
 
         // Update parent-child indices
         if (!out_node.is_leaf) {
@@ -77,9 +90,10 @@ private:
         size_t out   = bvh.sibling(in);
         size_t out_best = out;
 
-        auto bbox_in = bvh.nodes[in].bounding_box_proxy();
-        auto bbox_parent = bvh.nodes[pivot].bounding_box_proxy();
-        auto bbox_pivot = BoundingBox<Scalar>::empty();
+        BoundingVolume bbox_in = nodes()[in].bounding_box_proxy();
+        BoundingVolume bbox_parent = nodes()[pivot].bounding_box_proxy();
+        BoundingVolume bbox_pivot;
+        bool has_pivot = false;
 
         Scalar d = 0;
         Scalar d_best = 0;
@@ -87,8 +101,8 @@ private:
 
         // Perform a search to find a re-insertion position for the given node
         while (true) {
-            auto bbox_out = bvh.nodes[out].bounding_box_proxy().to_bounding_box();
-            auto bbox_merged = BoundingBox<Scalar>(bbox_in).extend(bbox_out);
+            BoundingVolume bbox_out = nodes()[out].bounding_box_proxy();
+            auto bbox_merged = BoundingVolume(bbox_in).extend(bbox_out);
             if (down) {
                 auto d_direct = bbox_parent.half_area() - bbox_merged.half_area();
                 if (d_best < d_direct + d) {
@@ -96,18 +110,20 @@ private:
                     out_best = out;
                 }
                 d = d + bbox_out.half_area() - bbox_merged.half_area();
-                if (bvh.nodes[out].is_leaf || d_bound + d <= d_best)
+                if (nodes()[out].is_leaf || d_bound + d <= d_best)
                     down = false;
                 else
-                    out = bvh.nodes[out].first_child_or_primitive;
+                    out = nodes()[out].first_child_or_primitive;
             } else {
                 d = d - bbox_out.half_area() + bbox_merged.half_area();
                 if (pivot == parents[out]) {
-                    bbox_pivot.extend(bbox_out);
+                    // There is no empty cylinder, hence the first volume initializes the union
+                    bbox_pivot = has_pivot ? bbox_pivot.extend(bbox_out) : bbox_out;
+                    has_pivot = true;
                     out = pivot;
-                    bbox_out = bvh.nodes[out].bounding_box_proxy();
+                    bbox_out = nodes()[out].bounding_box_proxy();
                     if (out != parents[in]) {
-                        bbox_merged = BoundingBox<Scalar>(bbox_in).extend(bbox_pivot);
+                        bbox_merged = BoundingVolume(bbox_in).extend(bbox_pivot);
                         auto d_direct = bbox_parent.half_area() - bbox_merged.half_area();
                         if (d_best < d_direct + d) {
                             d_best = d_direct + d;
@@ -138,8 +154,18 @@ private:
 
 public:
     void optimize(size_t u = 9, Scalar threshold = 0.1) {
-        auto locks = std::make_unique<std::atomic<uint64_t>[]>(bvh.node_count);
-        auto outs  = std::make_unique<Insertion[]>(bvh.node_count);
+        auto node_count = this->node_count();
+        auto locks = std::make_unique<std::atomic<uint64_t>[]>(node_count);
+        auto outs  = std::make_unique<Insertion[]>(node_count);
+
+        // The union of two cylinders does not always grow with its operands, so the estimated
+        // gains can be wrong: iterations that increase the cost are undone using a backup.
+        BvhArray<Node> nodes_backup;
+        std::unique_ptr<size_t[]> parents_backup;
+        if (NodeSet::is_cylinder) {
+            nodes_backup   = std::make_unique<Node[]>(node_count);
+            parents_backup = std::make_unique<size_t[]>(node_count);
+        }
 
         auto old_cost = compute_cost(bvh);
         for (size_t iteration = 0; ; ++iteration) {
@@ -147,19 +173,27 @@ public:
 
             #pragma omp parallel
             {
+                if (NodeSet::is_cylinder) {
+                    #pragma omp for
+                    for (size_t i = 0; i < node_count; i++) {
+                        nodes_backup[i] = nodes()[i];
+                        parents_backup[i] = parents[i];
+                    }
+                }
+
                 // Clear the locks
                 #pragma omp for nowait
-                for (size_t i = 0; i < bvh.node_count; i++)
+                for (size_t i = 0; i < node_count; i++)
                     locks[i] = 0;
 
                 // Search for insertion candidates
                 #pragma omp for
-                for (size_t i = first_node; i < bvh.node_count; i += u)
+                for (size_t i = first_node; i < node_count; i += u)
                     outs[i] = search(i);
 
                 // Resolve topological conflicts with locking
                 #pragma omp for
-                for (size_t i = first_node; i < bvh.node_count; i += u) {
+                for (size_t i = first_node; i < node_count; i += u) {
                     if (outs[i].second <= 0)
                         continue;
                     // Encode locks into 64 bits using the highest 32 bits for the cost and the
@@ -173,7 +207,7 @@ public:
 
                 // Check the locks to disable conflicting re-insertions
                 #pragma omp for
-                for (size_t i = first_node; i < bvh.node_count; i += u) {
+                for (size_t i = first_node; i < node_count; i += u) {
                     if (outs[i].second <= 0)
                         continue;
                     auto conflicts = get_conflicts(i, outs[i].first);
@@ -187,19 +221,24 @@ public:
 
                 // Perform the reinsertions
                 #pragma omp for
-                for (size_t i = first_node; i < bvh.node_count; i += u) {
+                for (size_t i = first_node; i < node_count; i += u) {
                     if (outs[i].second > 0)
                         reinsert(i, outs[i].first);
                 }
 
                 // Update the bounding boxes of each node in the tree
-                refit_in_parallel([] (typename Bvh::Node&) {});
+                refit_in_parallel([] (typename NodeSet::Node&) {});
             }
 
             // Compare the old SAH cost to the new one and decrease the number
             // of nodes that are ignored during the optimization if the change
             // in cost is below the threshold.
             auto new_cost = compute_cost(bvh);
+            if (NodeSet::is_cylinder && new_cost > old_cost) {
+                std::swap(nodes(), nodes_backup);
+                std::swap(parents, parents_backup);
+                new_cost = old_cost;
+            }
             if (std::abs(new_cost - old_cost) <= threshold || iteration >= u) {
                 if (u <= 1)
                     break;
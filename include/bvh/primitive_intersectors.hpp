@@ -2,11 +2,22 @@
 #define BVH_PRIMITIVE_INTERSECTORS_HPP
 
 #include <optional>
+#include <type_traits>
 
 #include "bvh/ray.hpp"
 
 namespace bvh {
 
+/// Detects the intersectors that can test all the primitives of a leaf at once, with a member function
+/// `std::optional<Result> intersect_leaf(size_t begin, size_t end, const Ray&) const`, which returns the
+/// closest (or any) hit among the primitives `[begin, end)`. Otherwise, the traversal algorithms call
+/// `intersect()` for each primitive of the leaf.
+template <typename PrimitiveIntersector, typename = void>
+struct IntersectsLeaves : std::false_type {};
+
+template <typename PrimitiveIntersector>
+struct IntersectsLeaves<PrimitiveIntersector, std::void_t<decltype(&PrimitiveIntersector::intersect_leaf)>> : std::true_type {};
+
 /// Base class for primitive intersectors.
 template <typename Bvh, typename Primitive, bool PreShuffled, bool AnyHit>
 struct PrimitiveIntersector {
@@ -0,0 +1,244 @@
+#ifndef BVH_PROXIMITY_TRAVERSER_HPP
+#define BVH_PROXIMITY_TRAVERSER_HPP
+
+#include <optional>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+
+#include "bvh/bvh.hpp"
+#include "bvh/vector.hpp"
+#include "bvh/bounding_box.hpp"
+#include "bvh/utilities.hpp"
+
+namespace bvh {
+
+	/// Proximity queries on box, cylinder and hybrid BVHs: closest primitive to a point or a segment,
+	/// and all the primitives within a given distance of it (e.g. for collisions between strands of
+	/// hair, where the leaves contain capsules). Nodes are culled with lower bounds of their distance
+	/// to the query, which are tight for cylinders around oblong primitives, and visited closest first.
+	/// The distance to a primitive is given by a function `distance(i, query)`, where `i` is the index
+	/// of the primitive in the original array, since this traverser does not know the primitive type.
+	template <typename Bvh, size_t StackSize = 256>
+	class ProximityTraverser {
+	public:
+		static constexpr size_t stack_size = StackSize;
+
+	private:
+		using Scalar = typename Bvh::ScalarType;
+
+		struct Stack {
+			struct Element {
+				bool cylinder;
+				size_t index;
+				Scalar distance;
+			};
+
+			Element elements[stack_size];
+			size_t size = 0;
+
+			void push(const Element& t) {
+				assert(size < stack_size);
+				elements[size++] = t;
+			}
+
+			Element pop() {
+				assert(!empty());
+				return elements[--size];
+			}
+
+			bool empty() const { return size == 0; }
+		};
+
+	public:
+		/// Query of a proximity search: a segment, or a point when both ends are equal.
+		struct Segment {
+			Vector3<Scalar> p0, p1;
+
+			Segment() = default;
+			Segment(const Vector3<Scalar>& point)
+				: p0(point), p1(point)
+			{}
+			Segment(const Vector3<Scalar>& p0, const Vector3<Scalar>& p1)
+				: p0(p0), p1(p1)
+			{}
+		};
+
+		struct Result {
+			size_t primitive_index;
+			Scalar distance;
+		};
+
+	private:
+		const Bvh& bvh;
+
+		/// Lower bound of the distance between a box and the query: the gap between the box and
+		/// the bounding box of the segment, or the distance to the middle of the segment minus its
+		/// half length, whichever is larger. Both are exact for points.
+		static Scalar distance_bound(const typename Bvh::Node& node, const Segment& query) {
+			auto middle = (query.p0 + query.p1) * Scalar(0.5);
+			Scalar gap2 = 0, middle2 = 0;
+			for (int i = 0; i < 3; ++i) {
+				auto min = node.bounds[2 * i], max = node.bounds[2 * i + 1];
+				auto gap = std::max({ min - std::max(query.p0[i], query.p1[i]), std::min(query.p0[i], query.p1[i]) - max, Scalar(0) });
+				auto offset = std::max({ min - middle[i], middle[i] - max, Scalar(0) });
+				gap2 += gap * gap;
+				middle2 += offset * offset;
+			}
+			return std::max(std::sqrt(gap2), std::sqrt(middle2) - length(query.p1 - query.p0) * Scalar(0.5));
+		}
+
+		/// Lower bound of the distance between a cylinder and the query: the distance to the capsule
+		/// around the axis of the cylinder, which contains it, or the distance from the cylinder to
+		/// the middle of the segment minus its half length, whichever is larger.
+		static Scalar distance_bound(const typename Bvh::CustomNode& node, const Segment& query) {
+			BoundingCyl<Scalar> cyl = node.bounding_box_proxy();
+			auto middle = (query.p0 + query.p1) * Scalar(0.5);
+			auto y = dot(middle - cyl.c, cyl.axis);
+			auto radial = length(middle - (cyl.c + cyl.axis * y));
+			auto axial_offset = std::max({ -y, y - cyl.h, Scalar(0) });
+			auto radial_offset = std::max(radial - cyl.r, Scalar(0));
+			auto middle_distance = std::sqrt(axial_offset * axial_offset + radial_offset * radial_offset);
+			auto capsule_distance = segment_distance(cyl.c, cyl.c + cyl.axis * cyl.h, query.p0, query.p1) - cyl.r;
+			return std::max({
+				capsule_distance,
+				middle_distance - length(query.p1 - query.p0) * Scalar(0.5),
+				Scalar(0) });
+		}
+
+		/// Visits the leaves whose lower bound does not exceed `limit`, closest first, and calls
+		/// `visit_primitive(i)` on each of their primitives. That function may decrease `limit`.
+		template <typename F>
+		void traverse(const Segment& query, Scalar& limit, F visit_primitive, bool cyl, bool hybrid) const {
+			auto visit_leaf = [&] (size_t first, size_t count) {
+				for (size_t i = first; i < first + count; ++i)
+					visit_primitive(bvh.primitive_indices[i]);
+			};
+
+			// Pushes the farthest child first, so that the closest child is visited next
+			auto push_children = [&] (Stack& stack, bool cylinder, size_t first_child, Scalar left, Scalar right) {
+				bool closest_first = left <= right;
+				if (right <= limit && closest_first)
+					stack.push(typename Stack::Element { cylinder, first_child + 1, right });
+				if (left <= limit)
+					stack.push(typename Stack::Element { cylinder, first_child, left });
+				if (right <= limit && !closest_first)
+					stack.push(typename Stack::Element { cylinder, first_child + 1, right });
+			};
+
+			Stack stack;
+			bool cylinder_root = cyl && !hybrid;
+			stack.push(typename Stack::Element {
+				cylinder_root, 0,
+				cylinder_root ? distance_bound(bvh.cnodes[0], query) : distance_bound(bvh.nodes[0], query) });
+			while (!stack.empty()) {
+				auto element = stack.pop();
+				if (element.distance > limit)
+					continue;
+
+				if (element.cylinder) {
+					const auto& node = bvh.cnodes[element.index];
+					if (node.is_leaf) {
+						visit_leaf(node.first_child_or_primitive, node.primitive_count);
+						continue;
+					}
+					auto first_child = node.first_child_or_primitive;
+					push_children(stack, true, first_child,
+						distance_bound(bvh.cnodes[first_child + 0], query),
+						distance_bound(bvh.cnodes[first_child + 1], query));
+				} else {
+					const auto& node = bvh.nodes[element.index];
+					if (node.is_leaf) {
+						if (hybrid) {
+							// The cylinder subtree is contained in the box, hence its bound cannot be smaller
+							auto root = node.cylinder_root();
+							auto distance = std::max(distance_bound(bvh.cnodes[root], query), element.distance);
+							if (distance <= limit)
+								stack.push(typename Stack::Element { true, root, distance });
+						} else
+							visit_leaf(node.first_child_or_primitive, node.primitive_count);
+						continue;
+					}
+					auto first_child = node.first_child_or_primitive;
+					push_children(stack, false, first_child,
+						distance_bound(bvh.nodes[first_child + 0], query),
+						distance_bound(bvh.nodes[first_child + 1], query));
+				}
+			}
+		}
+
+	public:
+		ProximityTraverser(const Bvh& bvh)
+			: bvh(bvh)
+		{}
+
+		/// Returns the closest primitive to the query, if there is one within `max_distance`.
+		/// The function `distance(i, query)` returns the distance between the primitive `i` and the query.
+		template <typename PrimitiveDistance>
+		std::optional<Result> closest(
+			const Segment& query,
+			PrimitiveDistance&& distance,
+			bool cyl, bool hybrid,
+			Scalar max_distance = std::numeric_limits<Scalar>::max()) const
+		{
+			std::optional<Result> best;
+			auto limit = max_distance;
+			traverse(query, limit, [&] (size_t i) {
+				auto d = distance(i, query);
+				if (d <= limit && (!best || d < best->distance)) {
+					best = std::make_optional(Result { i, d });
+					limit = d;
+				}
+			}, cyl, hybrid);
+			return best;
+		}
+
+		/// Calls `visitor(result)` for every primitive that is within `radius` of the query, in no particular order.
+		template <typename PrimitiveDistance, typename Visitor>
+		void within(
+			const Segment& query, Scalar radius,
+			PrimitiveDistance&& distance,
+			Visitor&& visitor,
+			bool cyl, bool hybrid) const
+		{
+			auto limit = radius;
+			traverse(query, limit, [&] (size_t i) {
+				auto d = distance(i, query);
+				if (d <= radius)
+					visitor(Result { i, d });
+			}, cyl, hybrid);
+		}
+
+		/// Runs `closest()` on the given queries in parallel, and writes the result of each query in `results`.
+		template <typename PrimitiveDistance>
+		void closest_batch(
+			const Segment* queries, size_t query_count,
+			PrimitiveDistance&& distance,
+			std::optional<Result>* results,
+			bool cyl, bool hybrid,
+			Scalar max_distance = std::numeric_limits<Scalar>::max()) const
+		{
+#pragma omp parallel for schedule(dynamic, 64)
+			for (size_t i = 0; i < query_count; ++i)
+				results[i] = closest(queries[i], distance, cyl, hybrid, max_distance);
+		}
+
+		/// Runs `within()` on the given queries in parallel, and calls `visitor(j, result)` for every primitive
+		/// within `radius` of the query `j`. The visitor is called concurrently by several threads.
+		template <typename PrimitiveDistance, typename Visitor>
+		void within_batch(
+			const Segment* queries, size_t query_count, Scalar radius,
+			PrimitiveDistance&& distance,
+			Visitor&& visitor,
+			bool cyl, bool hybrid) const
+		{
+#pragma omp parallel for schedule(dynamic, 64)
+			for (size_t i = 0; i < query_count; ++i)
+				within(queries[i], radius, distance, [&] (const Result& result) { visitor(i, result); }, cyl, hybrid);
+		}
+	};
+
+} // namespace bvh
+
+#endif
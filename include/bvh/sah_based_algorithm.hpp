@@ -1,11 +1,17 @@
 #ifndef BVH_SAH_BASED_ALGORITHM_HPP
 #define BVH_SAH_BASED_ALGORITHM_HPP
 
+#include <vector>
+
 #include "bvh/bvh.hpp"
+#include "bvh/node_set.hpp"
 
 namespace bvh {
 
-template <typename Bvh>
+/// Base class for algorithms that rely on the SAH. The cost model handles box, cylinder, and
+/// hybrid hierarchies: the `NodeSet` parameter selects the nodes that the algorithm works on,
+/// while the cost is always computed for the whole hierarchy.
+template <typename Bvh, typename NodeSet = BoxNodes<Bvh>>
 class SahBasedAlgorithm {
     using Scalar = typename Bvh::ScalarType;
 
@@ -15,18 +21,68 @@ public:
     /// which is assumed to be equal to 1.
     Scalar traversal_cost = 1;
 
+    /// Cost of intersecting a ray with a cylinder node, relative to the cost of
+    /// intersecting a primitive. Ray-cylinder tests are much more expensive than slab tests.
+    Scalar cylinder_traversal_cost = 4;
+
 protected:
     ~SahBasedAlgorithm() {}
 
+    /// Cost of intersecting a ray with a node of the set that the algorithm works on.
+    Scalar node_traversal_cost() const {
+        return NodeSet::is_cylinder ? cylinder_traversal_cost : traversal_cost;
+    }
+
+    /// Cost of visiting a cylinder node, that is, of intersecting its children (or its primitives).
+    template <typename CylinderNode>
+    Scalar cylinder_visit_cost(const CylinderNode& node) const {
+        return node.is_leaf ? Scalar(node.primitive_count) : cylinder_traversal_cost;
+    }
+
+    /// Computes the SAH cost of the cylinder subtree rooted at the given node, excluding
+    /// the contribution of the root, since its volume is never tested in hybrid hierarchies.
+    Scalar compute_subtree_cost(const Bvh& bvh, size_t root) const {
+        Scalar cost(0);
+        std::vector<size_t> stack;
+        if (!bvh.cnodes[root].is_leaf)
+            stack.push_back(root);
+        while (!stack.empty()) {
+            const auto& node = bvh.cnodes[stack.back()];
+            stack.pop_back();
+            for (size_t i = 0; i < 2; ++i) {
+                auto child = node.first_child_or_primitive + i;
+                cost += bvh.cnodes[child].bounding_box_proxy().half_area() * cylinder_visit_cost(bvh.cnodes[child]);
+                if (!bvh.cnodes[child].is_leaf)
+                    stack.push_back(child);
+            }
+        }
+        return cost;
+    }
+
     Scalar compute_cost(const Bvh& bvh) const {
         // Compute the SAH cost for the entire BVH
         Scalar cost(0);
+        if (bvh.cylinder && !bvh.hybrid) {
+            #pragma omp parallel for reduction(+: cost)
+            for (size_t i = 0; i < bvh.cnode_count; ++i)
+                cost += bvh.cnodes[i].bounding_box_proxy().half_area() * cylinder_visit_cost(bvh.cnodes[i]);
+            return cost / bvh.cnodes[0].bounding_box_proxy().half_area();
+        }
+
         #pragma omp parallel for reduction(+: cost)
         for (size_t i = 0; i < bvh.node_count; ++i) {
-            if (bvh.nodes[i].is_leaf)
-                cost += bvh.nodes[i].bounding_box_proxy().half_area() * bvh.nodes[i].primitive_count;
-            else
-                cost += traversal_cost * bvh.nodes[i].bounding_box_proxy().half_area();
+            const auto& node = bvh.nodes[i];
+            if (!node.is_leaf)
+                cost += traversal_cost * node.bounding_box_proxy().half_area();
+            else if (!bvh.hybrid)
+                cost += node.bounding_box_proxy().half_area() * node.primitive_count;
+            else {
+                // The leaves of hybrid hierarchies are the transition to cylinders:
+                // hitting the box leads to the children of the root of a cylinder subtree.
+                const auto& root = bvh.cnodes[node.cylinder_root()];
+                cost += node.bounding_box_proxy().half_area() * cylinder_visit_cost(root);
+                cost += compute_subtree_cost(bvh, node.cylinder_root());
+            }
         }
         return cost / bvh.nodes[0].bounding_box_proxy().half_area();
     }
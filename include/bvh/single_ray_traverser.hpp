@@ -2,11 +2,14 @@
 #define BVH_SINGLE_RAY_TRAVERSAL_HPP
 
 #include <cassert>
+#include <utility>
 
 #include "bvh/bvh.hpp"
 #include "bvh/ray.hpp"
 #include "bvh/node_intersectors.hpp"
+#include "bvh/primitive_intersectors.hpp"
 #include "bvh/utilities.hpp"
+#include "bvh/traversal_statistics.hpp"
 
 namespace bvh {
 
@@ -19,8 +22,9 @@ namespace bvh {
 	private:
 		using Scalar = typename Bvh::ScalarType;
 
+		template <typename T>
 		struct Stack {
-			using Element = const typename Bvh::Node*;
+			using Element = T;
 
 			Element elements[stack_size];
 			size_t size = 0;
@@ -36,27 +40,28 @@ namespace bvh {
 			}
 
 			bool empty() const { return size == 0; }
-		};
-
-		struct StackC {
-			using Element = const typename Bvh::CustomNode*;
-
-			Element elements[stack_size];
-			size_t size = 0;
 
-			void push(const Element& t) {
-				assert(size < stack_size);
-				elements[size++] = t;
-			}
-
-			Element pop() {
-				assert(!empty());
-				return elements[--size];
+			/// For stacks of nodes paired with their entry distance: pops elements until one of them
+			/// is not beyond the end of the ray, which may have been shortened since it was pushed,
+			/// without going below the given size. Returns false if there is no such element.
+			template <typename Node>
+			bool pop_within(Scalar tmax, Node& node, size_t base = 0) {
+				while (size > base) {
+					const auto& element = elements[--size];
+					if (element.second <= tmax) {
+						node = element.first;
+						return true;
+					}
+				}
+				return false;
 			}
-
-			bool empty() const { return size == 0; }
 		};
 
+		using NodeStack = Stack<const typename Bvh::Node*>;
+		using IndexStack = Stack<size_t>;
+		using CylinderDistanceStack = Stack<std::pair<const typename Bvh::CustomNode*, Scalar>>;
+		using DistanceStack = Stack<std::pair<size_t, Scalar>>;
+
 		/// New leaf intersector variant
 		template <typename PrimitiveIntersector, typename Statistics>
 		bvh__always_inline__
@@ -71,6 +76,17 @@ namespace bvh {
 			size_t begin = node.first_child_or_primitive;
 			size_t end = begin + node.primitive_count;
 			statistics.intersections += end - begin;
+			if constexpr (IntersectsLeaves<PrimitiveIntersector>::value) {
+				if (auto hit = primitive_intersector.intersect_leaf(begin, end, ray)) {
+					best_hit = hit;
+					if (!primitive_intersector.any_hit)
+						ray.tmax = hit->distance();
+					statistics.missed_intersections += end - begin - 1;
+				}
+				else
+					statistics.missed_intersections += end - begin;
+				return best_hit;
+			}
 			for (size_t i = begin; i < end; ++i) {
 				if (auto hit = primitive_intersector.intersect(i, ray)) {
 					best_hit = hit;
@@ -78,6 +94,8 @@ namespace bvh {
 						return best_hit;
 					ray.tmax = hit->distance();
 				}
+				else
+					statistics.missed_intersections++;
 			}
 			return best_hit;
 		}
@@ -95,6 +113,17 @@ namespace bvh {
 			size_t begin = node.first_child_or_primitive;
 			size_t end = begin + node.primitive_count;
 			statistics.intersections += end - begin;
+			if constexpr (IntersectsLeaves<PrimitiveIntersector>::value) {
+				if (auto hit = primitive_intersector.intersect_leaf(begin, end, ray)) {
+					best_hit = hit;
+					if (!primitive_intersector.any_hit)
+						ray.tmax = hit->distance();
+					statistics.missed_intersections += end - begin - 1;
+				}
+				else
+					statistics.missed_intersections += end - begin;
+				return best_hit;
+			}
 			for (size_t i = begin; i < end; ++i) {
 				if (auto hit = primitive_intersector.intersect(i, ray)) {
 					best_hit = hit;
@@ -102,6 +131,8 @@ namespace bvh {
 						return best_hit;
 					ray.tmax = hit->distance();
 				}
+				else
+					statistics.missed_intersections++;
 			}
 			return best_hit;
 		}
@@ -122,7 +153,7 @@ namespace bvh {
 			// This traversal loop is eager, because it immediately processes leaves instead of pushing them on the stack.
 			// This is generally beneficial for performance because intersections will likely be found which will
 			// allow to cull more subtrees with the ray-box test of the traversal loop.
-			StackC stack;
+			CylinderDistanceStack stack;
 			const auto* node = bvh.cnodes.get();
 			while (true) {
 				statistics.traversal_steps++;
@@ -130,8 +161,10 @@ namespace bvh {
 				auto first_child = node->first_child_or_primitive;
 				const auto* left_child = &bvh.cnodes[first_child + 0];
 				const auto* right_child = &bvh.cnodes[first_child + 1];
-				auto distance_left = node_intersector.intersect(*left_child, ray);
-				auto distance_right = node_intersector.intersect(*right_child, ray);
+				// Both siblings are tested at once, since they are contiguous in memory
+				auto [distance_left, distance_right] = node_intersector.template intersect<2>(left_child, ray);
+				statistics.record_cylinder_tests(2,
+					(distance_left.first <= distance_left.second) + (distance_right.first <= distance_right.second));
 
 				if (distance_left.first <= distance_left.second) {
 					if (bvh__unlikely(left_child->is_leaf)) {
@@ -139,6 +172,8 @@ namespace bvh {
 							primitive_intersector.any_hit)
 							break;
 						left_child = nullptr;
+						// The hit may be closer than the right child
+						distance_right.second = std::min(distance_right.second, ray.tmax);
 					}
 				}
 				else
@@ -159,156 +194,160 @@ namespace bvh {
 					node = left_child != NULL ? left_child : right_child;
 				}
 				else if (bvh__unlikely((left_child != NULL) & (right_child != NULL))) {
-					if (distance_left.first > distance_right.first)
+					if (distance_left.first > distance_right.first) {
 						std::swap(left_child, right_child);
-					stack.push(right_child);
+						std::swap(distance_left, distance_right);
+					}
+					stack.push(std::make_pair(right_child, distance_right.first));
+					record_max(statistics.max_stack_depth, stack.size);
 					node = left_child;
 				}
-				else {
-					if (stack.empty())
-						break;
-					node = stack.pop();
-				}
+				else if (!stack.pop_within(ray.tmax, node))
+					break;
 			}
 
 			return best_hit;
 		}
 
+		/// Traverses the cylinder subtree rooted at the given node, for the hybrid traversal. The stack is
+		/// shared with the box levels: entries are only popped until it is back to the size it had on entry.
+		/// Returns true if an any-hit query has found an intersection and the traversal can stop.
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+			bool intersect_cylinder_subtree(
+				size_t root,
+				DistanceStack& stack,
+				const CustomNodeIntersector<Bvh>& cnode_intersector,
+				Ray<Scalar>& ray,
+				std::optional<typename PrimitiveIntersector::Result>& best_hit,
+				PrimitiveIntersector& primitive_intersector,
+				Statistics& statistics) const
+		{
+			statistics.transitions++;
+
+			// if cylinder is a leaf
+			if (bvh.cnodes[root].is_leaf) {
+				return
+					intersect_leaf(bvh.cnodes[root], ray, best_hit, primitive_intersector, statistics) &&
+					primitive_intersector.any_hit;
+			}
+
+			auto base = stack.size;
+			auto cnode = root;
+			while (true) {
+				statistics.traversal_steps++;
+				auto left = bvh.cnodes[cnode].first_child_or_primitive;
+				auto right = left + 1;
+				auto [distance_left, distance_right] = cnode_intersector.template intersect<2>(&bvh.cnodes[left], ray);
+				bool hit_left = distance_left.first <= distance_left.second;
+				bool hit_right = distance_right.first <= distance_right.second;
+				statistics.record_cylinder_tests(2, hit_left + hit_right);
+
+				if (hit_left && bvh__unlikely(bvh.cnodes[left].is_leaf)) {
+					if (intersect_leaf(bvh.cnodes[left], ray, best_hit, primitive_intersector, statistics) &&
+						primitive_intersector.any_hit)
+						return true;
+					hit_left = false;
+					// The hit may be closer than the right child
+					hit_right = hit_right && distance_right.first <= ray.tmax;
+				}
+
+				if (hit_right && bvh__unlikely(bvh.cnodes[right].is_leaf)) {
+					if (intersect_leaf(bvh.cnodes[right], ray, best_hit, primitive_intersector, statistics) &&
+						primitive_intersector.any_hit)
+						return true;
+					hit_right = false;
+				}
+
+				if (bvh__likely(hit_left ^ hit_right)) {
+					cnode = hit_left ? left : right;
+				}
+				else if (bvh__unlikely(hit_left & hit_right)) {
+					if (distance_left.first > distance_right.first) {
+						std::swap(left, right);
+						std::swap(distance_left, distance_right);
+					}
+					stack.push(std::make_pair(right, distance_right.first));
+					record_max(statistics.max_stack_depth, stack.size);
+					cnode = left;
+				}
+				else if (!stack.pop_within(ray.tmax, cnode, base))
+					return false;
+			}
+		}
+
+		/// Hybrid traversal: box levels on top, whose leaves contain the roots of cylinder subtrees.
+		/// Both kinds of nodes are referred to by their index, and share the same stack.
 		template <typename PrimitiveIntersector, typename Statistics>
 		bvh__always_inline__
 			std::optional<typename PrimitiveIntersector::Result>
 			intersectH(Ray<Scalar> ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
 			auto best_hit = std::optional<typename PrimitiveIntersector::Result>(std::nullopt);
 
-			// If the root is a leaf, intersect it and return
-			if (bvh__unlikely(bvh.nodes[0].is_leaf))
-				return intersect_leaf(bvh.nodes[0], ray, best_hit, primitive_intersector, statistics);
-
+			// A box leaf at the root is handled by the loop below, since it bounds the cylinder hierarchy
 			NodeIntersector node_intersector(ray);
 			bvh::CustomNodeIntersector<Bvh> cnode_intersector(ray);
 
-			Stack stack;
-			StackC stackc; // second stack for cylinder nodes
-			const auto* node = bvh.nodes.get();
-			const auto* cnode = bvh.cnodes.get();
+			DistanceStack stack;
+			size_t node = 0;
 			while (true) {
 				statistics.traversal_steps++;
 
-				if (node->is_leaf) {
-					cnode = &bvh.cnodes[node->origin];
-
-					// if cylinder is a leaf
-					if (cnode->is_leaf) {
-						if (intersect_leaf(*cnode, ray, best_hit, primitive_intersector, statistics) &&
-							primitive_intersector.any_hit)
-							if (stack.empty())
-								break;
-						node = stack.pop();
-						continue;
-					}
-
-					while (true) {
-						statistics.traversal_steps++;
-						auto first_child = cnode->first_child_or_primitive;
-						const auto* left = &bvh.cnodes[first_child + 0];
-						const auto* right = &bvh.cnodes[first_child + 1];
-						auto distance_left = cnode_intersector.intersect(*left, ray);
-						auto distance_right = cnode_intersector.intersect(*right, ray);
-
-						if (distance_left.first <= distance_left.second) {
-							if (bvh__unlikely(left->is_leaf)) {
-								if (intersect_leaf(*left, ray, best_hit, primitive_intersector, statistics) &&
-									primitive_intersector.any_hit)
-									break;
-								left = nullptr;
-							}
-						}
-						else
-							left = nullptr;
-
-						if (distance_right.first <= distance_right.second) {
-							if (bvh__unlikely(right->is_leaf)) {
-								if (intersect_leaf(*right, ray, best_hit, primitive_intersector, statistics) &&
-									primitive_intersector.any_hit)
-									break;
-								right = nullptr;
-							}
-						}
-						else
-							right = nullptr;
-
-						// push to the cylinder stack
-						if (bvh__likely((left != NULL) ^ (right != NULL))) {
-							cnode = left != NULL ? left : right;
-						}
-						else if (bvh__unlikely((left != NULL) & (right != NULL))) {
-							if (distance_left.first > distance_right.first)
-								std::swap(left, right);
-							stackc.push(right);
-							cnode = left;
-						}
-						else {
-							if (stackc.empty())
-								break;
-							cnode = stackc.pop();
-						}
-					}
-					if (stack.empty())
+				if (bvh.nodes[node].is_leaf) {
+					if (intersect_cylinder_subtree(bvh.nodes[node].cylinder_root(), stack, cnode_intersector, ray, best_hit, primitive_intersector, statistics))
+						break;
+					if (!stack.pop_within(ray.tmax, node))
 						break;
-					node = stack.pop();
 					continue;
 				}
 
-				auto first_child = node->first_child_or_primitive;
-				const auto* left_child = &bvh.nodes[first_child + 0];
-				const auto* right_child = &bvh.nodes[first_child + 1];
-				auto distance_left = node_intersector.intersect(*left_child, ray);
-				auto distance_right = node_intersector.intersect(*right_child, ray);
-
-				if (distance_left.first <= distance_left.second) {
-					// if left child is leaf, change to cylinders
-					if (bvh__unlikely(left_child->is_leaf)) {
-						const auto* cleaf = &bvh.cnodes[left_child->origin];
-						if (cleaf->is_leaf) {
-							if (intersect_leaf(*cleaf, ray, best_hit, primitive_intersector, statistics) &&
-								primitive_intersector.any_hit)
-								break;
-							left_child = nullptr;
-						}
+				auto left_child = bvh.nodes[node].first_child_or_primitive;
+				auto right_child = left_child + 1;
+				auto distance_left = node_intersector.intersect(bvh.nodes[left_child], ray);
+				auto distance_right = node_intersector.intersect(bvh.nodes[right_child], ray);
+				statistics.box_tests += 2;
+				bool hit_left = distance_left.first <= distance_left.second;
+				bool hit_right = distance_right.first <= distance_right.second;
+
+				// if a child is a leaf whose cylinder subtree is a single leaf, intersect it right away
+				if (hit_left && bvh__unlikely(bvh.nodes[left_child].is_leaf)) {
+					const auto& cleaf = bvh.cnodes[bvh.nodes[left_child].cylinder_root()];
+					if (cleaf.is_leaf) {
+						statistics.transitions++;
+						if (intersect_leaf(cleaf, ray, best_hit, primitive_intersector, statistics) &&
+							primitive_intersector.any_hit)
+							break;
+						hit_left = false;
+						// The hit may be closer than the right child
+						hit_right = hit_right && distance_right.first <= ray.tmax;
 					}
 				}
-				else
-					left_child = nullptr;
 
-				if (distance_right.first <= distance_right.second) {
-					// if right child is leaf, change to cylinders
-					if (bvh__unlikely(right_child->is_leaf)) {
-						const auto* cleaf = &bvh.cnodes[right_child->origin];
-						if (cleaf->is_leaf) {
-							if (intersect_leaf(*cleaf, ray, best_hit, primitive_intersector, statistics) &&
-								primitive_intersector.any_hit)
-								break;
-							right_child = nullptr;
-						}
+				if (hit_right && bvh__unlikely(bvh.nodes[right_child].is_leaf)) {
+					const auto& cleaf = bvh.cnodes[bvh.nodes[right_child].cylinder_root()];
+					if (cleaf.is_leaf) {
+						statistics.transitions++;
+						if (intersect_leaf(cleaf, ray, best_hit, primitive_intersector, statistics) &&
+							primitive_intersector.any_hit)
+							break;
+						hit_right = false;
 					}
 				}
-				else
-					right_child = nullptr;
 
-				if (bvh__likely((left_child != NULL) ^ (right_child != NULL))) {
-					node = left_child != NULL ? left_child : right_child;
+				if (bvh__likely(hit_left ^ hit_right)) {
+					node = hit_left ? left_child : right_child;
 				}
-				else if (bvh__unlikely((left_child != NULL) & (right_child != NULL))) {
-					if (distance_left.first > distance_right.first)
+				else if (bvh__unlikely(hit_left & hit_right)) {
+					if (distance_left.first > distance_right.first) {
 						std::swap(left_child, right_child);
-					stack.push(right_child);
+						std::swap(distance_left, distance_right);
+					}
+					stack.push(std::make_pair(right_child, distance_right.first));
+					record_max(statistics.max_stack_depth, stack.size);
 					node = left_child;
 				}
-				else {
-					if (stack.empty())
-						break;
-					node = stack.pop();
-				}
+				else if (!stack.pop_within(ray.tmax, node))
+					break;
 			}
 
 			return best_hit;
@@ -329,7 +368,7 @@ namespace bvh {
 			// This traversal loop is eager, because it immediately processes leaves instead of pushing them on the stack.
 			// This is generally beneficial for performance because intersections will likely be found which will
 			// allow to cull more subtrees with the ray-box test of the traversal loop.
-			Stack stack;
+			NodeStack stack;
 			const auto* node = bvh.nodes.get();
 			while (true) {
 				statistics.traversal_steps++;
@@ -339,6 +378,7 @@ namespace bvh {
 				const auto* right_child = &bvh.nodes[first_child + 1];
 				auto distance_left = node_intersector.intersect(*left_child, ray);
 				auto distance_right = node_intersector.intersect(*right_child, ray);
+				statistics.box_tests += 2;
 
 				if (distance_left.first <= distance_left.second) {
 					if (bvh__unlikely(left_child->is_leaf)) {
@@ -369,6 +409,7 @@ namespace bvh {
 					if (distance_left.first > distance_right.first)
 						std::swap(left_child, right_child);
 					stack.push(right_child);
+					record_max(statistics.max_stack_depth, stack.size);
 					node = left_child;
 				}
 				else {
@@ -381,14 +422,163 @@ namespace bvh {
 			return best_hit;
 		}
 
+		/// Tests the primitives of a leaf for occlusion. Returns true if any of them is hit.
+		template <typename Node, typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+			bool occluded_leaf(const Node& node, const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+			assert(node.is_leaf);
+			size_t begin = node.first_child_or_primitive;
+			size_t end = begin + node.primitive_count;
+			if constexpr (IntersectsLeaves<PrimitiveIntersector>::value) {
+				statistics.intersections += end - begin;
+				if (primitive_intersector.intersect_leaf(begin, end, ray))
+					return true;
+				statistics.missed_intersections += end - begin;
+				return false;
+			}
+			for (size_t i = begin; i < end; ++i) {
+				statistics.intersections++;
+				if (primitive_intersector.intersect(i, ray))
+					return true;
+				statistics.missed_intersections++;
+			}
+			return false;
+		}
+
+		/// Occlusion test for the cylinder subtree rooted at the given node. Children are visited in memory
+		/// order, since any hit terminates the traversal. The stack is shared with the box levels of hybrid
+		/// hierarchies: entries are only popped until it is back to the size it had on entry.
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+			bool occludedC(size_t root, IndexStack& stack, const Ray<Scalar>& ray, const CustomNodeIntersector<Bvh>& node_intersector, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+			if (bvh__unlikely(bvh.cnodes[root].is_leaf))
+				return occluded_leaf(bvh.cnodes[root], ray, primitive_intersector, statistics);
+
+			auto base = stack.size;
+			auto node = root;
+			while (true) {
+				statistics.traversal_steps++;
+
+				auto left_child = bvh.cnodes[node].first_child_or_primitive;
+				auto right_child = left_child + 1;
+				auto [distance_left, distance_right] = node_intersector.template intersect<2>(&bvh.cnodes[left_child], ray);
+				bool hit_left = distance_left.first <= distance_left.second;
+				bool hit_right = distance_right.first <= distance_right.second;
+				statistics.record_cylinder_tests(2, hit_left + hit_right);
+
+				if (hit_left && bvh__unlikely(bvh.cnodes[left_child].is_leaf)) {
+					if (occluded_leaf(bvh.cnodes[left_child], ray, primitive_intersector, statistics))
+						return true;
+					hit_left = false;
+				}
+
+				if (hit_right && bvh__unlikely(bvh.cnodes[right_child].is_leaf)) {
+					if (occluded_leaf(bvh.cnodes[right_child], ray, primitive_intersector, statistics))
+						return true;
+					hit_right = false;
+				}
+
+				if (hit_left) {
+					if (hit_right) {
+						stack.push(right_child);
+						record_max(statistics.max_stack_depth, stack.size);
+					}
+					node = left_child;
+				}
+				else if (hit_right)
+					node = right_child;
+				else {
+					if (stack.size == base)
+						return false;
+					node = stack.pop();
+				}
+			}
+		}
+
+		/// Occlusion test for box and hybrid hierarchies. In hybrid mode, box leaves are the bounding
+		/// boxes of cylinder subtrees, which are tested in turn. Both kinds of nodes are referred to
+		/// by their index, and share the same stack.
+		template <bool Hybrid, typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+			bool occludedB(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+			CustomNodeIntersector<Bvh> cnode_intersector(ray);
+			IndexStack stack;
+			auto occluded_box_leaf = [&] (const typename Bvh::Node& leaf) {
+				if constexpr (Hybrid) {
+					statistics.transitions++;
+					return occludedC(leaf.cylinder_root(), stack, ray, cnode_intersector, primitive_intersector, statistics);
+				}
+				else
+					return occluded_leaf(leaf, ray, primitive_intersector, statistics);
+			};
+
+			// If the root is a leaf, test it and return
+			if (bvh__unlikely(bvh.nodes[0].is_leaf))
+				return occluded_box_leaf(bvh.nodes[0]);
+
+			NodeIntersector node_intersector(ray);
+
+			size_t node = 0;
+			while (true) {
+				statistics.traversal_steps++;
+
+				auto left_child = bvh.nodes[node].first_child_or_primitive;
+				auto right_child = left_child + 1;
+				auto distance_left = node_intersector.intersect(bvh.nodes[left_child], ray);
+				auto distance_right = node_intersector.intersect(bvh.nodes[right_child], ray);
+				statistics.box_tests += 2;
+				bool hit_left = distance_left.first <= distance_left.second;
+				bool hit_right = distance_right.first <= distance_right.second;
+
+				if (hit_left && bvh__unlikely(bvh.nodes[left_child].is_leaf)) {
+					if (occluded_box_leaf(bvh.nodes[left_child]))
+						return true;
+					hit_left = false;
+				}
+
+				if (hit_right && bvh__unlikely(bvh.nodes[right_child].is_leaf)) {
+					if (occluded_box_leaf(bvh.nodes[right_child]))
+						return true;
+					hit_right = false;
+				}
+
+				if (hit_left) {
+					if (hit_right) {
+						stack.push(right_child);
+						record_max(statistics.max_stack_depth, stack.size);
+					}
+					node = left_child;
+				}
+				else if (hit_right)
+					node = right_child;
+				else {
+					if (stack.empty())
+						return false;
+					node = stack.pop();
+				}
+			}
+		}
+
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+			bool occluded_any(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, bool cyl, bool hybrid, Statistics& statistics) const {
+			if (hybrid)
+				return occludedB<true>(ray, primitive_intersector, statistics);
+			if (cyl) {
+				IndexStack stack;
+				return occludedC(0, stack, ray, CustomNodeIntersector<Bvh>(ray), primitive_intersector, statistics);
+			}
+			return occludedB<false>(ray, primitive_intersector, statistics);
+		}
+
 		const Bvh& bvh;
 
 	public:
-		/// Statistics collected during traversal.
-		struct Statistics {
-			size_t traversal_steps = 0;
-			size_t intersections = 0;
-		};
+		/// Statistics collected during traversal: the number of traversal steps and intersections.
+		using Statistics = BasicStatistics;
+
+		/// Statistics collected during traversal, with a breakdown per type of bounding volume.
+		using DetailedStatistics = bvh::DetailedStatistics;
 
 		SingleRayTraverser(const Bvh& bvh)
 			: bvh(bvh)
@@ -399,13 +589,7 @@ namespace bvh {
 		bvh__always_inline__
 			std::optional<typename PrimitiveIntersector::Result>
 			traverse(const Ray<Scalar>& ray, PrimitiveIntersector& intersector) const {
-			struct {
-				struct Empty {
-					Empty& operator ++ (int) { return *this; }
-					Empty& operator ++ () { return *this; }
-					Empty& operator += (size_t) { return *this; }
-				} traversal_steps, intersections;
-			} statistics;
+			NullStatistics statistics;
 			return intersect(ray, intersector, statistics);
 		}
 
@@ -413,31 +597,42 @@ namespace bvh {
 		bvh__always_inline__
 			std::optional<typename PrimitiveIntersector::Result>
 			traverse(const Ray<Scalar>& ray, PrimitiveIntersector& intersector, bool cyl, bool hybrid) const {
-			struct {
-				struct Empty {
-					Empty& operator ++ (int) { return *this; }
-					Empty& operator ++ () { return *this; }
-					Empty& operator += (size_t) { return *this; }
-				} traversal_steps, intersections;
-			} statistics;
+			NullStatistics statistics;
 			return hybrid ? intersectH(ray, intersector, statistics) : cyl ? intersectC(ray, intersector, statistics) : intersect(ray, intersector, statistics);
 		}
 
 		/// Intersects the BVH with the given ray and intersector.
-		/// Record statistics on the number of traversal and intersection steps.
-		template <typename PrimitiveIntersector>
+		/// Records statistics on the traversal, either `Statistics` or `DetailedStatistics`.
+		template <typename PrimitiveIntersector, typename Counter, typename DetailedCounter>
 		bvh__always_inline__
 			std::optional<typename PrimitiveIntersector::Result>
-			traverse(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+			traverse(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, TraversalStatistics<Counter, DetailedCounter>& statistics) const {
 			return intersect(ray, primitive_intersector, statistics);
 		}
 
-		template <typename PrimitiveIntersector>
+		template <typename PrimitiveIntersector, typename Counter, typename DetailedCounter>
 		bvh__always_inline__
 			std::optional<typename PrimitiveIntersector::Result>
-			traverse(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, bool cyl, bool hybrid, Statistics& statistics) const {
+			traverse(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, bool cyl, bool hybrid, TraversalStatistics<Counter, DetailedCounter>& statistics) const {
 			return hybrid ? intersectH(ray, primitive_intersector, statistics) : cyl ? intersectC(ray, primitive_intersector, statistics) : intersect(ray, primitive_intersector, statistics);
 		}
+
+		/// Returns true if the ray hits any primitive between `ray.tmin` and `ray.tmax`. This is meant
+		/// for shadow rays: the traversal stops at the first hit, children are not sorted by distance,
+		/// and only the existence of an intersection is recorded. Best used with `AnyPrimitiveIntersector`.
+		template <typename PrimitiveIntersector>
+		bvh__always_inline__
+			bool occluded(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, bool cyl, bool hybrid) const {
+			NullStatistics statistics;
+			return occluded_any(ray, primitive_intersector, cyl, hybrid, statistics);
+		}
+
+		/// Occlusion test that records statistics on the traversal, like `traverse()`.
+		template <typename PrimitiveIntersector, typename Counter, typename DetailedCounter>
+		bvh__always_inline__
+			bool occluded(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, bool cyl, bool hybrid, TraversalStatistics<Counter, DetailedCounter>& statistics) const {
+			return occluded_any(ray, primitive_intersector, cyl, hybrid, statistics);
+		}
 	};
 
 } // namespace bvh
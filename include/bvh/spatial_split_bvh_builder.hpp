@@ -34,6 +34,7 @@ class SpatialSplitBvhBuilder : public TopDownBuilder, public SahBasedAlgorithm<B
 public:
     using TopDownBuilder::max_depth;
     using TopDownBuilder::max_leaf_size;
+    using TopDownBuilder::observer;
     using SahBasedAlgorithm<Bvh>::traversal_cost;
 
     /// Number of spatial binning passes that are run in order to
@@ -54,6 +55,8 @@ public:
         Scalar alpha = Scalar(1e-5),
         Scalar split_factor = Scalar(0.75))
     {
+        BuildTimer timer(observer);
+
         size_t max_reference_count = primitive_count + primitive_count * split_factor;
         size_t reference_count = 0;
 
@@ -88,6 +91,7 @@ public:
 
             #pragma omp single
             {
+                timer.phase(BuildPhase::Initialization, primitive_count);
                 BuildTask first_task(
                     *this,
                     primitives,
@@ -100,6 +104,7 @@ public:
             }
         }
 
+        timer.phase(BuildPhase::Splitting, bvh.node_count);
         return reference_count;
     }
 };
@@ -34,6 +34,7 @@ class SweepSahBuilder : public TopDownBuilder, public SahBasedAlgorithm<Bvh> {
 public:
     using TopDownBuilder::max_depth;
     using TopDownBuilder::max_leaf_size;
+    using TopDownBuilder::observer;
     using SahBasedAlgorithm<Bvh>::traversal_cost;
 
     SweepSahBuilder(Bvh& bvh)
@@ -46,6 +47,8 @@ public:
         const Vector3<Scalar>* centers,
         size_t primitive_count)
     {
+        BuildTimer timer(observer);
+
         // Allocate buffers
         bvh.nodes = std::make_unique<typename Bvh::Node[]>(2 * primitive_count + 1);
         bvh.primitive_indices = std::make_unique<size_t[]>(primitive_count);
@@ -68,6 +71,7 @@ public:
 
         bvh.node_count = 1;
         bvh.nodes[0].bounding_box_proxy() = global_bbox;
+        timer.phase(BuildPhase::Initialization, primitive_count);
 
         #pragma omp parallel
         {
@@ -102,10 +106,13 @@ public:
 
             #pragma omp single
             {
+                timer.phase(BuildPhase::Sorting, primitive_count);
                 BuildTask first_task(*this, bboxes, centers, sorted_references, costs, mark_data.get());
                 run_task(first_task, 0, 0, primitive_count, 0);
             }
         }
+
+        timer.phase(BuildPhase::Splitting, bvh.node_count);
     }
 };
 
@@ -4,6 +4,8 @@
 #include <stack>
 #include <cassert>
 
+#include "bvh/build_observer.hpp"
+
 namespace bvh {
 
 /// Base class for top-down build tasks.
@@ -40,6 +42,9 @@ public:
     /// to avoid creating leaves that are larger than this threshold.
     size_t max_leaf_size = 16;
 
+    /// Optional observer that receives the timings of the phases of the build.
+    BuildObserver* observer = nullptr;
+
 protected:
     ~TopDownBuilder() {}
 
@@ -0,0 +1,111 @@
+#ifndef BVH_TRANSFORM_HPP
+#define BVH_TRANSFORM_HPP
+
+#include <cmath>
+
+#include "bvh/vector.hpp"
+#include "bvh/bounding_box.hpp"
+#include "bvh/ray.hpp"
+
+namespace bvh {
+
+/// An affine transformation, made of a 3x3 matrix, stored by rows, and a translation.
+template <typename Scalar>
+struct AffineTransform {
+    Vector3<Scalar> rows[3];
+    Vector3<Scalar> translation;
+
+    static AffineTransform identity() {
+        return scaling(Vector3<Scalar>(1));
+    }
+
+    static AffineTransform translating(const Vector3<Scalar>& translation) {
+        auto transform = identity();
+        transform.translation = translation;
+        return transform;
+    }
+
+    static AffineTransform scaling(const Vector3<Scalar>& scale) {
+        AffineTransform transform;
+        transform.rows[0] = Vector3<Scalar>(scale[0], 0, 0);
+        transform.rows[1] = Vector3<Scalar>(0, scale[1], 0);
+        transform.rows[2] = Vector3<Scalar>(0, 0, scale[2]);
+        transform.translation = Vector3<Scalar>(0);
+        return transform;
+    }
+
+    /// Rotation of the given angle (in radians) around the given unit axis.
+    static AffineTransform rotation(const Vector3<Scalar>& axis, Scalar angle) {
+        auto c = std::cos(angle);
+        auto s = std::sin(angle);
+        AffineTransform transform;
+        for (int i = 0; i < 3; ++i) {
+            // Rodrigues' formula, applied to the i-th basis vector, gives the i-th column
+            Vector3<Scalar> e(0);
+            e[i] = 1;
+            auto column = e * c + cross(axis, e) * s + axis * (dot(axis, e) * (1 - c));
+            for (int j = 0; j < 3; ++j)
+                transform.rows[j][i] = column[j];
+        }
+        transform.translation = Vector3<Scalar>(0);
+        return transform;
+    }
+
+    Vector3<Scalar> transform_vector(const Vector3<Scalar>& v) const {
+        return Vector3<Scalar>(dot(rows[0], v), dot(rows[1], v), dot(rows[2], v));
+    }
+
+    Vector3<Scalar> transform_point(const Vector3<Scalar>& p) const {
+        return transform_vector(p) + translation;
+    }
+
+    /// Transforms a ray. The direction is not normalized, so that distances along the
+    /// transformed ray, including `tmin` and `tmax`, are the same as along the original one.
+    Ray<Scalar> transform_ray(const Ray<Scalar>& ray) const {
+        return Ray<Scalar>(transform_point(ray.origin), transform_vector(ray.direction), ray.tmin, ray.tmax);
+    }
+
+    /// Returns the bounding box of the transformed box, see "Transforming Axis-Aligned
+    /// Bounding Boxes", by J. Arvo, in Graphics Gems.
+    BoundingBox<Scalar> transform_bounding_box(const BoundingBox<Scalar>& bbox) const {
+        BoundingBox<Scalar> result(translation);
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                auto a = rows[i][j] * bbox.min[j];
+                auto b = rows[i][j] * bbox.max[j];
+                result.min[i] += std::min(a, b);
+                result.max[i] += std::max(a, b);
+            }
+        }
+        return result;
+    }
+
+    /// Composition of transforms: the resulting transform applies `other` first.
+    AffineTransform operator * (const AffineTransform& other) const {
+        AffineTransform transform;
+        for (int i = 0; i < 3; ++i)
+            transform.rows[i] = other.rows[0] * rows[i][0] + other.rows[1] * rows[i][1] + other.rows[2] * rows[i][2];
+        transform.translation = transform_point(other.translation);
+        return transform;
+    }
+
+    /// Returns the inverse transform. The matrix must not be singular.
+    AffineTransform inverse() const {
+        // The columns of the inverse are the cross products of the rows, divided by the determinant
+        Vector3<Scalar> columns[3] = {
+            cross(rows[1], rows[2]),
+            cross(rows[2], rows[0]),
+            cross(rows[0], rows[1])
+        };
+        auto inv_det = Scalar(1) / dot(rows[0], columns[0]);
+        AffineTransform transform;
+        for (int i = 0; i < 3; ++i)
+            transform.rows[i] = Vector3<Scalar>(columns[0][i], columns[1][i], columns[2][i]) * inv_det;
+        transform.translation = -transform.transform_vector(translation);
+        return transform;
+    }
+};
+
+} // namespace bvh
+
+#endif
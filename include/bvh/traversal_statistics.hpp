@@ -0,0 +1,78 @@
+#ifndef BVH_TRAVERSAL_STATISTICS_HPP
+#define BVH_TRAVERSAL_STATISTICS_HPP
+
+#include <cstddef>
+#include <algorithm>
+
+namespace bvh {
+
+	/// Counter that is not recorded: updating it compiles to nothing.
+	struct NullCounter {
+		NullCounter& operator ++ (int) { return *this; }
+		NullCounter& operator ++ () { return *this; }
+		NullCounter& operator += (size_t) { return *this; }
+		NullCounter& operator += (NullCounter) { return *this; }
+	};
+
+	/// Updates a counter that records a maximum value.
+	inline void record_max(NullCounter&, size_t) {}
+	inline void record_max(NullCounter&, NullCounter) {}
+	inline void record_max(size_t& counter, size_t value) { counter = std::max(counter, value); }
+
+	/// Statistics collected during traversal. The basic counters are of type `Counter`, and the
+	/// detailed ones of type `DetailedCounter`, each being either `size_t` or `NullCounter`, so that
+	/// the counters that are not needed do not cost anything. Cylinder tests are counted per node,
+	/// and the counters of the cylinder tests that hit or miss add up to the number of tests.
+	template <typename Counter, typename DetailedCounter>
+	struct TraversalStatistics {
+		/// Inner nodes visited.
+		Counter traversal_steps = Counter();
+		/// Ray-primitive intersection tests.
+		Counter intersections = Counter();
+
+		/// Ray-box tests.
+		DetailedCounter box_tests = DetailedCounter();
+		/// Ray-cylinder tests, and how many of them hit or missed the cylinder.
+		DetailedCounter cylinder_tests = DetailedCounter();
+		DetailedCounter cylinder_hits = DetailedCounter();
+		DetailedCounter cylinder_misses = DetailedCounter();
+		/// Transitions from a box leaf to the cylinder subtree it bounds, in hybrid BVHs.
+		DetailedCounter transitions = DetailedCounter();
+		/// Maximum number of elements on the traversal stack.
+		DetailedCounter max_stack_depth = DetailedCounter();
+		/// Ray-primitive intersection tests that did not find an intersection.
+		DetailedCounter missed_intersections = DetailedCounter();
+
+		/// Adds the number of hits and misses among the given number of cylinder tests.
+		void record_cylinder_tests(size_t count, size_t hit_count) {
+			cylinder_tests += count;
+			cylinder_hits += hit_count;
+			cylinder_misses += count - hit_count;
+		}
+
+		TraversalStatistics& operator += (const TraversalStatistics& other) {
+			traversal_steps += other.traversal_steps;
+			intersections += other.intersections;
+			box_tests += other.box_tests;
+			cylinder_tests += other.cylinder_tests;
+			cylinder_hits += other.cylinder_hits;
+			cylinder_misses += other.cylinder_misses;
+			transitions += other.transitions;
+			record_max(max_stack_depth, other.max_stack_depth);
+			missed_intersections += other.missed_intersections;
+			return *this;
+		}
+	};
+
+	/// Statistics that record nothing, used when no statistics are requested.
+	using NullStatistics = TraversalStatistics<NullCounter, NullCounter>;
+
+	/// Statistics that record the number of traversal steps and primitive intersections.
+	using BasicStatistics = TraversalStatistics<size_t, NullCounter>;
+
+	/// Statistics that record every counter.
+	using DetailedStatistics = TraversalStatistics<size_t, size_t>;
+
+} // namespace bvh
+
+#endif
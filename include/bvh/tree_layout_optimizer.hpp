@@ -0,0 +1,188 @@
+#ifndef BVH_TREE_LAYOUT_OPTIMIZER_HPP
+#define BVH_TREE_LAYOUT_OPTIMIZER_HPP
+
+#include <memory>
+#include <vector>
+#include <cassert>
+#include <algorithm>
+
+#include "bvh/bvh.hpp"
+
+namespace bvh {
+
+/// Orders of the nodes produced by `TreeLayoutOptimizer`.
+enum class TreeLayout {
+    /// Pairs of siblings are stored in depth-first order, so that every subtree is contiguous.
+    DepthFirst,
+    /// Pairs of siblings are stored in van Emde Boas order: the top half of the levels of the tree
+    /// is stored first, recursively, followed by each of the subtrees below it. This layout is
+    /// cache-oblivious: the nodes visited by a path from the root touch few blocks of memory,
+    /// whatever the size of the blocks.
+    VanEmdeBoas
+};
+
+/// Renumbers the nodes of box, cylinder, and hybrid hierarchies into a locality-preserving order
+/// (see `TreeLayout`). Sibling pairs stay adjacent, at the same positions within pairs. For hybrid
+/// hierarchies, the cylinder subtrees are stored contiguously, one after the other, in the order in
+/// which the box leaves that refer to them appear in the new box layout, so that the transition from
+/// a box leaf to its cylinder subtree follows the order of the box levels. Each cylinder root is
+/// followed by an empty, unreachable leaf when needed to keep the pairs of its tree at odd positions.
+/// The nodes that are not reachable from a root are removed. This does not change the topology of
+/// the BVH, nor the primitive indices.
+template <typename Bvh>
+class TreeLayoutOptimizer {
+    static constexpr size_t no_index = size_t(-1);
+
+    Bvh& bvh;
+
+    /// Gives positions to the pairs of children of the inner node `root` and of every inner node below it,
+    /// starting at `next`. The positions are given in `new_indices`, indexed by the old node indices.
+    template <typename Node>
+    void layout_pairs(const Node* nodes, size_t root, size_t& next, size_t* new_indices) const {
+        auto place_pair = [&] (size_t i) {
+            auto first_child = nodes[i].first_child_or_primitive;
+            new_indices[first_child + 0] = next++;
+            new_indices[first_child + 1] = next++;
+        };
+        auto for_each_inner_child = [&] (size_t i, auto f) {
+            auto first_child = nodes[i].first_child_or_primitive;
+            for (size_t j = 0; j < 2; ++j) {
+                if (!nodes[first_child + j].is_leaf)
+                    f(first_child + j);
+            }
+        };
+
+        if (nodes[root].is_leaf)
+            return;
+
+        if (layout == TreeLayout::DepthFirst) {
+            std::vector<size_t> stack(1, root);
+            while (!stack.empty()) {
+                auto i = stack.back();
+                stack.pop_back();
+                place_pair(i);
+                // The left child is processed first
+                auto first_child = nodes[i].first_child_or_primitive;
+                for (size_t j = 2; j-- > 0;) {
+                    if (!nodes[first_child + j].is_leaf)
+                        stack.push_back(first_child + j);
+                }
+            }
+            return;
+        }
+
+        // Number of levels of inner nodes below the root
+        size_t level_count = 0;
+        std::vector<std::pair<size_t, size_t>> stack(1, std::make_pair(root, size_t(1)));
+        while (!stack.empty()) {
+            auto [i, level] = stack.back();
+            stack.pop_back();
+            level_count = std::max(level_count, level);
+            for_each_inner_child(i, [&] (size_t j) { stack.emplace_back(j, level + 1); });
+        }
+
+        // Places the pairs of the given number of levels below `i`, and collects the inner nodes just below them
+        auto layout_levels = [&] (size_t i, size_t level_count, std::vector<size_t>& frontier, auto& layout_levels) -> void {
+            if (level_count == 1) {
+                place_pair(i);
+                for_each_inner_child(i, [&] (size_t j) { frontier.push_back(j); });
+                return;
+            }
+            auto top_level_count = level_count / 2;
+            std::vector<size_t> middle;
+            layout_levels(i, top_level_count, middle, layout_levels);
+            for (auto j : middle)
+                layout_levels(j, level_count - top_level_count, frontier, layout_levels);
+        };
+        std::vector<size_t> frontier;
+        layout_levels(root, level_count, frontier, layout_levels);
+        assert(frontier.empty());
+    }
+
+    /// Copies the nodes that have a new index into a new array, and remaps their children.
+    template <typename Node>
+    static std::unique_ptr<Node[]> copy_nodes(const Node* nodes, size_t node_count, const size_t* new_indices, size_t new_node_count) {
+        auto new_nodes = std::make_unique<Node[]>(new_node_count);
+        #pragma omp parallel for
+        for (size_t i = 0; i < node_count; ++i) {
+            if (new_indices[i] == no_index)
+                continue;
+            auto& node = new_nodes[new_indices[i]];
+            node = nodes[i];
+            if (!node.is_leaf)
+                node.first_child_or_primitive = new_indices[node.first_child_or_primitive];
+        }
+        return new_nodes;
+    }
+
+    /// Renumbers a tree rooted at index 0, and returns its new number of nodes.
+    template <typename Node>
+    size_t optimize_tree(BvhArray<Node>& nodes, size_t node_count) const {
+        auto new_indices = std::make_unique<size_t[]>(node_count);
+        std::fill(new_indices.get(), new_indices.get() + node_count, no_index);
+        new_indices[0] = 0;
+        size_t next = 1;
+        layout_pairs(nodes.get(), 0, next, new_indices.get());
+        assert(next <= node_count);
+        nodes = copy_nodes(nodes.get(), node_count, new_indices.get(), next);
+        return next;
+    }
+
+    void optimize_forest() {
+        std::vector<size_t> roots;
+        for (size_t i = 0; i < bvh.node_count; ++i) {
+            if (bvh.nodes[i].is_leaf)
+                roots.push_back(bvh.nodes[i].cylinder_root());
+        }
+
+        // Each tree can need one padding node
+        auto new_indices = std::make_unique<size_t[]>(bvh.cnode_count);
+        std::fill(new_indices.get(), new_indices.get() + bvh.cnode_count, no_index);
+        std::vector<size_t> padding_nodes;
+        size_t next = 0;
+        for (auto root : roots) {
+            new_indices[root] = next++;
+            if (next % 2 == 0)
+                padding_nodes.push_back(next++);
+            layout_pairs(bvh.cnodes.get(), root, next, new_indices.get());
+        }
+        assert(next <= bvh.cnode_count + roots.size());
+
+        auto cnodes = copy_nodes(bvh.cnodes.get(), bvh.cnode_count, new_indices.get(), next);
+        for (auto i : padding_nodes) {
+            cnodes[i] = cnodes[i - 1];
+            cnodes[i].is_leaf = true;
+            cnodes[i].primitive_count = 0;
+            cnodes[i].first_child_or_primitive = 0;
+        }
+        for (size_t i = 0; i < bvh.node_count; ++i) {
+            if (bvh.nodes[i].is_leaf)
+                bvh.nodes[i].set_cylinder_root(new_indices[bvh.nodes[i].cylinder_root()]);
+        }
+        bvh.cnodes = std::move(cnodes);
+        bvh.cnode_count = next;
+    }
+
+public:
+    TreeLayout layout = TreeLayout::DepthFirst;
+
+    TreeLayoutOptimizer(Bvh& bvh)
+        : bvh(bvh)
+    {}
+
+    void optimize() {
+        if (bvh.cylinder && !bvh.hybrid) {
+            // Cylinder hierarchies also record their size in `node_count`
+            bvh.node_count = bvh.cnode_count = optimize_tree(bvh.cnodes, bvh.cnode_count);
+            return;
+        }
+        // The box leaves are renumbered first, so that the cylinder subtrees follow their new order
+        bvh.node_count = optimize_tree(bvh.nodes, bvh.node_count);
+        if (bvh.hybrid)
+            optimize_forest();
+    }
+};
+
+} // namespace bvh
+
+#endif
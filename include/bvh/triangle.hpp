@@ -2,6 +2,7 @@
 #define BVH_TRIANGLE_HPP
 
 #include <optional>
+#include <algorithm>
 #include <cassert>
 #include <math.h>
 #include <limits>
@@ -167,6 +168,63 @@ namespace bvh {
 			return std::make_pair(left, right);
 		}
 
+		/// Returns a bounding cylinder of the part of the triangle that lies between the planes
+		/// orthogonal to the axis of the given cylinder, at the distances `begin` and `end` from
+		/// its base. The result has the same axis, and its radius only covers that part, which is
+		/// what makes splitting long triangles along their axis worthwhile (see `bounding_cyl()`).
+		BoundingCyl<Scalar> slab_bounding_cyl(const BoundingCyl<Scalar>& cyl, Scalar begin, Scalar end) const {
+			// Each plane cuts off at most one vertex and adds two, hence at most 5 vertices remain
+			Vector3<Scalar> polygon[5] = { p0, p1(), p2() };
+			size_t count = 3;
+			auto clip = [&](Scalar sign, Scalar position) {
+				Vector3<Scalar> clipped[5];
+				size_t clipped_count = 0;
+				for (size_t i = 0; i < count; ++i) {
+					const auto& a = polygon[i];
+					const auto& b = polygon[(i + 1) % count];
+					auto da = sign * (dot(a - cyl.c, cyl.axis) - position);
+					auto db = sign * (dot(b - cyl.c, cyl.axis) - position);
+					if (da <= 0)
+						clipped[clipped_count++] = a;
+					if ((da < 0 && db > 0) || (da > 0 && db < 0))
+						clipped[clipped_count++] = a + (da / (da - db)) * (b - a);
+				}
+				std::copy(clipped, clipped + clipped_count, polygon);
+				count = clipped_count;
+			};
+			clip(Scalar(-1), begin);
+			clip(Scalar(1), end);
+			if (count == 0)
+				return BoundingCyl<Scalar>(cyl.c + cyl.axis * begin, cyl.axis, Scalar(0), Scalar(0));
+
+			// The axis goes through the middle of the two vertices that are the farthest apart once
+			// projected onto the planes, which is close to the center of the smallest enclosing circle
+			Vector3<Scalar> offsets[5];
+			auto tmin = std::numeric_limits<Scalar>::max();
+			auto tmax = -std::numeric_limits<Scalar>::max();
+			for (size_t i = 0; i < count; ++i) {
+				auto t = dot(polygon[i] - cyl.c, cyl.axis);
+				offsets[i] = polygon[i] - cyl.c - cyl.axis * t;
+				tmin = std::min(tmin, t);
+				tmax = std::max(tmax, t);
+			}
+			Vector3<Scalar> center = offsets[0];
+			Scalar max_distance = 0;
+			for (size_t i = 0; i < count; ++i) {
+				for (size_t j = i + 1; j < count; ++j) {
+					auto distance = dot(offsets[j] - offsets[i], offsets[j] - offsets[i]);
+					if (distance > max_distance) {
+						max_distance = distance;
+						center = (offsets[i] + offsets[j]) * Scalar(0.5);
+					}
+				}
+			}
+			Scalar radius = 0;
+			for (size_t i = 0; i < count; ++i)
+				radius = std::max(radius, length(offsets[i] - center));
+			return BoundingCyl<Scalar>(cyl.c + center + cyl.axis * tmin, cyl.axis, tmax - tmin, radius);
+		}
+
 		std::optional<Intersection> intersect(const Ray<Scalar>& ray) const {
 			auto negate_when_right_handed = [](Scalar x) { return LeftHandedNormal ? x : -x; };
 
@@ -0,0 +1,273 @@
+#ifndef BVH_TRIANGLE_BLOCKS_HPP
+#define BVH_TRIANGLE_BLOCKS_HPP
+
+#include <memory>
+#include <vector>
+#include <optional>
+#include <limits>
+#include <cassert>
+#include <algorithm>
+
+#include "bvh/bvh.hpp"
+#include "bvh/ray.hpp"
+#include "bvh/vector.hpp"
+#include "bvh/platform.hpp"
+
+namespace bvh {
+
+/// Triangles stored as a structure of arrays, so that the intersection routine processes
+/// `BlockSize` triangles at once. Each component is stored in its own array, indexed by lane.
+template <typename Scalar, size_t BlockSize>
+struct alignas(sizeof(Scalar) * BlockSize) TriangleBlock {
+    Scalar p0[3][BlockSize];
+    Scalar e1[3][BlockSize];
+    Scalar e2[3][BlockSize];
+    Scalar n [3][BlockSize];
+
+    /// Stores the given triangle in the given lane. The normal is always the left-handed one,
+    /// which makes the intersection routine identical for both orientations of `Triangle`.
+    template <typename Triangle>
+    void set_triangle(size_t lane, const Triangle& triangle) {
+        auto n = cross(triangle.e1, triangle.e2);
+        for (int i = 0; i < 3; ++i) {
+            this->p0[i][lane] = triangle.p0[i];
+            this->e1[i][lane] = triangle.e1[i];
+            this->e2[i][lane] = triangle.e2[i];
+            this->n [i][lane] = n[i];
+        }
+    }
+
+    /// Clears the given lane. A degenerate triangle has a null normal, which makes the
+    /// barycentric coordinates computed by the intersection routine NaNs, and is thus never hit.
+    void clear(size_t lane) {
+        for (int i = 0; i < 3; ++i)
+            p0[i][lane] = e1[i][lane] = e2[i][lane] = n[i][lane] = 0;
+    }
+};
+
+/// Copy of the triangles of a BVH, grouped leaf by leaf into blocks of `BlockSize` triangles, so
+/// that the primitives of a leaf can be intersected with one SIMD Moeller-Trumbore test per block,
+/// without going through `bvh.primitive_indices`. The blocks of a leaf are contiguous, and only the
+/// last one is partially filled. This works for box, cylinder, and hybrid hierarchies, and must be
+/// created again whenever the leaves of the BVH change. It is best used with large leaves, as
+/// produced by top-down builders or by `LeafCollapser`.
+template <typename Bvh, typename Triangle, size_t BlockSize = 4>
+struct TriangleBlocks {
+    using Scalar = typename Bvh::ScalarType;
+    using Block  = TriangleBlock<Scalar, BlockSize>;
+
+    static constexpr size_t block_size = BlockSize;
+
+    std::unique_ptr<Block[]> blocks;
+    /// Index of the triangle stored in each lane of each block.
+    std::unique_ptr<size_t[]> primitive_indices;
+    /// Index of the first block of each leaf, indexed by the first primitive of the leaf.
+    std::unique_ptr<size_t[]> first_blocks;
+    size_t block_count = 0;
+
+    static size_t block_count_of(size_t primitive_count) {
+        return (primitive_count + BlockSize - 1) / BlockSize;
+    }
+
+    TriangleBlocks(const Bvh& bvh, const Triangle* triangles) {
+        // Leaves are collected in depth-first order, so that the blocks of neighboring leaves are close
+        std::vector<std::pair<size_t, size_t>> leaves;
+        auto collect_leaves = [&] (const auto* nodes, size_t root) {
+            std::vector<size_t> stack(1, root);
+            while (!stack.empty()) {
+                const auto& node = nodes[stack.back()];
+                stack.pop_back();
+                if (!node.is_leaf) {
+                    stack.push_back(node.first_child_or_primitive + 1);
+                    stack.push_back(node.first_child_or_primitive + 0);
+                } else if (node.primitive_count > 0)
+                    leaves.emplace_back(node.first_child_or_primitive, node.primitive_count);
+            }
+        };
+        if (bvh.hybrid) {
+            // The leaves of the box levels are the roots of the cylinder subtrees
+            std::vector<size_t> stack(1, 0);
+            while (!stack.empty()) {
+                const auto& node = bvh.nodes[stack.back()];
+                stack.pop_back();
+                if (node.is_leaf)
+                    collect_leaves(bvh.cnodes.get(), node.cylinder_root());
+                else {
+                    stack.push_back(node.first_child_or_primitive + 1);
+                    stack.push_back(node.first_child_or_primitive + 0);
+                }
+            }
+        } else if (bvh.cylinder)
+            collect_leaves(bvh.cnodes.get(), 0);
+        else
+            collect_leaves(bvh.nodes.get(), 0);
+
+        first_blocks = std::make_unique<size_t[]>(bvh.reference_count());
+        auto leaf_blocks = std::make_unique<size_t[]>(leaves.size());
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            leaf_blocks[i] = block_count;
+            first_blocks[leaves[i].first] = block_count;
+            block_count += block_count_of(leaves[i].second);
+        }
+
+        blocks = std::make_unique<Block[]>(block_count);
+        primitive_indices = std::make_unique<size_t[]>(block_count * BlockSize);
+        #pragma omp parallel for
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            auto [begin, primitive_count] = leaves[i];
+            for (size_t j = 0; j < block_count_of(primitive_count) * BlockSize; ++j) {
+                auto& block = blocks[leaf_blocks[i] + j / BlockSize];
+                if (j < primitive_count) {
+                    auto primitive_index = bvh.primitive_indices[begin + j];
+                    block.set_triangle(j % BlockSize, triangles[primitive_index]);
+                    primitive_indices[leaf_blocks[i] * BlockSize + j] = primitive_index;
+                } else
+                    block.clear(j % BlockSize);
+            }
+        }
+    }
+};
+
+/// Base class for the intersectors of triangle blocks. The traversal algorithms call `intersect_leaf()`
+/// with the range of primitives of each leaf they reach. The usual `intersect()` function, which tests
+/// one primitive at a time through `bvh.primitive_indices`, is kept for the algorithms that need it.
+template <typename Bvh, typename Triangle, size_t BlockSize, bool AnyHit>
+struct TriangleBlockIntersector {
+    using Scalar       = typename Bvh::ScalarType;
+    using Intersection = typename Triangle::IntersectionType;
+    using Blocks       = TriangleBlocks<Bvh, Triangle, BlockSize>;
+
+    TriangleBlockIntersector(const Bvh& bvh, const Blocks& blocks, const Triangle* triangles)
+        : bvh(bvh), blocks(blocks), triangles(triangles)
+    {}
+
+    const Bvh& bvh;
+    const Blocks& blocks;
+    const Triangle* triangles = nullptr;
+
+    static constexpr bool any_hit = AnyHit;
+
+protected:
+    ~TriangleBlockIntersector() {}
+
+    /// Intersects the blocks of the leaf that starts at primitive `begin`, and returns the index of the lane
+    /// (from the first block of the leaf) of the closest hit, or of any hit for any-hit queries, with the hit.
+    bvh__always_inline__
+    std::optional<std::pair<size_t, Intersection>> intersect_blocks(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        static constexpr Scalar no_hit = std::numeric_limits<Scalar>::infinity();
+
+        if (bvh__unlikely(begin == end))
+            return std::nullopt;
+
+        auto first_block = blocks.first_blocks[begin];
+        auto block_count = Blocks::block_count_of(end - begin);
+        auto o0 = ray.origin[0], o1 = ray.origin[1], o2 = ray.origin[2];
+        auto d0 = ray.direction[0], d1 = ray.direction[1], d2 = ray.direction[2];
+        auto tmin = ray.tmin, tmax = ray.tmax;
+        std::optional<std::pair<size_t, Intersection>> best_hit;
+        for (size_t i = 0; i < block_count; ++i) {
+            const auto& block = blocks.blocks[first_block + i];
+            Scalar t[BlockSize], u[BlockSize], v[BlockSize];
+
+            // Moeller-Trumbore test, with the same operations as `Triangle::intersect()`
+            #pragma omp simd
+            for (size_t j = 0; j < BlockSize; ++j) {
+                auto c0 = block.p0[0][j] - o0;
+                auto c1 = block.p0[1][j] - o1;
+                auto c2 = block.p0[2][j] - o2;
+                auto r0 = d1 * c2 - d2 * c1;
+                auto r1 = d2 * c0 - d0 * c2;
+                auto r2 = d0 * c1 - d1 * c0;
+                auto inv_det = Scalar(1.0) / (block.n[0][j] * d0 + block.n[1][j] * d1 + block.n[2][j] * d2);
+                auto uj = (r0 * block.e2[0][j] + r1 * block.e2[1][j] + r2 * block.e2[2][j]) * inv_det;
+                auto vj = (r0 * block.e1[0][j] + r1 * block.e1[1][j] + r2 * block.e1[2][j]) * inv_det;
+                auto wj = Scalar(1.0) - uj - vj;
+                auto tj = (block.n[0][j] * c0 + block.n[1][j] * c1 + block.n[2][j] * c2) * inv_det;
+                // These comparisons are designed to fail when one of t, u, or v is a NaN
+                bool hit = (uj >= 0) & (vj >= 0) & (wj >= 0) & (tj >= tmin) & (tj < tmax);
+                t[j] = hit ? tj : no_hit;
+                u[j] = uj;
+                v[j] = vj;
+            }
+
+            // The first of the closest lanes is kept, as when the triangles are tested one by one
+            for (size_t j = 0; j < BlockSize; ++j) {
+                if (t[j] < tmax) {
+                    tmax = t[j];
+                    best_hit = std::make_optional(std::make_pair(i * BlockSize + j, Intersection { t[j], u[j], v[j] }));
+                    if (AnyHit)
+                        return best_hit;
+                }
+            }
+        }
+        return best_hit;
+    }
+};
+
+/// An intersector for triangle blocks that looks for the closest intersection.
+template <typename Bvh, typename Triangle, size_t BlockSize = 4>
+struct ClosestTriangleBlockIntersector : public TriangleBlockIntersector<Bvh, Triangle, BlockSize, false> {
+    using Base         = TriangleBlockIntersector<Bvh, Triangle, BlockSize, false>;
+    using Scalar       = typename Base::Scalar;
+    using Intersection = typename Base::Intersection;
+
+    struct Result {
+        size_t       primitive_index;
+        Intersection intersection;
+
+        Scalar distance() const { return intersection.distance(); }
+    };
+
+    ClosestTriangleBlockIntersector(const Bvh& bvh, const typename Base::Blocks& blocks, const Triangle* triangles)
+        : Base(bvh, blocks, triangles)
+    {}
+
+    std::optional<Result> intersect(size_t index, const Ray<Scalar>& ray) const {
+        auto i = this->bvh.primitive_indices[index];
+        if (auto hit = this->triangles[i].intersect(ray))
+            return std::make_optional(Result { i, *hit });
+        return std::nullopt;
+    }
+
+    /// Intersects the primitives `[begin, end)` of a leaf, and returns the closest hit.
+    std::optional<Result> intersect_leaf(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        if (auto hit = this->intersect_blocks(begin, end, ray)) {
+            auto first_lane = this->blocks.first_blocks[begin] * BlockSize;
+            return std::make_optional(Result { this->blocks.primitive_indices[first_lane + hit->first], hit->second });
+        }
+        return std::nullopt;
+    }
+};
+
+/// An intersector for triangle blocks that exits after the first hit and only stores the distance to the primitive.
+template <typename Bvh, typename Triangle, size_t BlockSize = 4>
+struct AnyTriangleBlockIntersector : public TriangleBlockIntersector<Bvh, Triangle, BlockSize, true> {
+    using Base   = TriangleBlockIntersector<Bvh, Triangle, BlockSize, true>;
+    using Scalar = typename Base::Scalar;
+
+    struct Result {
+        Scalar t;
+        Scalar distance() const { return t; }
+    };
+
+    AnyTriangleBlockIntersector(const Bvh& bvh, const typename Base::Blocks& blocks, const Triangle* triangles)
+        : Base(bvh, blocks, triangles)
+    {}
+
+    std::optional<Result> intersect(size_t index, const Ray<Scalar>& ray) const {
+        if (auto hit = this->triangles[this->bvh.primitive_indices[index]].intersect(ray))
+            return std::make_optional(Result { hit->distance() });
+        return std::nullopt;
+    }
+
+    /// Intersects the primitives `[begin, end)` of a leaf, and returns the first hit found.
+    std::optional<Result> intersect_leaf(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        if (auto hit = this->intersect_blocks(begin, end, ray))
+            return std::make_optional(Result { hit->second.distance() });
+        return std::nullopt;
+    }
+};
+
+} // namespace bvh
+
+#endif
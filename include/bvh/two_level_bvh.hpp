@@ -0,0 +1,174 @@
+#ifndef BVH_TWO_LEVEL_BVH_HPP
+#define BVH_TWO_LEVEL_BVH_HPP
+
+#include <vector>
+#include <optional>
+#include <memory>
+#include <numeric>
+#include <cassert>
+
+#include "bvh/bvh.hpp"
+#include "bvh/transform.hpp"
+#include "bvh/binned_sah_builder.hpp"
+#include "bvh/single_ray_traverser.hpp"
+
+namespace bvh {
+
+	/// Two-level hierarchy: a top-level BVH of boxes over instances, each of which places one of the
+	/// bottom-level BVHs (the objects) in the scene with an affine transform. Objects can be box,
+	/// cylinder, or hybrid hierarchies (see `Bvh::cylinder` and `Bvh::hybrid`), and an object can be
+	/// referenced by several instances, in which case its primitives are only stored once. The leaves
+	/// of the top level refer to instances through `top_level.primitive_indices`.
+	template <typename Bvh>
+	struct TwoLevelBvh {
+		using Scalar      = typename Bvh::ScalarType;
+		using ScalarType  = Scalar;
+		using ObjectBvh   = Bvh;
+		using TopLevelBvh = bvh::Bvh<Scalar>;
+		using Transform   = AffineTransform<Scalar>;
+
+		struct Instance {
+			size_t object;
+			Transform object_to_world;
+			Transform world_to_object;
+
+			Instance(size_t object, const Transform& object_to_world)
+				: object(object), object_to_world(object_to_world), world_to_object(object_to_world.inverse())
+			{}
+		};
+
+		std::vector<Bvh> objects;
+		std::vector<Instance> instances;
+		TopLevelBvh top_level;
+
+		/// Adds an empty object, to be built with `TwoLevelBvhBuilder::build_objects()`, and returns its index.
+		size_t add_object() {
+			objects.emplace_back();
+			return objects.size() - 1;
+		}
+
+		/// Adds an instance of the given object, and returns its index.
+		size_t add_instance(size_t object, const Transform& object_to_world = Transform::identity()) {
+			assert(object < objects.size());
+			instances.emplace_back(object, object_to_world);
+			return instances.size() - 1;
+		}
+
+		/// Returns the bounding box of an object, in object space. The object must have been built.
+		BoundingBox<Scalar> object_bounding_box(size_t object) const {
+			const auto& bvh = objects[object];
+			if (bvh.cylinder && !bvh.hybrid)
+				return bvh.cnodes[0].bounding_box_proxy().to_bounding_box().AABB();
+			return bvh.nodes[0].bounding_box_proxy().to_bounding_box();
+		}
+
+		/// Returns the bounding box of an instance, in world space.
+		BoundingBox<Scalar> instance_bounding_box(size_t instance) const {
+			const auto& i = instances[instance];
+			return i.object_to_world.transform_bounding_box(object_bounding_box(i.object));
+		}
+	};
+
+	/// Builder for two-level hierarchies. The objects are built concurrently, as OpenMP tasks of a single
+	/// parallel region, instead of one after the other with all the threads. The parallel regions of the
+	/// builders are then nested (and executed by one thread, unless nested parallelism is enabled), which
+	/// is more efficient when there are many objects of moderate size. Changed objects can be rebuilt
+	/// alone, after which only the top level needs to be rebuilt, which is cheap.
+	template <typename Bvh>
+	class TwoLevelBvhBuilder {
+		using Scalar      = typename Bvh::ScalarType;
+		using TopLevelBvh = typename TwoLevelBvh<Bvh>::TopLevelBvh;
+
+		static constexpr size_t top_level_bin_count = 16;
+
+		TwoLevelBvh<Bvh>& two_level_bvh;
+
+	public:
+		TwoLevelBvhBuilder(TwoLevelBvh<Bvh>& two_level_bvh)
+			: two_level_bvh(two_level_bvh)
+		{}
+
+		/// Builds the given objects with the given function, called with the BVH of each object
+		/// and its index, which must build the BVH and set its `cylinder` and `hybrid` flags.
+		/// Objects are built in the given order: large objects should come first, so that they
+		/// do not delay the end of the build.
+		template <typename BuildObject>
+		void build_objects(const size_t* objects, size_t object_count, BuildObject&& build_object) {
+			auto& bvhs = two_level_bvh.objects;
+#pragma omp parallel
+#pragma omp single
+			for (size_t i = 0; i < object_count; ++i) {
+				auto object = objects[i];
+				assert(object < bvhs.size());
+#pragma omp task firstprivate(object) shared(bvhs, build_object)
+				build_object(bvhs[object], object);
+			}
+		}
+
+		/// Builds every object with the given function, see above.
+		template <typename BuildObject>
+		void build_objects(BuildObject&& build_object) {
+			std::vector<size_t> objects(two_level_bvh.objects.size());
+			std::iota(objects.begin(), objects.end(), 0);
+			build_objects(objects.data(), objects.size(), build_object);
+		}
+
+		/// Builds the top level over the instances, with a binned SAH builder. This must be
+		/// called after the objects are built, and whenever an object or instance changes.
+		void build_top_level() {
+			auto instance_count = two_level_bvh.instances.size();
+			assert(instance_count > 0);
+			auto bboxes = std::make_unique<BoundingBox<Scalar>[]>(instance_count);
+			auto centers = std::make_unique<Vector3<Scalar>[]>(instance_count);
+			auto global_bbox = BoundingBox<Scalar>::empty();
+			for (size_t i = 0; i < instance_count; ++i) {
+				bboxes[i] = two_level_bvh.instance_bounding_box(i);
+				centers[i] = bboxes[i].center();
+				global_bbox.extend(bboxes[i]);
+			}
+
+			BinnedSahBuilder<TopLevelBvh, top_level_bin_count> builder(two_level_bvh.top_level);
+			builder.build(global_bbox, bboxes.get(), centers.get(), instance_count);
+		}
+	};
+
+	/// Primitive intersector for the top level of a two-level hierarchy: the ray is transformed
+	/// into the space of the instance, and traverses the BVH of its object with the intersector of
+	/// that object. Distances are the same in world and object space, since the direction of the
+	/// transformed ray is not normalized. Use with `SingleRayTraverser<TwoLevelBvh<Bvh>::TopLevelBvh>`.
+	template <typename Bvh, typename PrimitiveIntersector>
+	struct InstanceIntersector {
+		using Scalar = typename Bvh::ScalarType;
+
+		struct Result {
+			typename PrimitiveIntersector::Result hit;
+			size_t instance;
+
+			Scalar distance() const { return hit.distance(); }
+		};
+
+		static constexpr bool any_hit = PrimitiveIntersector::any_hit;
+
+		const TwoLevelBvh<Bvh>& two_level_bvh;
+		/// Intersectors of the objects, indexed by object.
+		PrimitiveIntersector* object_intersectors;
+
+		InstanceIntersector(const TwoLevelBvh<Bvh>& two_level_bvh, PrimitiveIntersector* object_intersectors)
+			: two_level_bvh(two_level_bvh), object_intersectors(object_intersectors)
+		{}
+
+		std::optional<Result> intersect(size_t index, const Ray<Scalar>& ray) const {
+			auto instance_index = two_level_bvh.top_level.primitive_indices[index];
+			const auto& instance = two_level_bvh.instances[instance_index];
+			const auto& object = two_level_bvh.objects[instance.object];
+			SingleRayTraverser<Bvh> traverser(object);
+			auto local_ray = instance.world_to_object.transform_ray(ray);
+			if (auto hit = traverser.traverse(local_ray, object_intersectors[instance.object], object.cylinder, object.hybrid))
+				return std::make_optional(Result { *hit, instance_index });
+			return std::nullopt;
+		}
+	};
+
+} // namespace bvh
+
+#endif
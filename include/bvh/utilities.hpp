@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <atomic>
 #include <memory>
+#include <utility>
 #include <queue>
 #include <algorithm>
 #include <cmath>
@@ -105,6 +106,74 @@ namespace bvh {
 		return std::isfinite(x) ? as<T>(as<U>(x) + ulps) : x;
 	}
 
+	/// Deleter of the arrays of a BVH. They are allocated with `new[]`, unless they are stored in a
+	/// memory-mapped file (see `BvhCache::map()`), in which case they share the ownership of the
+	/// mapping, which is unmapped along with the last of them. The conversion from the default
+	/// deleter lets arrays created by `std::make_unique` be assigned to the arrays of a BVH.
+	/// Arrays allocated by a `GrowingBuffer` also record their capacity, so that the buffer can
+	/// take them back: it is zero (unknown) for any other array.
+	template <typename T>
+	struct ArrayDeleter {
+		std::shared_ptr<void> mapping;
+		size_t capacity = 0;
+
+		ArrayDeleter() = default;
+		ArrayDeleter(std::default_delete<T[]>) {}
+		explicit ArrayDeleter(std::shared_ptr<void> mapping)
+			: mapping(std::move(mapping))
+		{}
+
+		// Releasing a mapped array gives up its share of the mapping, so that the next array owned
+		// by the same deleter is allocated with `new[]`, and whose capacity is not known either
+		void operator () (T* array) {
+			capacity = 0;
+			if (mapping)
+				mapping.reset();
+			else
+				delete[] array;
+		}
+	};
+
+	template <typename T>
+	using BvhArray = std::unique_ptr<T[], ArrayDeleter<T>>;
+
+	/// Array whose storage is kept when it is reused, and only grows. This avoids allocating
+	/// (and touching new pages of memory) for every build when a builder is used repeatedly.
+	template <typename T>
+	class GrowingBuffer {
+		BvhArray<T> data;
+
+	public:
+		/// Makes sure that the buffer holds at least the given number of elements, and returns it.
+		/// The contents of the buffer are not preserved when it grows.
+		T* reserve(size_t size) {
+			if (capacity() < size) {
+				data.reset(new T[size]);
+				data.get_deleter().capacity = size;
+			}
+			return data.get();
+		}
+
+		T* get() const { return data.get(); }
+
+		size_t capacity() const { return data ? data.get_deleter().capacity : 0; }
+
+		/// Exchanges the storage of two buffers.
+		void swap_storage(GrowingBuffer& other) {
+			std::swap(data, other.data);
+		}
+
+		/// Hands the storage of the buffer over to the given array (typically, an array of a BVH).
+		/// The previous storage of the array is taken back if it was allocated by a buffer, since
+		/// its capacity is then recorded with it, and is released otherwise. Arrays that replace
+		/// it in the meantime (e.g. after optimizing the layout of the BVH) have no known capacity.
+		void give(BvhArray<T>& array) {
+			std::swap(array, data);
+			if (capacity() == 0)
+				data.reset();
+		}
+	};
+
 	/// Computes the (rounded-up) compile-time log in base-2 of an unsigned integer.
 	inline constexpr size_t round_up_log2(size_t i, size_t p = 0) {
 		return (size_t(1) << p) >= i ? p : round_up_log2(i, p + 1);
@@ -311,6 +380,41 @@ namespace bvh {
 		return height;
 	}
 
+	/// Returns the distance between the segments [p0, p1] and [q0, q1], either of which can be a point.
+	template <typename Scalar>
+	Scalar segment_distance(const Vector3<Scalar>& p0, const Vector3<Scalar>& p1, const Vector3<Scalar>& q0, const Vector3<Scalar>& q1) {
+		auto d1 = p1 - p0;
+		auto d2 = q1 - q0;
+		auto r = p0 - q0;
+		auto a = dot(d1, d1);
+		auto e = dot(d2, d2);
+		auto f = dot(d2, r);
+		Scalar s = 0, t = 0;
+		if (a <= 0 && e > 0)
+			t = std::clamp(f / e, Scalar(0), Scalar(1));
+		else if (a > 0) {
+			auto c = dot(d1, r);
+			if (e <= 0)
+				s = std::clamp(-c / a, Scalar(0), Scalar(1));
+			else {
+				// Closest points of the lines, clamped to the first segment, then to the second one
+				auto b = dot(d1, d2);
+				auto denominator = a * e - b * b;
+				s = denominator > 0 ? std::clamp((b * f - c * e) / denominator, Scalar(0), Scalar(1)) : Scalar(0);
+				t = (b * s + f) / e;
+				if (t < 0) {
+					t = 0;
+					s = std::clamp(-c / a, Scalar(0), Scalar(1));
+				}
+				else if (t > 1) {
+					t = 1;
+					s = std::clamp((b - c) / a, Scalar(0), Scalar(1));
+				}
+			}
+		}
+		return length(p0 + d1 * s - (q0 + d2 * t));
+	}
+
 } // namespace bvh
 
 #endif
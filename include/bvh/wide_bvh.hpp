@@ -0,0 +1,167 @@
+#ifndef BVH_WIDE_BVH_HPP
+#define BVH_WIDE_BVH_HPP
+
+#include <memory>
+#include <limits>
+#include <cstdint>
+#include <cassert>
+#include <climits>
+
+#include "bvh/bvh.hpp"
+#include "bvh/bounding_box.hpp"
+#include "bvh/utilities.hpp"
+
+namespace bvh {
+
+	/// Node of a wide BVH. The bounding boxes of the `Width` children are stored as a
+	/// structure of arrays, so that all of them can be tested against a ray in one pass.
+	/// Unused child slots have an empty bounding box, which no ray can hit.
+	template <typename Scalar, size_t Width>
+	struct WideNode {
+		using IndexType = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
+
+		enum class ChildType : uint8_t {
+			Empty,      ///< Unused slot
+			Inner,      ///< Index of another wide node
+			Leaf,       ///< Range of primitive indices
+			Cylinder    ///< Index of the root of a cylinder subtree
+		};
+
+		/// Bounds of the children. For the child `i`, `bounds[2 * axis][i]` and `bounds[2 * axis + 1][i]`
+		/// are respectively the minimum and maximum coordinates on the given axis.
+		Scalar bounds[6][Width];
+		IndexType children[Width];
+		IndexType primitive_counts[Width];
+		ChildType types[Width];
+
+		void set_child(size_t i, ChildType type, const BoundingBox<Scalar>& bbox, IndexType index, IndexType primitive_count = 0) {
+			for (int axis = 0; axis < 3; ++axis) {
+				bounds[axis * 2 + 0][i] = bbox.min[axis];
+				bounds[axis * 2 + 1][i] = bbox.max[axis];
+			}
+			types[i] = type;
+			children[i] = index;
+			primitive_counts[i] = primitive_count;
+		}
+
+		void set_empty(size_t i) {
+			set_child(i, ChildType::Empty, BoundingBox<Scalar>::empty(), 0);
+		}
+
+		BoundingBox<Scalar> child_bounding_box(size_t i) const {
+			return BoundingBox<Scalar>(
+				Vector3<Scalar>(bounds[0][i], bounds[2][i], bounds[4][i]),
+				Vector3<Scalar>(bounds[1][i], bounds[3][i], bounds[5][i]));
+		}
+	};
+
+	/// Wide BVH, made of the AABB nodes of a binary BVH collapsed into nodes with `Width` children.
+	/// Primitive indices and cylinder nodes are not duplicated: they are still read from the binary
+	/// BVH, which must therefore outlive this structure. The root is located at index 0.
+	template <typename Scalar, size_t Width>
+	struct WideBvh {
+		using ScalarType = Scalar;
+		using Node = WideNode<Scalar, Width>;
+
+		static constexpr size_t width = Width;
+
+		std::unique_ptr<Node[]> nodes;
+		size_t node_count = 0;
+	};
+
+	/// Collapses the AABB part of a binary BVH into a wide BVH. Each wide node is obtained by
+	/// repeatedly opening the child with the largest surface area, until `Width` children are
+	/// gathered or only leaves remain. For hybrid BVHs, box leaves become links to the cylinder
+	/// subtree they bound (given by `Node::cylinder_root()`), which is kept binary.
+	template <typename Bvh, size_t Width>
+	class WideBvhCollapser {
+		static_assert(Width >= 2, "Wide BVH nodes must have at least two children");
+
+		using Scalar = typename Bvh::ScalarType;
+		using WideBvh = bvh::WideBvh<Scalar, Width>;
+		using WideNode = typename WideBvh::Node;
+		using ChildType = typename WideNode::ChildType;
+
+		const Bvh& bvh;
+
+		void set_child(WideNode& wide_node, size_t i, size_t index, WideBvh& wide_bvh, size_t* stack, size_t& stack_size) const {
+			const auto& node = bvh.nodes[index];
+			auto bbox = node.bounding_box_proxy().to_bounding_box();
+			if (!node.is_leaf) {
+				auto wide_index = wide_bvh.node_count++;
+				wide_node.set_child(i, ChildType::Inner, bbox, wide_index);
+				stack[stack_size++] = index;
+				stack[stack_size++] = wide_index;
+			} else if (bvh.hybrid)
+				wide_node.set_child(i, ChildType::Cylinder, bbox, node.cylinder_root());
+			else
+				wide_node.set_child(i, ChildType::Leaf, bbox, node.first_child_or_primitive, node.primitive_count);
+		}
+
+	public:
+		WideBvhCollapser(const Bvh& bvh)
+			: bvh(bvh)
+		{}
+
+		void collapse(WideBvh& wide_bvh) const {
+			assert(!bvh.cylinder || bvh.hybrid);
+
+			// Every wide node except the root consumes at least one inner binary node
+			wide_bvh.nodes = std::make_unique<WideNode[]>(bvh.node_count / 2 + 1);
+			wide_bvh.node_count = 1;
+
+			// The stack contains pairs of (binary node, wide node) indices
+			auto stack = std::make_unique<size_t[]>(2 * (bvh.node_count / 2 + 1));
+			size_t stack_size = 0;
+
+			if (bvh__unlikely(bvh.nodes[0].is_leaf)) {
+				auto& root = wide_bvh.nodes[0];
+				set_child(root, 0, 0, wide_bvh, stack.get(), stack_size);
+				for (size_t i = 1; i < Width; ++i)
+					root.set_empty(i);
+				return;
+			}
+
+			stack[stack_size++] = 0;
+			stack[stack_size++] = 0;
+			while (stack_size > 0) {
+				auto wide_index = stack[--stack_size];
+				auto index = stack[--stack_size];
+
+				size_t candidates[Width];
+				size_t candidate_count = 2;
+				candidates[0] = bvh.nodes[index].first_child_or_primitive;
+				candidates[1] = candidates[0] + 1;
+				while (candidate_count < Width) {
+					// Open the inner node with the largest area
+					size_t best = candidate_count;
+					Scalar best_area = -std::numeric_limits<Scalar>::max();
+					for (size_t i = 0; i < candidate_count; ++i) {
+						const auto& node = bvh.nodes[candidates[i]];
+						if (node.is_leaf)
+							continue;
+						auto area = node.bounding_box_proxy().half_area();
+						if (area > best_area) {
+							best = i;
+							best_area = area;
+						}
+					}
+					if (best == candidate_count)
+						break;
+					auto first_child = bvh.nodes[candidates[best]].first_child_or_primitive;
+					candidates[best] = first_child;
+					candidates[candidate_count++] = first_child + 1;
+				}
+
+				auto& wide_node = wide_bvh.nodes[wide_index];
+				for (size_t i = 0; i < candidate_count; ++i)
+					set_child(wide_node, i, candidates[i], wide_bvh, stack.get(), stack_size);
+				for (size_t i = candidate_count; i < Width; ++i)
+					wide_node.set_empty(i);
+			}
+		}
+	};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,332 @@
+#ifndef BVH_WIDE_RAY_TRAVERSER_HPP
+#define BVH_WIDE_RAY_TRAVERSER_HPP
+
+#include <cassert>
+#include <optional>
+
+#include "bvh/bvh.hpp"
+#include "bvh/wide_bvh.hpp"
+#include "bvh/ray.hpp"
+#include "bvh/node_intersectors.hpp"
+#include "bvh/primitive_intersectors.hpp"
+#include "bvh/utilities.hpp"
+#include "bvh/traversal_statistics.hpp"
+
+namespace bvh {
+
+	/// Single ray traversal algorithm for wide BVHs. All the children of a node are intersected
+	/// at once, and the ones that are hit are visited in front-to-back order. Cylinder subtrees
+	/// (in hybrid BVHs) are traversed two siblings at a time, as in `SingleRayTraverser`.
+	template <typename Bvh, size_t Width, size_t StackSize = 256>
+	class WideRayTraverser {
+	public:
+		static constexpr size_t stack_size = StackSize;
+
+		using WideBvh = bvh::WideBvh<typename Bvh::ScalarType, Width>;
+
+	private:
+		using Scalar = typename Bvh::ScalarType;
+		using WideNode = typename WideBvh::Node;
+		using ChildType = typename WideNode::ChildType;
+
+		struct Stack {
+			struct Element {
+				ChildType type;
+				size_t index;
+				Scalar distance;
+			};
+
+			Element elements[stack_size];
+			size_t size = 0;
+
+			void push(const Element& t) {
+				assert(size < stack_size);
+				elements[size++] = t;
+			}
+
+			Element pop() {
+				assert(!empty());
+				return elements[--size];
+			}
+
+			bool empty() const { return size == 0; }
+		};
+
+		struct StackC {
+			struct Element {
+				const typename Bvh::CustomNode* node;
+				Scalar distance;
+			};
+
+			Element elements[stack_size];
+			size_t size = 0;
+
+			void push(const Element& t) {
+				assert(size < stack_size);
+				elements[size++] = t;
+			}
+
+			Element pop() {
+				assert(!empty());
+				return elements[--size];
+			}
+
+			bool empty() const { return size == 0; }
+		};
+
+		/// Slab test for all the children of a wide node.
+		struct WideNodeIntersector {
+			std::array<int, 3> octant;
+			Vector3<Scalar> scaled_origin;
+			Vector3<Scalar> inverse_direction;
+
+			WideNodeIntersector(const Ray<Scalar>& ray)
+				: octant {
+					ray.direction[0] < Scalar(0),
+					ray.direction[1] < Scalar(0),
+					ray.direction[2] < Scalar(0)
+				}
+			{
+				inverse_direction = ray.direction.inverse();
+				scaled_origin = -ray.origin * inverse_direction;
+			}
+
+			bvh__always_inline__
+			void intersect(const WideNode& node, const Ray<Scalar>& ray, Scalar* bvh__restrict__ entry, Scalar* bvh__restrict__ exit) const {
+				const Scalar* bvh__restrict__ near[3];
+				const Scalar* bvh__restrict__ far[3];
+				for (int axis = 0; axis < 3; ++axis) {
+					near[axis] = node.bounds[axis * 2 + octant[axis]];
+					far[axis] = node.bounds[axis * 2 + 1 - octant[axis]];
+				}
+				#pragma omp simd
+				for (size_t i = 0; i < Width; ++i) {
+					Scalar entry_x = fast_multiply_add(near[0][i], inverse_direction[0], scaled_origin[0]);
+					Scalar entry_y = fast_multiply_add(near[1][i], inverse_direction[1], scaled_origin[1]);
+					Scalar entry_z = fast_multiply_add(near[2][i], inverse_direction[2], scaled_origin[2]);
+					Scalar exit_x  = fast_multiply_add(far[0][i], inverse_direction[0], scaled_origin[0]);
+					Scalar exit_y  = fast_multiply_add(far[1][i], inverse_direction[1], scaled_origin[1]);
+					Scalar exit_z  = fast_multiply_add(far[2][i], inverse_direction[2], scaled_origin[2]);
+					// Note: This order for the min/max operations is guaranteed not to produce NaNs
+					entry[i] = robust_max(entry_x, robust_max(entry_y, robust_max(entry_z, ray.tmin)));
+					exit[i]  = robust_min(exit_x, robust_min(exit_y, robust_min(exit_z, ray.tmax)));
+				}
+			}
+		};
+
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+		bool intersect_leaf(
+			size_t begin, size_t end,
+			Ray<Scalar>& ray,
+			std::optional<typename PrimitiveIntersector::Result>& best_hit,
+			PrimitiveIntersector& primitive_intersector,
+			Statistics& statistics) const
+		{
+			statistics.intersections += end - begin;
+			if constexpr (IntersectsLeaves<PrimitiveIntersector>::value) {
+				if (auto hit = primitive_intersector.intersect_leaf(begin, end, ray)) {
+					best_hit = hit;
+					if (primitive_intersector.any_hit)
+						return true;
+					ray.tmax = hit->distance();
+					statistics.missed_intersections += end - begin - 1;
+				}
+				else
+					statistics.missed_intersections += end - begin;
+				return false;
+			}
+			for (size_t i = begin; i < end; ++i) {
+				if (auto hit = primitive_intersector.intersect(i, ray)) {
+					best_hit = hit;
+					if (primitive_intersector.any_hit)
+						return true;
+					ray.tmax = hit->distance();
+				}
+				else
+					statistics.missed_intersections++;
+			}
+			return false;
+		}
+
+		/// Traverses a cylinder subtree. Returns true if the traversal can be stopped.
+		template <typename PrimitiveIntersector, typename Statistics>
+		bool intersect_cylinders(
+			const typename Bvh::CustomNode* cnode,
+			const CustomNodeIntersector<Bvh>& cnode_intersector,
+			Ray<Scalar>& ray,
+			std::optional<typename PrimitiveIntersector::Result>& best_hit,
+			PrimitiveIntersector& primitive_intersector,
+			Statistics& statistics) const
+		{
+			statistics.transitions++;
+
+			if (cnode->is_leaf) {
+				auto begin = cnode->first_child_or_primitive;
+				return intersect_leaf(begin, begin + cnode->primitive_count, ray, best_hit, primitive_intersector, statistics);
+			}
+
+			StackC stack;
+			while (true) {
+				statistics.traversal_steps++;
+
+				const auto* left = &bvh.cnodes[cnode->first_child_or_primitive + 0];
+				const auto* right = &bvh.cnodes[cnode->first_child_or_primitive + 1];
+				auto [distance_left, distance_right] = cnode_intersector.template intersect<2>(left, ray);
+				statistics.record_cylinder_tests(2,
+					(distance_left.first <= distance_left.second) + (distance_right.first <= distance_right.second));
+
+				if (distance_left.first <= distance_left.second) {
+					if (bvh__unlikely(left->is_leaf)) {
+						auto begin = left->first_child_or_primitive;
+						if (intersect_leaf(begin, begin + left->primitive_count, ray, best_hit, primitive_intersector, statistics))
+							return true;
+						left = nullptr;
+						// The hit may be closer than the right child
+						distance_right.second = std::min(distance_right.second, ray.tmax);
+					}
+				}
+				else
+					left = nullptr;
+
+				if (distance_right.first <= distance_right.second) {
+					if (bvh__unlikely(right->is_leaf)) {
+						auto begin = right->first_child_or_primitive;
+						if (intersect_leaf(begin, begin + right->primitive_count, ray, best_hit, primitive_intersector, statistics))
+							return true;
+						right = nullptr;
+					}
+				}
+				else
+					right = nullptr;
+
+				if (bvh__likely((left != NULL) ^ (right != NULL))) {
+					cnode = left != NULL ? left : right;
+				}
+				else if (bvh__unlikely((left != NULL) & (right != NULL))) {
+					if (distance_left.first > distance_right.first) {
+						std::swap(left, right);
+						std::swap(distance_left, distance_right);
+					}
+					stack.push(typename StackC::Element { right, distance_right.first });
+					record_max(statistics.max_stack_depth, stack.size);
+					cnode = left;
+				}
+				else {
+					// The ray may have been shortened since the top of the stack was pushed
+					auto element = typename StackC::Element { nullptr, Scalar(0) };
+					do {
+						if (stack.empty())
+							return false;
+						element = stack.pop();
+					} while (element.distance > ray.tmax);
+					cnode = element.node;
+				}
+			}
+		}
+
+		template <typename PrimitiveIntersector, typename Statistics>
+		bvh__always_inline__
+		std::optional<typename PrimitiveIntersector::Result>
+		intersect(Ray<Scalar> ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+			auto best_hit = std::optional<typename PrimitiveIntersector::Result>(std::nullopt);
+
+			WideNodeIntersector node_intersector(ray);
+			CustomNodeIntersector<Bvh> cnode_intersector(ray);
+
+			Stack stack;
+			stack.push(typename Stack::Element { ChildType::Inner, 0, ray.tmin });
+			while (!stack.empty()) {
+				auto element = stack.pop();
+				// The ray may have been shortened since this element was pushed
+				if (element.distance > ray.tmax)
+					continue;
+
+				if (element.type == ChildType::Cylinder) {
+					if (intersect_cylinders(&bvh.cnodes[element.index], cnode_intersector, ray, best_hit, primitive_intersector, statistics))
+						break;
+					continue;
+				}
+
+				statistics.traversal_steps++;
+
+				const auto& node = wide_bvh.nodes[element.index];
+				Scalar entry[Width], exit[Width];
+				node_intersector.intersect(node, ray, entry, exit);
+				statistics.box_tests += Width;
+
+				// Sort the children that are hit by increasing distance (insertion sort, since there are only a few)
+				size_t order[Width];
+				size_t hit_count = 0;
+				for (size_t i = 0; i < Width; ++i) {
+					if (node.types[i] == ChildType::Empty || !(entry[i] <= exit[i]))
+						continue;
+					size_t j = hit_count++;
+					for (; j > 0 && entry[order[j - 1]] > entry[i]; --j)
+						order[j] = order[j - 1];
+					order[j] = i;
+				}
+
+				// Leaves are processed eagerly, closest first, which helps culling the other children
+				bool done = false;
+				for (size_t j = 0; j < hit_count && !done; ++j) {
+					auto i = order[j];
+					if (node.types[i] == ChildType::Leaf && entry[i] <= ray.tmax) {
+						auto begin = node.children[i];
+						done = intersect_leaf(begin, begin + node.primitive_counts[i], ray, best_hit, primitive_intersector, statistics);
+					}
+				}
+				if (done)
+					break;
+
+				// The other children are pushed back-to-front, so that the closest one is popped first
+				for (size_t j = hit_count; j-- > 0;) {
+					auto i = order[j];
+					if (node.types[i] != ChildType::Leaf && entry[i] <= ray.tmax)
+						stack.push(typename Stack::Element { node.types[i], node.children[i], entry[i] });
+				}
+				record_max(statistics.max_stack_depth, stack.size);
+			}
+
+			return best_hit;
+		}
+
+		const WideBvh& wide_bvh;
+		const Bvh& bvh;
+
+	public:
+		/// Statistics collected during traversal: the number of traversal steps and intersections.
+		using Statistics = BasicStatistics;
+
+		/// Statistics collected during traversal, with a breakdown per type of bounding volume.
+		/// Box tests are counted per child slot of the wide nodes, including empty ones.
+		using DetailedStatistics = bvh::DetailedStatistics;
+
+		/// Creates a traverser for the given wide BVH. The binary BVH it was collapsed
+		/// from is needed to access the cylinder nodes.
+		WideRayTraverser(const WideBvh& wide_bvh, const Bvh& bvh)
+			: wide_bvh(wide_bvh), bvh(bvh)
+		{}
+
+		/// Intersects the BVH with the given ray and intersector.
+		template <typename PrimitiveIntersector>
+		bvh__always_inline__
+		std::optional<typename PrimitiveIntersector::Result>
+		traverse(const Ray<Scalar>& ray, PrimitiveIntersector& intersector) const {
+			NullStatistics statistics;
+			return intersect(ray, intersector, statistics);
+		}
+
+		/// Intersects the BVH with the given ray and intersector.
+		/// Records statistics on the traversal, either `Statistics` or `DetailedStatistics`.
+		template <typename PrimitiveIntersector, typename Counter, typename DetailedCounter>
+		bvh__always_inline__
+		std::optional<typename PrimitiveIntersector::Result>
+		traverse(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, TraversalStatistics<Counter, DetailedCounter>& statistics) const {
+			return intersect(ray, primitive_intersector, statistics);
+		}
+	};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,89 @@
+#include <vector>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/binned_sah_builder.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/batch_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = float;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Ray      = bvh::Ray<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+
+using ClosestIntersector = bvh::ClosestPrimitiveIntersector<Bvh, Triangle>;
+using AnyIntersector     = bvh::AnyPrimitiveIntersector<Bvh, Triangle>;
+
+// Box hierarchies are built with the binned SAH builder, which creates leaves of several primitives
+template <typename Bvh>
+using BinnedSahBuilder = bvh::BinnedSahBuilder<Bvh, 16>;
+
+// Incoherent rays, with random origins inside the scene and random directions.
+static std::vector<Ray> random_rays(size_t ray_count) {
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < ray_count; ++i)
+        rays.emplace_back(random_vector<Scalar>(-1, 1), bvh::normalize(random_vector<Scalar>(-1, 1)), Scalar(0), Scalar(0.5));
+    return rays;
+}
+
+// The batch must give the same results as tracing the rays one by one, in their original order.
+static bool check_batch(const Bvh& bvh, const std::vector<Triangle>& triangles, const std::vector<Ray>& rays) {
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::BatchTraverser<Bvh> batch_traverser(bvh);
+    ClosestIntersector closest_intersector(bvh, triangles.data());
+    AnyIntersector any_intersector(bvh, triangles.data());
+
+    auto hits = std::make_unique<std::optional<ClosestIntersector::Result>[]>(rays.size());
+    auto occluded = std::make_unique<bool[]>(rays.size());
+    batch_traverser.traverse_batch(rays.data(), rays.size(), closest_intersector, hits.get(), bvh.cylinder, bvh.hybrid);
+    batch_traverser.occluded_batch(rays.data(), rays.size(), any_intersector, occluded.get(), bvh.cylinder, bvh.hybrid);
+
+    size_t hit_count = 0;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        auto hit = traverser.traverse(rays[i], closest_intersector, bvh.cylinder, bvh.hybrid);
+        if (hit.has_value() != hits[i].has_value() ||
+            (hit && (hit->distance() != hits[i]->distance() || hit->primitive_index != hits[i]->primitive_index)) ||
+            occluded[i] != traverser.occluded(rays[i], any_intersector, bvh.cylinder, bvh.hybrid))
+            return false;
+        hit_count += hit.has_value();
+    }
+    std::cout << hit_count << " out of " << rays.size() << " ray(s) hit the scene" << std::endl;
+    return true;
+}
+
+int main() {
+    auto triangles = random_triangles<Scalar>(5000);
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        Bvh bvh;
+        build<BinnedSahBuilder>(bvh, triangles, mode);
+        // The small batch is traced without sorting
+        for (auto ray_count : { 100, 20000 }) {
+            if (!check_batch(bvh, triangles, random_rays(ray_count))) {
+                std::cerr << "Batch traversal does not match single-ray traversal" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // Rays that share the same origin must not break the Morton encoding
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < 5000; ++i)
+        rays.emplace_back(Vector3(0), bvh::normalize(random_vector<Scalar>(-1, 1)));
+    Bvh bvh;
+    build<BinnedSahBuilder>(bvh, triangles, Mode::Boxes);
+    if (!check_batch(bvh, triangles, rays)) {
+        std::cerr << "Batch traversal of rays with a common origin does not match single-ray traversal" << std::endl;
+        return 1;
+    }
+    return 0;
+}
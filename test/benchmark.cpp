@@ -6,32 +6,38 @@
 #include <fstream>
 #include <cstdint>
 #include <functional>
+#include <optional>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
 
 #include <bvh/bvh.hpp>
+#include <bvh/build_observer.hpp>
+#include <bvh/morton.hpp>
 #include <bvh/binned_sah_builder.hpp>
 #include <bvh/sweep_sah_builder.hpp>
 #include <bvh/spatial_split_bvh_builder.hpp>
 #include <bvh/locally_ordered_clustering_builder.hpp>
+#include <bvh/chunked_hybrid_builder.hpp>
 #include <bvh/linear_bvh_builder.hpp>
 #include <bvh/parallel_reinsertion_optimizer.hpp>
 #include <bvh/node_layout_optimizer.hpp>
+#include <bvh/tree_layout_optimizer.hpp>
+#include <bvh/triangle_blocks.hpp>
 #include <bvh/leaf_collapser.hpp>
 #include <bvh/heuristic_primitive_splitter.hpp>
 #include <bvh/hierarchy_refitter.hpp>
 #include <bvh/single_ray_traverser.hpp>
+#include <bvh/wide_bvh.hpp>
+#include <bvh/wide_ray_traverser.hpp>
+#include <bvh/packet_traverser.hpp>
 #include <bvh/primitive_intersectors.hpp>
 #include <bvh/triangle.hpp>
+#include <bvh/bvh_cache.hpp>
+#include <bvh/bvh_analyzer.hpp>
 
 #include <bvh/obj_exporter.hpp>
 
-using Scalar = double;
-using Vector3 = bvh::Vector3<Scalar>;
-using Triangle = bvh::Triangle<Scalar>;
-using BoundingBox = bvh::BoundingBox<Scalar>;
-using BoundingCyl = bvh::BoundingCyl<Scalar>;
-using Ray = bvh::Ray<Scalar>;
-using Bvh = bvh::Bvh<Scalar>;
-
 #include "obj.hpp"
 
 template <typename F>
@@ -43,6 +49,35 @@ void profile(const char* task, F f) {
 	std::cout << task << " took " << ms << "ms" << std::endl;
 }
 
+/// Returns the time taken by the given function, in milliseconds.
+template <typename F>
+double measure(F f) {
+	auto start_tick = std::chrono::high_resolution_clock::now();
+	f();
+	auto end_tick = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::milli>(end_tick - start_tick).count();
+}
+
+/// Splits a comma-separated list of values given on the command line.
+static std::vector<std::string> split_list(const char* list) {
+	std::vector<std::string> values;
+	for (const char* p = list; ; ++p) {
+		auto end = strchr(p, ',');
+		values.emplace_back(p, end ? end - p : strlen(p));
+		if (!end)
+			break;
+		p = end;
+	}
+	return values;
+}
+
+static std::vector<size_t> split_size_list(const char* list) {
+	std::vector<size_t> values;
+	for (const auto& value : split_list(list))
+		values.push_back(strtoull(value.c_str(), NULL, 10));
+	return values;
+}
+
 static int not_enough_arguments(const char* option) {
 	std::cerr << "Not enough arguments for '" << option << "'" << std::endl;
 	return 1;
@@ -56,10 +91,16 @@ static void usage() {
 		"  --builder <name>        Sets the BVH builder to use (defaults to 'hybrid').\n"
 		"  --optimizer <name>      Sets the BVH optimizer to use (none by default).\n"
 		"  --pre-shuffle           Activates the pre-shuffling optimization (disabled by default).\n"
+		"  --leaf-blocks <size>    Stores the triangles of each leaf in SIMD blocks of 4 or 8 triangles, after any\n"
+		"                          builder, and intersects them one block at a time. This replaces pre-shuffling\n"
+		"                          (disabled by default).\n"
 		"  --optimize-layout       Activates the node layout optimization (disabled by default).\n"
+		"  --tree-layout <order>   Renumbers the nodes in 'depth_first' or 'van_emde_boas' order, including the\n"
+		"                          cylinder subtrees of hybrid hierarchies (disabled by default).\n"
 		"  --collapse-leaves       Activates the leaf collapse optimization (disabled by default).\n"
 		"  --parallel-reinsertion  Activates the parallel reinsertion optimization (disabled by default).\n"
 		"  --pre-split <percent>   Activates pre-splitting and sets the percentage of references (disabled by default).\n"
+		"                          Cylinder builders split long triangles along the axis of their cylinders.\n"
 		"  --eye <x> <y> <z>       Sets the position of the camera.\n"
 		"  --dir <x> <y> <z>       Sets the direction of the camera.\n"
 		"  --up  <x> <y> <z>       Sets the up vector of the camera.\n"
@@ -68,6 +109,41 @@ static void usage() {
 		"  --height <pixels>       Sets the image height.\n"
 		"  --r <radius>		  Sets the search radius for methods based on locally-ordered clustering (defaults to 10).\n"
 		"  --i <iterations>	  Sets the transition iteration for a hybrid builder (defaults to 5).\n"
+		"  --adaptive <cost>       Switches each cluster of a hybrid builder from cylinders to boxes when its cylinder\n"
+		"                          test, of the given cost relative to a box test, becomes more expensive (disabled by\n"
+		"                          default). The number of iterations given by '--i' is then an upper bound.\n"
+		"  --chunk-size <count>    Sets the maximum number of primitives of the chunks that the 'hybrid_chunked'\n"
+		"                          builder clusters into cylinder subtrees (defaults to 32).\n"
+		"  --fast-cylinder-search  Ranks the merge candidates of cylinder clusters with a cheap upper bound on the\n"
+		"                          area of their union, instead of computing it (disabled by default).\n"
+		"  --cylinder-search <steps> <clusters>\n"
+		"                          Optimizes the axis of merged cylinders with a brute-force search over steps^2\n"
+		"                          candidates, once at most the given number of clusters remain (disabled by default).\n"
+		"  --direction-bits <bits> Sorts cylinders by a 64-bit code that also encodes the direction of their axis\n"
+		"                          with the given number of bits per dimension (disabled by default).\n"
+		"  --compact-cylinders     Stores cylinder nodes in a compact, 32-byte layout (disabled by default).\n"
+		"  --float                 Builds and traverses the BVH in single precision, instead of double\n"
+		"                          precision (disabled by default).\n"
+		"  --wide <width>          Collapses the AABB nodes into a BVH of the given width (4 or 8) for rendering.\n"
+		"  --packet <size>         Traces packets of 4, 8, or 16 rays for neighboring pixels (disabled by default).\n"
+		"  --cache <directory>     Loads the BVH from a cache in the given directory if it was already built for the\n"
+		"                          same scene and options, and stores it there otherwise (disabled by default).\n"
+		"  --profile-build         Prints the duration of each phase of the construction of the BVH, and of each\n"
+		"                          clustering iteration (disabled by default).\n"
+		"  --export-geometry       Writes the bounding volumes of each level of the BVH into an OBJ file, in addition\n"
+		"                          to the statistics of each level (disabled by default).\n"
+		"  --analyze <file.json>   Writes quality metrics of the BVH (per-level areas, overlap, leaf sizes, SAH cost)\n"
+		"                          to the given JSON file (disabled by default).\n"
+		"  --sweep <file>          Benchmarks every combination of the builders, search radii, and iterations given\n"
+		"                          by the options below, on a scene that is only loaded once, and writes the results\n"
+		"                          (build times, Mrays/s for primary and shadow rays, memory footprint) to the given\n"
+		"                          JSON (.json extension) or CSV file. No image is rendered in this mode.\n"
+		"  --sweep-builders <name,...>\n"
+		"                          Sets the builders of a sweep (defaults to the one given by '--builder').\n"
+		"  --sweep-r <r,...>       Sets the search radii of a sweep (defaults to the one given by '--r').\n"
+		"  --sweep-i <i,...>       Sets the transition iterations of a sweep (defaults to the one given by '--i').\n"
+		"  --warmup <count>        Sets the number of untimed runs before the measurements of a sweep (defaults to 1).\n"
+		"  --repetitions <count>   Sets the number of timed runs of a sweep (defaults to 5).\n"
 		"  -o <file.ppm>           Sets the output file name (defaults to 'render.ppm').\n\n"
 		"  --rotate <axis> <degrees>\n\n"
 		"    Rotates the scene by the given amount of degrees on the\n"
@@ -86,157 +162,351 @@ static void usage() {
 		"  locally_ordered_clustering,\n"
 		"  ploc_cylinder,\n"
 		"  hybrid,\n"
+		"  hybrid_chunked,\n"
 		"  linear\n"
 		"\nOptimizers:\n"
 		"  parallel_reinsertion\n"
 		<< std::endl;
 }
 
+/// Camera parameters, given on the command line in double precision whatever the precision of the BVH.
 struct Camera {
-	Vector3 eye;
-	Vector3 dir;
-	Vector3 up;
-	Scalar  fov;
+	bvh::Vector3<double> eye;
+	bvh::Vector3<double> dir;
+	bvh::Vector3<double> up;
+	double fov;
 };
 
-template <bool PreShuffle, bool CollectStatistics>
+/// Generates the primary rays of a camera, for an image of the given size.
+template <typename Scalar>
+struct CameraRays {
+	using Vector3 = bvh::Vector3<Scalar>;
+
+	Vector3 eye, dir, image_u, image_v;
+	size_t width, height;
+
+	CameraRays(const Camera& camera, size_t width, size_t height)
+		: width(width), height(height)
+	{
+		auto convert = [] (const bvh::Vector3<double>& v) { return Vector3(Scalar(v[0]), Scalar(v[1]), Scalar(v[2])); };
+		eye = convert(camera.eye);
+		dir = bvh::normalize(convert(camera.dir));
+		image_u = bvh::normalize(bvh::cross(dir, convert(camera.up)));
+		image_v = bvh::normalize(bvh::cross(image_u, dir));
+		auto image_w = Scalar(std::tan(camera.fov * (3.14159265 * (1.0 / 180.0) * 0.5)));
+		auto ratio = Scalar(height) / Scalar(width);
+		image_u = image_u * image_w;
+		image_v = image_v * image_w * ratio;
+	}
+
+	/// Returns the ray going through the center of the given pixel.
+	bvh::Ray<Scalar> generate(size_t i, size_t j) const {
+		auto u = 2 * (i + Scalar(0.5)) / Scalar(width) - Scalar(1);
+		auto v = 2 * (j + Scalar(0.5)) / Scalar(height) - Scalar(1);
+		return bvh::Ray<Scalar>(eye, bvh::normalize(image_u * u + image_v * v + dir));
+	}
+};
+
+/// Binds the traversal mode (boxes, cylinders, or hybrid) of a BVH to the single-ray traverser,
+/// so that it exposes the same interface as the other traversers.
+template <typename Bvh>
+struct BinaryTraverser {
+	using Statistics = typename bvh::SingleRayTraverser<Bvh>::Statistics;
+	using DetailedStatistics = typename bvh::SingleRayTraverser<Bvh>::DetailedStatistics;
+	using Ray = bvh::Ray<typename Bvh::ScalarType>;
+
+	bvh::SingleRayTraverser<Bvh> traverser;
+	bool cylinder, hybrid;
+
+	BinaryTraverser(const Bvh& bvh)
+		: traverser(bvh), cylinder(bvh.cylinder), hybrid(bvh.hybrid)
+	{}
+
+	template <typename PrimitiveIntersector>
+	auto traverse(const Ray& ray, PrimitiveIntersector& intersector) const {
+		return traverser.traverse(ray, intersector, cylinder, hybrid);
+	}
+
+	template <typename PrimitiveIntersector, typename Counter, typename DetailedCounter>
+	auto traverse(const Ray& ray, PrimitiveIntersector& intersector, bvh::TraversalStatistics<Counter, DetailedCounter>& statistics) const {
+		return traverser.traverse(ray, intersector, cylinder, hybrid, statistics);
+	}
+};
+
+/// Renders one pixel at a time with a single-ray traverser.
+template <typename Traverser>
+struct SingleRayRendering {
+	using Statistics = typename Traverser::DetailedStatistics;
+
+	static constexpr size_t tile_width  = 1;
+	static constexpr size_t tile_height = 1;
+
+	Traverser traverser;
+
+	template <bool CollectStatistics, typename Ray, typename PrimitiveIntersector>
+	void traverse(const Ray* rays, size_t, PrimitiveIntersector& intersector, std::optional<typename PrimitiveIntersector::Result>* hits, Statistics* statistics) const {
+		if constexpr (CollectStatistics)
+			hits[0] = traverser.traverse(rays[0], intersector, statistics[0]);
+		else
+			hits[0] = traverser.traverse(rays[0], intersector);
+	}
+};
+
+/// Renders tiles of pixels at once with the packet traverser.
+template <typename Bvh, size_t TileWidth, size_t TileHeight>
+struct PacketRendering {
+	using Traverser = bvh::PacketTraverser<Bvh, TileWidth * TileHeight>;
+	using Statistics = typename Traverser::Statistics;
+	using Ray = bvh::Ray<typename Bvh::ScalarType>;
+
+	static constexpr size_t tile_width  = TileWidth;
+	static constexpr size_t tile_height = TileHeight;
+
+	Traverser traverser;
+	bool cylinder, hybrid;
+
+	PacketRendering(const Bvh& bvh)
+		: traverser(bvh), cylinder(bvh.cylinder), hybrid(bvh.hybrid)
+	{}
+
+	template <bool CollectStatistics, typename PrimitiveIntersector>
+	void traverse(const Ray* rays, size_t ray_count, PrimitiveIntersector& intersector, std::optional<typename PrimitiveIntersector::Result>* hits, Statistics* statistics) const {
+		if constexpr (CollectStatistics)
+			traverser.traverse(rays, ray_count, intersector, hits, cylinder, hybrid, statistics);
+		else
+			traverser.traverse(rays, ray_count, intersector, hits, cylinder, hybrid);
+	}
+};
+
+/// Statistics of the rays traced by one thread. Each thread accumulates its own, and they are
+/// merged once every tile is rendered, so that the totals do not depend on the scheduling.
+struct RenderStatistics {
+	size_t traversal_steps = 0;
+	size_t intersections = 0;
+	size_t hit_count = 0;
+	size_t combined_sum = 0;
+	size_t min_combined = std::numeric_limits<size_t>::max();
+	size_t max_combined = 0;
+	/// Breakdown of the traversal, only recorded by the single-ray traversers
+	bvh::DetailedStatistics detailed;
+
+	/// Records a ray that hit something, with the given sum of traversal steps and intersections.
+	void add_hit(size_t combined) {
+		hit_count++;
+		combined_sum += combined;
+		min_combined = std::min(min_combined, combined);
+		max_combined = std::max(max_combined, combined);
+	}
+
+	void merge(const RenderStatistics& other) {
+		traversal_steps += other.traversal_steps;
+		intersections += other.intersections;
+		hit_count += other.hit_count;
+		combined_sum += other.combined_sum;
+		min_combined = std::min(min_combined, other.min_combined);
+		max_combined = std::max(max_combined, other.max_combined);
+		detailed += other.detailed;
+	}
+};
+
+/// Size (in pixels) of the square tiles that are distributed to the rendering threads.
+static constexpr size_t render_tile_size = 16;
+
+/// Returns the origin of the tiles covering an image of the given size, in Morton order,
+/// so that consecutive tiles (and thus tiles rendered at the same time) are close in the image.
+static std::vector<std::pair<size_t, size_t>> morton_ordered_tiles(size_t width, size_t height) {
+	size_t tile_count_x = (width + render_tile_size - 1) / render_tile_size;
+	size_t tile_count_y = (height + render_tile_size - 1) / render_tile_size;
+	std::vector<std::pair<uint64_t, size_t>> codes(tile_count_x * tile_count_y);
+	for (size_t y = 0; y < tile_count_y; ++y) {
+		for (size_t x = 0; x < tile_count_x; ++x)
+			codes[y * tile_count_x + x] = std::make_pair(bvh::morton_encode<uint64_t>(x, y, 0), y * tile_count_x + x);
+	}
+	std::sort(codes.begin(), codes.end());
+	std::vector<std::pair<size_t, size_t>> tiles(codes.size());
+	for (size_t i = 0; i < codes.size(); ++i) {
+		auto index = codes[i].second;
+		tiles[i] = std::make_pair((index % tile_count_x) * render_tile_size, (index / tile_count_x) * render_tile_size);
+	}
+	return tiles;
+}
+
+/// Maps a statistic, relative to the mean over the image, to a color.
+// original method author: Jiri Bittner
+template <typename Scalar>
+static void heatmap_color(Scalar combined, Scalar mean, Scalar* color) {
+	auto value = Scalar(1.0f) - combined / (mean * Scalar(2.0f));
+	value = value < 0 ? Scalar(0.0f) : value;
+	auto x = value * Scalar(4.0f);
+	value = x - (int)x;
+	switch ((int)x) {
+	case 0: // red to yellow
+		color[0] = Scalar(1.0f);
+		color[1] = Scalar(value);
+		color[2] = 0.0f;
+		break;
+	case 1: // yellow to green
+		color[0] = Scalar(1.0f) - Scalar(value);
+		color[1] = Scalar(1.0f);
+		color[2] = 0.0f;
+		break;
+	case 2: // green to cyan
+		color[0] = 0.0f;
+		color[1] = Scalar(1.0f);
+		color[2] = Scalar(value);
+		break;
+	case 3: // cyan to blue
+		color[0] = 0.0f;
+		color[1] = Scalar(1.0f) - Scalar(value);
+		color[2] = Scalar(1.0f);
+		break;
+	default: // blue to magenta
+		color[0] = Scalar(value);
+		color[1] = 0.0f;
+		color[2] = Scalar(1.0f);
+		break;
+	}
+}
+
+/// Renders the image tile by tile. The tiles are visited in Morton order and handed out
+/// dynamically to the threads, and the pixels within a tile are traced row by row, in groups
+/// of the size of the packets of the rendering method. When statistics are collected, the
+/// colors are assigned in a second pass, once the mean over the whole image is known. The triangles
+/// are only used for shading, and are indexed by the primitive indices returned by the intersector.
+template <bool CollectStatistics, typename Scalar, typename Rendering, typename PrimitiveIntersector>
 void render(
 	const Camera& camera,
-	const Bvh& bvh,
-	const Triangle* triangles,
+	const Rendering& rendering,
+	PrimitiveIntersector intersector,
+	const bvh::Triangle<Scalar>* triangles,
 	Scalar* pixels,
 	size_t width, size_t height,
-	const Scalar* statistics_weights = NULL)
+	const double* statistics_weights = NULL)
 {
-	auto dir = bvh::normalize(camera.dir);
-	auto image_u = bvh::normalize(bvh::cross(dir, camera.up));
-	auto image_v = bvh::normalize(bvh::cross(image_u, dir));
-	auto image_w = std::tan(camera.fov * Scalar(3.14159265 * (1.0 / 180.0) * 0.5));
-	auto ratio = Scalar(height) / Scalar(width);
-	image_u = image_u * image_w;
-	image_v = image_v * image_w * ratio;
-
-	bvh::ClosestPrimitiveIntersector<Bvh, Triangle, PreShuffle> intersector(bvh, triangles);
-	bvh::SingleRayTraverser<Bvh> traverser(bvh);
-
-
-	// collect overall statistics
-	size_t traversal_steps = 0, intersections = 0, count = 0;
-	Scalar mean = 0;
-	size_t maxval = 0, minval = std::numeric_limits<size_t>::max();
-
-#pragma omp parallel for collapse(2) reduction(+: traversal_steps, intersections)
-	for (size_t i = 0; i < width; ++i) {
-		for (size_t j = 0; j < height; ++j) {
-			size_t index = 3 * (width * j + i);
-
-			auto u = 2 * (i + Scalar(0.5)) / Scalar(width) - Scalar(1);
-			auto v = 2 * (j + Scalar(0.5)) / Scalar(height) - Scalar(1);
-
-			Ray ray(camera.eye, bvh::normalize(image_u * u + image_v * v + dir));
-
-			bvh::SingleRayTraverser<Bvh>::Statistics statistics;
-			auto hit = CollectStatistics
-				? traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid, statistics)
-				: traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
-			if (CollectStatistics) {
-				traversal_steps += statistics.traversal_steps;
-				intersections += statistics.intersections;
-			}
-			if (!hit) {
-				if (CollectStatistics)
-					pixels[index] = pixels[index + 1] = pixels[index + 2] = 0;
-				else {
-					pixels[index] = 0.50;
-					pixels[index + 1] = 0.8;
-					pixels[index + 2] = 1;
-				}
-			}
-			else {
-				if (CollectStatistics) {
-					/// Original version
-					//pixels[index] = std::min(statistics.traversal_steps * statistics_weights[0], Scalar(1.0f));
-					//pixels[index + 1] = std::min(statistics.intersections * statistics_weights[1], Scalar(1.0f));
-					//pixels[index + 2] = std::min(combined * statistics_weights[2], Scalar(1.0f));
-
-					/// Color mapping statistics
-					// original method author: Jiri Bittner
-					auto combined = statistics.traversal_steps + statistics.intersections;
-					if (combined < minval)
-						minval = combined;
-					if (combined > maxval)
-						maxval = combined;
-					count++;
-					mean += (Scalar(combined) - mean) / Scalar(count);
-
-					auto value = Scalar(1.0f) - combined / (mean * Scalar(2.0f));
-					value = value < 0 ? Scalar(0.0f) : value;
-					auto x = value * Scalar(4.0f);
-					value = x - (int)x;
-					pixels[index] = 0.0f;
-					pixels[index + 1] = 0.0f;
-					pixels[index + 2] = 0.0f;
-					switch ((int)x) {
-					case 0: // red to yellow
-						pixels[index] = Scalar(1.0f);
-						pixels[index + 1] = Scalar(value);
-						pixels[index + 2] = 0.0f;
-						break;
-					case 1: // yellow to green
-						pixels[index] = Scalar(1.0f) - Scalar(value);
-						pixels[index + 1] = Scalar(1.0f);
-						pixels[index + 2] = 0.0f;
-						break;
-					case 2: // green to cyan
-						pixels[index] = 0.0f;
-						pixels[index + 1] = Scalar(1.0f);
-						pixels[index + 2] = Scalar(value);
-						break;
-					case 3: // cyan to blue
-						pixels[index] = 0.0f;
-						pixels[index + 1] = Scalar(1.0f) - Scalar(value);
-						pixels[index + 2] = Scalar(1.0f);
-						break;
-					default: // blue to magenta
-						pixels[index] = Scalar(value);
-						pixels[index + 1] = 0.0f;
-						pixels[index + 2] = Scalar(1.0f);
-						break;
+	using Vector3  = bvh::Vector3<Scalar>;
+	using Ray      = bvh::Ray<Scalar>;
+
+	CameraRays<Scalar> camera_rays(camera, width, height);
+
+	static constexpr size_t packet_width  = Rendering::tile_width;
+	static constexpr size_t packet_height = Rendering::tile_height;
+	static constexpr size_t packet_size   = packet_width * packet_height;
+	static_assert(render_tile_size % packet_width == 0 && render_tile_size % packet_height == 0);
+
+	// Sum of the traversal steps and intersections of each pixel, or -1 for pixels without a hit
+	static constexpr size_t no_hit = size_t(-1);
+	std::vector<size_t> combined_statistics(CollectStatistics ? width * height : 0);
+
+	auto tiles = morton_ordered_tiles(width, height);
+	RenderStatistics statistics;
+
+#pragma omp parallel
+	{
+		RenderStatistics thread_statistics;
+
+#pragma omp for schedule(dynamic) nowait
+		for (size_t tile = 0; tile < tiles.size(); ++tile) {
+			auto [tile_i, tile_j] = tiles[tile];
+			auto tile_end_i = std::min(tile_i + render_tile_size, width);
+			auto tile_end_j = std::min(tile_j + render_tile_size, height);
+			for (size_t packet_j = tile_j; packet_j < tile_end_j; packet_j += packet_height) {
+				for (size_t packet_i = tile_i; packet_i < tile_end_i; packet_i += packet_width) {
+					Ray rays[packet_size];
+					size_t indices[packet_size];
+					size_t ray_count = 0;
+					for (size_t j = packet_j; j < std::min(packet_j + packet_height, tile_end_j); ++j) {
+						for (size_t i = packet_i; i < std::min(packet_i + packet_width, tile_end_i); ++i) {
+							indices[ray_count] = width * j + i;
+							rays[ray_count++] = camera_rays.generate(i, j);
+						}
+					}
+
+					std::optional<typename decltype(intersector)::Result> hits[packet_size];
+					typename Rendering::Statistics packet_statistics[packet_size];
+					rendering.template traverse<CollectStatistics>(rays, ray_count, intersector, hits, packet_statistics);
+
+					for (size_t k = 0; k < ray_count; ++k) {
+						size_t index = 3 * indices[k];
+						const auto& ray = rays[k];
+						const auto& hit = hits[k];
+						if constexpr (CollectStatistics) {
+							const auto& ray_statistics = packet_statistics[k];
+							thread_statistics.traversal_steps += ray_statistics.traversal_steps;
+							thread_statistics.intersections += ray_statistics.intersections;
+							size_t combined = ray_statistics.traversal_steps + ray_statistics.intersections;
+							if constexpr (std::is_same<typename Rendering::Statistics, bvh::DetailedStatistics>::value)
+								thread_statistics.detailed += ray_statistics;
+							if (hit)
+								thread_statistics.add_hit(combined);
+							combined_statistics[indices[k]] = hit ? combined : no_hit;
+						}
+						else if (!hit) {
+							pixels[index] = 0.50;
+							pixels[index + 1] = 0.8;
+							pixels[index + 2] = 1;
+						}
+						else {
+							auto normal = bvh::normalize(triangles[hit->primitive_index].n);
+							//pixels[index] = std::fabs(normal[0]);
+							//pixels[index + 1] = std::fabs(normal[1]);
+							//pixels[index + 2] = std::fabs(normal[2]); 
+
+							/// Render in white
+							auto dotprod = bvh::dot(ray.direction, normal);
+							Vector3 color;
+							if (dotprod < Scalar(0))
+								color = Vector3(std::max(Scalar(0.05), -dotprod));
+							else
+								color = Vector3(0);
+
+							pixels[index] = std::fabs(color[0]);
+							pixels[index + 1] = std::fabs(color[1]);
+							pixels[index + 2] = std::fabs(color[2]);
+						}
 					}
-					// end of Colormapping statistics
-				}
-				else {
-					auto normal = bvh::normalize(triangles[hit->primitive_index].n);
-					//pixels[index] = std::fabs(normal[0]);
-					//pixels[index + 1] = std::fabs(normal[1]);
-					//pixels[index + 2] = std::fabs(normal[2]); 
-
-					/// Render in white
-					auto dotprod = bvh::dot(ray.direction, normal);
-					Vector3 color;
-					if (dotprod < Scalar(0))
-						color = Vector3(std::max(0.05, -dotprod));
-					else
-						color = Vector3(0);
-
-					pixels[index] = std::fabs(color[0]);
-					pixels[index + 1] = std::fabs(color[1]);
-					pixels[index + 2] = std::fabs(color[2]);
 				}
 			}
 		}
+
+#pragma omp critical
+		statistics.merge(thread_statistics);
 	}
 
-	if (CollectStatistics) {
-		std::cout << intersections << " total primitive intersection(s)" << std::endl;
-		std::cout << traversal_steps << " total traversal step(s)" << std::endl;
-		std::cout << " minimum no. of intersects/trav.steps. " << minval << std::endl;
-		std::cout << " maximum no. of intersects/trav.steps. " << maxval << std::endl;
+	if constexpr (CollectStatistics) {
+		/// Original version
+		//pixels[index] = std::min(statistics.traversal_steps * statistics_weights[0], Scalar(1.0f));
+		//pixels[index + 1] = std::min(statistics.intersections * statistics_weights[1], Scalar(1.0f));
+		//pixels[index + 2] = std::min(combined * statistics_weights[2], Scalar(1.0f));
+
+		/// Color mapping statistics
+		auto mean = statistics.hit_count > 0 ? Scalar(statistics.combined_sum) / Scalar(statistics.hit_count) : Scalar(1);
+#pragma omp parallel for
+		for (size_t i = 0; i < width * height; ++i) {
+			if (combined_statistics[i] == no_hit)
+				pixels[3 * i] = pixels[3 * i + 1] = pixels[3 * i + 2] = 0;
+			else
+				heatmap_color(Scalar(combined_statistics[i]), mean, pixels + 3 * i);
+		}
+
+		std::cout << statistics.intersections << " total primitive intersection(s)" << std::endl;
+		std::cout << statistics.traversal_steps << " total traversal step(s)" << std::endl;
+		std::cout << " minimum no. of intersects/trav.steps. " << statistics.min_combined << std::endl;
+		std::cout << " maximum no. of intersects/trav.steps. " << statistics.max_combined << std::endl;
+		if constexpr (std::is_same<typename Rendering::Statistics, bvh::DetailedStatistics>::value) {
+			const auto& detailed = statistics.detailed;
+			std::cout << detailed.box_tests << " ray-box test(s)" << std::endl;
+			std::cout << detailed.cylinder_tests << " ray-cylinder test(s): "
+				<< detailed.cylinder_hits << " hit(s), " << detailed.cylinder_misses << " miss(es)" << std::endl;
+			std::cout << detailed.transitions << " box-to-cylinder transition(s)" << std::endl;
+			std::cout << detailed.missed_intersections << " primitive intersection(s) without a hit" << std::endl;
+			std::cout << " maximum stack depth " << detailed.max_stack_depth << std::endl;
+		}
 	}
 }
 
-template <size_t Axis>
-static void rotate_triangles(Scalar degrees, Triangle* triangles, size_t triangle_count) {
+template <size_t Axis, typename Scalar>
+static void rotate_triangles(Scalar degrees, bvh::Triangle<Scalar>* triangles, size_t triangle_count) {
+	using Vector3 = bvh::Vector3<Scalar>;
 	static constexpr Scalar pi = Scalar(3.14159265359);
 	auto cos = std::cos(degrees * pi / Scalar(180));
 	auto sin = std::sin(degrees * pi / Scalar(180));
@@ -253,234 +523,557 @@ static void rotate_triangles(Scalar degrees, Triangle* triangles, size_t triangl
 		auto p0 = rotate(triangles[i].p0);
 		auto p1 = rotate(triangles[i].p1());
 		auto p2 = rotate(triangles[i].p2());
-		triangles[i] = Triangle(p0, p1, p2);
+		triangles[i] = bvh::Triangle<Scalar>(p0, p1, p2);
 	}
 }
 
-int main(int argc, char** argv) {
-	if (argc < 2) {
-		usage();
-		return 1;
-	}
-
+struct Options {
 	const char* output_file = "render.ppm";
 	const char* input_file = NULL;
 	const char* builder_name = "hybrid";
 	Camera camera = {
-		Vector3(0, 0, -10),
-		Vector3(0, 0, 1),
-		Vector3(0, 1, 0),
+		bvh::Vector3<double>(0, 0, -10),
+		bvh::Vector3<double>(0, 0, 1),
+		bvh::Vector3<double>(0, 1, 0),
 		60
 	};
 
 	bool pre_shuffle = false;
+	size_t leaf_block_size = 0;
 	bool optimize_layout = false;
 	bool parallel_reinsertion = false;
 	bool collapse_leaves = false;
-	Scalar pre_split_factor = 0;
+	const char* tree_layout = NULL;
+	double pre_split_factor = 0;
 	bool collect_statistics = false;
 	size_t rotation_axis = 3;
-	Scalar rotation_degrees = 0;
-	Scalar statistics_weights[3];
+	double rotation_degrees = 0;
+	double statistics_weights[3] = { 0, 0, 0 };
 	size_t width = 1080;
 	size_t height = 720;
-	/// New variables
 	size_t rad = 10;
 	size_t iter = 5;
+	bool adaptive = false;
+	double cylinder_cost = 4;
+	size_t chunk_size = 32;
+	bool fast_cylinder_search = false;
+	size_t cylinder_search_steps = 0;
+	size_t cylinder_search_threshold = 0;
+	size_t direction_bits = 0;
+	bool compact_cylinders = false;
+	bool single_precision = false;
+	size_t wide_width = 0;
+	size_t packet_size = 0;
+	const char* cache_directory = NULL;
+	bool export_geometry = false;
+	const char* analysis_file = NULL;
+	const char* sweep_file = NULL;
+	std::vector<std::string> sweep_builders;
+	std::vector<size_t> sweep_radii;
+	std::vector<size_t> sweep_iterations;
+	size_t warmup = 1;
+	size_t repetitions = 5;
+	bool profile_build = false;
+};
 
-	for (int i = 1; i < argc; ++i) {
-		if (argv[i][0] == '-') {
-			if (!strcmp(argv[i], "--help")) {
-				usage();
-				return 1;
-			}
-			else if (!strcmp(argv[i], "--eye") ||
-				!strcmp(argv[i], "--dir") ||
-				!strcmp(argv[i], "--up")) {
-				if (i + 3 >= argc)
-					return not_enough_arguments(argv[i]);
-				Vector3* destination;
-				switch (argv[i][2]) {
-				case 'd': destination = &camera.dir; break;
-				case 'u': destination = &camera.up;  break;
-				default:  destination = &camera.eye; break;
-				}
-				(*destination)[0] = strtof(argv[++i], NULL);
-				(*destination)[1] = strtof(argv[++i], NULL);
-				(*destination)[2] = strtof(argv[++i], NULL);
-			}
-			else if (!strcmp(argv[i], "--fov")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				camera.fov = strtof(argv[++i], NULL);
-			}
-			else if (!strcmp(argv[i], "--width") ||
-				!strcmp(argv[i], "--height")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				size_t* destination = argv[i][2] == 'w' ? &width : &height;
-				*destination = strtoull(argv[++i], NULL, 10);
-			}
-			else if (!strcmp(argv[i], "--builder")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				builder_name = argv[++i];
-			}
-			else if (!strcmp(argv[i], "--pre-shuffle")) {
-				pre_shuffle = true;
-			}
-			else if (!strcmp(argv[i], "--optimize-layout")) {
-				optimize_layout = true;
-			}
-			else if (!strcmp(argv[i], "--parallel-reinsertion")) {
-				parallel_reinsertion = true;
-			}
-			else if (!strcmp(argv[i], "--collapse-leaves")) {
-				collapse_leaves = true;
-			}
-			else if (!strcmp(argv[i], "--pre-split")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				pre_split_factor = strtof(argv[++i], NULL) / Scalar(100.0);
-				if (pre_split_factor < 0) {
-					std::cerr << "Invalid pre-split factor." << std::endl;
-					return 1;
-				}
-			}
-			else if (!strcmp(argv[i], "--rotate")) {
-				if (i + 2 >= argc)
-					return not_enough_arguments(argv[i]);
-				rotation_axis = argv[++i][0] - 'x';
-				rotation_degrees = strtof(argv[++i], NULL);
-				if (rotation_axis > 2) {
-					std::cerr << "Invalid rotation axis" << std::endl;
-					return 1;
-				}
-			}
-			else if (!strcmp(argv[i], "--collect-statistics")) {
-				if (i + 2 >= argc)
-					return not_enough_arguments(argv[i]);
-				collect_statistics = true;
-				statistics_weights[0] = strtof(argv[++i], NULL);
-				statistics_weights[1] = strtof(argv[++i], NULL);
-				statistics_weights[2] = strtof(argv[++i], NULL);
-			}
-			else if (!strcmp(argv[i], "--i")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				iter = strtoul(argv[++i], NULL, 10);
-			}
-			else if (!strcmp(argv[i], "--r")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				rad = strtoul(argv[++i], NULL, 10);
-			}
-			else if (!strcmp(argv[i], "-o")) {
-				if (i + 1 >= argc)
-					return not_enough_arguments(argv[i]);
-				output_file = argv[++i];
-			}
-			else {
-				std::cerr << "Unknown option: '" << argv[i] << "'" << std::endl;
-				return 1;
-			}
-		}
-		else {
-			if (input_file) {
-				std::cerr << "Scene file specified twice" << std::endl;
-				return 1;
-			}
-			input_file = argv[i];
-		}
+/// Computes the key under which the BVH of the given scene is cached. The key covers every option
+/// that changes the hierarchy, so that a cached BVH is only reused when the build would give it back.
+template <typename Triangle>
+static uint64_t compute_cache_key(const Options& options, const std::vector<Triangle>& triangles) {
+	bvh::BvhCacheKey key;
+	key.add(triangles.data(), triangles.size() * sizeof(Triangle));
+	key.add(std::string(options.builder_name));
+	key.add(options.rad);
+	key.add(options.iter);
+	key.add(options.adaptive);
+	key.add(options.cylinder_cost);
+	key.add(options.chunk_size);
+	key.add(options.fast_cylinder_search);
+	key.add(options.cylinder_search_steps);
+	key.add(options.cylinder_search_threshold);
+	key.add(options.direction_bits);
+	key.add(options.pre_split_factor);
+	key.add(options.parallel_reinsertion);
+	key.add(options.optimize_layout);
+	key.add(options.collapse_leaves);
+	key.add(std::string(options.tree_layout ? options.tree_layout : ""));
+	return key.get();
+}
+
+/// Applies the options shared by the builders that cluster cylinders.
+template <typename Builder>
+static void configure_cylinder_builder(Builder& builder, const Options& options, size_t radius) {
+	builder.search_radius = radius;
+	builder.approximate_cylinder_distances = options.fast_cylinder_search;
+	builder.cylinder_search_steps = options.cylinder_search_steps;
+	builder.cylinder_search_threshold = options.cylinder_search_threshold;
+	builder.direction_bit_count = options.direction_bits;
+}
+
+/// Prints the duration of each phase of a build, and of each clustering iteration.
+struct BuildProfiler : bvh::BuildObserver {
+	void phase_completed(bvh::BuildPhase phase, double milliseconds, size_t element_count) override {
+		std::cout << "  " << bvh::build_phase_name(phase) << " took " << milliseconds << "ms ("
+			<< element_count << " element(s))" << std::endl;
 	}
 
-	if (!input_file) {
-		std::cerr << "Missing a command line argument for the scene file" << std::endl;
-		return 1;
+	void iteration_completed(
+		bvh::BuildPhase phase, size_t iteration, double milliseconds,
+		size_t cluster_count_before, size_t cluster_count_after) override
+	{
+		std::cout << "    " << bvh::build_phase_name(phase) << " iteration " << iteration << ": "
+			<< cluster_count_before << " -> " << cluster_count_after << " cluster(s) in " << milliseconds << "ms" << std::endl;
 	}
+};
+
+/// Names of the builders that can be selected on the command line.
+static const char* const builder_names[] = {
+	"binned_sah", "sweep_sah", "spatial_split", "locally_ordered_clustering", "ploc_cylinder", "hybrid", "hybrid_chunked", "linear"
+};
+
+static bool is_known_builder(const std::string& name) {
+	return std::find(std::begin(builder_names), std::end(builder_names), name) != std::end(builder_names);
+}
+
+/// Builds the BVH of the given triangles with the builder and post-build optimizations selected
+/// in the options, with the search radius and transition iteration given as parameters.
+/// Returns the number of primitive references of the BVH.
+template <typename Bvh>
+static size_t build_bvh(
+	const Options& options,
+	Bvh& bvh,
+	const bvh::Triangle<typename Bvh::ScalarType>* triangles,
+	size_t triangle_count,
+	size_t radius, size_t iteration,
+	bvh::BuildObserver* observer = nullptr)
+{
+	using Scalar      = typename Bvh::ScalarType;
+	using Vector3     = bvh::Vector3<Scalar>;
+	using Triangle    = bvh::Triangle<Scalar>;
+	using BoundingBox = bvh::BoundingBox<Scalar>;
+	using BoundingCyl = bvh::BoundingCyl<Scalar>;
 
 	std::function<size_t(Bvh&, const Triangle*, const BoundingBox&, const BoundingBox*, const Vector3*, size_t, size_t)> builder;
 	std::function<size_t(Bvh&, const Triangle*, const BoundingCyl&, const BoundingCyl*, const Vector3*, size_t, size_t)> cbuilder;
 	std::function<size_t(Bvh&, const Triangle*, const BoundingBox&, const BoundingCyl*, const Vector3*, size_t, size_t)> obuilder;
 	std::function<size_t(Bvh&, const Triangle*, const BoundingBox&, const BoundingCyl*, const Vector3*, size_t, size_t, size_t)> hbuilder;
-	if (!strcmp(builder_name, "binned_sah")) {
-		builder = [](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
+	if (!strcmp(options.builder_name, "binned_sah")) {
+		builder = [observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
 			static constexpr size_t bin_count = 16;
 			bvh::BinnedSahBuilder<Bvh, bin_count> builder(bvh);
+			builder.observer = observer;
 			builder.build(global_bbox, bboxes, centers, primitive_count);
 			return primitive_count;
 		};
 	}
-	else if (!strcmp(builder_name, "sweep_sah")) {
-		builder = [](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
+	else if (!strcmp(options.builder_name, "sweep_sah")) {
+		builder = [observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
 			bvh::SweepSahBuilder<Bvh> builder(bvh);
+			builder.observer = observer;
 			builder.build(global_bbox, bboxes, centers, primitive_count);
 			return primitive_count;
 		};
 	}
-	else if (!strcmp(builder_name, "spatial_split")) {
-		builder = [](Bvh& bvh, const Triangle* triangles, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
+	else if (!strcmp(options.builder_name, "spatial_split")) {
+		builder = [observer](Bvh& bvh, const Triangle* triangles, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
 			static constexpr size_t bin_count = 64;
 			bvh::SpatialSplitBvhBuilder<Bvh, Triangle, bin_count> builder(bvh);
+			builder.observer = observer;
 			return builder.build(global_bbox, triangles, bboxes, centers, primitive_count);
 		};
 	}
-	else if (!strcmp(builder_name, "locally_ordered_clustering")) {
-		builder = [](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
+	else if (!strcmp(options.builder_name, "locally_ordered_clustering")) {
+		builder = [observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
 			using Morton = uint32_t;
-			bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, Bvh::Node> builder(bvh);
+			bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, typename Bvh::Node> builder(bvh);
+			builder.observer = observer;
 			builder.search_radius = radius;
 			builder.build(global_bbox, bboxes, centers, primitive_count);
 			return primitive_count;
 		};
 	}
 	/// A locally ordered clustering variant with cylinders as bounding boxes.
-	else if (!strcmp(builder_name, "ploc_cylinder")) {
-		obuilder = [](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingCyl* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
-			using Morton = uint32_t;
-			bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, Bvh::CustomNode> obuilder(bvh);
-			obuilder.search_radius = radius;
-			obuilder.build(global_bbox, bboxes, centers, primitive_count);
+	else if (!strcmp(options.builder_name, "ploc_cylinder")) {
+		obuilder = [&options, observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingCyl* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
+			// Codes that include the direction of the cylinders need more bits
+			auto build = [&] (auto morton) {
+				using Morton = decltype(morton);
+				bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>> obuilder(bvh);
+				configure_cylinder_builder(obuilder, options, radius);
+				obuilder.observer = observer;
+				obuilder.build(global_bbox, bboxes, centers, primitive_count);
+			};
+			if (options.direction_bits > 0)
+				build(uint64_t());
+			else
+				build(uint32_t());
 			return primitive_count;
 		};
 	}
 	/// A hybrid builder with cylinders and AABBs combined.
-	else if (!strcmp(builder_name, "hybrid")) {
-		hbuilder = [](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingCyl* bboxes, const Vector3* centers, size_t primitive_count, size_t iteration, size_t radius) {
-			using Morton = uint32_t;
-			bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, Bvh::CustomNode> hbuilder(bvh);
-			hbuilder.search_radius = radius;
-			hbuilder.build(global_bbox, bboxes, centers, primitive_count, iteration);
+	else if (!strcmp(options.builder_name, "hybrid")) {
+		hbuilder = [&options, observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingCyl* bboxes, const Vector3* centers, size_t primitive_count, size_t iteration, size_t radius) {
+			auto build = [&] (auto morton) {
+				using Morton = decltype(morton);
+				bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>> hbuilder(bvh);
+				configure_cylinder_builder(hbuilder, options, radius);
+				hbuilder.observer = observer;
+				hbuilder.adaptive_switch = options.adaptive;
+				hbuilder.cylinder_cost = options.cylinder_cost;
+				hbuilder.build(global_bbox, bboxes, centers, primitive_count, iteration);
+			};
+			if (options.direction_bits > 0)
+				build(uint64_t());
+			else
+				build(uint32_t());
 			return primitive_count;
 		};
 	}
-	else if (!strcmp(builder_name, "linear")) {
-		builder = [](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
+	/// A hybrid builder with binned SAH box levels over chunks clustered into cylinders.
+	else if (!strcmp(options.builder_name, "hybrid_chunked")) {
+		hbuilder = [&options, observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingCyl* bboxes, const Vector3* centers, size_t primitive_count, size_t, size_t radius) {
+			auto build = [&] (auto morton) {
+				using Morton = decltype(morton);
+				static constexpr size_t bin_count = 16;
+				bvh::ChunkedHybridBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>, bin_count> hbuilder(bvh);
+				configure_cylinder_builder(hbuilder, options, radius);
+				hbuilder.observer = observer;
+				hbuilder.chunk_size = options.chunk_size;
+				hbuilder.build(global_bbox, bboxes, centers, primitive_count);
+			};
+			if (options.direction_bits > 0)
+				build(uint64_t());
+			else
+				build(uint32_t());
+			return primitive_count;
+		};
+	}
+	else if (!strcmp(options.builder_name, "linear")) {
+		builder = [observer](Bvh& bvh, const Triangle*, const BoundingBox& global_bbox, const BoundingBox* bboxes, const Vector3* centers, size_t primitive_count, size_t radius) {
 			using Morton = uint32_t;
 			bvh::LinearBvhBuilder<Bvh, Morton> builder(bvh);
+			builder.observer = observer;
 			builder.build(global_bbox, bboxes, centers, primitive_count);
 			return primitive_count;
 		};
 	}
+	else
+		return 0;
+
+	// Post-build optimizations, applied to the given set of nodes
+	auto optimize = [&] (auto node_set) {
+		using NodeSet = decltype(node_set);
+		if (!options.parallel_reinsertion && !options.optimize_layout && !options.collapse_leaves)
+			return;
+		bvh::BuildTimer timer(observer);
+		if (options.parallel_reinsertion) {
+			bvh::ParallelReinsertionOptimizer<Bvh, NodeSet> reinsertion_optimizer(bvh);
+			reinsertion_optimizer.optimize();
+		}
+		if (options.optimize_layout) {
+			bvh::NodeLayoutOptimizer<Bvh, NodeSet> layout_optimizer(bvh);
+			layout_optimizer.optimize();
+		}
+		if (options.collapse_leaves) {
+			bvh::LeafCollapser<Bvh, NodeSet> leaf_collapser(bvh);
+			leaf_collapser.collapse();
+		}
+		timer.phase(bvh::BuildPhase::Optimization, bvh.node_count);
+	};
+
+	size_t reference_count = triangle_count;
+	if (obuilder || hbuilder) {
+		bvh.cylinder = true;
+		bvh.hybrid = static_cast<bool>(hbuilder);
+		// The bounding volumes are computed outside of the builders, and are timed here
+		bvh::BuildTimer timer(observer);
+		auto [bboxes, centers] =
+			bvh::compute_bounding_cylinders_and_centers(triangles, triangle_count);
+		auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangle_count);
+
+		// Long triangles are split along the axis of their cylinders
+		bvh::HeuristicPrimitiveSplitter<Triangle> splitter;
+		if (options.pre_split_factor > 0)
+			std::tie(reference_count, bboxes, centers) = splitter.split_cylinders(triangles, triangle_count, options.pre_split_factor);
+		timer.phase(bvh::BuildPhase::BoundingVolumes, reference_count);
+		if (obuilder) {
+			reference_count = obuilder(bvh, triangles, global_bbox, bboxes.get(), centers.get(), reference_count, radius);
+			if (options.pre_split_factor > 0)
+				splitter.repair_bvh_leaves(bvh);
+			optimize(bvh::CylinderNodes<Bvh>());
+		}
+		else {
+			reference_count = hbuilder(bvh, triangles, global_bbox, bboxes.get(), centers.get(), reference_count, iteration, radius);
+			if (options.pre_split_factor > 0)
+				splitter.repair_bvh_leaves(bvh);
+			// The box levels are optimized, the cylinder subtrees move along with the box leaves
+			optimize(bvh::BoxNodes<Bvh>());
+		}
+	}
+	else {
+		bvh::BuildTimer timer(observer);
+		auto [bboxes, centers] =
+			bvh::compute_bounding_boxes_and_centers(triangles, triangle_count);
+		auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangle_count);
+
+		bvh::HeuristicPrimitiveSplitter<Triangle> splitter;
+		if (options.pre_split_factor > 0)
+			std::tie(reference_count, bboxes, centers) = splitter.split(global_bbox, triangles, triangle_count, options.pre_split_factor);
+		timer.phase(bvh::BuildPhase::BoundingVolumes, reference_count);
+		reference_count = builder(bvh, triangles, global_bbox, bboxes.get(), centers.get(), reference_count, radius);
+		if (options.pre_split_factor > 0)
+			splitter.repair_bvh_leaves(bvh);
+		optimize(bvh::BoxNodes<Bvh>());
+	}
+
+	// The layout of the whole hierarchy is changed last, once its topology is final
+	if (options.tree_layout) {
+		bvh::BuildTimer timer(observer);
+		bvh::TreeLayoutOptimizer<Bvh> tree_layout_optimizer(bvh);
+		tree_layout_optimizer.layout = !strcmp(options.tree_layout, "van_emde_boas")
+			? bvh::TreeLayout::VanEmdeBoas
+			: bvh::TreeLayout::DepthFirst;
+		tree_layout_optimizer.optimize();
+		timer.phase(bvh::BuildPhase::Optimization, bvh.node_count);
+	}
+	return reference_count;
+}
+
+/// Results of one configuration of a parameter sweep. Times are in milliseconds, and ray
+/// throughputs are computed from the median time over the repetitions.
+struct SweepResult {
+	std::string builder;
+	size_t radius = 0;
+	size_t iteration = 0;
+	double median_build_time = 0;
+	double min_build_time = 0;
+	double primary_mrays = 0;
+	double shadow_mrays = 0;
+	size_t shadow_ray_count = 0;
+	size_t node_count = 0;
+	size_t cylinder_node_count = 0;
+	size_t reference_count = 0;
+	size_t memory = 0;
+};
+
+static double median(std::vector<double> values) {
+	std::sort(values.begin(), values.end());
+	auto n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) * 0.5;
+}
+
+static bool has_extension(const std::string& file_name, const std::string& extension) {
+	return file_name.size() >= extension.size() &&
+		file_name.compare(file_name.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+static void write_sweep_results(const Options& options, size_t triangle_count, const std::vector<SweepResult>& results) {
+	std::ofstream out(options.sweep_file);
+	if (has_extension(options.sweep_file, ".json")) {
+		out << "{\n";
+		out << "  \"scene\": \"" << options.input_file << "\",\n";
+		out << "  \"triangle_count\": " << triangle_count << ",\n";
+		out << "  \"precision\": \"" << (options.single_precision ? "float" : "double") << "\",\n";
+		out << "  \"width\": " << options.width << ",\n";
+		out << "  \"height\": " << options.height << ",\n";
+		out << "  \"warmup\": " << options.warmup << ",\n";
+		out << "  \"repetitions\": " << options.repetitions << ",\n";
+		out << "  \"results\": [";
+		for (size_t i = 0; i < results.size(); ++i) {
+			const auto& result = results[i];
+			out << (i > 0 ? "," : "") << "\n    {"
+				<< "\"builder\": \"" << result.builder << "\", "
+				<< "\"radius\": " << result.radius << ", "
+				<< "\"iteration\": " << result.iteration << ", "
+				<< "\"median_build_time_ms\": " << result.median_build_time << ", "
+				<< "\"min_build_time_ms\": " << result.min_build_time << ", "
+				<< "\"primary_mrays_per_s\": " << result.primary_mrays << ", "
+				<< "\"shadow_mrays_per_s\": " << result.shadow_mrays << ", "
+				<< "\"shadow_ray_count\": " << result.shadow_ray_count << ", "
+				<< "\"node_count\": " << result.node_count << ", "
+				<< "\"cylinder_node_count\": " << result.cylinder_node_count << ", "
+				<< "\"reference_count\": " << result.reference_count << ", "
+				<< "\"memory_bytes\": " << result.memory << "}";
+		}
+		out << "\n  ]\n}\n";
+	}
 	else {
+		out << "builder,radius,iteration,median_build_time_ms,min_build_time_ms,primary_mrays_per_s,shadow_mrays_per_s,"
+			"shadow_ray_count,node_count,cylinder_node_count,reference_count,memory_bytes\n";
+		for (const auto& result : results) {
+			out << result.builder << "," << result.radius << "," << result.iteration << ","
+				<< result.median_build_time << "," << result.min_build_time << ","
+				<< result.primary_mrays << "," << result.shadow_mrays << "," << result.shadow_ray_count << ","
+				<< result.node_count << "," << result.cylinder_node_count << ","
+				<< result.reference_count << "," << result.memory << "\n";
+		}
+	}
+}
+
+/// Benchmarks every combination of the builders, search radii, and transition iterations given on
+/// the command line, on a scene that is only loaded once. Each BVH is built, and then traversed with
+/// the primary rays of the camera and with shadow rays towards a point light, `options.warmup` times
+/// without being timed, and `options.repetitions` times with timing. The search radius only applies
+/// to the builders based on locally-ordered clustering, and the iteration to the hybrid builder.
+template <typename Bvh>
+static int sweep(const Options& options, const std::vector<bvh::Triangle<typename Bvh::ScalarType>>& triangles) {
+	using Scalar   = typename Bvh::ScalarType;
+	using Triangle = bvh::Triangle<Scalar>;
+	using Ray      = bvh::Ray<Scalar>;
+
+	std::vector<std::string> builders = options.sweep_builders;
+	if (builders.empty())
+		builders.emplace_back(options.builder_name);
+	for (const auto& builder : builders) {
+		if (!is_known_builder(builder)) {
+			std::cerr << "Unknown BVH builder name '" << builder << "'" << std::endl;
+			return 1;
+		}
+		if ((builder == "hybrid" || builder == "hybrid_chunked") && options.collapse_leaves) {
+			std::cerr << "The leaves of hybrid hierarchies cannot be collapsed" << std::endl;
+			return 1;
+		}
+	}
+	auto radii = options.sweep_radii.empty() ? std::vector<size_t> { options.rad } : options.sweep_radii;
+	auto iterations = options.sweep_iterations.empty() ? std::vector<size_t> { options.iter } : options.sweep_iterations;
+
+	CameraRays<Scalar> camera_rays(options.camera, options.width, options.height);
+	std::vector<Ray> primary_rays(options.width * options.height);
+	for (size_t j = 0; j < options.height; ++j) {
+		for (size_t i = 0; i < options.width; ++i)
+			primary_rays[j * options.width + i] = camera_rays.generate(i, j);
+	}
+
+	// The light is placed outside of the scene, above a corner of its bounding box
+	auto scene_bbox = bvh::BoundingBox<Scalar>::empty();
+	for (const auto& triangle : triangles)
+		scene_bbox.extend(triangle.bounding_box());
+	auto light = scene_bbox.max + scene_bbox.diagonal() * Scalar(0.5);
+	auto shadow_offset = bvh::length(scene_bbox.diagonal()) * Scalar(1e-5);
+
+	auto repeat = [&] (auto f) {
+		std::vector<double> times;
+		for (size_t k = 0; k < options.warmup + options.repetitions; ++k) {
+			auto time = measure(f);
+			if (k >= options.warmup)
+				times.push_back(time);
+		}
+		return times;
+	};
+
+	std::vector<SweepResult> results;
+	for (const auto& builder : builders) {
+		bool uses_radius =
+			builder == "locally_ordered_clustering" || builder == "ploc_cylinder" ||
+			builder == "hybrid" || builder == "hybrid_chunked";
+		bool uses_iteration = builder == "hybrid";
+		for (auto radius : uses_radius ? radii : std::vector<size_t> { options.rad }) {
+			for (auto iteration : uses_iteration ? iterations : std::vector<size_t> { options.iter }) {
+				Options configuration = options;
+				configuration.builder_name = builder.c_str();
+
+				SweepResult result;
+				result.builder = builder;
+				result.radius = uses_radius ? radius : 0;
+				result.iteration = uses_iteration ? iteration : 0;
+
+				Bvh bvh;
+				auto build_times = repeat([&] {
+					bvh = Bvh();
+					result.reference_count = build_bvh(configuration, bvh, triangles.data(), triangles.size(), radius, iteration);
+				});
+				result.median_build_time = median(build_times);
+				result.min_build_time = *std::min_element(build_times.begin(), build_times.end());
+
+				// Pure cylinder hierarchies record their size in both counts, but only have cylinder nodes
+				result.node_count = bvh.cylinder && !bvh.hybrid ? 0 : bvh.node_count;
+				result.cylinder_node_count = bvh.cylinder ? bvh.cnode_count : 0;
+				result.memory =
+					result.node_count * sizeof(typename Bvh::Node) +
+					result.cylinder_node_count * sizeof(typename Bvh::CustomNode) +
+					result.reference_count * sizeof(size_t);
+
+				bvh::SingleRayTraverser<Bvh> traverser(bvh);
+				bvh::ClosestPrimitiveIntersector<Bvh, Triangle> closest_intersector(bvh, triangles.data());
+				bvh::AnyPrimitiveIntersector<Bvh, Triangle> any_intersector(bvh, triangles.data());
+
+				std::vector<Scalar> distances(primary_rays.size());
+				auto primary_times = repeat([&] {
+					#pragma omp parallel for schedule(dynamic, 64)
+					for (size_t i = 0; i < primary_rays.size(); ++i) {
+						auto hit = traverser.traverse(primary_rays[i], closest_intersector, bvh.cylinder, bvh.hybrid);
+						distances[i] = hit ? hit->distance() : std::numeric_limits<Scalar>::max();
+					}
+				});
+				result.primary_mrays = double(primary_rays.size()) / (median(primary_times) * 1000);
+
+				std::vector<Ray> shadow_rays;
+				for (size_t i = 0; i < primary_rays.size(); ++i) {
+					if (distances[i] == std::numeric_limits<Scalar>::max())
+						continue;
+					auto origin = primary_rays[i].origin + primary_rays[i].direction * distances[i];
+					auto to_light = light - origin;
+					auto distance = bvh::length(to_light);
+					shadow_rays.emplace_back(origin, to_light * (Scalar(1) / distance), shadow_offset, distance);
+				}
+				size_t occluded_count = 0;
+				auto shadow_times = repeat([&] {
+					occluded_count = 0;
+					#pragma omp parallel for schedule(dynamic, 64) reduction(+: occluded_count)
+					for (size_t i = 0; i < shadow_rays.size(); ++i)
+						occluded_count += traverser.occluded(shadow_rays[i], any_intersector, bvh.cylinder, bvh.hybrid);
+				});
+				result.shadow_ray_count = shadow_rays.size();
+				result.shadow_mrays = shadow_rays.empty() ? 0 : double(shadow_rays.size()) / (median(shadow_times) * 1000);
+
+				std::cout
+					<< builder << " r = " << radius << (uses_iteration ? " i = " + std::to_string(iteration) : "") << ": "
+					<< "build " << result.median_build_time << "ms (min " << result.min_build_time << "ms), "
+					<< result.primary_mrays << " Mrays/s primary, "
+					<< result.shadow_mrays << " Mrays/s shadow (" << occluded_count << "/" << shadow_rays.size() << " occluded), "
+					<< result.memory << " bytes" << std::endl;
+				results.push_back(result);
+			}
+		}
+	}
+
+	write_sweep_results(options, triangles.size(), results);
+	return 0;
+}
+
+template <typename Bvh>
+static int run(const Options& options) {
+	using Scalar   = typename Bvh::ScalarType;
+	using Triangle = bvh::Triangle<Scalar>;
+
+	if (!is_known_builder(options.builder_name)) {
 		std::cerr << "Unknown BVH builder name" << std::endl;
 		return 1;
 	}
+	bool is_cylinder_builder = !strcmp(options.builder_name, "ploc_cylinder");
+	bool is_hybrid_builder = !strcmp(options.builder_name, "hybrid") || !strcmp(options.builder_name, "hybrid_chunked");
+	if (is_hybrid_builder && options.collapse_leaves) {
+		std::cerr << "The leaves of hybrid hierarchies cannot be collapsed" << std::endl;
+		return 1;
+	}
 
 	// Load mesh from file
-	auto triangles = obj::load_from_file(input_file);
+	auto triangles = obj::load_from_file<Scalar>(options.input_file);
 	if (triangles.size() == 0) {
 		std::cerr << "The given scene is empty or cannot be loaded" << std::endl;
 		return 1;
 	}
 
 	// Rotate triangles if requested
-	if (rotation_axis == 0)
-		rotate_triangles<0>(rotation_degrees, triangles.data(), triangles.size());
-	else if (rotation_axis == 1)
-		rotate_triangles<1>(rotation_degrees, triangles.data(), triangles.size());
-	else if (rotation_axis == 2)
-		rotate_triangles<2>(rotation_degrees, triangles.data(), triangles.size());
+	if (options.rotation_axis == 0)
+		rotate_triangles<0>(Scalar(options.rotation_degrees), triangles.data(), triangles.size());
+	else if (options.rotation_axis == 1)
+		rotate_triangles<1>(Scalar(options.rotation_degrees), triangles.data(), triangles.size());
+	else if (options.rotation_axis == 2)
+		rotate_triangles<2>(Scalar(options.rotation_degrees), triangles.data(), triangles.size());
+
+	if (options.sweep_file)
+		return sweep<Bvh>(options, triangles);
 
 	Bvh bvh;
 
@@ -488,123 +1081,170 @@ int main(int argc, char** argv) {
 	std::unique_ptr<Triangle[]> shuffled_triangles;
 
 	// Build an acceleration data structure for this object set
-	std::cout << "Building BVH (" << builder_name;
-	if (pre_split_factor)
+	std::cout << "Building BVH (" << options.builder_name;
+	if (options.pre_split_factor)
 		std::cout << " + pre-split";
-	if (parallel_reinsertion)
+	if (options.parallel_reinsertion)
 		std::cout << " + parallel-reinsertion";
-	if (optimize_layout)
+	if (options.optimize_layout)
 		std::cout << " + optimize-layout";
-	if (collapse_leaves)
+	if (options.collapse_leaves)
 		std::cout << " + collapse-leaves";
-	if (pre_shuffle)
+	if (options.tree_layout)
+		std::cout << " + " << options.tree_layout << " layout";
+	if (options.pre_shuffle)
 		std::cout << " + pre-shuffle";
+	if (options.leaf_block_size)
+		std::cout << " + leaf blocks of " << options.leaf_block_size;
 	std::cout << ")..." << std::endl;
+	std::cout << "r = " << options.rad << std::endl;
 
-
-	std::ofstream bigstat;
-
-	if (!strcmp(builder_name, "ploc_cylinder")) {
-		std::cout << "r = " << rad << std::endl;
-		profile("BVH construction", [&] {
-			auto [bboxes, centers] =
-				bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
-			auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
-			reference_count = obuilder(bvh, triangles.data(), global_bbox, bboxes.get(), centers.get(), reference_count, rad);
-			});
-		bvh.cylinder = true;
-		std::string fname = "stat_ploc_cylinder";
-		bigstat.open(fname + ".txt", std::ios_base::out | std::ios_base::app);
-		bigstat << rad << " ";
-		bigstat.close();
-		profile("BVH export", [&] {
-			auto exporter = bvh::ObjExporter<Bvh>(bvh, fname);
-			exporter.traverseExport();
+	// Builds the BVH, unless it can be loaded from the cache
+	std::string cache_file;
+	uint64_t cache_key = 0;
+	if (options.cache_directory) {
+		cache_key = compute_cache_key(options, triangles);
+		char key[17];
+		snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(cache_key));
+		cache_file = std::string(options.cache_directory) + "/bvh_" + key + ".bin";
+	}
+	bool is_loaded = false;
+	if (!cache_file.empty()) {
+		size_t cached_reference_count = 0;
+		profile("BVH cache mapping", [&] {
+			cached_reference_count = bvh::BvhCache<Bvh>::map(bvh, cache_file, cache_key);
 			});
+		if (cached_reference_count) {
+			std::cout << "Mapped BVH from '" << cache_file << "'" << std::endl;
+			reference_count = cached_reference_count;
+			is_loaded = true;
+		}
 	}
-	else if (!strcmp(builder_name, "hybrid")) {
-		std::cout << "r = " << rad << std::endl;
+	if (!is_loaded) {
+		BuildProfiler profiler;
 		profile("BVH construction", [&] {
-			auto [bboxes, centers] =
-				bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
-			auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
-			reference_count = hbuilder(bvh, triangles.data(), global_bbox, bboxes.get(), centers.get(), reference_count, iter, rad);
-			});
-		bvh.cylinder = true;
-		bvh.hybrid = true;
-		std::string fname = "stat_hybrid_iter" + std::to_string(iter);
-		bigstat.open(fname + ".txt", std::ios_base::out | std::ios_base::app);
-		bigstat << rad << " ";
-		bigstat.close();
-		profile("BVH export", [&] {
-			auto exporter = bvh::ObjExporter<Bvh>(bvh, fname);
-			exporter.traverseExportHybrid();
+			reference_count = build_bvh(
+				options, bvh, triangles.data(), triangles.size(), options.rad, options.iter,
+				options.profile_build ? &profiler : nullptr);
 			});
+		if (!cache_file.empty() && !bvh::BvhCache<Bvh>::save(bvh, cache_file, cache_key, reference_count))
+			std::cerr << "Cannot write the BVH cache to '" << cache_file << "'" << std::endl;
 	}
-	else {
-		std::cout << "r = " << rad << std::endl;
-		profile("BVH construction", [&] {
-			auto [bboxes, centers] =
-				bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
-			auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
-
-			bvh::HeuristicPrimitiveSplitter<Triangle> splitter;
-			if (pre_split_factor > 0)
-				std::tie(reference_count, bboxes, centers) = splitter.split(global_bbox, triangles.data(), triangles.size(), pre_split_factor);
-			reference_count = builder(bvh, triangles.data(), global_bbox, bboxes.get(), centers.get(), reference_count, rad);
-			if (pre_split_factor > 0)
-				splitter.repair_bvh_leaves(bvh);
-			if (parallel_reinsertion) {
-				bvh::ParallelReinsertionOptimizer<Bvh> reinsertion_optimizer(bvh);
-				reinsertion_optimizer.optimize();
-			}
-			if (optimize_layout) {
-				bvh::NodeLayoutOptimizer layout_optimizer(bvh);
-				layout_optimizer.optimize();
-			}
-			if (collapse_leaves) {
-				bvh::LeafCollapser leaf_collapser(bvh);
-				leaf_collapser.collapse();
-			}
-			if (pre_shuffle)
-				shuffled_triangles = bvh::shuffle_primitives(triangles.data(), bvh.primitive_indices.get(), reference_count);
+	if (options.pre_shuffle && !bvh.cylinder)
+		shuffled_triangles = bvh::shuffle_primitives(triangles.data(), bvh.primitive_indices.get(), reference_count);
+
+	// The triangle blocks follow the leaves of the final BVH, whatever the builder
+	std::unique_ptr<bvh::TriangleBlocks<Bvh, Triangle, 4>> triangle_blocks4;
+	std::unique_ptr<bvh::TriangleBlocks<Bvh, Triangle, 8>> triangle_blocks8;
+	if (options.leaf_block_size) {
+		profile("Triangle blocks", [&] {
+			if (options.leaf_block_size == 4)
+				triangle_blocks4 = std::make_unique<bvh::TriangleBlocks<Bvh, Triangle, 4>>(bvh, triangles.data());
+			else
+				triangle_blocks8 = std::make_unique<bvh::TriangleBlocks<Bvh, Triangle, 8>>(bvh, triangles.data());
 			});
-		std::string fname = "stat_boxes";
-		bigstat.open(fname + ".txt", std::ios_base::out | std::ios_base::app);
-		bigstat << rad << " ";
-		bigstat.close();
-		profile("BVH export", [&] {
-			auto exporter = bvh::ObjExporter<Bvh>(bvh, fname);
+	}
+
+	std::string fname =
+		is_cylinder_builder ? "stat_ploc_cylinder" :
+		is_hybrid_builder   ? "stat_hybrid_iter" + std::to_string(options.iter) :
+		"stat_boxes";
+	std::ofstream bigstat(fname + ".txt", std::ios_base::out | std::ios_base::app);
+	bigstat << options.rad << " ";
+	bigstat.close();
+	profile("BVH export", [&] {
+		auto exporter = bvh::ObjExporter<Bvh>(bvh, fname);
+		if (options.export_geometry)
+			exporter.mode = bvh::ObjExporter<Bvh>::Mode::Geometry;
+		if (is_cylinder_builder)
+			exporter.traverseExport();
+		else if (is_hybrid_builder)
+			exporter.traverseExportHybrid();
+		else
 			exporter.traverseExportBox();
+		});
+
+	std::cout << bvh.node_count << " node(s), ";
+	if (bvh.hybrid)
+		std::cout << bvh.cnode_count << " cylinder node(s), ";
+	std::cout << reference_count << " reference(s)" << std::endl;
+
+	if (options.analysis_file) {
+		bvh::BvhAnalysis<Scalar> analysis;
+		profile("BVH analysis", [&] {
+			bvh::BvhAnalyzer<Bvh> analyzer(bvh);
+			analysis = analyzer.analyze();
 			});
+		std::cout << "SAH cost " << analysis.sah_cost << ", depth " << analysis.depth << std::endl;
+		std::ofstream(options.analysis_file) << analysis.to_json();
 	}
 
-	std::cout << bvh.node_count << " node(s), " << reference_count << " reference(s)" << std::endl;
+	auto pixels = std::make_unique<Scalar[]>(3 * options.width * options.height);
 
-	auto pixels = std::make_unique<Scalar[]>(3 * width * height);
+	std::cout << "Rendering image (" << options.width << "x" << options.height << ")..." << std::endl;
 
-	std::cout << "Rendering image (" << width << "x" << height << ")..." << std::endl;
+	if (options.wide_width != 0 && bvh.cylinder && !bvh.hybrid) {
+		std::cerr << "Wide BVHs can only be created from box or hybrid hierarchies" << std::endl;
+		return 1;
+	}
 
-	profile("Rendering", [&] {
-		if (pre_shuffle) {
-			if (collect_statistics)
-				render<true, true>(camera, bvh, shuffled_triangles.get(), pixels.get(), width, height, statistics_weights);
+	auto render_with = [&] (const auto& rendering) {
+		auto render_with_intersector = [&] (const auto& intersector, const Triangle* shading_triangles) {
+			if (options.collect_statistics)
+				render<true>(options.camera, rendering, intersector, shading_triangles, pixels.get(), options.width, options.height, options.statistics_weights);
 			else
-				render<true, false>(camera, bvh, shuffled_triangles.get(), pixels.get(), width, height);
-		}
-		else {
-			if (collect_statistics)
-				render<false, true>(camera, bvh, triangles.data(), pixels.get(), width, height, statistics_weights);
+				render<false>(options.camera, rendering, intersector, shading_triangles, pixels.get(), options.width, options.height);
+		};
+		profile("Rendering", [&] {
+			if (triangle_blocks4)
+				render_with_intersector(bvh::ClosestTriangleBlockIntersector<Bvh, Triangle, 4>(bvh, *triangle_blocks4, triangles.data()), triangles.data());
+			else if (triangle_blocks8)
+				render_with_intersector(bvh::ClosestTriangleBlockIntersector<Bvh, Triangle, 8>(bvh, *triangle_blocks8, triangles.data()), triangles.data());
+			else if (options.pre_shuffle)
+				render_with_intersector(bvh::ClosestPrimitiveIntersector<Bvh, Triangle, true>(bvh, shuffled_triangles.get()), shuffled_triangles.get());
 			else
-				render<false, false>(camera, bvh, triangles.data(), pixels.get(), width, height);
-		}
-		});
+				render_with_intersector(bvh::ClosestPrimitiveIntersector<Bvh, Triangle>(bvh, triangles.data()), triangles.data());
+			});
+	};
+
+	auto render_wide = [&] (auto& wide_bvh) {
+		static constexpr size_t width = std::remove_reference_t<decltype(wide_bvh)>::width;
+		profile("Wide BVH collapse", [&] {
+			bvh::WideBvhCollapser<Bvh, width> collapser(bvh);
+			collapser.collapse(wide_bvh);
+			});
+		std::cout << wide_bvh.node_count << " wide node(s) with " << width << " children" << std::endl;
+		using Traverser = bvh::WideRayTraverser<Bvh, width>;
+		render_with(SingleRayRendering<Traverser> { Traverser(wide_bvh, bvh) });
+	};
+
+	if (options.wide_width != 0 && options.packet_size != 0) {
+		std::cerr << "Packet traversal is not available for wide BVHs" << std::endl;
+		return 1;
+	}
 
-	std::ofstream out(output_file, std::ofstream::binary);
-	out << "P6 " << width << " " << height << " " << 255 << "\n";
-	for (size_t j = height; j > 0; --j) {
-		for (size_t i = 0; i < width; ++i) {
-			size_t index = 3 * (width * (j - 1) + i);
+	if (options.packet_size == 4)
+		render_with(PacketRendering<Bvh, 2, 2>(bvh));
+	else if (options.packet_size == 8)
+		render_with(PacketRendering<Bvh, 4, 2>(bvh));
+	else if (options.packet_size == 16)
+		render_with(PacketRendering<Bvh, 4, 4>(bvh));
+	else if (options.wide_width == 4) {
+		bvh::WideBvh<Scalar, 4> wide_bvh;
+		render_wide(wide_bvh);
+	}
+	else if (options.wide_width == 8) {
+		bvh::WideBvh<Scalar, 8> wide_bvh;
+		render_wide(wide_bvh);
+	}
+	else
+		render_with(SingleRayRendering<BinaryTraverser<Bvh>> { BinaryTraverser<Bvh>(bvh) });
+
+	std::ofstream out(options.output_file, std::ofstream::binary);
+	out << "P6 " << options.width << " " << options.height << " " << 255 << "\n";
+	for (size_t j = options.height; j > 0; --j) {
+		for (size_t i = 0; i < options.width; ++i) {
+			size_t index = 3 * (options.width * (j - 1) + i);
 			uint8_t pixel[3] = {
 				static_cast<uint8_t>(std::max(std::min(pixels[index] * 255, Scalar(255)), Scalar(0))),
 				static_cast<uint8_t>(std::max(std::min(pixels[index + 1] * 255, Scalar(255)), Scalar(0))),
@@ -613,4 +1253,262 @@ int main(int argc, char** argv) {
 			out.write(reinterpret_cast<char*>(pixel), sizeof(uint8_t) * 3);
 		}
 	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	Options options;
+	bool iteration_given = false;
+	for (int i = 1; i < argc; ++i) {
+		if (argv[i][0] == '-') {
+			if (!strcmp(argv[i], "--help")) {
+				usage();
+				return 1;
+			}
+			else if (!strcmp(argv[i], "--eye") ||
+				!strcmp(argv[i], "--dir") ||
+				!strcmp(argv[i], "--up")) {
+				if (i + 3 >= argc)
+					return not_enough_arguments(argv[i]);
+				bvh::Vector3<double>* destination;
+				switch (argv[i][2]) {
+				case 'd': destination = &options.camera.dir; break;
+				case 'u': destination = &options.camera.up;  break;
+				default:  destination = &options.camera.eye; break;
+				}
+				(*destination)[0] = strtof(argv[++i], NULL);
+				(*destination)[1] = strtof(argv[++i], NULL);
+				(*destination)[2] = strtof(argv[++i], NULL);
+			}
+			else if (!strcmp(argv[i], "--fov")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.camera.fov = strtof(argv[++i], NULL);
+			}
+			else if (!strcmp(argv[i], "--width") ||
+				!strcmp(argv[i], "--height")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				size_t* destination = argv[i][2] == 'w' ? &options.width : &options.height;
+				*destination = strtoull(argv[++i], NULL, 10);
+			}
+			else if (!strcmp(argv[i], "--builder")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.builder_name = argv[++i];
+			}
+			else if (!strcmp(argv[i], "--pre-shuffle")) {
+				options.pre_shuffle = true;
+			}
+			else if (!strcmp(argv[i], "--leaf-blocks")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.leaf_block_size = strtoul(argv[++i], NULL, 10);
+				if (options.leaf_block_size != 4 && options.leaf_block_size != 8) {
+					std::cerr << "Invalid leaf block size (must be 4 or 8)" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--optimize-layout")) {
+				options.optimize_layout = true;
+			}
+			else if (!strcmp(argv[i], "--tree-layout")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.tree_layout = argv[++i];
+				if (strcmp(options.tree_layout, "depth_first") && strcmp(options.tree_layout, "van_emde_boas")) {
+					std::cerr << "Invalid tree layout (must be depth_first or van_emde_boas)" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--parallel-reinsertion")) {
+				options.parallel_reinsertion = true;
+			}
+			else if (!strcmp(argv[i], "--collapse-leaves")) {
+				options.collapse_leaves = true;
+			}
+			else if (!strcmp(argv[i], "--pre-split")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.pre_split_factor = strtof(argv[++i], NULL) / 100.0;
+				if (options.pre_split_factor < 0) {
+					std::cerr << "Invalid pre-split factor." << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--rotate")) {
+				if (i + 2 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.rotation_axis = argv[++i][0] - 'x';
+				options.rotation_degrees = strtof(argv[++i], NULL);
+				if (options.rotation_axis > 2) {
+					std::cerr << "Invalid rotation axis" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--collect-statistics")) {
+				if (i + 2 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.collect_statistics = true;
+				options.statistics_weights[0] = strtof(argv[++i], NULL);
+				options.statistics_weights[1] = strtof(argv[++i], NULL);
+				options.statistics_weights[2] = strtof(argv[++i], NULL);
+			}
+			else if (!strcmp(argv[i], "--i")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.iter = strtoul(argv[++i], NULL, 10);
+				iteration_given = true;
+			}
+			else if (!strcmp(argv[i], "--adaptive")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.adaptive = true;
+				options.cylinder_cost = strtof(argv[++i], NULL);
+				if (options.cylinder_cost <= 0) {
+					std::cerr << "Invalid cylinder cost" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--r")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.rad = strtoul(argv[++i], NULL, 10);
+			}
+			else if (!strcmp(argv[i], "--chunk-size")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.chunk_size = strtoul(argv[++i], NULL, 10);
+				if (options.chunk_size == 0) {
+					std::cerr << "Invalid chunk size" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--fast-cylinder-search")) {
+				options.fast_cylinder_search = true;
+			}
+			else if (!strcmp(argv[i], "--cylinder-search")) {
+				if (i + 2 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.cylinder_search_steps = strtoul(argv[++i], NULL, 10);
+				options.cylinder_search_threshold = strtoul(argv[++i], NULL, 10);
+			}
+			else if (!strcmp(argv[i], "--direction-bits")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.direction_bits = strtoul(argv[++i], NULL, 10);
+				if (options.direction_bits > 16) {
+					std::cerr << "Invalid number of direction bits (must be at most 16)" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--compact-cylinders")) {
+				options.compact_cylinders = true;
+			}
+			else if (!strcmp(argv[i], "--float")) {
+				options.single_precision = true;
+			}
+			else if (!strcmp(argv[i], "--packet")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.packet_size = strtoul(argv[++i], NULL, 10);
+				if (options.packet_size != 4 && options.packet_size != 8 && options.packet_size != 16) {
+					std::cerr << "Invalid packet size (must be 4, 8, or 16)" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--wide")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.wide_width = strtoul(argv[++i], NULL, 10);
+				if (options.wide_width != 4 && options.wide_width != 8) {
+					std::cerr << "Invalid wide BVH width (must be 4 or 8)" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "--cache")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.cache_directory = argv[++i];
+			}
+			else if (!strcmp(argv[i], "--profile-build")) {
+				options.profile_build = true;
+			}
+			else if (!strcmp(argv[i], "--export-geometry")) {
+				options.export_geometry = true;
+			}
+			else if (!strcmp(argv[i], "--analyze")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.analysis_file = argv[++i];
+			}
+			else if (!strcmp(argv[i], "--sweep")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.sweep_file = argv[++i];
+			}
+			else if (!strcmp(argv[i], "--sweep-builders")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.sweep_builders = split_list(argv[++i]);
+			}
+			else if (!strcmp(argv[i], "--sweep-r") ||
+				!strcmp(argv[i], "--sweep-i")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				auto& destination = argv[i][8] == 'r' ? options.sweep_radii : options.sweep_iterations;
+				destination = split_size_list(argv[++i]);
+			}
+			else if (!strcmp(argv[i], "--warmup") ||
+				!strcmp(argv[i], "--repetitions")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				size_t* destination = argv[i][2] == 'w' ? &options.warmup : &options.repetitions;
+				*destination = strtoull(argv[++i], NULL, 10);
+				if (options.repetitions == 0) {
+					std::cerr << "Invalid number of repetitions" << std::endl;
+					return 1;
+				}
+			}
+			else if (!strcmp(argv[i], "-o")) {
+				if (i + 1 >= argc)
+					return not_enough_arguments(argv[i]);
+				options.output_file = argv[++i];
+			}
+			else {
+				std::cerr << "Unknown option: '" << argv[i] << "'" << std::endl;
+				return 1;
+			}
+		}
+		else {
+			if (options.input_file) {
+				std::cerr << "Scene file specified twice" << std::endl;
+				return 1;
+			}
+			options.input_file = argv[i];
+		}
+	}
+
+	if (!options.input_file) {
+		std::cerr << "Missing a command line argument for the scene file" << std::endl;
+		return 1;
+	}
+
+	// Without an explicit bound, the adaptive switch runs until no cluster can be merged as a cylinder
+	if (options.adaptive && !iteration_given)
+		options.iter = 0;
+
+	if (options.single_precision) {
+		if (options.compact_cylinders)
+			return run<bvh::Bvh<float, bvh::CompactCylinderNode>>(options);
+		return run<bvh::Bvh<float>>(options);
+	}
+	if (options.compact_cylinders)
+		return run<bvh::Bvh<double, bvh::CompactCylinderNode>>(options);
+	return run<bvh::Bvh<double>>(options);
 }
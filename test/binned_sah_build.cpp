@@ -0,0 +1,60 @@
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/binned_sah_builder.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = float;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+
+// Every node must contain its children, every leaf must contain its primitives,
+// and every primitive must be referenced exactly once.
+static bool check_hierarchy(const Bvh& bvh, const std::vector<Triangle>& triangles) {
+    std::vector<size_t> reference_counts(triangles.size(), 0);
+    for (size_t i = 0; i < bvh.node_count; ++i) {
+        const auto& node = bvh.nodes[i];
+        if (node.is_leaf) {
+            for (size_t j = 0; j < node.primitive_count; ++j) {
+                auto index = bvh.primitive_indices[node.first_child_or_primitive + j];
+                if (!triangles[index].bounding_box().is_contained_in(node.bounding_box_proxy()))
+                    return false;
+                reference_counts[index]++;
+            }
+        } else {
+            for (size_t j = 0; j < 2; ++j) {
+                if (!bvh.nodes[node.first_child_or_primitive + j].bounding_box_proxy().to_bounding_box().is_contained_in(node.bounding_box_proxy()))
+                    return false;
+            }
+        }
+    }
+    return std::all_of(reference_counts.begin(), reference_counts.end(), [] (size_t count) { return count == 1; });
+}
+
+int main() {
+    auto triangles = random_small_triangles<Scalar>(10000);
+    auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+
+    // A traversal cost as large as the leaf size makes most splits fall back to the median split
+    for (size_t leaf_size : { 1, 4, 32, 256 }) {
+        Bvh bvh;
+        bvh::BinnedSahBuilder<Bvh, 16> builder(bvh);
+        builder.max_leaf_size = leaf_size;
+        builder.traversal_cost = Scalar(leaf_size);
+        builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+        if (!check_hierarchy(bvh, triangles)) {
+            std::cerr << "Invalid binned SAH hierarchy with leaves of at most " << leaf_size << " primitive(s)" << std::endl;
+            return 1;
+        }
+        std::cout << "Built a hierarchy of " << bvh.node_count << " nodes with leaves of at most " << leaf_size << " primitive(s)" << std::endl;
+    }
+    std::cout << "Binned SAH hierarchies are valid" << std::endl;
+    return 0;
+}
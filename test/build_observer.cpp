@@ -0,0 +1,133 @@
+#include <vector>
+#include <iostream>
+#include <random>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/build_observer.hpp>
+#include <bvh/binned_sah_builder.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = double;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+using Morton   = uint32_t;
+
+// Records the phases and iterations reported by a builder.
+struct RecordingObserver : bvh::BuildObserver {
+    struct Iteration {
+        bvh::BuildPhase phase;
+        size_t index;
+        size_t cluster_count_before;
+        size_t cluster_count_after;
+    };
+
+    std::vector<std::pair<bvh::BuildPhase, size_t>> phases;
+    std::vector<Iteration> iterations;
+    bool has_negative_time = false;
+
+    void phase_completed(bvh::BuildPhase phase, double milliseconds, size_t element_count) override {
+        phases.emplace_back(phase, element_count);
+        has_negative_time |= milliseconds < 0;
+    }
+
+    void iteration_completed(
+        bvh::BuildPhase phase, size_t iteration, double milliseconds,
+        size_t cluster_count_before, size_t cluster_count_after) override
+    {
+        iterations.push_back(Iteration { phase, iteration, cluster_count_before, cluster_count_after });
+        has_negative_time |= milliseconds < 0;
+    }
+
+    bool has_phases(std::initializer_list<bvh::BuildPhase> expected) const {
+        if (phases.size() != expected.size())
+            return false;
+        size_t i = 0;
+        for (auto phase : expected) {
+            if (phases[i++].first != phase)
+                return false;
+        }
+        return true;
+    }
+
+    // Checks that the iterations are numbered consecutively, that each one starts with the
+    // clusters left by the previous one, and that they end with the given number of clusters.
+    bool has_consistent_iterations(size_t primitive_count, size_t final_cluster_count) const {
+        size_t cluster_count = primitive_count;
+        for (size_t i = 0; i < iterations.size(); ++i) {
+            const auto& iteration = iterations[i];
+            if (iteration.index != i ||
+                iteration.cluster_count_before != cluster_count ||
+                iteration.cluster_count_after > iteration.cluster_count_before)
+                return false;
+            cluster_count = iteration.cluster_count_after;
+        }
+        return cluster_count == final_cluster_count;
+    }
+};
+
+static bool check_hybrid_build(const std::vector<Triangle>& triangles, size_t switch_iteration) {
+    Bvh bvh;
+    RecordingObserver observer;
+    bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>> builder(bvh);
+    builder.observer = &observer;
+
+    auto [bcyls, centers] = bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), triangles.size());
+    builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size(), switch_iteration);
+
+    using bvh::BuildPhase;
+    if (!observer.has_phases({
+            BuildPhase::Sorting, BuildPhase::Leaves, BuildPhase::CylinderClustering,
+            BuildPhase::Conversion, BuildPhase::BoxClustering, BuildPhase::Finalization }) ||
+        !observer.has_consistent_iterations(triangles.size(), 1) ||
+        observer.has_negative_time) {
+        std::cerr << "Invalid phases reported for the hybrid build" << std::endl;
+        return false;
+    }
+
+    // The cylinder waves stop at the switch iteration, and the clusters left are converted to boxes
+    size_t cylinder_wave_count = 0;
+    for (const auto& iteration : observer.iterations)
+        cylinder_wave_count += iteration.phase == BuildPhase::CylinderClustering;
+    auto converted_count = observer.phases[3].second;
+    if (cylinder_wave_count > switch_iteration ||
+        observer.iterations[cylinder_wave_count - 1].cluster_count_after != converted_count ||
+        observer.phases[2].second != converted_count) {
+        std::cerr << "Invalid cylinder clustering waves reported for the hybrid build" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool check_top_down_build(const std::vector<Triangle>& triangles) {
+    Bvh bvh;
+    RecordingObserver observer;
+    bvh::BinnedSahBuilder<Bvh, 16> builder(bvh);
+    builder.observer = &observer;
+
+    auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+    builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+
+    if (!observer.has_phases({ bvh::BuildPhase::Initialization, bvh::BuildPhase::Splitting }) ||
+        observer.phases[1].second != bvh.node_count ||
+        !observer.iterations.empty()) {
+        std::cerr << "Invalid phases reported for the top-down build" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    auto triangles = random_triangles<Scalar>(5000);
+    if (!check_hybrid_build(triangles, 3) || !check_top_down_build(triangles))
+        return 1;
+    std::cout << "Build phases are reported correctly" << std::endl;
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <vector>
+#include <iostream>
+#include <cmath>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/bvh_analyzer.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = double;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+using Analysis = bvh::BvhAnalysis<Scalar>;
+
+// Computes the per-level statistics with a sequential depth-first traversal.
+static Analysis reference_analysis(const Bvh& bvh) {
+    Analysis analysis;
+    struct Item { bool is_cylinder; size_t index, level; };
+    std::vector<Item> stack { Item { bvh.cylinder && !bvh.hybrid, 0, 0 } };
+    auto level = [&] (size_t i) -> Analysis::Level& {
+        if (analysis.levels.size() <= i)
+            analysis.levels.resize(i + 1);
+        return analysis.levels[i];
+    };
+    while (!stack.empty()) {
+        auto item = stack.back();
+        stack.pop_back();
+        analysis.depth = std::max(analysis.depth, item.level);
+        if (!item.is_cylinder) {
+            const auto& node = bvh.nodes[item.index];
+            level(item.level).box_count++;
+            level(item.level).box_half_area += node.bounding_box_proxy().half_area();
+            if (!node.is_leaf) {
+                stack.push_back(Item { false, node.first_child_or_primitive + 0, item.level + 1 });
+                stack.push_back(Item { false, node.first_child_or_primitive + 1, item.level + 1 });
+            } else if (bvh.hybrid) {
+                const auto& root = bvh.cnodes[node.cylinder_root()];
+                if (root.is_leaf)
+                    level(item.level).leaf_count++;
+                else {
+                    stack.push_back(Item { true, root.first_child_or_primitive + 0, item.level + 1 });
+                    stack.push_back(Item { true, root.first_child_or_primitive + 1, item.level + 1 });
+                }
+            } else
+                level(item.level).leaf_count++;
+        } else {
+            const auto& node = bvh.cnodes[item.index];
+            level(item.level).cylinder_count++;
+            level(item.level).cylinder_half_area += node.bounding_box_proxy().half_area();
+            if (!node.is_leaf) {
+                stack.push_back(Item { true, node.first_child_or_primitive + 0, item.level + 1 });
+                stack.push_back(Item { true, node.first_child_or_primitive + 1, item.level + 1 });
+            } else
+                level(item.level).leaf_count++;
+        }
+    }
+    return analysis;
+}
+
+static bool is_close(Scalar a, Scalar b) {
+    return std::fabs(a - b) <= Scalar(1e-9) * std::max(Scalar(1), std::fabs(b));
+}
+
+static bool check_analysis(size_t triangle_count, Mode mode) {
+    auto triangles = random_triangles<Scalar>(triangle_count);
+    Bvh bvh;
+    build(bvh, triangles, mode);
+
+    bvh::BvhAnalyzer<Bvh> analyzer(bvh);
+    auto analysis = analyzer.analyze();
+    auto reference = reference_analysis(bvh);
+
+    if (analysis.depth != reference.depth || analysis.levels.size() != reference.levels.size()) {
+        std::cerr << "The depth of the BVH is incorrect" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < analysis.levels.size(); ++i) {
+        auto& level = analysis.levels[i];
+        auto& expected = reference.levels[i];
+        if (level.box_count != expected.box_count ||
+            level.cylinder_count != expected.cylinder_count ||
+            level.leaf_count != expected.leaf_count ||
+            !is_close(level.box_half_area, expected.box_half_area) ||
+            !is_close(level.cylinder_half_area, expected.cylinder_half_area)) {
+            std::cerr << "The statistics of level " << i << " are incorrect" << std::endl;
+            return false;
+        }
+    }
+
+    size_t reference_count = 0, leaf_count = 0;
+    for (size_t i = 0; i < analysis.leaf_sizes.size(); ++i) {
+        reference_count += i * analysis.leaf_sizes[i];
+        leaf_count += analysis.leaf_sizes[i];
+    }
+    if (reference_count != triangle_count || leaf_count != analysis.leaf_count()) {
+        std::cerr << "The leaf sizes do not add up to the number of primitives" << std::endl;
+        return false;
+    }
+    if (mode == Mode::Hybrid && analysis.max_transition_depth > analysis.depth) {
+        std::cerr << "The transition depth is deeper than the BVH" << std::endl;
+        return false;
+    }
+    if (!(analysis.sah_cost > 0) || !(analysis.sibling_overlap >= 0)) {
+        std::cerr << "Invalid SAH cost or sibling overlap" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        for (auto size : { 1, 2, 100, 5000 }) {
+            if (!check_analysis(size, mode))
+                return 1;
+        }
+    }
+    std::cout << "The analysis matches a traversal of the BVHs" << std::endl;
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <iterator>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/bvh_cache.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = float;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+using Cache    = bvh::BvhCache<Bvh>;
+
+using CompactNode  = bvh::CompactCylinderNode<Scalar>;
+using CompactBvh   = bvh::Bvh<Scalar, bvh::CompactCylinderNode>;
+using CompactCache = bvh::BvhCache<CompactBvh>;
+
+template <typename Node>
+static bool is_same_node(const Node& a, const Node& b) {
+    return std::memcmp(&a, &b, sizeof(Node)) == 0;
+}
+
+static bool is_same_bvh(const Bvh& a, const Bvh& b, size_t reference_count, Mode mode) {
+    if (a.node_count != b.node_count || a.cnode_count != b.cnode_count || a.cylinder != b.cylinder || a.hybrid != b.hybrid)
+        return false;
+    if (mode != Mode::Cylinders) {
+        for (size_t i = 0; i < a.node_count; ++i) {
+            if (!is_same_node(a.nodes[i], b.nodes[i]))
+                return false;
+        }
+    }
+    if (mode != Mode::Boxes) {
+        for (size_t i = 0; i < a.cnode_count; ++i) {
+            if (!is_same_node(a.cnodes[i], b.cnodes[i]))
+                return false;
+        }
+    }
+    return std::equal(
+        a.primitive_indices.get(), a.primitive_indices.get() + reference_count,
+        b.primitive_indices.get());
+}
+
+// Maps the given cache file, and checks that the mapped BVH is the saved one, that modifying it does
+// not modify the file, and that the file is unmapped once the arrays of the BVH are released.
+static bool check_mapping(const Bvh& bvh, const std::string& file_name, uint64_t key, Mode mode) {
+    std::weak_ptr<void> mapping;
+    {
+        Bvh mapped;
+        auto reference_count = Cache::map(mapped, file_name, key);
+        if (reference_count != bvh.reference_count() || !is_same_bvh(bvh, mapped, reference_count, mode)) {
+            std::cerr << "The BVH mapped from the cache is not the one that was saved" << std::endl;
+            return false;
+        }
+        mapping = mapped.primitive_indices.get_deleter().mapping;
+        std::swap(mapped.primitive_indices[0], mapped.primitive_indices[1]);
+        mapped.nodes.reset();
+        mapped.cnodes.reset();
+        if (mapping.expired()) {
+            std::cerr << "The cache file was unmapped while some of the arrays of the BVH were in use" << std::endl;
+            return false;
+        }
+    }
+    if (!mapping.expired()) {
+        std::cerr << "The cache file is still mapped after the BVH was released" << std::endl;
+        return false;
+    }
+
+    Bvh loaded;
+    auto reference_count = Cache::load(loaded, file_name, key);
+    if (reference_count != bvh.reference_count() || !is_same_bvh(bvh, loaded, reference_count, mode)) {
+        std::cerr << "Modifying a mapped BVH modified the cache file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Saves BVHs to the cache and loads or maps them back, and checks that
+// files written with another key or truncated files are rejected.
+static bool check_cache(Mode mode, const std::string& file_name) {
+    auto triangles = random_triangles<Scalar>(5000);
+    auto key = bvh::BvhCacheKey().add(triangles.data(), triangles.size() * sizeof(Triangle)).add(int(mode)).get();
+
+    Bvh bvh;
+    build(bvh, triangles, mode);
+    if (!Cache::save(bvh, file_name, key)) {
+        std::cerr << "Cannot write the cache file '" << file_name << "'" << std::endl;
+        return false;
+    }
+
+    Bvh loaded;
+    auto reference_count = Cache::load(loaded, file_name, key);
+    if (reference_count != triangles.size() || !is_same_bvh(bvh, loaded, reference_count, mode)) {
+        std::cerr << "The BVH loaded from the cache is not the one that was saved" << std::endl;
+        return false;
+    }
+
+    if (!check_mapping(bvh, file_name, key, mode))
+        return false;
+
+    Bvh rejected;
+    if (Cache::load(rejected, file_name, key + 1) || rejected.nodes || rejected.cnodes ||
+        Cache::map(rejected, file_name, key + 1) || rejected.nodes || rejected.cnodes) {
+        std::cerr << "A BVH was loaded from the cache with the wrong key" << std::endl;
+        return false;
+    }
+
+    std::vector<char> contents;
+    {
+        std::ifstream in(file_name, std::ifstream::binary);
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream out(file_name, std::ofstream::binary | std::ofstream::trunc);
+        out.write(contents.data(), contents.size() - 1);
+    }
+    if (Cache::load(rejected, file_name, key) || Cache::map(rejected, file_name, key)) {
+        std::cerr << "A BVH was loaded from a truncated cache file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Compact cylinder nodes are offset by half a cache line in memory, and must be when they are mapped.
+static bool check_compact_alignment(const std::string& file_name) {
+    const size_t cnode_count = 15;
+    CompactBvh bvh;
+    bvh.cnodes = std::make_unique<CompactNode[]>(cnode_count);
+    bvh.primitive_indices = std::make_unique<size_t[]>(1);
+    bvh.cnode_count = bvh.node_count = cnode_count;
+    bvh.cylinder = true;
+    if (!CompactCache::save(bvh, file_name, 0, 1))
+        return false;
+
+    CompactBvh mapped;
+    if (CompactCache::map(mapped, file_name, 0) != 1 || mapped.cnode_count != cnode_count) {
+        std::cerr << "Cannot map a BVH of compact cylinder nodes" << std::endl;
+        return false;
+    }
+    auto address = reinterpret_cast<std::uintptr_t>(&mapped.cnodes[1]);
+    if (address % CompactNode::cache_line_size != 0) {
+        std::cerr << "Mapped sibling cylinder nodes do not start on a cache line boundary" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    std::string file_name = "bvh_cache_test.bin";
+    bool success = true;
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid })
+        success = success && check_cache(mode, file_name);
+    success = success && check_compact_alignment(file_name);
+    std::remove(file_name.c_str());
+    if (success)
+        std::cout << "BVHs loaded from the cache are identical to the ones that were saved" << std::endl;
+    return success ? 0 : 1;
+}
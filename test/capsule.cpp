@@ -0,0 +1,176 @@
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <optional>
+#include <cstdint>
+#include <cstdio>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/capsule.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/sweep_sah_builder.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+#include "obj.hpp"
+
+using Scalar  = float;
+using Vector3 = bvh::Vector3<Scalar>;
+using Capsule = bvh::Capsule<Scalar>;
+using Ray     = bvh::Ray<Scalar>;
+using Bvh     = bvh::Bvh<Scalar>;
+
+// Strands of hair, as random walks of capsules.
+static std::vector<Capsule> random_strands(size_t strand_count, size_t segment_count, Scalar radius) {
+    std::vector<Capsule> capsules;
+    for (size_t i = 0; i < strand_count; ++i) {
+        auto p = random_vector<Scalar>(-1, 1);
+        auto d = bvh::normalize(random_vector<Scalar>(-1, 1)) * Scalar(0.05);
+        for (size_t j = 0; j < segment_count; ++j) {
+            d = bvh::normalize(d + random_vector(-Scalar(0.02), Scalar(0.02))) * Scalar(0.05);
+            capsules.emplace_back(p, p + d, radius);
+            p = p + d;
+        }
+    }
+    return capsules;
+}
+
+static Scalar distance_to_segment(const Capsule& capsule, const Vector3& p) {
+    auto ba = capsule.p1 - capsule.p0;
+    auto baba = bvh::dot(ba, ba);
+    auto u = baba > 0 ? std::clamp(bvh::dot(p - capsule.p0, ba) / baba, Scalar(0), Scalar(1)) : Scalar(0);
+    return bvh::length(p - (capsule.p0 + ba * u));
+}
+
+// The bounding volumes must contain the capsule, and the intersection must be on its surface.
+static bool check_capsule(const Capsule& capsule) {
+    static constexpr Scalar eps = Scalar(1e-4);
+    auto bcyl = capsule.bounding_cyl();
+    auto bbox = capsule.bounding_box();
+    for (size_t i = 0; i < 100; ++i) {
+        auto q = capsule.p0 + (capsule.p1 - capsule.p0) * random_scalar<Scalar>(0, 1);
+        auto p = q + bvh::normalize(random_vector<Scalar>(-1, 1)) * capsule.radius;
+        for (int j = 0; j < 3; ++j) {
+            if (p[j] < bbox.min[j] - eps || p[j] > bbox.max[j] + eps)
+                return false;
+        }
+        if (!is_inside(bcyl, p, eps))
+            return false;
+    }
+    if (bvh::length(bcyl.c - (capsule.p0 - capsule.axis() * capsule.radius)) > eps ||
+        std::abs(bcyl.h - (bvh::length(capsule.p1 - capsule.p0) + 2 * capsule.radius)) > eps ||
+        bcyl.r != capsule.radius)
+        return false;
+
+    // Rays starting close to the capsule, some of them inside, in random directions
+    for (size_t i = 0; i < 100; ++i) {
+        auto origin = capsule.center() + random_vector<Scalar>(-1, 1);
+        Ray ray(origin, bvh::normalize(random_vector<Scalar>(-1, 1)), 0, 4);
+        if (i % 2 == 0)
+            ray.direction = bvh::normalize(capsule.center() + random_vector(-Scalar(0.3), Scalar(0.3)) - origin);
+        auto hit = capsule.intersect(ray);
+        auto end = hit ? hit->t : ray.tmax;
+        if (hit && std::abs(distance_to_segment(capsule, ray.origin + ray.direction * hit->t) - capsule.radius) > eps)
+            return false;
+        // A ray that starts outside cannot go inside before the hit
+        bool starts_inside = distance_to_segment(capsule, ray.origin) < capsule.radius;
+        for (Scalar t = 0; !starts_inside && t < end - eps; t += Scalar(0.001)) {
+            if (distance_to_segment(capsule, ray.origin + ray.direction * t) < capsule.radius - eps)
+                return false;
+        }
+        // A ray that starts inside must leave it at the hit, within the range of the ray
+        if (starts_inside && (!hit || distance_to_segment(capsule, ray.origin + ray.direction * (end + 2 * eps)) < capsule.radius))
+            return false;
+    }
+    return true;
+}
+
+static std::optional<std::pair<size_t, Scalar>> intersect_brute_force(const std::vector<Capsule>& capsules, const Ray& ray) {
+    std::optional<std::pair<size_t, Scalar>> best_hit;
+    for (size_t i = 0; i < capsules.size(); ++i) {
+        if (auto hit = capsules[i].intersect(ray); hit && (!best_hit || hit->t < best_hit->second))
+            best_hit = std::make_pair(i, hit->t);
+    }
+    return best_hit;
+}
+
+// Box hierarchies must find the closest hits. The cylinder node intersector may miss a few primitives,
+// hence cylinder hierarchies must only never report a hit that is closer than the closest one.
+static bool check_traversal(const std::vector<Capsule>& capsules, Mode mode) {
+    Bvh bvh;
+    build<bvh::SweepSahBuilder>(bvh, capsules, mode);
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Capsule> intersector(bvh, capsules.data());
+
+    size_t ray_count = 2000, hit_count = 0, match_count = 0;
+    for (size_t i = 0; i < ray_count; ++i) {
+        auto origin = random_vector<Scalar>(-2, 2);
+        Ray ray(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+        auto hit = traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
+        auto closest = intersect_brute_force(capsules, ray);
+        if (hit && (!closest || hit->distance() < closest->second))
+            return false;
+        hit_count += closest.has_value();
+        match_count += closest && hit && hit->distance() == closest->second;
+    }
+    std::cout << match_count << " out of " << hit_count << " closest hit(s) found" << std::endl;
+    return mode == Mode::Boxes ? match_count == hit_count : match_count * 10 >= hit_count * 8;
+}
+
+// Lines are split into one capsule per segment, and faces are ignored.
+static bool check_loader(const std::string& file_name) {
+    std::ofstream(file_name) <<
+        "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+        "l 1 2 3\n"
+        "f 1 2 3\n"
+        "l -2 -1\n"
+        "l 1/1 4/4\n";
+    auto capsules = obj::load_curves_from_file<Scalar>(file_name, Scalar(0.1));
+    auto triangles = obj::load_from_file<Scalar>(file_name);
+    std::remove(file_name.c_str());
+    Vector3 expected[][2] = {
+        { Vector3(0, 0, 0), Vector3(1, 0, 0) },
+        { Vector3(1, 0, 0), Vector3(1, 1, 0) },
+        { Vector3(1, 1, 0), Vector3(0, 1, 0) },
+        { Vector3(0, 0, 0), Vector3(0, 1, 0) }
+    };
+    if (capsules.size() != 4 || triangles.size() != 1)
+        return false;
+    for (size_t i = 0; i < capsules.size(); ++i) {
+        if (bvh::length(capsules[i].p0 - expected[i][0]) != 0 ||
+            bvh::length(capsules[i].p1 - expected[i][1]) != 0 ||
+            capsules[i].radius != Scalar(0.1))
+            return false;
+    }
+    return true;
+}
+
+int main() {
+    for (size_t i = 0; i < 200; ++i) {
+        auto p = random_vector<Scalar>(-1, 1);
+        // Some capsules are spheres
+        Capsule capsule(p, i % 10 == 0 ? p : p + random_vector<Scalar>(-1, 1), random_scalar(Scalar(0.05), Scalar(0.3)));
+        if (!check_capsule(capsule)) {
+            std::cerr << "Invalid capsule intersection or bounding volume" << std::endl;
+            return 1;
+        }
+    }
+
+    auto capsules = random_strands(500, 10, Scalar(0.005));
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        if (!check_traversal(capsules, mode)) {
+            std::cerr << "Traversal of capsules does not match the brute-force intersection" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!check_loader("capsule_test.obj")) {
+        std::cerr << "Curves are not loaded correctly" << std::endl;
+        return 1;
+    }
+    std::cout << "Capsules are valid" << std::endl;
+    return 0;
+}
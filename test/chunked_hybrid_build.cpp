@@ -0,0 +1,140 @@
+#include <vector>
+#include <iostream>
+#include <optional>
+#include <cstdint>
+#include <algorithm>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/chunked_hybrid_builder.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar      = float;
+using Vector3     = bvh::Vector3<Scalar>;
+using Triangle    = bvh::Triangle<Scalar>;
+using BoundingCyl = bvh::BoundingCyl<Scalar>;
+using Ray         = bvh::Ray<Scalar>;
+using Bvh         = bvh::Bvh<Scalar>;
+using Morton      = uint32_t;
+
+static bool is_inside(const bvh::BoundingBox<Scalar>& bbox, const Vector3& p) {
+    const Scalar eps = Scalar(1e-4);
+    for (int i = 0; i < 3; ++i) {
+        if (p[i] < bbox.min[i] - eps || p[i] > bbox.max[i] + eps)
+            return false;
+    }
+    return true;
+}
+
+// Returns the number of primitives of the given cylinder subtree, or 0 if one of its nodes, or the box
+// leaf that refers to it, does not contain the triangles below it, or if siblings are not stored at
+// odd indices, as in the other builders.
+static size_t check_cylinder_subtree(
+    const Bvh& bvh, const std::vector<Triangle>& triangles,
+    const bvh::BoundingBox<Scalar>& bbox, size_t index,
+    std::vector<size_t>& ancestors)
+{
+    const auto& node = bvh.cnodes[index];
+    ancestors.push_back(index);
+    size_t primitive_count = 0;
+    if (node.is_leaf) {
+        for (size_t i = 0; i < node.primitive_count; ++i) {
+            const auto& triangle = triangles[bvh.primitive_indices[node.first_child_or_primitive + i]];
+            if (!is_inside(bbox, triangle.p0) || !is_inside(bbox, triangle.p1()) || !is_inside(bbox, triangle.p2()))
+                return 0;
+            for (auto ancestor : ancestors) {
+                BoundingCyl cylinder = bvh.cnodes[ancestor].bounding_box_proxy();
+                if (!is_inside(cylinder, triangle.p0) || !is_inside(cylinder, triangle.p1()) || !is_inside(cylinder, triangle.p2()))
+                    return 0;
+            }
+        }
+        primitive_count = node.primitive_count;
+    } else if (node.first_child_or_primitive % 2 == 1 && node.first_child_or_primitive + 1 < bvh.cnode_count) {
+        auto left  = check_cylinder_subtree(bvh, triangles, bbox, node.first_child_or_primitive + 0, ancestors);
+        auto right = check_cylinder_subtree(bvh, triangles, bbox, node.first_child_or_primitive + 1, ancestors);
+        primitive_count = left && right ? left + right : 0;
+    }
+    ancestors.pop_back();
+    return primitive_count;
+}
+
+static std::optional<std::pair<size_t, Scalar>> intersect_brute_force(const std::vector<Triangle>& triangles, const Ray& ray) {
+    std::optional<std::pair<size_t, Scalar>> best_hit;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        if (auto hit = triangles[i].intersect(ray); hit && (!best_hit || hit->t < best_hit->second))
+            best_hit = std::make_pair(i, hit->t);
+    }
+    return best_hit;
+}
+
+// Every box leaf must refer to a cylinder subtree, rooted at an even index, of at most `chunk_size`
+// primitives, which the box contains, and every triangle must be referenced exactly once. Hybrid traversal must never report
+// a hit that is not the closest one, and must find most of the closest hits.
+static bool check_hierarchy(const std::vector<Triangle>& triangles, size_t chunk_size) {
+    auto [bcyls, centers] = bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), triangles.size());
+
+    Bvh bvh;
+    bvh::ChunkedHybridBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>> builder(bvh);
+    builder.chunk_size = chunk_size;
+    builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size());
+    bvh.cylinder = true;
+    bvh.hybrid = true;
+
+    std::vector<size_t> reference_counts(triangles.size(), 0);
+    for (size_t i = 0; i < triangles.size(); ++i)
+        reference_counts[bvh.primitive_indices[i]]++;
+    if (std::any_of(reference_counts.begin(), reference_counts.end(), [] (size_t count) { return count != 1; }))
+        return false;
+
+    size_t chunk_count = 0, primitive_count = 0;
+    std::vector<size_t> ancestors;
+    for (size_t i = 0; i < bvh.node_count; ++i) {
+        const auto& node = bvh.nodes[i];
+        if (!node.is_leaf)
+            continue;
+        if (!node.is_cylinder_link() || node.cylinder_root() % 2 != 0 || node.cylinder_root() >= bvh.cnode_count)
+            return false;
+        auto count = check_cylinder_subtree(bvh, triangles, node.bounding_box_proxy().to_bounding_box(), node.cylinder_root(), ancestors);
+        if (count == 0 || count > chunk_size)
+            return false;
+        primitive_count += count;
+        chunk_count++;
+    }
+    if (primitive_count != triangles.size())
+        return false;
+
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> intersector(bvh, triangles.data());
+    size_t ray_count = 2000, hit_count = 0, match_count = 0;
+    for (size_t i = 0; i < ray_count; ++i) {
+        auto origin = random_vector<Scalar>(-3, 3);
+        Ray ray(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+        auto hit = traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
+        auto closest = intersect_brute_force(triangles, ray);
+        if (hit && (!closest || hit->distance() < closest->second))
+            return false;
+        hit_count += closest.has_value();
+        match_count += closest && hit && hit->distance() == closest->second;
+    }
+    std::cout << chunk_count << " chunk(s), " << match_count << " out of " << hit_count << " closest hit(s) found" << std::endl;
+    return match_count * 10 >= hit_count * 8;
+}
+
+int main() {
+    auto triangles = random_small_triangles<Scalar>(5000);
+    // Many chunks, a few chunks, and a single chunk at the root
+    for (auto chunk_size : { 64, 1024, 8192 }) {
+        if (!check_hierarchy(triangles, chunk_size)) {
+            std::cerr << "Invalid chunked hybrid hierarchy" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Chunked hybrid hierarchies are valid" << std::endl;
+    return 0;
+}
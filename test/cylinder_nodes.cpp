@@ -0,0 +1,222 @@
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <array>
+#include <limits>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/bounding_box.hpp>
+#include <bvh/cylinder_nodes.hpp>
+#include <bvh/node_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar       = double;
+using Vector3      = bvh::Vector3<Scalar>;
+using BoundingCyl  = bvh::BoundingCyl<Scalar>;
+using Ray          = bvh::Ray<Scalar>;
+using CompactNode  = bvh::CompactCylinderNode<Scalar>;
+using CompactBvh   = bvh::Bvh<Scalar, bvh::CompactCylinderNode>;
+
+static_assert(sizeof(CompactNode) == 32, "Compact cylinder nodes must be 32 bytes");
+static_assert(sizeof(bvh::CompactCylinderNode<float>) == 32, "Compact cylinder nodes must be 32 bytes");
+
+static Vector3 random_direction() {
+    while (true) {
+        auto v = random_vector<Scalar>(-1, 1);
+        auto l = bvh::length(v);
+        if (l > Scalar(0.01) && l <= 1)
+            return v * (Scalar(1) / l);
+    }
+}
+
+static Vector3 orthogonal(const Vector3& axis) {
+    auto v = std::abs(axis[0]) < Scalar(0.5) ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+    return bvh::normalize(bvh::cross(axis, v));
+}
+
+// Returns a point strictly inside the given cylinder.
+static Vector3 random_point_inside(const BoundingCyl& cyl) {
+    std::uniform_real_distribution<Scalar> uniform(0, 1);
+    auto u = orthogonal(cyl.axis);
+    auto v = bvh::cross(cyl.axis, u);
+    auto angle   = uniform(gen) * Scalar(2 * 3.14159265358979);
+    auto radius  = std::sqrt(uniform(gen)) * cyl.r * Scalar(0.99);
+    auto height  = (Scalar(0.005) + uniform(gen) * Scalar(0.99)) * cyl.h;
+    return cyl.c + height * cyl.axis + (radius * std::cos(angle)) * u + (radius * std::sin(angle)) * v;
+}
+
+static bool check_alignment() {
+    CompactBvh bvh;
+    bvh.cnodes = std::make_unique<CompactNode[]>(15);
+    auto address = reinterpret_cast<std::uintptr_t>(&bvh.cnodes[1]);
+    if (address % CompactNode::cache_line_size != 0) {
+        std::cerr << "Sibling cylinder nodes do not start on a cache line boundary" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool check_encoding(size_t cylinder_count, size_t sample_count) {
+    std::uniform_real_distribution<Scalar> uniform(0, 1);
+    for (size_t i = 0; i < cylinder_count; ++i) {
+        BoundingCyl cyl(
+            random_vector<Scalar>(-100, 100),
+            random_direction(),
+            Scalar(0.01) + uniform(gen) * 10,
+            Scalar(0.01) + uniform(gen) * 10);
+
+        CompactNode node;
+        node.bounding_box_proxy() = cyl;
+        auto origin    = node.origin();
+        auto direction = node.direction();
+
+        for (size_t j = 0; j < sample_count; ++j) {
+            auto p = random_point_inside(cyl);
+
+            // The point must be contained in the stored cylinder
+            auto e = p - origin;
+            auto t = bvh::dot(e, direction);
+            auto q = e - t * direction;
+            if (t < 0 || t > Scalar(node.h) || bvh::dot(q, q) > Scalar(node.r2)) {
+                std::cerr << "Compact cylinder node does not enclose the original cylinder" << std::endl;
+                return false;
+            }
+
+            // Any ray going through the point must hit the stored cylinder
+            auto ray_origin = p + random_direction() * Scalar(50);
+            Ray ray(ray_origin, bvh::normalize(p - ray_origin));
+            bvh::CustomNodeIntersector<CompactBvh> intersector(ray);
+            auto [entry, exit] = intersector.intersect(node, ray);
+            if (!(entry <= exit)) {
+                std::cerr << "A ray hitting the original cylinder misses the compact node" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Checks that single-precision cylinders are hit by rays that come from far away, for which the
+// terms of the quadratic equation are much larger than its roots.
+static bool check_single_precision(size_t cylinder_count, size_t sample_count) {
+    using FloatNode = bvh::FullCylinderNode<float>;
+    using FloatBvh  = bvh::Bvh<float>;
+    std::uniform_real_distribution<Scalar> uniform(0, 1);
+    for (size_t i = 0; i < cylinder_count; ++i) {
+        BoundingCyl cyl(
+            random_vector<Scalar>(-100, 100),
+            random_direction(),
+            Scalar(0.01) + uniform(gen) * 10,
+            Scalar(0.01) + uniform(gen));
+
+        auto to_float = [] (const Vector3& v) { return bvh::Vector3<float>(float(v[0]), float(v[1]), float(v[2])); };
+        FloatNode node;
+        node.bounding_box_proxy() = bvh::BoundingCyl<float>(
+            to_float(cyl.c), bvh::normalize(to_float(cyl.axis)), float(cyl.h), float(cyl.r)).inflate(4 * std::numeric_limits<float>::epsilon());
+
+        for (size_t j = 0; j < sample_count; ++j) {
+            auto p = random_point_inside(cyl);
+            auto ray_origin = to_float(p + random_direction() * Scalar(5000));
+            bvh::Ray<float> ray(ray_origin, bvh::normalize(to_float(p) - ray_origin));
+            bvh::CustomNodeIntersector<FloatBvh> intersector(ray);
+            auto [entry, exit] = intersector.intersect(node, ray);
+            if (!(entry <= exit)) {
+                std::cerr << "A ray hitting a single-precision cylinder from far away misses it" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The intersection must be the part of the ray, clipped to its range, that is inside the cylinder:
+// the points sampled along the ray that are inside must be in the interval, the middle of the
+// interval must be inside, and the interval must be empty when the cylinder is beyond `tmax`.
+static bool check_interval(size_t cylinder_count, size_t ray_count) {
+    using FullNode = bvh::FullCylinderNode<Scalar>;
+    using FullBvh  = bvh::Bvh<Scalar>;
+    static constexpr Scalar eps = Scalar(1e-6);
+    std::uniform_real_distribution<Scalar> uniform(0, 1);
+    for (size_t i = 0; i < cylinder_count; ++i) {
+        BoundingCyl cyl(
+            random_vector<Scalar>(-2, 2),
+            random_direction(),
+            Scalar(0.1) + uniform(gen) * 3,
+            Scalar(0.05) + uniform(gen));
+        FullNode node;
+        node.bounding_box_proxy() = cyl;
+
+        for (size_t j = 0; j < ray_count; ++j) {
+            auto p = random_point_inside(cyl);
+            auto origin = p + random_direction() * (uniform(gen) * 8);
+            // Rays aim at points inside the cylinder or in random directions, and may stop before it
+            auto direction = j % 2 == 0 ? bvh::normalize(p - origin) : random_direction();
+            Ray ray(origin, direction, uniform(gen) * 2, uniform(gen) * 12);
+            bvh::CustomNodeIntersector<FullBvh> intersector(ray);
+            auto [entry, exit] = intersector.intersect(node, ray);
+            if (entry <= exit) {
+                if (entry < ray.tmin - eps || exit > ray.tmax + eps ||
+                    !is_inside(cyl, ray.origin + ray.direction * ((entry + exit) * Scalar(0.5)), eps)) {
+                    std::cerr << "The cylinder interval is not inside the cylinder and the range of the ray" << std::endl;
+                    return false;
+                }
+            }
+            for (Scalar t = ray.tmin; t <= ray.tmax; t += Scalar(0.01)) {
+                auto q = ray.origin + ray.direction * t;
+                if (is_inside(cyl, q, -eps) && !(t >= entry - eps && t <= exit + eps)) {
+                    std::cerr << "The cylinder interval misses a part of the ray that is inside the cylinder" << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool same_distance(Scalar a, Scalar b) {
+    return a == b || std::abs(a - b) <= std::abs(a) * Scalar(1e-12);
+}
+
+template <size_t N, typename Node>
+static bool check_wide_intersection(size_t ray_count) {
+    std::uniform_real_distribution<Scalar> uniform(0, 1);
+    std::array<Node, N> nodes;
+    for (auto& node : nodes) {
+        node.bounding_box_proxy() = BoundingCyl(
+            random_vector<Scalar>(-5, 5),
+            random_direction(),
+            Scalar(0.1) + uniform(gen) * 5,
+            Scalar(0.1) + uniform(gen) * 2);
+    }
+
+    for (size_t i = 0; i < ray_count; ++i) {
+        Ray ray(random_vector<Scalar>(-20, 20), random_direction());
+        // Also test axis-aligned rays, for which some cap tests are skipped
+        if (i % 8 == 0)
+            ray.direction = Vector3(0, 0, uniform(gen) < Scalar(0.5) ? 1 : -1);
+        bvh::CustomNodeIntersector<CompactBvh> intersector(ray);
+        auto distances = intersector.template intersect<N>(nodes.data(), ray);
+        for (size_t j = 0; j < N; ++j) {
+            auto expected = intersector.intersect(nodes[j], ray);
+            if (!same_distance(expected.first, distances[j].first) ||
+                !same_distance(expected.second, distances[j].second)) {
+                std::cerr << "The " << N << "-wide cylinder test does not match the scalar version" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    if (!check_alignment() || !check_encoding(1000, 64) || !check_single_precision(1000, 64) || !check_interval(200, 64))
+        return 1;
+    if (!check_wide_intersection<2, CompactNode>(10000) ||
+        !check_wide_intersection<4, CompactNode>(10000) ||
+        !check_wide_intersection<8, bvh::FullCylinderNode<Scalar>>(10000))
+        return 1;
+    return 0;
+}
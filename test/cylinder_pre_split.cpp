@@ -0,0 +1,143 @@
+#include <vector>
+#include <iostream>
+#include <optional>
+#include <cstdint>
+#include <algorithm>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
+#include <bvh/heuristic_primitive_splitter.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar      = float;
+using Vector3     = bvh::Vector3<Scalar>;
+using Triangle    = bvh::Triangle<Scalar>;
+using BoundingCyl = bvh::BoundingCyl<Scalar>;
+using Ray         = bvh::Ray<Scalar>;
+using Bvh         = bvh::Bvh<Scalar>;
+using Morton      = uint32_t;
+
+// Mostly small triangles, with a few long and thin ones, which are the ones that should get split.
+static std::vector<Triangle> random_mixed_triangles(size_t triangle_count) {
+    std::vector<Triangle> triangles(triangle_count);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        auto p = random_vector<Scalar>(-1, 1);
+        auto d = random_vector(-Scalar(0.05), Scalar(0.05));
+        if (i % 10 == 0)
+            d = random_vector<Scalar>(-1, 1);
+        triangles[i] = Triangle(p, p + d, p + d * Scalar(0.5) + random_vector(-Scalar(0.01), Scalar(0.01)));
+    }
+    return triangles;
+}
+
+// Every point of a triangle must be in one of its slabs, and several slabs must be
+// smaller, in total, than the cylinder of the whole triangle (one slab is that cylinder, up to rounding).
+static bool check_slabs(const Triangle& triangle, size_t slab_count) {
+    const Scalar eps = Scalar(1e-5);
+    auto bcyl = triangle.bounding_cyl();
+    std::vector<BoundingCyl> slabs;
+    Scalar half_area = 0;
+    for (size_t i = 0; i < slab_count; ++i) {
+        slabs.push_back(triangle.slab_bounding_cyl(bcyl, bcyl.h * i / slab_count, bcyl.h * (i + 1) / slab_count));
+        half_area += slabs.back().half_area();
+    }
+    if (slab_count > 1 ? half_area >= bcyl.half_area() : half_area > bcyl.half_area() * Scalar(1.001))
+        return false;
+    for (size_t i = 0; i < 100; ++i) {
+        auto u = random_scalar<Scalar>(0, 1);
+        auto v = random_scalar<Scalar>(0, 1 - u);
+        auto p = triangle.p0 - triangle.e1 * u + triangle.e2 * v;
+        if (std::none_of(slabs.begin(), slabs.end(), [&] (auto& slab) { return is_inside(slab, p, eps); }))
+            return false;
+    }
+    return true;
+}
+
+static std::optional<std::pair<size_t, Scalar>> intersect_brute_force(const std::vector<Triangle>& triangles, const Ray& ray) {
+    std::optional<std::pair<size_t, Scalar>> best_hit;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        if (auto hit = triangles[i].intersect(ray); hit && (!best_hit || hit->t < best_hit->second))
+            best_hit = std::make_pair(i, hit->t);
+    }
+    return best_hit;
+}
+
+// After repairing the leaves, they must only refer to the original triangles, without duplicates,
+// and every triangle must be found. The traversal must behave as without splitting: the cylinder
+// node intersector may miss a few primitives, but must never report a hit that is not the closest.
+static bool check_hierarchy(const std::vector<Triangle>& triangles, bool hybrid) {
+    bvh::HeuristicPrimitiveSplitter<Triangle> splitter;
+    auto [reference_count, bcyls, centers] = splitter.split_cylinders(triangles.data(), triangles.size(), Scalar(0.5));
+    if (reference_count <= triangles.size())
+        return false;
+
+    Bvh bvh;
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), reference_count);
+    bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>> builder(bvh);
+    if (hybrid)
+        builder.build(global_bbox, bcyls.get(), centers.get(), reference_count, 3);
+    else
+        builder.build(global_bbox, bcyls.get(), centers.get(), reference_count);
+    bvh.cylinder = true;
+    bvh.hybrid = hybrid;
+    splitter.repair_bvh_leaves(bvh);
+
+    std::vector<bool> is_referenced(triangles.size(), false);
+    for (size_t i = 0; i < bvh.cnode_count; ++i) {
+        const auto& node = bvh.cnodes[i];
+        if (!node.is_leaf)
+            continue;
+        auto begin = bvh.primitive_indices.get() + node.first_child_or_primitive;
+        auto end   = begin + node.primitive_count;
+        if (std::adjacent_find(begin, end, [] (size_t a, size_t b) { return a >= b; }) != end)
+            return false;
+        for (auto it = begin; it != end; ++it) {
+            if (*it >= triangles.size())
+                return false;
+            is_referenced[*it] = true;
+        }
+    }
+    if (std::find(is_referenced.begin(), is_referenced.end(), false) != is_referenced.end())
+        return false;
+
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> intersector(bvh, triangles.data());
+    size_t ray_count = 2000, hit_count = 0, match_count = 0;
+    for (size_t i = 0; i < ray_count; ++i) {
+        auto origin = random_vector<Scalar>(-3, 3);
+        Ray ray(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+        auto hit = traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
+        auto closest = intersect_brute_force(triangles, ray);
+        if (hit && (!closest || hit->distance() < closest->second))
+            return false;
+        hit_count += closest.has_value();
+        match_count += closest && hit && hit->distance() == closest->second;
+    }
+    std::cout << reference_count << " reference(s), " << match_count << " out of " << hit_count << " closest hit(s) found" << std::endl;
+    return match_count * 10 >= hit_count * 8;
+}
+
+int main() {
+    auto triangles = random_mixed_triangles(5000);
+    for (size_t i = 0; i < triangles.size(); i += 10) {
+        if (!check_slabs(triangles[i], 1 + i % 7)) {
+            std::cerr << "Invalid slab bounding cylinder" << std::endl;
+            return 1;
+        }
+    }
+
+    for (auto hybrid : { false, true }) {
+        if (!check_hierarchy(triangles, hybrid)) {
+            std::cerr << "Invalid hierarchy after splitting" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Split cylinder hierarchies are valid" << std::endl;
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include <vector>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/hierarchy_refitter.hpp>
+#include <bvh/double_buffered_bvh.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar      = float;
+using Vector3     = bvh::Vector3<Scalar>;
+using Triangle    = bvh::Triangle<Scalar>;
+using BoundingBox = bvh::BoundingBox<Scalar>;
+using BoundingCyl = bvh::BoundingCyl<Scalar>;
+using Ray         = bvh::Ray<Scalar>;
+using Bvh         = bvh::Bvh<Scalar>;
+using Buffer      = bvh::DoubleBufferedBvh<Bvh>;
+
+// Moves every triangle by a small random offset, as in an animation.
+static void move_triangles(std::vector<Triangle>& triangles) {
+    for (auto& triangle : triangles) {
+        auto offset = random_vector(-Scalar(0.05), Scalar(0.05));
+        triangle = Triangle(triangle.p0 + offset, triangle.p1() + offset, triangle.p2() + offset);
+    }
+}
+
+static void refit(Bvh& bvh, const std::vector<Triangle>& triangles) {
+    bvh::CylinderHierarchyRefitter<Bvh> refitter(bvh);
+    refitter.refit_from_primitives(triangles.data());
+}
+
+// Checks the parts of the hierarchy that do not depend on the positions of the primitives: inner
+// boxes contain their children, links are valid, and every primitive is referenced exactly once.
+// Pure cylinder hierarchies have no box nodes.
+static bool check_structure(const Bvh& bvh, size_t primitive_count) {
+    std::vector<size_t> reference_counts(primitive_count, 0);
+    for (size_t i = 0; i < primitive_count; ++i) {
+        if (bvh.primitive_indices[i] >= primitive_count)
+            return false;
+        reference_counts[bvh.primitive_indices[i]]++;
+    }
+    if (std::any_of(reference_counts.begin(), reference_counts.end(), [] (size_t count) { return count != 1; }))
+        return false;
+    if ((bvh.nodes.get() != nullptr) != bvh.hybrid)
+        return false;
+    for (size_t i = 0; bvh.hybrid && i < bvh.node_count; ++i) {
+        const auto& node = bvh.nodes[i];
+        if (node.is_leaf) {
+            if (!node.is_cylinder_link() || node.cylinder_root() >= bvh.cnode_count)
+                return false;
+            continue;
+        }
+        for (size_t j = 0; j < 2; ++j) {
+            if (!bvh.nodes[node.first_child_or_primitive + j].bounding_box_proxy().to_bounding_box().is_contained_in(node.bounding_box_proxy()))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Checks that the cylinders of the given subtree contain the triangles below them.
+static bool check_cylinder_subtree(const Bvh& bvh, const std::vector<Triangle>& triangles, size_t index, std::vector<size_t>& ancestors) {
+    const auto& node = bvh.cnodes[index];
+    ancestors.push_back(index);
+    bool is_valid = true;
+    if (node.is_leaf) {
+        for (size_t i = 0; i < node.primitive_count && is_valid; ++i) {
+            const auto& triangle = triangles[bvh.primitive_indices[node.first_child_or_primitive + i]];
+            for (auto ancestor : ancestors) {
+                BoundingCyl cylinder = bvh.cnodes[ancestor].bounding_box_proxy();
+                is_valid &= is_inside(cylinder, triangle.p0) && is_inside(cylinder, triangle.p1()) && is_inside(cylinder, triangle.p2());
+            }
+        }
+    } else {
+        is_valid =
+            check_cylinder_subtree(bvh, triangles, node.first_child_or_primitive + 0, ancestors) &&
+            check_cylinder_subtree(bvh, triangles, node.first_child_or_primitive + 1, ancestors);
+    }
+    ancestors.pop_back();
+    return is_valid;
+}
+
+// Checks that the hierarchy bounds the given triangles, and that traversing it never reports a hit
+// that is not the closest one, and finds most of the closest hits.
+static bool check_bounds(const Bvh& bvh, const std::vector<Triangle>& triangles) {
+    if (!check_structure(bvh, triangles.size()))
+        return false;
+    std::vector<size_t> ancestors;
+    if (!bvh.hybrid && !check_cylinder_subtree(bvh, triangles, 0, ancestors))
+        return false;
+    for (size_t i = 0; bvh.hybrid && i < bvh.node_count; ++i) {
+        if (bvh.nodes[i].is_leaf && !check_cylinder_subtree(bvh, triangles, bvh.nodes[i].cylinder_root(), ancestors))
+            return false;
+    }
+
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> intersector(bvh, triangles.data());
+    size_t hit_count = 0, match_count = 0;
+    for (size_t i = 0; i < 500; ++i) {
+        auto origin = random_vector<Scalar>(-3, 3);
+        Ray ray(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+        auto hit = traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
+        std::optional<Scalar> closest;
+        for (auto& triangle : triangles) {
+            if (auto other = triangle.intersect(ray); other && (!closest || other->t < *closest))
+                closest = other->t;
+        }
+        if (hit && (!closest || hit->distance() < *closest))
+            return false;
+        hit_count += closest.has_value();
+        match_count += closest && hit && hit->distance() == *closest;
+    }
+    return match_count * 10 >= hit_count * 8;
+}
+
+// A snapshot keeps the buffer that it has acquired after another one is published, which is then
+// reclaimed once released, and refits do not modify the published buffers.
+static bool check_publication(Mode mode) {
+    auto triangles = random_small_triangles<Scalar>(2000);
+    Bvh initial;
+    build(initial, triangles, mode);
+    Buffer buffer(std::move(initial));
+
+    auto old_snapshot = buffer.acquire(0);
+    auto old_triangles = triangles;
+    move_triangles(triangles);
+    if (!buffer.rebuild_async([triangles, mode] (Bvh& bvh) { build(bvh, triangles, mode); }) || buffer.rebuild_async([] (Bvh&) {}))
+        return false;
+    buffer.wait();
+    if (!buffer.is_rebuild_ready() || !buffer.publish_rebuild() || buffer.is_rebuilding() || buffer.retired_count() != 1)
+        return false;
+    {
+        auto snapshot = buffer.acquire(1);
+        if (&*snapshot == &*old_snapshot || !check_bounds(*old_snapshot, old_triangles) || !check_bounds(*snapshot, triangles))
+            return false;
+    }
+    { auto released = std::move(old_snapshot); }
+    if (buffer.reclaim() != 0)
+        return false;
+
+    for (size_t i = 0; i < 3; ++i) {
+        auto snapshot = buffer.acquire(0);
+        auto previous_triangles = triangles;
+        move_triangles(triangles);
+        buffer.refit([&] (Bvh& bvh) { refit(bvh, triangles); });
+        if (!check_bounds(*snapshot, previous_triangles) || !check_bounds(*buffer.acquire(1), triangles))
+            return false;
+    }
+    return buffer.reclaim() == 0;
+}
+
+// Readers traverse the hierarchy continuously, while it is rebuilt in the background and refitted
+// in between. Every snapshot must remain valid and unchanged while it is held.
+static bool check_concurrent_readers() {
+    const size_t reader_count = 3;
+    const size_t primitive_count = 2000;
+    auto triangles = random_small_triangles<Scalar>(primitive_count);
+    Bvh initial;
+    build(initial, triangles, Mode::Hybrid);
+    Buffer buffer(std::move(initial));
+
+    std::atomic<bool> stop { false };
+    std::atomic<size_t> failure_count { 0 }, snapshot_count { 0 };
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < reader_count; ++i) {
+        readers.emplace_back([&, i] {
+            while (!stop) {
+                auto snapshot = buffer.acquire(i);
+                auto root = snapshot->nodes[0].bounding_box_proxy().to_bounding_box();
+                BoundingCyl root_cylinder = snapshot->cnodes[0].bounding_box_proxy();
+                bool is_valid = check_structure(*snapshot, primitive_count);
+                auto new_root = snapshot->nodes[0].bounding_box_proxy().to_bounding_box();
+                BoundingCyl new_root_cylinder = snapshot->cnodes[0].bounding_box_proxy();
+                for (int j = 0; j < 3; ++j) {
+                    is_valid &= root.min[j] == new_root.min[j] && root.max[j] == new_root.max[j];
+                    is_valid &= root_cylinder.c[j] == new_root_cylinder.c[j];
+                }
+                failure_count += !is_valid;
+                snapshot_count++;
+            }
+        });
+    }
+
+    size_t rebuild_count = 0;
+    for (size_t frame = 0; frame < 60; ++frame) {
+        move_triangles(triangles);
+        if (!buffer.is_rebuilding())
+            buffer.rebuild_async([triangles] (Bvh& bvh) { build(bvh, triangles, Mode::Hybrid); });
+        // A published rebuild is refitted, since the primitives may have moved since it started
+        rebuild_count += buffer.publish_rebuild();
+        buffer.refit([&] (Bvh& bvh) { refit(bvh, triangles); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    buffer.wait();
+    rebuild_count += buffer.publish_rebuild();
+    buffer.refit([&] (Bvh& bvh) { refit(bvh, triangles); });
+
+    stop = true;
+    for (auto& reader : readers)
+        reader.join();
+    std::cout << rebuild_count << " rebuild(s) published, " << snapshot_count << " snapshot(s) acquired" << std::endl;
+    return failure_count == 0 && rebuild_count > 0 && buffer.reclaim() == 0 && check_bounds(*buffer.acquire(0), triangles);
+}
+
+int main() {
+    for (auto mode : { Mode::Cylinders, Mode::Hybrid }) {
+        if (!check_publication(mode)) {
+            std::cerr << "Invalid publication of double-buffered " << (mode == Mode::Hybrid ? "hybrid" : "cylinder") << " hierarchies" << std::endl;
+            return 1;
+        }
+    }
+    if (!check_concurrent_readers()) {
+        std::cerr << "Invalid snapshot of a double-buffered hierarchy" << std::endl;
+        return 1;
+    }
+    std::cout << "Double-buffered hierarchies are valid" << std::endl;
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <algorithm>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/incremental_rebuilder.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = double;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Ray      = bvh::Ray<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+
+static const char* mode_name(Mode mode) {
+    switch (mode) {
+        case Mode::Boxes:     return "box";
+        case Mode::Cylinders: return "cylinder";
+        default:              return "hybrid";
+    }
+}
+
+// Moves the triangles that are close to the given point, and returns their indices.
+static std::vector<size_t> move_group(std::vector<Triangle>& triangles, const Vector3& point, Scalar radius, const Vector3& offset) {
+    std::vector<size_t> moved;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        auto& triangle = triangles[i];
+        if (bvh::length(triangle.center() - point) > radius)
+            continue;
+        auto jitter = random_vector(-Scalar(0.02), Scalar(0.02));
+        triangle = Triangle(triangle.p0 + offset, triangle.p1() + offset + jitter, triangle.p2() + offset);
+        moved.push_back(i);
+    }
+    return moved;
+}
+
+// Collects the primitives referenced by the subtree, and checks that box nodes enclose their children.
+static bool check_subtree(const Bvh& bvh, size_t index, bool cylinder, const std::vector<Triangle>& triangles, std::vector<int>& references) {
+    auto is_leaf = cylinder ? bvh.cnodes[index].is_leaf : bvh.nodes[index].is_leaf;
+    auto first = cylinder ? bvh.cnodes[index].first_child_or_primitive : bvh.nodes[index].first_child_or_primitive;
+    auto count = cylinder ? bvh.cnodes[index].primitive_count : bvh.nodes[index].primitive_count;
+    if (is_leaf) {
+        for (size_t i = 0; i < count; ++i) {
+            auto primitive_index = bvh.primitive_indices[first + i];
+            references[primitive_index]++;
+            if (!cylinder && !triangles[primitive_index].bounding_box().is_contained_in(bvh.nodes[index].bounding_box_proxy()))
+                return false;
+        }
+        return true;
+    }
+    if (!cylinder) {
+        for (size_t i = 0; i < 2; ++i) {
+            if (!bvh.nodes[first + i].bounding_box_proxy().to_bounding_box().is_contained_in(bvh.nodes[index].bounding_box_proxy()))
+                return false;
+        }
+    }
+    return
+        check_subtree(bvh, first + 0, cylinder, triangles, references) &&
+        check_subtree(bvh, first + 1, cylinder, triangles, references);
+}
+
+static bool check_structure(const Bvh& bvh, const std::vector<Triangle>& triangles) {
+    std::vector<int> references(triangles.size(), 0);
+    if (bvh.hybrid) {
+        for (size_t i = 0; i < bvh.node_count; ++i) {
+            const auto& node = bvh.nodes[i];
+            if (!node.is_leaf)
+                continue;
+            auto bbox = bvh.cnodes[node.cylinder_root()].bounding_box_proxy().to_bounding_box().AABB();
+            if (!bbox.is_contained_in(node.bounding_box_proxy()) ||
+                !check_subtree(bvh, node.cylinder_root(), true, triangles, references))
+                return false;
+        }
+        if (!check_subtree(bvh, 0, false, triangles, references))
+            return false;
+    } else if (!check_subtree(bvh, 0, bvh.cylinder, triangles, references))
+        return false;
+    return std::all_of(references.begin(), references.end(), [] (int count) { return count == 1; });
+}
+
+static std::vector<Ray> random_rays(size_t ray_count) {
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < ray_count; ++i) {
+        auto origin = random_vector<Scalar>(-3, 3);
+        rays.emplace_back(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+    }
+    return rays;
+}
+
+// Compares the traversal to a brute-force search, and returns the number of rays for which the closest hit
+// is not found, or nothing if a hit is reported in front of the closest one.
+static std::optional<size_t> count_mismatches(const Bvh& bvh, const std::vector<Triangle>& triangles, const std::vector<Ray>& rays) {
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> intersector(bvh, triangles.data());
+    size_t mismatch_count = 0;
+    for (const auto& ray : rays) {
+        auto hit = traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
+        std::optional<Scalar> closest;
+        for (const auto& triangle : triangles) {
+            if (auto triangle_hit = triangle.intersect(Ray(ray.origin, ray.direction, ray.tmin, closest ? *closest : ray.tmax)))
+                closest = triangle_hit->distance();
+        }
+        if (hit && (!closest || hit->distance() < *closest))
+            return std::nullopt;
+        mismatch_count += hit.has_value() != closest.has_value() || (hit && hit->distance() != *closest);
+    }
+    return std::make_optional(mismatch_count);
+}
+
+// Box hierarchies must give the exact closest hits. The cylinder node intersector may miss a few primitives,
+// hence cylinder hierarchies are only required to miss about as many as a hierarchy built from scratch.
+static bool check_traversal(const Bvh& bvh, const std::vector<Triangle>& triangles, Mode mode) {
+    auto rays = random_rays(1000);
+    auto mismatch_count = count_mismatches(bvh, triangles, rays);
+    if (!mismatch_count)
+        return false;
+    Bvh reference;
+    build(reference, triangles, mode);
+    auto reference_mismatch_count = count_mismatches(reference, triangles, rays);
+    std::cout << *mismatch_count << " ray(s) miss their closest hit, against "
+        << *reference_mismatch_count << " with a full rebuild" << std::endl;
+    return mode == Mode::Boxes ? *mismatch_count == 0 : *mismatch_count <= 2 * *reference_mismatch_count + 5;
+}
+
+template <typename NodeSet>
+static bool check_update(Mode mode) {
+    auto triangles = random_triangles<Scalar>(4000);
+    Bvh bvh;
+    build(bvh, triangles, mode);
+    bvh::IncrementalRebuilder<Bvh, NodeSet> rebuilder(bvh);
+
+    // A group of primitives moves several times, and the hierarchy is updated each time
+    for (size_t i = 0; i < 3; ++i) {
+        auto moved = move_group(triangles, Vector3(Scalar(0.3)), Scalar(0.4), Vector3(Scalar(0.1), -Scalar(0.05), Scalar(0.08)));
+        if (!rebuilder.update(triangles.data(), moved.data(), moved.size()) ||
+            rebuilder.statistics.rebuilt_subtree_count == 0) {
+            std::cerr << "Failed to update the " << mode_name(mode) << " BVH" << std::endl;
+            return false;
+        }
+        std::cout << "Updated " << mode_name(mode) << " BVH after moving " << moved.size() << " primitive(s): "
+            << rebuilder.statistics.rebuilt_subtree_count << " subtree(s) with "
+            << rebuilder.statistics.rebuilt_primitive_count << " primitive(s) rebuilt, "
+            << rebuilder.statistics.refitted_leaf_count << " leaf (leaves) refitted" << std::endl;
+        if (!check_structure(bvh, triangles) || !check_traversal(bvh, triangles, mode)) {
+            std::cerr << "Invalid " << mode_name(mode) << " BVH after the update" << std::endl;
+            return false;
+        }
+    }
+
+    // When every primitive moves, a full rebuild is cheaper
+    std::vector<size_t> all(triangles.size());
+    std::iota(all.begin(), all.end(), 0);
+    if (rebuilder.update(triangles.data(), all.data(), all.size())) {
+        std::cerr << "Updates that touch every primitive must be rejected" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    if (!check_update<bvh::BoxNodes<Bvh>>(Mode::Boxes) ||
+        !check_update<bvh::CylinderNodes<Bvh>>(Mode::Cylinders) ||
+        !check_update<bvh::CylinderNodes<Bvh>>(Mode::Hybrid))
+        return 1;
+    return 0;
+}
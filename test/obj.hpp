@@ -5,6 +5,25 @@
 #include <string>
 #include <optional>
 #include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/capsule.hpp>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define OBJ_HAS_MMAP
+#endif
 
 namespace obj {
 
@@ -53,7 +72,11 @@ inline std::optional<int> read_index(char** ptr) {
     return std::make_optional(index);
 }
 
-inline std::vector<Triangle> load_from_stream(std::istream& is) {
+template <typename Scalar>
+std::vector<bvh::Triangle<Scalar>> load_from_stream(std::istream& is) {
+    using Vector3  = bvh::Vector3<Scalar>;
+    using Triangle = bvh::Triangle<Scalar>;
+
     static constexpr size_t max_line = 1024;
     char line[max_line];
 
@@ -94,11 +117,371 @@ inline std::vector<Triangle> load_from_stream(std::istream& is) {
     return triangles;
 }
 
-inline std::vector<Triangle> load_from_file(const std::string& file) {
-    std::ifstream is(file);
-    if (is)
-        return load_from_stream(is);
-    return std::vector<Triangle>();
+/// Read-only view of the contents of a file. The file is memory-mapped when the platform
+/// supports it, and read into memory otherwise.
+class MappedFile {
+    const char* contents = nullptr;
+    size_t file_size = 0;
+#ifdef OBJ_HAS_MMAP
+    void* mapping = nullptr;
+#else
+    std::vector<char> buffer;
+#endif
+
+public:
+    explicit MappedFile(const std::string& file) {
+#ifdef OBJ_HAS_MMAP
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            auto ptr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                madvise(ptr, info.st_size, MADV_SEQUENTIAL);
+                mapping = ptr;
+                contents = static_cast<const char*>(ptr);
+                file_size = info.st_size;
+            }
+        }
+        close(fd);
+#else
+        std::ifstream is(file, std::ios::binary | std::ios::ate);
+        if (!is)
+            return;
+        buffer.resize(is.tellg());
+        is.seekg(0);
+        if (is.read(buffer.data(), buffer.size())) {
+            contents = buffer.data();
+            file_size = buffer.size();
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef OBJ_HAS_MMAP
+        if (mapping)
+            munmap(mapping, file_size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    const char* data() const { return contents; }
+    size_t size() const { return file_size; }
+};
+
+inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline const char* skip_blanks(const char* ptr, const char* end) {
+    while (ptr < end && is_blank(*ptr)) ptr++;
+    return ptr;
+}
+
+/// Parses the number at the beginning of the token with `std::strtof`. The token is copied,
+/// since the input is not null-terminated.
+inline float parse_float_with_strtof(const char*& ptr, const char* end) {
+    auto token_end = ptr;
+    while (token_end < end && !is_blank(*token_end)) token_end++;
+    std::string token(ptr, token_end);
+    char* number_end;
+    auto x = std::strtof(token.c_str(), &number_end);
+    ptr += number_end - token.c_str();
+    return x;
+}
+
+/// Fast float parser for the common case of decimal numbers with at most 15 significant digits
+/// and a small exponent, which are converted exactly to the nearest double, and then rounded
+/// to a float. That second rounding gives the nearest float, unless the double is halfway
+/// between two floats, in which case the number is parsed again with `std::strtof`, as are
+/// other numbers (and special values). The result is therefore correctly rounded.
+inline float parse_float(const char*& ptr, const char* end) {
+    static constexpr double powers_of_ten[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    ptr = skip_blanks(ptr, end);
+    auto p = ptr;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    size_t digit_count = 0;
+    bool has_digits = false;
+    for (; p < end && std::isdigit(*p); ++p, has_digits = true) {
+        if (digit_count < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digit_count += mantissa != 0;
+        } else
+            exponent++;
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && std::isdigit(*p); ++p, has_digits = true) {
+            if (digit_count < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digit_count += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (has_digits && p < end && (*p == 'e' || *p == 'E')) {
+        auto q = p + 1;
+        bool negative_exponent = q < end && *q == '-';
+        if (q < end && (*q == '-' || *q == '+'))
+            q++;
+        if (q < end && std::isdigit(*q)) {
+            int value = 0;
+            for (; q < end && std::isdigit(*q); ++q)
+                value = std::min(value * 10 + (*q - '0'), 10000);
+            exponent += negative_exponent ? -value : value;
+            p = q;
+        }
+    }
+
+    // The mantissa and the power of ten must be exactly representable as doubles for their product
+    // or quotient to be the nearest double to the number, which must span the whole token
+    if (!has_digits || digit_count >= 16 || exponent < -22 || exponent > 22 || (p < end && !is_blank(*p)))
+        return parse_float_with_strtof(ptr, end);
+
+    double value = double(mantissa);
+    value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+
+    // The 29 low bits of the mantissa of a double are the ones that are rounded off in a float
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x1FFFFFFF) == 0x10000000)
+        return parse_float_with_strtof(ptr, end);
+
+    ptr = p;
+    return float(negative ? -value : value);
+}
+
+inline std::optional<int64_t> parse_index(const char*& ptr, const char* end) {
+    auto p = skip_blanks(ptr, end);
+    bool negative = p < end && *p == '-';
+    if (negative)
+        p++;
+    if (p == end || !std::isdigit(*p))
+        return std::nullopt;
+    int64_t index = 0;
+    for (; p < end && std::isdigit(*p); ++p)
+        index = index * 10 + (*p - '0');
+    ptr = p;
+    return negative ? -index : index;
+}
+
+/// Reads a vertex index of a face, skipping the texture coordinate and normal indices.
+inline std::optional<int64_t> parse_face_index(const char*& ptr, const char* end) {
+    auto index = parse_index(ptr, end);
+    if (!index)
+        return std::nullopt;
+    for (size_t i = 0; i < 2 && ptr < end && *ptr == '/'; ++i) {
+        ptr++;
+        parse_index(ptr, end);
+    }
+    return index;
+}
+
+/// Vertices, faces, and line segments parsed from a chunk of the file. Indices are not resolved yet,
+/// since the vertices that come before the chunk are unknown: relative (negative) indices are stored
+/// as offsets from the beginning of the chunk, and absolute ones as 0-based indices.
+template <typename Scalar>
+struct ObjChunk {
+    template <size_t N>
+    struct Element {
+        int64_t indices[N];
+        uint8_t relative_mask;
+    };
+
+    using Face    = Element<3>;
+    using Segment = Element<2>;
+
+    std::vector<bvh::Vector3<Scalar>> vertices;
+    std::vector<Face> faces;
+    std::vector<Segment> segments;
+};
+
+template <typename Scalar>
+void parse_chunk(const char* ptr, const char* end, ObjChunk<Scalar>& chunk) {
+    while (ptr < end) {
+        auto line_end = static_cast<const char*>(std::memchr(ptr, '\n', end - ptr));
+        if (!line_end)
+            line_end = end;
+        auto p = skip_blanks(ptr, line_end);
+        if (line_end - p >= 2 && p[0] == 'v' && is_blank(p[1])) {
+            p++;
+            auto x = parse_float(p, line_end);
+            auto y = parse_float(p, line_end);
+            auto z = parse_float(p, line_end);
+            chunk.vertices.emplace_back(x, y, z);
+        } else if (line_end - p >= 2 && p[0] == 'f' && is_blank(p[1])) {
+            p++;
+            // Polygons are triangulated as fans around their first vertex
+            typename ObjChunk<Scalar>::Face face;
+            face.relative_mask = 0;
+            size_t i = 0;
+            while (auto index = parse_face_index(p, line_end)) {
+                bool relative = *index < 0;
+                auto j = relative ? int64_t(chunk.vertices.size()) + *index : *index - 1;
+                auto k = std::min(i, size_t(2));
+                face.indices[k] = j;
+                face.relative_mask = (face.relative_mask & ~(1 << k)) | (relative << k);
+                if (++i >= 3) {
+                    chunk.faces.push_back(face);
+                    face.indices[1] = face.indices[2];
+                    face.relative_mask = (face.relative_mask & 1) | ((face.relative_mask >> 1) & 2);
+                }
+            }
+        } else if (line_end - p >= 2 && p[0] == 'l' && is_blank(p[1])) {
+            p++;
+            // Polylines are split into segments between consecutive vertices
+            typename ObjChunk<Scalar>::Segment segment;
+            segment.relative_mask = 0;
+            size_t i = 0;
+            while (auto index = parse_face_index(p, line_end)) {
+                bool relative = *index < 0;
+                auto j = relative ? int64_t(chunk.vertices.size()) + *index : *index - 1;
+                auto k = std::min(i, size_t(1));
+                segment.indices[k] = j;
+                segment.relative_mask = (segment.relative_mask & ~(1 << k)) | (relative << k);
+                if (++i >= 2) {
+                    chunk.segments.push_back(segment);
+                    segment.indices[0] = segment.indices[1];
+                    segment.relative_mask >>= 1;
+                }
+            }
+        }
+        ptr = line_end + 1;
+    }
+}
+
+/// Parsed contents of a file: the chunks, with their elements, and the vertices of the whole file.
+template <typename Scalar>
+struct ObjFile {
+    std::vector<ObjChunk<Scalar>> chunks;
+    std::vector<bvh::Vector3<Scalar>> vertices;
+    /// Number of vertices before each chunk.
+    std::vector<size_t> vertex_offsets;
+
+    /// Resolves the indices of an element of the given chunk into indices into `vertices`.
+    /// Returns false if one of them is out of bounds.
+    template <typename Element, size_t N>
+    bool resolve(size_t chunk, const Element& element, size_t (&indices)[N]) const {
+        bool is_valid = true;
+        for (size_t k = 0; k < N; ++k) {
+            auto offset = (element.relative_mask >> k) & 1 ? int64_t(vertex_offsets[chunk]) : int64_t(0);
+            indices[k] = size_t(element.indices[k] + offset);
+            is_valid = is_valid && indices[k] < vertices.size();
+        }
+        return is_valid;
+    }
+};
+
+/// Parses a file in parallel: the file is memory-mapped and split into chunks of whole lines,
+/// which are parsed independently. The vertices of the chunks are then gathered. Returns false
+/// if the file cannot be read.
+template <typename Scalar>
+bool parse_file(const std::string& file, ObjFile<Scalar>& obj_file) {
+    MappedFile mapped_file(file);
+    const char* data = mapped_file.data();
+    size_t size = mapped_file.size();
+    if (!data)
+        return false;
+
+    // Chunks are large enough to amortize the cost of their setup
+    static constexpr size_t min_chunk_size = 1 << 20;
+    size_t chunk_count = std::max(size_t(1), std::min(size / min_chunk_size, size_t(1024)));
+    std::vector<size_t> chunk_begins(chunk_count + 1);
+    chunk_begins[chunk_count] = size;
+    for (size_t i = 1; i < chunk_count; ++i) {
+        auto begin = std::max(chunk_begins[i - 1], i * (size / chunk_count));
+        auto line_end = static_cast<const char*>(std::memchr(data + begin, '\n', size - begin));
+        chunk_begins[i] = line_end ? line_end - data + 1 : size;
+    }
+
+    auto& chunks = obj_file.chunks;
+    chunks.resize(chunk_count);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < chunk_count; ++i)
+        parse_chunk(data + chunk_begins[i], data + chunk_begins[i + 1], chunks[i]);
+
+    auto& vertex_offsets = obj_file.vertex_offsets;
+    vertex_offsets.assign(chunk_count + 1, 0);
+    for (size_t i = 0; i < chunk_count; ++i)
+        vertex_offsets[i + 1] = vertex_offsets[i] + chunks[i].vertices.size();
+
+    obj_file.vertices.resize(vertex_offsets[chunk_count]);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < chunk_count; ++i) {
+        std::copy(chunks[i].vertices.begin(), chunks[i].vertices.end(), obj_file.vertices.begin() + vertex_offsets[i]);
+        chunks[i].vertices = std::vector<bvh::Vector3<Scalar>>();
+    }
+    return true;
+}
+
+/// Creates one primitive per element of the given kind (faces or segments) of the parsed file,
+/// directly in its final location, once the number of vertices before each chunk is known.
+template <typename Primitive, typename Scalar, typename Elements, typename F>
+std::vector<Primitive> resolve_elements(const std::string& file, const ObjFile<Scalar>& obj_file, Elements elements, F make_primitive) {
+    using Element = typename std::remove_reference_t<decltype(obj_file.chunks[0].*elements)>::value_type;
+    static constexpr size_t index_count = std::extent<decltype(Element::indices)>::value;
+
+    const auto& chunks = obj_file.chunks;
+    std::vector<size_t> offsets(chunks.size() + 1, 0);
+    for (size_t i = 0; i < chunks.size(); ++i)
+        offsets[i + 1] = offsets[i] + (chunks[i].*elements).size();
+
+    std::vector<Primitive> primitives(offsets[chunks.size()]);
+    bool is_valid = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&: is_valid)
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        for (size_t j = 0; j < (chunks[i].*elements).size(); ++j) {
+            size_t indices[index_count];
+            is_valid = obj_file.resolve(i, (chunks[i].*elements)[j], indices) && is_valid;
+            if (is_valid)
+                primitives[offsets[i] + j] = make_primitive(indices);
+        }
+    }
+    if (!is_valid) {
+        std::cerr << "Invalid vertex index in '" << file << "'" << std::endl;
+        return std::vector<Primitive>();
+    }
+    return primitives;
+}
+
+/// Loads the faces of a file in parallel, as triangles (see `parse_file()`).
+template <typename Scalar>
+std::vector<bvh::Triangle<Scalar>> load_from_file(const std::string& file) {
+    using Triangle = bvh::Triangle<Scalar>;
+
+    ObjFile<Scalar> obj_file;
+    if (!parse_file(file, obj_file))
+        return std::vector<Triangle>();
+    const auto& vertices = obj_file.vertices;
+    return resolve_elements<Triangle>(file, obj_file, &ObjChunk<Scalar>::faces, [&] (const size_t* indices) {
+        return Triangle(vertices[indices[0]], vertices[indices[1]], vertices[indices[2]]);
+    });
+}
+
+/// Loads the lines (`l` elements) of a file in parallel, as strands of capsules of the given radius,
+/// with one capsule per segment of each polyline (see `parse_file()`).
+template <typename Scalar>
+std::vector<bvh::Capsule<Scalar>> load_curves_from_file(const std::string& file, Scalar radius) {
+    using Capsule = bvh::Capsule<Scalar>;
+
+    ObjFile<Scalar> obj_file;
+    if (!parse_file(file, obj_file))
+        return std::vector<Capsule>();
+    const auto& vertices = obj_file.vertices;
+    return resolve_elements<Capsule>(file, obj_file, &ObjChunk<Scalar>::segments, [&] (const size_t* indices) {
+        return Capsule(vertices[indices[0]], vertices[indices[1]], radius);
+    });
 }
 
 } // namespace obj
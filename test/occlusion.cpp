@@ -0,0 +1,91 @@
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = double;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Ray      = bvh::Ray<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+
+using Traverser = bvh::SingleRayTraverser<Bvh>;
+
+// Checks that the detailed statistics agree with the basic ones, and are consistent with each other.
+static bool is_consistent(const Traverser::Statistics& basic, const Traverser::DetailedStatistics& detailed, Mode mode) {
+    return
+        basic.traversal_steps == detailed.traversal_steps &&
+        basic.intersections == detailed.intersections &&
+        detailed.cylinder_hits + detailed.cylinder_misses == detailed.cylinder_tests &&
+        detailed.missed_intersections <= detailed.intersections &&
+        (mode != Mode::Boxes || (detailed.cylinder_tests == 0 && detailed.transitions == 0)) &&
+        (mode != Mode::Boxes || detailed.box_tests == 2 * detailed.traversal_steps) &&
+        (mode != Mode::Cylinders || (detailed.box_tests == 0 && detailed.transitions == 0)) &&
+        detailed.max_stack_depth < Traverser::stack_size;
+}
+
+static bool check_occlusion(size_t triangle_count, size_t ray_count, Mode mode) {
+    auto triangles = random_triangles<Scalar>(triangle_count);
+
+    Bvh bvh;
+    build(bvh, triangles, mode);
+
+    Traverser traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> closest_intersector(bvh, triangles.data());
+    bvh::AnyPrimitiveIntersector<Bvh, Triangle> any_intersector(bvh, triangles.data());
+
+    size_t occluded_count = 0;
+    for (size_t i = 0; i < ray_count; ++i) {
+        // Rays of finite length between two random points, like shadow rays
+        auto origin = random_vector<Scalar>(-2, 2);
+        auto target = random_vector<Scalar>(-1, 1);
+        Ray ray(origin, bvh::normalize(target - origin), 0, bvh::length(target - origin));
+
+        bool occluded = traverser.occluded(ray, any_intersector, bvh.cylinder, bvh.hybrid);
+        bool closest  = traverser.traverse(ray, closest_intersector, bvh.cylinder, bvh.hybrid).has_value();
+        bool any      = traverser.traverse(ray, any_intersector, bvh.cylinder, bvh.hybrid).has_value();
+        if (occluded != closest || occluded != any) {
+            std::cerr << "Occlusion query does not match the intersection query" << std::endl;
+            return false;
+        }
+        occluded_count += occluded;
+
+        Traverser::Statistics basic;
+        Traverser::DetailedStatistics detailed;
+        traverser.traverse(ray, closest_intersector, bvh.cylinder, bvh.hybrid, basic);
+        traverser.traverse(ray, closest_intersector, bvh.cylinder, bvh.hybrid, detailed);
+        if (!is_consistent(basic, detailed, mode)) {
+            std::cerr << "Detailed traversal statistics are inconsistent" << std::endl;
+            return false;
+        }
+        basic = {};
+        detailed = {};
+        traverser.occluded(ray, any_intersector, bvh.cylinder, bvh.hybrid, basic);
+        traverser.occluded(ray, any_intersector, bvh.cylinder, bvh.hybrid, detailed);
+        if (!is_consistent(basic, detailed, mode)) {
+            std::cerr << "Detailed occlusion statistics are inconsistent" << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << occluded_count << " out of " << ray_count << " ray(s) are occluded" << std::endl;
+    return true;
+}
+
+int main() {
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        for (auto size : { 1, 2, 100, 5000 }) {
+            if (!check_occlusion(size, 2000, mode))
+                return 1;
+        }
+    }
+    return 0;
+}
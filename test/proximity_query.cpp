@@ -0,0 +1,131 @@
+#include <vector>
+#include <iostream>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/capsule.hpp>
+#include <bvh/sweep_sah_builder.hpp>
+#include <bvh/proximity_traverser.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar    = float;
+using Vector3   = bvh::Vector3<Scalar>;
+using Capsule   = bvh::Capsule<Scalar>;
+using Bvh       = bvh::Bvh<Scalar>;
+using Traverser = bvh::ProximityTraverser<Bvh>;
+using Segment   = Traverser::Segment;
+using Result    = Traverser::Result;
+
+// Strands of hair, as random walks of capsules.
+static std::vector<Capsule> random_strands(size_t strand_count, size_t segment_count, Scalar radius) {
+    std::vector<Capsule> capsules;
+    for (size_t i = 0; i < strand_count; ++i) {
+        auto p = random_vector<Scalar>(-1, 1);
+        auto d = bvh::normalize(random_vector<Scalar>(-1, 1)) * Scalar(0.05);
+        for (size_t j = 0; j < segment_count; ++j) {
+            d = bvh::normalize(d + random_vector(-Scalar(0.02), Scalar(0.02))) * Scalar(0.05);
+            capsules.emplace_back(p, p + d, radius);
+            p = p + d;
+        }
+    }
+    return capsules;
+}
+
+// Points and short segments, around and inside the strands.
+static std::vector<Segment> random_queries(size_t query_count) {
+    std::vector<Segment> queries;
+    for (size_t i = 0; i < query_count; ++i) {
+        auto p = random_vector(-Scalar(1.5), Scalar(1.5));
+        if (i % 2 == 0)
+            queries.emplace_back(p);
+        else
+            queries.emplace_back(p, p + random_vector(-Scalar(0.1), Scalar(0.1)));
+    }
+    return queries;
+}
+
+// The traverser must find the same closest primitives and the same primitives within a radius as
+// the brute-force search, since the node bounds are conservative, and the batches must match.
+static bool check_queries(const std::vector<Capsule>& capsules, const std::vector<Segment>& queries, Mode mode) {
+    Bvh bvh;
+    build<bvh::SweepSahBuilder>(bvh, capsules, mode);
+    Traverser traverser(bvh);
+    auto distance = [&] (size_t i, const Segment& query) { return capsules[i].distance(query.p0, query.p1); };
+    const Scalar radius = Scalar(0.05);
+    const Scalar max_distance = Scalar(0.1);
+
+    size_t within_count = 0;
+    for (auto& query : queries) {
+        Scalar closest_distance = std::numeric_limits<Scalar>::max();
+        std::vector<size_t> expected;
+        for (size_t i = 0; i < capsules.size(); ++i) {
+            auto d = distance(i, query);
+            closest_distance = std::min(closest_distance, d);
+            if (d <= radius)
+                expected.push_back(i);
+        }
+
+        auto closest = traverser.closest(query, distance, bvh.cylinder, bvh.hybrid);
+        if (!closest || closest->distance != closest_distance || distance(closest->primitive_index, query) != closest_distance)
+            return false;
+        auto bounded = traverser.closest(query, distance, bvh.cylinder, bvh.hybrid, max_distance);
+        if (bounded.has_value() != (closest_distance <= max_distance) || (bounded && bounded->distance != closest_distance))
+            return false;
+
+        std::vector<size_t> found;
+        traverser.within(query, radius, distance, [&] (const Result& result) { found.push_back(result.primitive_index); }, bvh.cylinder, bvh.hybrid);
+        std::sort(found.begin(), found.end());
+        if (found != expected)
+            return false;
+        within_count += found.size();
+    }
+
+    std::vector<std::optional<Result>> results(queries.size());
+    traverser.closest_batch(queries.data(), queries.size(), distance, results.data(), bvh.cylinder, bvh.hybrid);
+    std::vector<std::vector<size_t>> found(queries.size());
+    traverser.within_batch(queries.data(), queries.size(), radius, distance,
+        [&] (size_t j, const Result& result) { found[j].push_back(result.primitive_index); }, bvh.cylinder, bvh.hybrid);
+    size_t batch_within_count = 0;
+    for (size_t j = 0; j < queries.size(); ++j) {
+        auto closest = traverser.closest(queries[j], distance, bvh.cylinder, bvh.hybrid);
+        if (!results[j] || results[j]->distance != closest->distance)
+            return false;
+        batch_within_count += found[j].size();
+    }
+    std::cout << within_count << " primitive(s) within the radius of the queries" << std::endl;
+    return batch_within_count == within_count;
+}
+
+int main() {
+    for (size_t i = 0; i < 1000; ++i) {
+        // Segments and points, some of them degenerate or parallel
+        auto p0 = random_vector<Scalar>(-1, 1), p1 = i % 10 == 0 ? p0 : random_vector<Scalar>(-1, 1);
+        auto q0 = random_vector<Scalar>(-1, 1), q1 = i % 7 == 0 ? q0 : (i % 5 == 0 ? q0 + (p1 - p0) : random_vector<Scalar>(-1, 1));
+        auto d = bvh::segment_distance(p0, p1, q0, q1);
+        Scalar sampled = std::numeric_limits<Scalar>::max();
+        for (size_t j = 0; j <= 100; ++j) {
+            auto p = p0 + (p1 - p0) * (Scalar(j) / 100);
+            for (size_t k = 0; k <= 100; ++k)
+                sampled = std::min(sampled, bvh::length(p - (q0 + (q1 - q0) * (Scalar(k) / 100))));
+        }
+        if (d > sampled + Scalar(1e-5) || d < sampled - Scalar(0.03)) {
+            std::cerr << "Invalid distance between segments" << std::endl;
+            return 1;
+        }
+    }
+
+    auto capsules = random_strands(300, 10, Scalar(0.005));
+    auto queries = random_queries(1000);
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        if (!check_queries(capsules, queries, mode)) {
+            std::cerr << "Proximity queries do not match the brute-force search" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Proximity queries are valid" << std::endl;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef RANDOM_SCENE_HPP
+#define RANDOM_SCENE_HPP
+
+#include <vector>
+#include <random>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/bounding_box.hpp>
+#include <bvh/cylinder_nodes.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
+
+// Fixture shared by the tests: random scenes, and the hierarchies built over them.
+
+static std::default_random_engine gen;
+
+template <typename Scalar>
+static Scalar random_scalar(Scalar min, Scalar max) {
+    return std::uniform_real_distribution<Scalar>(min, max)(gen);
+}
+
+template <typename Scalar>
+static bvh::Vector3<Scalar> random_vector(Scalar min, Scalar max) {
+    return bvh::Vector3<Scalar>(random_scalar(min, max), random_scalar(min, max), random_scalar(min, max));
+}
+
+// Creates thin, elongated triangles, for which cylinders are good bounding volumes.
+template <typename Scalar>
+static std::vector<bvh::Triangle<Scalar>> random_triangles(size_t triangle_count) {
+    std::vector<bvh::Triangle<Scalar>> triangles(triangle_count);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        auto p = random_vector<Scalar>(-1, 1);
+        auto d = random_vector(-Scalar(0.2), Scalar(0.2));
+        triangles[i] = bvh::Triangle<Scalar>(p, p + d, p + d * Scalar(0.5) + random_vector(-Scalar(0.01), Scalar(0.01)));
+    }
+    return triangles;
+}
+
+// Creates small triangles of arbitrary shapes.
+template <typename Scalar>
+static std::vector<bvh::Triangle<Scalar>> random_small_triangles(size_t triangle_count) {
+    std::vector<bvh::Triangle<Scalar>> triangles(triangle_count);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        auto p = random_vector<Scalar>(-1, 1);
+        triangles[i] = bvh::Triangle<Scalar>(p, p + random_vector(-Scalar(0.1), Scalar(0.1)), p + random_vector(-Scalar(0.1), Scalar(0.1)));
+    }
+    return triangles;
+}
+
+enum class Mode { Boxes, Cylinders, Hybrid };
+
+template <typename Bvh>
+using LocBoxBuilder = bvh::LocallyOrderedClusteringBuilder<Bvh, uint32_t, typename Bvh::Node>;
+
+// Builds a hierarchy of boxes with the given builder, or a hierarchy of cylinders or a hybrid
+// one (with three levels of boxes) with the LOC builder.
+template <template <typename> class BoxBuilder = LocBoxBuilder, typename Bvh, typename Primitive>
+static void build(Bvh& bvh, const std::vector<Primitive>& primitives, Mode mode) {
+    using Scalar = typename Bvh::ScalarType;
+    if (mode == Mode::Boxes) {
+        auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(primitives.data(), primitives.size());
+        auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), primitives.size());
+        BoxBuilder<Bvh> builder(bvh);
+        builder.build(global_bbox, bboxes.get(), centers.get(), primitives.size());
+        bvh.cylinder = bvh.hybrid = false;
+        return;
+    }
+    auto [bcyls, centers] = bvh::compute_bounding_cylinders_and_centers(primitives.data(), primitives.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), primitives.size());
+    bvh::LocallyOrderedClusteringBuilder<Bvh, uint32_t, bvh::FullCylinderNode<Scalar>> builder(bvh);
+    if (mode == Mode::Cylinders)
+        builder.build(global_bbox, bcyls.get(), centers.get(), primitives.size());
+    else
+        builder.build(global_bbox, bcyls.get(), centers.get(), primitives.size(), 3);
+    bvh.cylinder = true;
+    bvh.hybrid = mode == Mode::Hybrid;
+}
+
+template <typename Scalar>
+static bool is_inside(const bvh::BoundingCyl<Scalar>& cylinder, const bvh::Vector3<Scalar>& p, Scalar eps = Scalar(1e-4)) {
+    auto y = bvh::dot(p - cylinder.c, cylinder.axis);
+    auto radial = bvh::length(p - (cylinder.c + cylinder.axis * y));
+    return y >= -eps && y <= cylinder.h + eps && radial <= cylinder.r + eps;
+}
+
+#endif
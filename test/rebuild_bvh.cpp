@@ -0,0 +1,161 @@
+#include <vector>
+#include <iostream>
+#include <random>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
+#include <bvh/tree_layout_optimizer.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = float;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+using Morton   = uint32_t;
+
+using BoxBuilder      = bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, Bvh::Node>;
+using CylinderBuilder = bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>>;
+
+static void build(BoxBuilder& box_builder, CylinderBuilder& builder, Bvh& bvh, const std::vector<Triangle>& triangles, Mode mode) {
+    if (mode == Mode::Boxes) {
+        auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+        auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+        box_builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+        return;
+    }
+    auto [bcyls, centers] = bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), triangles.size());
+    if (mode == Mode::Cylinders)
+        builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size());
+    else
+        builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size(), 3);
+    bvh.cylinder = true;
+    bvh.hybrid = mode == Mode::Hybrid;
+}
+
+static bool is_same_vector(const Vector3& a, const Vector3& b) {
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+template <typename Node>
+static bool is_same_node(const Node& a, const Node& b) {
+    return
+        a.is_leaf == b.is_leaf &&
+        a.primitive_count == b.primitive_count &&
+        a.first_child_or_primitive == b.first_child_or_primitive;
+}
+
+static bool is_same_bvh(const Bvh& a, const Bvh& b, Mode mode) {
+    if (a.node_count != b.node_count || a.cnode_count != b.cnode_count)
+        return false;
+    if (mode != Mode::Cylinders) {
+        for (size_t i = 0; i < a.node_count; ++i) {
+            auto box_a = a.nodes[i].bounding_box_proxy().to_bounding_box();
+            auto box_b = b.nodes[i].bounding_box_proxy().to_bounding_box();
+            if (!is_same_node(a.nodes[i], b.nodes[i]) ||
+                !is_same_vector(box_a.min, box_b.min) || !is_same_vector(box_a.max, box_b.max))
+                return false;
+        }
+    }
+    if (mode != Mode::Boxes) {
+        for (size_t i = 0; i < a.cnode_count; ++i) {
+            auto cyl_a = a.cnodes[i].bounding_box_proxy().to_bounding_box();
+            auto cyl_b = b.cnodes[i].bounding_box_proxy().to_bounding_box();
+            if (!is_same_node(a.cnodes[i], b.cnodes[i]) ||
+                !is_same_vector(cyl_a.c, cyl_b.c) || !is_same_vector(cyl_a.axis, cyl_b.axis) || cyl_a.h != cyl_b.h || cyl_a.r != cyl_b.r)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Builds a series of BVHs of varying sizes with the same builders, which reuse their buffers,
+// and checks that the result is the same as the one obtained with fresh builders.
+static bool check_rebuilds(Mode mode) {
+    Bvh bvh;
+    BoxBuilder box_builder(bvh);
+    CylinderBuilder builder(bvh);
+    for (auto size : { 1000, 100, 5000, 2, 5000 }) {
+        auto triangles = random_triangles<Scalar>(size);
+        build(box_builder, builder, bvh, triangles, mode);
+
+        Bvh reference;
+        BoxBuilder reference_box_builder(reference);
+        CylinderBuilder reference_builder(reference);
+        build(reference_box_builder, reference_builder, reference, triangles, mode);
+
+        if (!is_same_bvh(bvh, reference, mode) ||
+            !std::equal(
+                bvh.primitive_indices.get(), bvh.primitive_indices.get() + size,
+                reference.primitive_indices.get())) {
+            std::cerr << "Rebuilding a BVH of " << size << " primitive(s) does not give the same BVH" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Optimizing the layout of a BVH replaces its node arrays by smaller ones, which the allocator may
+// place where the arrays of the builders were. The next build must not take them back as buffers.
+static bool check_rebuilds_after_layout(Mode mode) {
+    Bvh bvh;
+    BoxBuilder box_builder(bvh);
+    CylinderBuilder builder(bvh);
+    auto triangles = random_triangles<Scalar>(4000);
+    for (size_t i = 0; i < 3; ++i) {
+        build(box_builder, builder, bvh, triangles, mode);
+        for (size_t j = 0; j < 2; ++j) {
+            bvh::TreeLayoutOptimizer<Bvh> optimizer(bvh);
+            optimizer.optimize();
+        }
+    }
+    build(box_builder, builder, bvh, triangles, mode);
+
+    Bvh reference;
+    BoxBuilder reference_box_builder(reference);
+    CylinderBuilder reference_builder(reference);
+    build(reference_box_builder, reference_builder, reference, triangles, mode);
+    if (!is_same_bvh(bvh, reference, mode)) {
+        std::cerr << "Rebuilding a BVH after optimizing its layout does not give the same BVH" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// An array that replaces one that a buffer has handed over, even at the same address, has an unknown
+// capacity: the buffer must release it instead of taking it back.
+static bool check_replaced_arrays() {
+    bvh::GrowingBuffer<size_t> buffer;
+    bvh::BvhArray<size_t> array;
+    buffer.reserve(100);
+    buffer.give(array);
+    buffer.reserve(100);
+    buffer.give(array);
+    if (buffer.capacity() != 100) {
+        std::cerr << "A buffer does not take back the array that it has handed over" << std::endl;
+        return false;
+    }
+    auto storage = array.release();
+    array = bvh::BvhArray<size_t>(storage);
+    buffer.give(array);
+    if (buffer.capacity() != 0) {
+        std::cerr << "A buffer takes back an array that replaced the one that it has handed over" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    if (!check_replaced_arrays())
+        return 1;
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        if (!check_rebuilds(mode) || !check_rebuilds_after_layout(mode))
+            return 1;
+    }
+    std::cout << "Rebuilt BVHs are identical to the ones built from scratch" << std::endl;
+    return 0;
+}
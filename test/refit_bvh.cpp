@@ -2,12 +2,15 @@
 #include <iostream>
 #include <random>
 #include <array>
+#include <limits>
+#include <cmath>
 
 #include <bvh/bvh.hpp>
 #include <bvh/vector.hpp>
 #include <bvh/triangle.hpp>
 #include <bvh/ray.hpp>
 #include <bvh/sweep_sah_builder.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
 #include <bvh/single_ray_traverser.hpp>
 #include <bvh/primitive_intersectors.hpp>
 #include <bvh/bounding_box.hpp>
@@ -55,6 +58,133 @@ bool check_bvh(const Bvh& bvh, const std::vector<Primitive>& primitives) {
         });
 }
 
+static bool is_same_cylinder(const bvh::BoundingCyl<Scalar>& a, const bvh::BoundingCyl<Scalar>& b) {
+    return
+        a.c[0] == b.c[0] && a.c[1] == b.c[1] && a.c[2] == b.c[2] &&
+        a.axis[0] == b.axis[0] && a.axis[1] == b.axis[1] && a.axis[2] == b.axis[2] &&
+        a.h == b.h && a.r == b.r;
+}
+
+// Returns true if the point is inside the cylinder, without tolerance. The test is evaluated in
+// double precision, with a normalized axis, so that it does not add its own rounding errors to
+// those of the cylinder.
+static bool is_strictly_inside(const bvh::BoundingCyl<Scalar>& cylinder, const Vector3& p) {
+    double d[3], y = 0, d2 = 0, axis2 = 0;
+    for (int i = 0; i < 3; ++i) {
+        d[i] = double(p[i]) - double(cylinder.c[i]);
+        y += d[i] * double(cylinder.axis[i]);
+        d2 += d[i] * d[i];
+        axis2 += double(cylinder.axis[i]) * double(cylinder.axis[i]);
+    }
+    y /= std::sqrt(axis2);
+    return y >= 0 && y <= double(cylinder.h) && d2 - y * y <= double(cylinder.r) * double(cylinder.r);
+}
+
+// Checks that the cylinder subtree is consistent with the given triangles: leaves must be the padded
+// bounding cylinders of their triangles, and inner nodes the padded union of the cylinders of their
+// children. The union of two cylinders is approximate, hence the cylinders are compared to what the
+// builder would compute. The padding must make every cylinder contain the triangles below it.
+static bool check_cylinder_subtree(const Bvh& bvh, size_t index, const std::vector<Triangle>& triangles, std::vector<size_t>& ancestors) {
+    const Scalar inflation = Scalar(4) * std::numeric_limits<Scalar>::epsilon();
+    const auto& node = bvh.cnodes[index];
+    auto cyl = node.bounding_box_proxy().to_bounding_box();
+    ancestors.push_back(index);
+    bool is_valid = true;
+    if (node.is_leaf) {
+        auto primitive_index = bvh.primitive_indices.get() + node.first_child_or_primitive;
+        auto expected = triangles[primitive_index[0]].bounding_cyl();
+        for (size_t i = 1; i < node.primitive_count; ++i)
+            expected.extend(triangles[primitive_index[i]].bounding_cyl());
+        is_valid = is_same_cylinder(cyl, expected.inflate(inflation));
+        for (size_t i = 0; i < node.primitive_count; ++i) {
+            const auto& triangle = triangles[primitive_index[i]];
+            for (auto ancestor : ancestors) {
+                auto ancestor_cyl = bvh.cnodes[ancestor].bounding_box_proxy().to_bounding_box();
+                is_valid &=
+                    is_strictly_inside(ancestor_cyl, triangle.p0) &&
+                    is_strictly_inside(ancestor_cyl, triangle.p1()) &&
+                    is_strictly_inside(ancestor_cyl, triangle.p2());
+            }
+        }
+    } else {
+        auto left  = node.first_child_or_primitive + 0;
+        auto right = node.first_child_or_primitive + 1;
+        auto expected = bvh.cnodes[left].bounding_box_proxy().to_bounding_box().extend(bvh.cnodes[right].bounding_box_proxy());
+        is_valid =
+            is_same_cylinder(cyl, expected.inflate(inflation)) &&
+            check_cylinder_subtree(bvh, left, triangles, ancestors) &&
+            check_cylinder_subtree(bvh, right, triangles, ancestors);
+    }
+    ancestors.pop_back();
+    return is_valid;
+}
+
+static bool check_cylinder_bvh(const Bvh& bvh, const std::vector<Triangle>& triangles) {
+    std::vector<size_t> ancestors;
+    if (!bvh.hybrid)
+        return check_cylinder_subtree(bvh, 0, triangles, ancestors);
+
+    // The box leaves must enclose the cylinder subtrees that they refer to
+    return std::all_of(
+        bvh.nodes.get(), bvh.nodes.get() + bvh.node_count,
+        [&] (const Bvh::Node& node) {
+            if (!node.is_leaf) {
+                auto left_bbox  = bvh.nodes[node.first_child_or_primitive + 0].bounding_box_proxy().to_bounding_box();
+                auto right_bbox = bvh.nodes[node.first_child_or_primitive + 1].bounding_box_proxy().to_bounding_box();
+                return
+                    left_bbox.is_contained_in(node.bounding_box_proxy()) &&
+                    right_bbox.is_contained_in(node.bounding_box_proxy());
+            }
+            auto bbox = bvh.cnodes[node.cylinder_root()].bounding_box_proxy().to_bounding_box().AABB();
+            return
+                bbox.is_contained_in(node.bounding_box_proxy()) &&
+                check_cylinder_subtree(bvh, node.cylinder_root(), triangles, ancestors);
+        });
+}
+
+// Creates thin, elongated triangles, for which cylinders are good bounding volumes.
+static std::vector<Triangle> random_thin_triangles(size_t triangle_count, std::default_random_engine& gen) {
+    std::uniform_real_distribution<Scalar> uniform(-1, 1);
+    auto random_vector = [&] (Scalar scale) { return Vector3(uniform(gen), uniform(gen), uniform(gen)) * scale; };
+    std::vector<Triangle> triangles(triangle_count);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        auto p = random_vector(1);
+        auto d = random_vector(Scalar(0.2));
+        triangles[i] = Triangle(p, p + d, p + d * Scalar(0.5) + random_vector(Scalar(0.01)));
+    }
+    return triangles;
+}
+
+static bool create_and_refit_cylinder_bvh(size_t primitive_count, bool hybrid) {
+    std::default_random_engine gen;
+    auto triangles = random_thin_triangles(primitive_count, gen);
+
+    Bvh bvh;
+    bvh::LocallyOrderedClusteringBuilder<Bvh, uint32_t, bvh::FullCylinderNode<Scalar>> builder(bvh);
+    auto [bcyls, centers] = bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), triangles.size());
+    if (hybrid)
+        builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size(), 3);
+    else
+        builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size());
+    bvh.cylinder = true;
+    bvh.hybrid = hybrid;
+
+    std::cout << "Created " << (hybrid ? "hybrid" : "cylinder") << " BVH with " << bvh.cnode_count << " cylinder nodes" << std::endl;
+
+    // Randomly move triangles, and change their shape
+    std::uniform_real_distribution<Scalar> uniform(-Scalar(0.1), Scalar(0.1));
+    for (auto& triangle : triangles) {
+        auto offset = Vector3(uniform(gen), uniform(gen), uniform(gen));
+        triangle = Triangle(triangle.p0 + offset, triangle.p1() + offset * Scalar(0.5), triangle.p2());
+    }
+
+    bvh::CylinderHierarchyRefitter<Bvh> refitter(bvh);
+    refitter.refit_from_primitives(triangles.data());
+
+    return check_cylinder_bvh(bvh, triangles);
+}
+
 static bool create_and_refit_bvh(size_t primitive_count) {
     auto triangles = random_triangles(primitive_count);
 
@@ -97,6 +227,12 @@ int main() {
             std::cerr << "Failed to refit BVH" << std::endl;
             return 1;
         }
+        for (auto hybrid : { false, true }) {
+            if (!create_and_refit_cylinder_bvh(size, hybrid)) {
+                std::cerr << "Failed to refit " << (hybrid ? "hybrid" : "cylinder") << " BVH" << std::endl;
+                return 1;
+            }
+        }
     }
     return 0;
 }
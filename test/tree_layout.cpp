@@ -0,0 +1,118 @@
+#include <vector>
+#include <iostream>
+#include <optional>
+#include <cstdint>
+#include <algorithm>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/sweep_sah_builder.hpp>
+#include <bvh/tree_layout_optimizer.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = float;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Ray      = bvh::Ray<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+
+using Hit = std::optional<std::pair<size_t, Scalar>>;
+
+static std::vector<Hit> trace(const Bvh& bvh, const std::vector<Triangle>& triangles, const std::vector<Ray>& rays) {
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> intersector(bvh, triangles.data());
+    std::vector<Hit> hits;
+    for (const auto& ray : rays) {
+        auto hit = traverser.traverse(ray, intersector, bvh.cylinder, bvh.hybrid);
+        hits.push_back(hit ? std::make_optional(std::make_pair(hit->primitive_index, hit->distance())) : std::nullopt);
+    }
+    return hits;
+}
+
+// Returns the number of nodes of the subtree, and checks that the pairs are at odd positions.
+// For the depth-first layout, the nodes below every inner node must follow its children contiguously.
+template <typename Node>
+static std::optional<size_t> check_subtree(const Node* nodes, size_t index, bool is_depth_first) {
+    const auto& node = nodes[index];
+    if (node.is_leaf)
+        return std::make_optional(size_t(1));
+    auto first_child = node.first_child_or_primitive;
+    if (first_child % 2 != 1)
+        return std::nullopt;
+    size_t node_count = 1;
+    for (size_t i = 0; i < 2; ++i) {
+        auto child_node_count = check_subtree(nodes, first_child + i, is_depth_first);
+        if (!child_node_count)
+            return std::nullopt;
+        node_count += *child_node_count;
+    }
+    if (is_depth_first) {
+        // The left subtree comes first, right after the pair of children
+        const auto& left = nodes[first_child];
+        if (!left.is_leaf && left.first_child_or_primitive != first_child + 2)
+            return std::nullopt;
+    }
+    return std::make_optional(node_count);
+}
+
+static bool check_layout(const Bvh& bvh, bool is_depth_first) {
+    if (bvh.cylinder && !bvh.hybrid)
+        return check_subtree(bvh.cnodes.get(), 0, is_depth_first) == std::make_optional(bvh.cnode_count);
+    if (check_subtree(bvh.nodes.get(), 0, is_depth_first) != std::make_optional(bvh.node_count))
+        return false;
+    if (!bvh.hybrid)
+        return true;
+
+    // The cylinder subtrees follow each other in the order of the box leaves, padded to keep pairs at odd positions
+    size_t next = 0;
+    for (size_t i = 0; i < bvh.node_count; ++i) {
+        if (!bvh.nodes[i].is_leaf)
+            continue;
+        auto root = bvh.nodes[i].cylinder_root();
+        auto node_count = check_subtree(bvh.cnodes.get(), root, is_depth_first);
+        if (root != next || !node_count)
+            return false;
+        next = root + *node_count + (root % 2 == 1 ? 1 : 0);
+        if (root % 2 == 1 && bvh.cnodes[root + 1].primitive_count != 0)
+            return false;
+    }
+    return next == bvh.cnode_count;
+}
+
+int main() {
+    auto triangles = random_triangles<Scalar>(5000);
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < 2000; ++i) {
+        auto origin = random_vector<Scalar>(-3, 3);
+        rays.emplace_back(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+    }
+
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        for (auto layout : { bvh::TreeLayout::DepthFirst, bvh::TreeLayout::VanEmdeBoas }) {
+            Bvh bvh;
+            build<bvh::SweepSahBuilder>(bvh, triangles, mode);
+            auto hits = trace(bvh, triangles, rays);
+
+            bvh::TreeLayoutOptimizer<Bvh> optimizer(bvh);
+            optimizer.layout = layout;
+            optimizer.optimize();
+            if (!check_layout(bvh, layout == bvh::TreeLayout::DepthFirst)) {
+                std::cerr << "Invalid node layout" << std::endl;
+                return 1;
+            }
+
+            // The topology is the same, hence so are the results of the traversal
+            if (trace(bvh, triangles, rays) != hits) {
+                std::cerr << "The node layout changes the results of the traversal" << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::cout << "Node layouts are valid" << std::endl;
+    return 0;
+}
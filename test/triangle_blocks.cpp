@@ -0,0 +1,105 @@
+#include <vector>
+#include <iostream>
+#include <random>
+#include <optional>
+#include <cstdint>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/binned_sah_builder.hpp>
+#include <bvh/locally_ordered_clustering_builder.hpp>
+#include <bvh/leaf_collapser.hpp>
+#include <bvh/node_set.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/packet_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+#include <bvh/triangle_blocks.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar   = float;
+using Vector3  = bvh::Vector3<Scalar>;
+using Triangle = bvh::Triangle<Scalar>;
+using Ray      = bvh::Ray<Scalar>;
+using Bvh      = bvh::Bvh<Scalar>;
+using Morton   = uint32_t;
+
+static void build(Bvh& bvh, const std::vector<Triangle>& triangles, Mode mode) {
+    if (mode == Mode::Boxes) {
+        // The binned SAH builder creates leaves of several primitives
+        auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+        auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+        bvh::BinnedSahBuilder<Bvh, 16> builder(bvh);
+        builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+        return;
+    }
+    auto [bcyls, centers] = bvh::compute_bounding_cylinders_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bcyls.get(), triangles.size());
+    bvh::LocallyOrderedClusteringBuilder<Bvh, Morton, bvh::FullCylinderNode<Scalar>> builder(bvh);
+    bvh.cylinder = true;
+    if (mode == Mode::Cylinders) {
+        builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size());
+        bvh::LeafCollapser<Bvh, bvh::CylinderNodes<Bvh>> collapser(bvh);
+        collapser.collapse();
+    } else {
+        builder.build(global_bbox, bcyls.get(), centers.get(), triangles.size(), 3);
+        bvh.hybrid = true;
+    }
+}
+
+template <typename HitA, typename HitB>
+static bool same_hit(const std::optional<HitA>& a, const std::optional<HitB>& b) {
+    return
+        a.has_value() == b.has_value() &&
+        (!a || (a->primitive_index == b->primitive_index && a->distance() == b->distance()));
+}
+
+// Triangle blocks must give the same results as testing the triangles one by one.
+template <size_t BlockSize>
+static bool check_blocks(const Bvh& bvh, const std::vector<Triangle>& triangles, const std::vector<Ray>& rays) {
+    static constexpr size_t packet_size = 8;
+
+    bvh::TriangleBlocks<Bvh, Triangle, BlockSize> blocks(bvh, triangles.data());
+    bvh::ClosestPrimitiveIntersector<Bvh, Triangle> closest_intersector(bvh, triangles.data());
+    bvh::AnyPrimitiveIntersector<Bvh, Triangle> any_intersector(bvh, triangles.data());
+    bvh::ClosestTriangleBlockIntersector<Bvh, Triangle, BlockSize> closest_block_intersector(bvh, blocks, triangles.data());
+    bvh::AnyTriangleBlockIntersector<Bvh, Triangle, BlockSize> any_block_intersector(bvh, blocks, triangles.data());
+    bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    bvh::PacketTraverser<Bvh, packet_size> packet_traverser(bvh);
+
+    for (size_t i = 0; i < rays.size(); i += packet_size) {
+        std::optional<typename decltype(closest_block_intersector)::Result> hits[packet_size];
+        packet_traverser.traverse(rays.data() + i, packet_size, closest_block_intersector, hits, bvh.cylinder, bvh.hybrid);
+        for (size_t j = i; j < i + packet_size; ++j) {
+            auto hit = traverser.traverse(rays[j], closest_intersector, bvh.cylinder, bvh.hybrid);
+            auto block_hit = traverser.traverse(rays[j], closest_block_intersector, bvh.cylinder, bvh.hybrid);
+            if (!same_hit(hit, block_hit) || !same_hit(block_hit, hits[j - i]) ||
+                traverser.occluded(rays[j], any_intersector, bvh.cylinder, bvh.hybrid) !=
+                traverser.occluded(rays[j], any_block_intersector, bvh.cylinder, bvh.hybrid))
+                return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    auto triangles = random_triangles<Scalar>(5000);
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < 2000; ++i) {
+        auto origin = random_vector<Scalar>(-3, 3);
+        rays.emplace_back(origin, bvh::normalize(random_vector<Scalar>(-1, 1) - origin));
+    }
+
+    for (auto mode : { Mode::Boxes, Mode::Cylinders, Mode::Hybrid }) {
+        Bvh bvh;
+        build(bvh, triangles, mode);
+        if (!check_blocks<4>(bvh, triangles, rays) || !check_blocks<8>(bvh, triangles, rays)) {
+            std::cerr << "Triangle blocks do not match the triangles" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Triangle blocks match the triangles" << std::endl;
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+
+#include <bvh/bvh.hpp>
+#include <bvh/vector.hpp>
+#include <bvh/triangle.hpp>
+#include <bvh/ray.hpp>
+#include <bvh/two_level_bvh.hpp>
+#include <bvh/binned_sah_builder.hpp>
+#include <bvh/single_ray_traverser.hpp>
+#include <bvh/primitive_intersectors.hpp>
+
+#include "random_scene.hpp"
+
+using Scalar      = double;
+using Vector3     = bvh::Vector3<Scalar>;
+using Triangle    = bvh::Triangle<Scalar>;
+using Ray         = bvh::Ray<Scalar>;
+using Bvh         = bvh::Bvh<Scalar>;
+using TwoLevelBvh = bvh::TwoLevelBvh<Bvh>;
+using Transform   = TwoLevelBvh::Transform;
+
+using ClosestIntersector = bvh::ClosestPrimitiveIntersector<Bvh, Triangle>;
+using AnyIntersector     = bvh::AnyPrimitiveIntersector<Bvh, Triangle>;
+
+// Box hierarchies are built with the binned SAH builder, which creates leaves of several primitives
+template <typename Bvh>
+using BinnedSahBuilder = bvh::BinnedSahBuilder<Bvh, 16>;
+
+struct Scene {
+    std::vector<std::vector<Triangle>> triangles;
+    std::vector<Mode> modes;
+    TwoLevelBvh two_level_bvh;
+};
+
+// Traverses the BVH of every instance, one after the other, with the ray transformed into object space.
+static std::optional<std::pair<size_t, Scalar>> intersect_instances(
+    const Scene& scene, std::vector<ClosestIntersector>& intersectors, const Ray& ray)
+{
+    std::optional<std::pair<size_t, Scalar>> best_hit;
+    for (size_t i = 0; i < scene.two_level_bvh.instances.size(); ++i) {
+        const auto& instance = scene.two_level_bvh.instances[i];
+        const auto& object = scene.two_level_bvh.objects[instance.object];
+        bvh::SingleRayTraverser<Bvh> traverser(object);
+        auto local_ray = instance.world_to_object.transform_ray(ray);
+        auto hit = traverser.traverse(local_ray, intersectors[instance.object], object.cylinder, object.hybrid);
+        if (hit && (!best_hit || hit->distance() < best_hit->second))
+            best_hit = std::make_pair(i, hit->distance());
+    }
+    return best_hit;
+}
+
+// Intersects the ray with the triangles of every instance, transformed into world space.
+static std::optional<std::pair<size_t, Scalar>> intersect_brute_force(const Scene& scene, const Ray& ray) {
+    std::optional<std::pair<size_t, Scalar>> best_hit;
+    auto tmax = ray.tmax;
+    for (size_t i = 0; i < scene.two_level_bvh.instances.size(); ++i) {
+        const auto& instance = scene.two_level_bvh.instances[i];
+        for (const auto& triangle : scene.triangles[instance.object]) {
+            Triangle world_triangle(
+                instance.object_to_world.transform_point(triangle.p0),
+                instance.object_to_world.transform_point(triangle.p1()),
+                instance.object_to_world.transform_point(triangle.p2()));
+            if (auto hit = world_triangle.intersect(Ray(ray.origin, ray.direction, ray.tmin, tmax))) {
+                tmax = hit->distance();
+                best_hit = std::make_pair(i, tmax);
+            }
+        }
+    }
+    return best_hit;
+}
+
+static bool check_traversal(const Scene& scene, size_t ray_count) {
+    const auto& two_level_bvh = scene.two_level_bvh;
+    std::vector<ClosestIntersector> closest_intersectors;
+    std::vector<AnyIntersector> any_intersectors;
+    for (size_t i = 0; i < two_level_bvh.objects.size(); ++i) {
+        closest_intersectors.emplace_back(two_level_bvh.objects[i], scene.triangles[i].data());
+        any_intersectors.emplace_back(two_level_bvh.objects[i], scene.triangles[i].data());
+    }
+
+    bvh::SingleRayTraverser<TwoLevelBvh::TopLevelBvh> traverser(two_level_bvh.top_level);
+    bvh::InstanceIntersector<Bvh, ClosestIntersector> closest_intersector(two_level_bvh, closest_intersectors.data());
+    bvh::InstanceIntersector<Bvh, AnyIntersector> any_intersector(two_level_bvh, any_intersectors.data());
+
+    size_t hit_count = 0;
+    for (size_t i = 0; i < ray_count; ++i) {
+        auto origin = random_vector<Scalar>(-6, 6);
+        auto target = random_vector<Scalar>(-3, 3);
+        Ray ray(origin, bvh::normalize(target - origin));
+
+        auto hit = traverser.traverse(ray, closest_intersector);
+        auto reference = intersect_instances(scene, closest_intersectors, ray);
+        if (hit.has_value() != reference.has_value() ||
+            (hit && (hit->distance() != reference->second || hit->instance != reference->first))) {
+            std::cerr << "Two-level traversal does not match the traversal of each instance" << std::endl;
+            return false;
+        }
+
+        // The transforms are checked against the triangles transformed into world space. Only
+        // the closest hits on instances of box hierarchies are compared, since the cylinder
+        // node intersector may miss a few primitives that are hit by the brute-force search.
+        auto world_hit = intersect_brute_force(scene, ray);
+        if (world_hit && scene.modes[two_level_bvh.instances[world_hit->first].object] == Mode::Boxes &&
+            (!hit || hit->instance != world_hit->first ||
+             std::fabs(hit->distance() - world_hit->second) > Scalar(1e-9) * world_hit->second)) {
+            std::cerr << "Two-level traversal does not match the brute-force intersection" << std::endl;
+            return false;
+        }
+        if (traverser.occluded(ray, any_intersector, false, false) != hit.has_value()) {
+            std::cerr << "Two-level occlusion query does not match the intersection query" << std::endl;
+            return false;
+        }
+        hit_count += hit.has_value();
+    }
+    std::cout << hit_count << " out of " << ray_count << " ray(s) hit the scene" << std::endl;
+    return true;
+}
+
+int main() {
+    Scene scene;
+    auto& two_level_bvh = scene.two_level_bvh;
+    for (auto [size, mode] : { std::make_pair(2000, Mode::Boxes), std::make_pair(3000, Mode::Cylinders), std::make_pair(3000, Mode::Hybrid) }) {
+        scene.triangles.push_back(random_triangles<Scalar>(size));
+        scene.modes.push_back(mode);
+        two_level_bvh.add_object();
+    }
+
+    // Objects are instanced several times, with transforms that rotate, scale, and move them
+    auto axis = bvh::normalize(Vector3(1, 2, 3));
+    two_level_bvh.add_instance(0);
+    two_level_bvh.add_instance(0, Transform::translating(Vector3(3, 0, 0)) * Transform::rotation(axis, Scalar(0.7)));
+    two_level_bvh.add_instance(1, Transform::translating(Vector3(0, 3, 0)) * Transform::scaling(Vector3(2, Scalar(0.5), 1)));
+    two_level_bvh.add_instance(1, Transform::rotation(axis, Scalar(-1.3)) * Transform::translating(Vector3(-2, 0, 1)));
+    two_level_bvh.add_instance(2, Transform::translating(Vector3(0, -2, -2)) * Transform::rotation(Vector3(0, 0, 1), Scalar(2)));
+
+    bvh::TwoLevelBvhBuilder<Bvh> builder(two_level_bvh);
+    builder.build_objects([&] (Bvh& bvh, size_t object) {
+        build<BinnedSahBuilder>(bvh, scene.triangles[object], scene.modes[object]);
+    });
+    builder.build_top_level();
+    if (!check_traversal(scene, 2000))
+        return 1;
+
+    // Only the object that changed is rebuilt, followed by the top level
+    size_t changed_object = 1;
+    scene.triangles[changed_object] = random_triangles<Scalar>(1500);
+    builder.build_objects(&changed_object, 1, [&] (Bvh& bvh, size_t object) {
+        build<BinnedSahBuilder>(bvh, scene.triangles[object], scene.modes[object]);
+    });
+    builder.build_top_level();
+    if (!check_traversal(scene, 2000))
+        return 1;
+
+    // The inverse of a composition of transforms gives back the original points
+    auto transform = two_level_bvh.instances[1].object_to_world * two_level_bvh.instances[3].object_to_world;
+    auto p = random_vector<Scalar>(-1, 1);
+    if (bvh::length(transform.inverse().transform_point(transform.transform_point(p)) - p) > Scalar(1e-12)) {
+        std::cerr << "Inverse transform is incorrect" << std::endl;
+        return 1;
+    }
+    return 0;
+}